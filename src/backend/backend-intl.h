@@ -6,7 +6,10 @@
 #include "mhash.h"
 #include "ptree.h"
 #include "ptable.h"
+#include "frozen.h"
+#include "ptpack.h"
 #include "tbchain.h"
+#include "wal.h"
 #include "metadata.h"
 
 #include <glib.h>
@@ -15,12 +18,33 @@ struct ptree_ref {
     fs_rid pred;
     fs_ptree *ptree_s;
     fs_ptree *ptree_o;
+    unsigned int hits;      /* uses, decays over time */
+    int pinned;             /* in use by a commit batch, can't be closed */
 };
 
+/* open trees are kept in a set, the least frequently used is closed to make
+ * room, see fs_backend_ptree_limited_open() */
 #define FS_MAX_OPEN_PTREES 300
 
+/* the pairs table and model list are vacuumed once this fraction of them is
+ * free, for up to FS_VACUUM_STEP seconds after each import or model delete,
+ * see fs_backend_vacuum() */
+#define FS_VACUUM_FREE 0.25
+#define FS_VACUUM_STEP 0.2
+
 #define FS_PENDED_LISTS 16
 
+/* pending quads are inserted into up to FS_COMMIT_BATCH_TREES trees at once,
+ * by up to FS_COMMIT_THREADS threads, a batch is started once it holds
+ * FS_COMMIT_BATCH_ROWS pairs, see commit.h */
+#define FS_COMMIT_THREADS 32
+#define FS_COMMIT_BATCH_TREES (FS_MAX_OPEN_PTREES / 2)
+#define FS_COMMIT_BATCH_ROWS (1 << 20)
+
+/* updates go in the write-ahead log, except for bulk loads, which only run on
+ * empty segments, and updates that are being replayed from the log */
+#define FS_LOG_UPDATES(be) ((be)->wal && !(be)->wal_replay && !(be)->bulk_import)
+
 struct _fs_backend {
     const char *db_name;
     fs_metadata *md;
@@ -37,7 +61,12 @@ struct _fs_backend {
     fs_tbchain *model_list;
     fs_list *predicates;
     fs_ptable *pairs;
+    fs_frozen *frozen;
+    fs_ptpack *ptpack;
     int pended_import;
+    int bulk_import;        /* loading an empty segment, see fs_start_import() */
+    fs_wal *wal;
+    int wal_replay;         /* applying updates from the wal */
     int ptree_size;
     int ptree_length;
     struct ptree_ref *ptrees_priv;
@@ -46,8 +75,14 @@ struct _fs_backend {
     int ptree_open_flags;
     int ptree_open_count;
     int open_ptrees[FS_MAX_OPEN_PTREES];
-    int open_ptrees_newest;
-    int open_ptrees_oldest;
+    int ptree_evictions;
+    int threaded;           /* shared by a threaded server, see fs_backend_set_threaded() */
+    int exclusive;          /* the server holds the write lock */
+    GStaticMutex ptree_mutex; /* held while opening trees, if threaded */
+    int *ptree_overflow;    /* trees opened past FS_MAX_OPEN_PTREES, if threaded */
+    int ptree_overflow_length;
+    int ptree_overflow_size;
+    struct import_buffer *import_buf; /* see import-backend.c */
     fs_import_timing in_time[FS_MAX_SEGMENTS];
     fs_query_timing out_time[FS_MAX_SEGMENTS];
     int checked_transaction;
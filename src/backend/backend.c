@@ -39,6 +39,7 @@
 #include "lock.h"
 #include "mhash.h"
 #include "tlist.h"
+#include "commit.h"
 
 /* used to indicate to backend processes that they need to reopen thier
  * index files */
@@ -76,11 +77,137 @@ static void do_sigusr2(int sig)
     need_reload = 1;
 }
 
+struct replay {
+    fs_backend *be;
+    int importing;
+};
+
+/* applies a committed update from the log, the same way as it was applied
+ * when it was made */
+static int replay_record(void *data, const fs_wal_record *rec)
+{
+    struct replay *rp = data;
+    fs_backend *be = rp->be;
+    const fs_segment seg = be->segment;
+    int ret = 0;
+
+    switch (rec->type) {
+    case FS_WAL_RESOURCES:
+    case FS_WAL_QUADS:
+	if (!rp->importing) {
+	    ret += fs_start_import(be, seg, 0);
+	    rp->importing = 1;
+	}
+	if (rec->type == FS_WAL_RESOURCES) {
+	    ret += fs_res_import(be, seg, rec->count, rec->res);
+	} else {
+	    ret += fs_quad_import(be, seg, FS_BIND_BY_SUBJECT, rec->count, rec->quads);
+	}
+	break;
+    case FS_WAL_DELETE_QUADS: {
+	fs_rid_vector *quads[4];
+	for (int c=0; c<4; c++) {
+	    quads[c] = fs_rid_vector_new(rec->count);
+	    for (int i=0; i<rec->count; i++) {
+		quads[c]->data[i] = rec->quads[i][c];
+	    }
+	}
+	ret += fs_delete_quads(be, quads);
+	for (int c=0; c<4; c++) {
+	    fs_rid_vector_free(quads[c]);
+	}
+	break;
+    }
+    case FS_WAL_DELETE_MODELS: {
+	fs_rid_vector *models = fs_rid_vector_new(rec->count);
+	memcpy(models->data, rec->models, rec->count * sizeof(fs_rid));
+	ret += fs_delete_models(be, seg, models);
+	fs_rid_vector_free(models);
+	break;
+    }
+    case FS_WAL_COMMIT:
+	if (rp->importing) {
+	    fs_res_import_commit(be, seg, 0);
+	    ret += fs_quad_import_commit(be, seg, FS_BIND_BY_SUBJECT, 0);
+	    ret += fs_stop_import(be, seg);
+	    rp->importing = 0;
+	}
+	break;
+    }
+
+    return ret;
+}
+
+/* the updates in the segment's log after its applied mark were committed, but
+ * may not have made it to the indexes, so they're applied again, then the log
+ * is emptied */
+static int recover_segment(fs_backend *be, fs_segment seg)
+{
+    fs_wal *wal = fs_wal_open(be, seg, O_RDWR | O_CREAT);
+    if (!wal) {
+	return 1;
+    }
+    if (!fs_wal_pending(wal)) {
+	fs_wal_close(wal);
+
+	return 0;
+    }
+
+    if (fs_backend_open_files(be, seg, O_RDWR | O_CREAT, FS_OPEN_ALL)) {
+	fs_wal_close(wal);
+
+	return 1;
+    }
+    struct replay rp = { be, 0 };
+    be->wal_replay = 1;
+    const int count = fs_wal_replay(wal, replay_record, &rp);
+    be->wal_replay = 0;
+    int ret = count < 0;
+    if (count > 0) {
+	fs_error(LOG_INFO, "replayed %d updates to segment %d", count, seg);
+    }
+    if (!ret) {
+	ret += fs_wal_checkpoint(wal);
+    }
+    fs_wal_close(wal);
+    fs_backend_cleanup_files(be);
+    fs_backend_close_files(be, seg);
+
+    return ret;
+}
+
+/* a vacuum leaves the files their full size, as forked readers may have them
+ * mapped, so they're only cut short here, before any readers exist */
+static void trim_segment(fs_backend *be, fs_segment seg)
+{
+    be->segment = seg;
+    fs_ptable *pairs = fs_ptable_open(be, "pairs", O_RDWR | O_CREAT);
+    if (pairs) {
+	const fs_row_id rows = fs_ptable_trim(pairs);
+	if (rows) {
+	    fs_error(LOG_INFO, "trimmed %u rows from pairs table of segment %d",
+		     rows, seg);
+	}
+	fs_ptable_close(pairs);
+    }
+    fs_tbchain *mlist = fs_tbchain_open(be, "mlist", O_RDWR | O_CREAT);
+    if (mlist) {
+	const fs_index_node blocks = fs_tbchain_trim(mlist);
+	if (blocks) {
+	    fs_error(LOG_INFO, "trimmed %u blocks from model list of segment %d",
+		     blocks, seg);
+	}
+	fs_tbchain_close(mlist);
+    }
+    be->segment = -1;
+}
+
 fs_backend *fs_backend_init(const char *db_name, int flags)
 {
     fs_backend *ret = calloc(1, sizeof(fs_backend));
     ret->db_name = db_name;
     ret->segment = -1;
+    g_static_mutex_init(&ret->ptree_mutex);
     if (flags & FS_BACKEND_NO_OPEN) {
 	return ret;
     }
@@ -166,11 +293,15 @@ fs_backend *fs_backend_init(const char *db_name, int flags)
 
     ret->transaction = -1;
 
-    /* preload indexes for primary segments */
+    /* preload indexes for primary segments, finish any updates that were
+     * cut short by a crash, and give back space freed by vacuums */
     if (flags & FS_BACKEND_PRELOAD) {
 	fs_rid_vector *segs = fs_metadata_get_int_vector(ret->md, FS_MD_SEGMENT_P);
 	for (int i=0; i<segs->length; i++) {
-            ret->segment = segs->data[i];
+	    if (recover_segment(ret, segs->data[i])) {
+		fs_error(LOG_CRIT, "failed to recover segment %d", (int)segs->data[i]);
+	    }
+	    trim_segment(ret, segs->data[i]);
         }
         fs_rid_vector_free(segs);
 	ret->segment = -1;
@@ -207,6 +338,7 @@ void fs_backend_fini(fs_backend *be)
 
     fs_backend_cleanup_files(be);
     fs_backend_close_files(be, be->segment);
+    fs_import_buffer_free(be);
     fs_metadata_close(be->md);
     g_free((void *)be->hash);
     free(be);
@@ -288,42 +420,223 @@ void fs_backend_set_min_free(fs_backend *be, float min_free)
     be->min_free = min_free;
 }
 
-int fs_start_import(fs_backend *be, int seg)
+/* quads are appended to the pended lists instead of going into the ptrees,
+ * they're sorted and added to the ptrees by fs_commit() */
+int fs_backend_open_pended(fs_backend *be)
+{
+    if (be->pended_import) return 0;
+
+    be->pended_import = 1;
+    for (int pend=0; pend < FS_PENDED_LISTS; pend++) {
+	char label[256];
+	snprintf(label, 255, "pl-%1x", pend);
+	be->pended[pend] = fs_list_open(be, label,
+	    sizeof(fs_rid) * 4, O_CREAT | O_TRUNC | O_RDWR);
+	if (!be->pended[pend]) {
+	    fs_error(LOG_CRIT, "failed to open pended list %d", pend);
+
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/* a bulk import into an empty segment pends all the quads and spills the
+ * resources, then at fs_stop_import() builds the rhash and each ptree from
+ * sorted runs, front to back, without looking for existing entries */
+int fs_start_import(fs_backend *be, int seg, int flags)
 {
     int errs = 0;
 
     /* TODO update metadata ? */
 
+    if ((flags & FS_IMPORT_BULK) && !be->bulk_import) {
+	if (be->ptree_length > 0 || !be->res || fs_rhash_count(be->res) > 0) {
+	    fs_error(LOG_INFO, "segment %d is not empty, importing incrementally", seg);
+	} else if (fs_rhash_bulk_start(be->res)) {
+	    errs++;
+	} else {
+	    be->bulk_import = 1;
+	    errs += fs_backend_open_pended(be);
+	}
+    }
+
     return errs;
 }
 
-void fs_backend_ptree_limited_open(fs_backend *be, int n)
+static void open_ptree_ref(fs_backend *be, int n)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+    const int flags = be->ptree_open_flags | O_RDWR;
+    if (be->ptpack) {
+	ref->ptree_s = fs_ptpack_open_tree(be->ptpack, n, 0, be->pairs, flags);
+	ref->ptree_o = fs_ptpack_open_tree(be->ptpack, n, 1, be->pairs, flags);
+    } else {
+	ref->ptree_s = fs_ptree_open(be, ref->pred, 's', flags, be->pairs);
+	ref->ptree_o = fs_ptree_open(be, ref->pred, 'o', flags, be->pairs);
+    }
+    if (be->frozen) {
+	const fs_rid pred = be->ptrees_priv[n].pred;
+	if (be->ptrees_priv[n].ptree_s) {
+	    fs_ptree_set_frozen(be->ptrees_priv[n].ptree_s, be->frozen,
+				fs_frozen_get_run(be->frozen, pred, 0));
+	}
+	if (be->ptrees_priv[n].ptree_o) {
+	    fs_ptree_set_frozen(be->ptrees_priv[n].ptree_o, be->frozen,
+				fs_frozen_get_run(be->frozen, pred, 1));
+	}
+    }
+}
+
+static void close_ptree_ref(fs_backend *be, int n)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+    if (be->ptpack) {
+	fs_ptpack_close_tree(be->ptpack, n, 0, ref->ptree_s);
+	fs_ptpack_close_tree(be->ptpack, n, 1, ref->ptree_o);
+    } else {
+	if (ref->ptree_s) fs_ptree_close(ref->ptree_s);
+	if (ref->ptree_o) fs_ptree_close(ref->ptree_o);
+    }
+    ref->ptree_s = NULL;
+    ref->ptree_o = NULL;
+}
+
+/* the open tree with the fewest hits that isn't pinned, or -1 */
+static int least_hit_open_ptree(fs_backend *be)
+{
+    int victim = -1;
+    for (int i=0; i<be->ptree_open_count; i++) {
+	if (be->ptrees_priv[be->open_ptrees[i]].pinned) continue;
+	if (victim == -1 || be->ptrees_priv[be->open_ptrees[i]].hits <
+	    be->ptrees_priv[be->open_ptrees[victim]].hits) {
+	    victim = i;
+	}
+    }
+
+    return victim;
+}
+
+static void evict_open_ptree(fs_backend *be, int victim)
+{
+    close_ptree_ref(be, be->open_ptrees[victim]);
+    be->open_ptrees[victim] = be->open_ptrees[--be->ptree_open_count];
+    if (++be->ptree_evictions % FS_MAX_OPEN_PTREES == 0) {
+	for (int i=0; i<be->ptree_length; i++) {
+	    be->ptrees_priv[i].hits /= 2;
+	}
+    }
+}
+
+static void limited_open(fs_backend *be, int n)
 {
+    be->ptrees_priv[n].hits++;
     if (be->ptrees_priv[n].ptree_s) return;
 
     if (be->ptree_open_count >= FS_MAX_OPEN_PTREES) {
-	int toclose = be->open_ptrees[be->open_ptrees_oldest++];
-	if (be->open_ptrees_oldest >= FS_MAX_OPEN_PTREES)
-	    be->open_ptrees_oldest = 0;
-
-	if (be->ptrees_priv[toclose].ptree_s)
-	    fs_ptree_close(be->ptrees_priv[toclose].ptree_s);
-	be->ptrees_priv[toclose].ptree_s = NULL;
-	if (be->ptrees_priv[toclose].ptree_o)
-	    fs_ptree_close(be->ptrees_priv[toclose].ptree_o);
-	be->ptrees_priv[toclose].ptree_o = NULL;
-	be->ptree_open_count--;
-    }
-
-    be->ptrees_priv[n].ptree_s = fs_ptree_open(be, be->ptrees_priv[n].pred, 's', be->ptree_open_flags | O_RDWR, be->pairs);
-    be->ptrees_priv[n].ptree_o = fs_ptree_open(be, be->ptrees_priv[n].pred, 'o', be->ptree_open_flags | O_RDWR, be->pairs);
-    be->open_ptrees[be->open_ptrees_newest++] = n;
-    fs_rid *rid = g_malloc(sizeof(fs_rid));
-    *rid = be->ptrees_priv[n].pred;
-    g_hash_table_insert(be->rid_id_map, rid, GINT_TO_POINTER(n));
-    if (be->open_ptrees_newest >= FS_MAX_OPEN_PTREES)
-	be->open_ptrees_newest = 0;
-    be->ptree_open_count++;
+	if (be->threaded && !be->exclusive) {
+	    /* other threads could be reading any of the open trees, so this
+	     * one goes over the limit until fs_backend_set_exclusive() */
+	    if (be->ptree_overflow_length == be->ptree_overflow_size) {
+		be->ptree_overflow_size = be->ptree_overflow_size ?
+		    be->ptree_overflow_size * 2 : 16;
+		be->ptree_overflow = realloc(be->ptree_overflow,
+		    be->ptree_overflow_size * sizeof(int));
+	    }
+	    open_ptree_ref(be, n);
+	    be->ptree_overflow[be->ptree_overflow_length++] = n;
+
+	    return;
+	}
+	const int victim = least_hit_open_ptree(be);
+	if (victim == -1) {
+	    fs_error(LOG_CRIT, "all %d open ptrees are pinned, cannot open %d",
+		     be->ptree_open_count, n);
+
+	    return;
+	}
+	evict_open_ptree(be, victim);
+    }
+
+    open_ptree_ref(be, n);
+    be->open_ptrees[be->ptree_open_count++] = n;
+}
+
+/* at most FS_MAX_OPEN_PTREES predicates' trees are kept open, when another
+ * is needed the one with the fewest hits is closed, so a scan over every
+ * predicate doesn't push out the busy ones. Hits are halved every so often,
+ * so trees that were busy a while ago don't stay open forever */
+void fs_backend_ptree_limited_open(fs_backend *be, int n)
+{
+    if (be->threaded) {
+	g_static_mutex_lock(&be->ptree_mutex);
+	limited_open(be, n);
+	g_static_mutex_unlock(&be->ptree_mutex);
+    } else {
+	limited_open(be, n);
+    }
+}
+
+/* move the trees opened over the limit into the open set, each one evicts
+ * the least used tree, or is closed itself if it's used less */
+static void trim_ptrees(fs_backend *be)
+{
+    int kept = 0;
+    for (int i=0; i<be->ptree_overflow_length; i++) {
+	const int n = be->ptree_overflow[i];
+	if (!be->ptrees_priv[n].ptree_s) continue;
+
+	if (be->ptree_open_count < FS_MAX_OPEN_PTREES) {
+	    be->open_ptrees[be->ptree_open_count++] = n;
+	    continue;
+	}
+	const int victim = least_hit_open_ptree(be);
+	if (victim != -1 && be->ptrees_priv[be->open_ptrees[victim]].hits <
+			    be->ptrees_priv[n].hits) {
+	    evict_open_ptree(be, victim);
+	    be->open_ptrees[be->ptree_open_count++] = n;
+	} else if (!be->ptrees_priv[n].pinned) {
+	    close_ptree_ref(be, n);
+	} else {
+	    be->ptree_overflow[kept++] = n;
+	}
+    }
+    be->ptree_overflow_length = kept;
+}
+
+void fs_backend_set_threaded(fs_backend *be, int threaded)
+{
+    be->threaded = threaded;
+    if (be->res) {
+	fs_rhash_set_threaded(be->res, threaded);
+    }
+}
+
+void fs_backend_set_exclusive(fs_backend *be, int exclusive)
+{
+    be->exclusive = exclusive;
+    trim_ptrees(be);
+}
+
+int fs_backend_trim_needed(fs_backend *be)
+{
+    return be->ptree_overflow_length >= FS_MAX_OPEN_PTREES / 4;
+}
+
+long long fs_backend_ptree_count(fs_backend *be, int n, int object)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+    if (!ref->ptree_s && be->ptpack) {
+	const long long count = fs_ptpack_get_count(be->ptpack, n, object);
+	if (count >= 0) {
+	    return count;
+	}
+    }
+    fs_backend_ptree_limited_open(be, n);
+    fs_ptree *pt = object ? ref->ptree_o : ref->ptree_s;
+
+    return pt ? fs_ptree_count(pt) : 0;
 }
 
 static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
@@ -343,51 +656,28 @@ static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
 	/* push out pending data */
 
 	fs_rid quad[4];
-	fs_rid pred = FS_RID_NULL;
-	fs_ptree *current_tree = NULL;
 	for (int i=0; i<FS_PENDED_LISTS; i++) {
 	    fs_list_flush(be->pended[i]);
 
 	    /* process S ptrees */
 	    fs_list_rewind(be->pended[i]);
 	    fs_list_sort_chunked(be->pended[i], quad_sort_by_psmo);
+	    fs_commit_batch *cb = fs_commit_batch_new(be, 0, be->bulk_import);
 	    while (fs_list_next_sort_uniqed(be->pended[i], quad)) {
-		if (quad[2] != pred) {
-		    pred = quad[2];
-		    current_tree = fs_backend_get_ptree(be, pred, 0);
-		    if (!current_tree) {
-			/* it's a new ptree pair */
-			int n = fs_backend_open_ptree(be, pred);
-			struct ptree_ref *r = fs_backend_ptree_ref(be, n);
-			current_tree = r->ptree_s;
-			fs_list_add(be->predicates, &pred);
-		    }
-		    if (!current_tree) {
-			fs_error(LOG_CRIT, "failed to create ptree for %016llx",
-				 pred);
-		    }
-		}
 		fs_rid pair[2] = { quad[0], quad[3] };
-		fs_ptree_add(current_tree, quad[1], pair, 0);
+		fs_commit_batch_add(cb, quad[2], 0, quad[1], pair, NULL);
 	    }
+	    fs_commit_batch_finish(cb);
 
 	    /* process O ptrees */
-	    pred = FS_RID_NULL;
-	    current_tree = NULL;
 	    fs_list_rewind(be->pended[i]);
 	    fs_list_sort_chunked(be->pended[i], quad_sort_by_poms);
+	    cb = fs_commit_batch_new(be, 0, be->bulk_import);
 	    while (fs_list_next_sort_uniqed(be->pended[i], quad)) {
-		if (quad[2] != pred) {
-		    pred = quad[2];
-		    current_tree = fs_backend_get_ptree(be, pred, 1);
-		    if (!current_tree) {
-			fs_error(LOG_CRIT, "failed to get ptree for %016llx",
-				 pred);
-		    }
-		}
 		fs_rid pair[2] = { quad[0], quad[1] };
-		fs_ptree_add(current_tree, quad[3], pair, 0);
+		fs_commit_batch_add(cb, quad[2], 1, quad[3], pair, NULL);
 	    }
+	    fs_commit_batch_finish(cb);
 
 	    /* cleanup pended lists */
 	    fs_list_unlink(be->pended[i]);
@@ -416,20 +706,84 @@ int fs_stop_import(fs_backend *be, int seg)
 	return 0;
     }
 
+    int ret = 0;
+    /* the import is durable once it's in the log */
+    if (be->wal && fs_wal_commit(be->wal)) {
+	ret++;
+    }
+    if (be->bulk_import) {
+	ret += fs_rhash_bulk_finish(be->res);
+    }
     fs_rhash_flush(be->res);
     if (be->models) {
 	fs_mhash_flush(be->models);
     }
 
-    int ret = fs_commit(be, seg, 0);
+    ret += fs_commit(be, seg, 0);
+    be->bulk_import = 0;
     double now = fs_time();
     be->in_time[seg].rebuild += now - then;
 
     /* TODO update metadata? */
 
+    if (!ret) {
+	fs_backend_vacuum(be, FS_VACUUM_STEP);
+    }
+    if (be->wal) {
+	ret += fs_wal_end(be->wal);
+    }
+
     return ret;
 }
 
+/* trees are vacuumed in predicate order, with the position kept in the pairs
+ * table, so a vacuum can be spread over many requests and processes and
+ * queries on other trees carry on meanwhile. A big tree can run over the
+ * budget, as it's done in one go */
+int fs_backend_vacuum(fs_backend *be, double budget)
+{
+    const double then = fs_time();
+
+    if (be->pairs && !fs_ptable_vacuum_start(be->pairs, FS_VACUUM_FREE)) {
+	int n = fs_ptable_vacuum_get_cursor(be->pairs);
+	for (; n < be->ptree_length && fs_time() - then < budget; n++) {
+	    fs_backend_ptree_limited_open(be, n);
+	    fs_ptree_vacuum(be->ptrees_priv[n].ptree_s);
+	    fs_ptree_vacuum(be->ptrees_priv[n].ptree_o);
+	}
+	fs_ptable_vacuum_set_cursor(be->pairs, n);
+	if (n < be->ptree_length) {
+	    return 1;
+	}
+	const fs_row_id rows = fs_ptable_vacuum_finish(be->pairs);
+	fs_error(LOG_INFO, "vacuum of segment %d reclaimed %u pairs table rows",
+		 be->segment, rows);
+    }
+
+    if (be->model_list && be->models &&
+	!fs_tbchain_vacuum_start(be->model_list, FS_VACUUM_FREE)) {
+	/* the model list is small next to the pairs, so it's done in one go */
+	fs_rid_vector *models = fs_mhash_get_keys(be->models);
+	for (int i=0; i<models->length; i++) {
+	    fs_index_node val = 0;
+	    fs_mhash_get(be->models, models->data[i], &val);
+	    if (val > 1) {
+		const fs_index_node nval = fs_tbchain_vacuum_chain(be->model_list, val);
+		if (nval != val) {
+		    fs_mhash_put(be->models, models->data[i], nval);
+		}
+	    }
+	}
+	fs_rid_vector_free(models);
+	fs_mhash_flush(be->models);
+	const fs_index_node blocks = fs_tbchain_vacuum_finish(be->model_list);
+	fs_error(LOG_INFO, "vacuum of segment %d reclaimed %u model list blocks",
+		 be->segment, blocks);
+    }
+
+    return 0;
+}
+
 int fs_backend_transaction(fs_backend *be, fs_segment seg, int op)
 {
     fs_error(LOG_CRIT, "transactions not supported in this branch");
@@ -489,23 +843,29 @@ struct ptree_ref *fs_backend_ptree_ref(fs_backend *be, int n)
 	return NULL;
     }
 
-    if (be->ptrees_priv[n].ptree_s) {
-	/* already open, good */
-	return &be->ptrees_priv[n];
-    } else {
-	/* needs to be opened */
-	fs_backend_ptree_limited_open(be, n);
-	return &be->ptrees_priv[n];
-    }
+    /* opens it if needed, and counts the hit either way */
+    fs_backend_ptree_limited_open(be, n);
+
+    return &be->ptrees_priv[n];
 }
 
-fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object)
+int fs_backend_ptree_id(fs_backend *be, fs_rid pred)
 {
     long int id = (long int)g_hash_table_lookup(be->rid_id_map, &pred);
     /* if the the lookup function returns 0, it could mean item 0, or that it's
      * not there */
     if (id == 0 &&
         (be->ptree_length == 0 || be->ptrees_priv[id].pred != pred)) {
+	return -1;
+    }
+
+    return id;
+}
+
+fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object)
+{
+    const int id = fs_backend_ptree_id(be, pred);
+    if (id == -1) {
 	return NULL;
     }
     struct ptree_ref *ref = fs_backend_ptree_ref(be, id);
@@ -513,14 +873,9 @@ fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object)
     return ref->ptree_o;
 }
 
-int fs_backend_open_ptree(fs_backend *be, fs_rid pred)
+/* add pred to the trees we know about, without opening them */
+static int add_ptree_ref(fs_backend *be, fs_rid pred)
 {
-    if (be == NULL) {
-	fs_error(LOG_CRIT, "fs_backend_open_ptree() passed NULL be");
-
-	return 0;
-    }
-
     if (be->ptree_length == be->ptree_size) {
 	be->ptree_size *= 2;
 	be->ptrees_priv = realloc(be->ptrees_priv, be->ptree_size * sizeof(struct ptree_ref));
@@ -534,12 +889,32 @@ int fs_backend_open_ptree(fs_backend *be, fs_rid pred)
     be->ptrees_priv[be->ptree_length].ptree_s = NULL;
     be->ptrees_priv[be->ptree_length].ptree_o = NULL;
     be->ptrees_priv[be->ptree_length].pred = pred;
-    fs_backend_ptree_limited_open(be, be->ptree_length);
-    be->approx_size += fs_ptree_count(be->ptrees_priv[be->ptree_length].ptree_s);
+    be->ptrees_priv[be->ptree_length].hits = 0;
+    be->ptrees_priv[be->ptree_length].pinned = 0;
+    fs_rid *rid = g_malloc(sizeof(fs_rid));
+    *rid = pred;
+    g_hash_table_insert(be->rid_id_map, rid, GINT_TO_POINTER(be->ptree_length));
 
     return (be->ptree_length)++;
 }
 
+int fs_backend_open_ptree(fs_backend *be, fs_rid pred)
+{
+    if (be == NULL) {
+	fs_error(LOG_CRIT, "fs_backend_open_ptree() passed NULL be");
+
+	return 0;
+    }
+
+    const int n = add_ptree_ref(be, pred);
+    if (be->ptpack) {
+	fs_ptpack_add(be->ptpack, n, pred);
+    }
+    fs_backend_ptree_limited_open(be, n);
+
+    return n;
+}
+
 int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int files, char *file, int line)
 {
     if (!be) {
@@ -570,6 +945,9 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 
             return 1;
         }
+        if (be->threaded) {
+            fs_rhash_set_threaded(be->res, 1);
+        }
     }
 
     if (files & FS_OPEN_MHASH && !be->models) {
@@ -608,8 +986,20 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 	}
 	be->rid_id_map = g_hash_table_new_full(rid_hash, rid_equal, g_free,
 					       NULL);
+	/* if the segment has been frozen, reads of predicates that haven't
+	 * changed since are served from the frozen copy */
+	be->frozen = fs_frozen_open(be, seg);
 	while (fs_list_next_value(be->predicates, &pred)) {
-	    fs_backend_open_ptree(be, pred);
+	    add_ptree_ref(be, pred);
+	}
+	/* the directory holds counts of the trees, so they don't all have to
+	 * be opened here */
+	be->ptpack = fs_ptpack_open(be, flags);
+	if (be->ptpack) {
+	    fs_ptpack_check(be->ptpack, be);
+	}
+	for (int i=0; i<be->ptree_length; i++) {
+	    be->approx_size += fs_backend_ptree_count(be, i, 0);
 	}
     }
 
@@ -618,6 +1008,15 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 	be->pending_insert = fs_list_open(be, "ins", sizeof(fs_rid), flags);
     }
 
+    if (!be->wal && (flags & (O_WRONLY | O_RDWR))) {
+	be->wal = fs_wal_open(be, seg, O_RDWR | O_CREAT);
+	if (!be->wal) {
+	    fs_error(LOG_CRIT, "failed to open write-ahead log");
+
+	    return 1;
+	}
+    }
+
     return 0;
 }
 
@@ -647,17 +1046,31 @@ int fs_backend_unlink_indexes(fs_backend *be, fs_segment seg)
     }
 
     for (int i=0; i<be->ptree_length; i++) {
-	fs_backend_ptree_limited_open(be, i);
-	fs_ptree_unlink(be->ptrees_priv[i].ptree_s);
-	fs_ptree_close(be->ptrees_priv[i].ptree_s);
-	fs_ptree_unlink(be->ptrees_priv[i].ptree_o);
-	fs_ptree_close(be->ptrees_priv[i].ptree_o);
+	if (!be->ptrees_priv[i].ptree_s) {
+	    open_ptree_ref(be, i);
+	}
+	if (be->ptrees_priv[i].ptree_s)
+	    fs_ptree_unlink(be->ptrees_priv[i].ptree_s);
+	if (be->ptrees_priv[i].ptree_o)
+	    fs_ptree_unlink(be->ptrees_priv[i].ptree_o);
+	close_ptree_ref(be, i);
 	be->ptrees_priv[i].pred = 0LL;
-	be->ptrees_priv[i].ptree_s = NULL;
-	be->ptrees_priv[i].ptree_o = NULL;
     }
 
     be->ptree_length = 0;
+    be->ptree_open_count = 0;
+    be->ptree_overflow_length = 0;
+    if (be->ptpack) {
+	fs_ptpack_truncate(be->ptpack);
+    }
+
+    if (be->frozen) {
+	fs_frozen_close(be->frozen);
+	be->frozen = NULL;
+    }
+    char *frozen = g_strdup_printf(FS_FROZEN, be->db_name, be->segment);
+    fs_frozen_unlink(frozen);
+    g_free(frozen);
 
     fs_rid_vector *models = fs_mhash_get_keys(be->models);
     for (int i=0; i<models->length; i++) {
@@ -727,16 +1140,23 @@ int fs_backend_close_files(fs_backend *be, fs_segment seg)
 	fs_list_close(be->pending_insert);
 	be->pending_insert = NULL;
     }
+    if (be->wal) {
+	fs_wal_close(be->wal);
+	be->wal = NULL;
+    }
     for (int i=0; i<be->ptree_length; i++) {
-        if (be->ptrees_priv[i].ptree_s)
-	    fs_ptree_close(be->ptrees_priv[i].ptree_s);
-        if (be->ptrees_priv[i].ptree_o)
-	    fs_ptree_close(be->ptrees_priv[i].ptree_o);
+	close_ptree_ref(be, i);
 	be->ptrees_priv[i].pred = 0LL;
-	be->ptrees_priv[i].ptree_s = NULL;
-	be->ptrees_priv[i].ptree_o = NULL;
     }
     be->ptree_open_count = 0;
+    free(be->ptree_overflow);
+    be->ptree_overflow = NULL;
+    be->ptree_overflow_length = 0;
+    be->ptree_overflow_size = 0;
+    if (be->frozen) {
+	fs_frozen_close(be->frozen);
+	be->frozen = NULL;
+    }
     free(be->ptrees_priv);
     be->ptrees_priv = NULL;
     be->ptree_length = 0;
@@ -745,6 +1165,12 @@ int fs_backend_close_files(fs_backend *be, fs_segment seg)
 	fs_list_close(be->predicates);
     }
     be->predicates = NULL;
+    /* after the predicates list, which has to be written before our
+     * entries in the directory can be checked */
+    if (be->ptpack) {
+	fs_ptpack_close(be->ptpack);
+	be->ptpack = NULL;
+    }
     g_hash_table_destroy(be->rid_id_map);
     be->rid_id_map = NULL;
     be->segment = -1;
@@ -34,15 +34,30 @@ int fs_backend_get_segments(fs_backend *be);
 fs_segment fs_backend_get_segment(fs_backend *be);
 void fs_backend_set_min_free(fs_backend *be, float min_free);
 
+/* a threaded server shares one backend between connections, queries run
+ * under a read lock, any number at once, and updates under a write lock,
+ * which is passed on with fs_backend_set_exclusive(). Trees that queries open
+ * past the limit aren't closed until the next exclusive section, which should
+ * be taken when fs_backend_trim_needed() */
+void fs_backend_set_threaded(fs_backend *be, int threaded);
+void fs_backend_set_exclusive(fs_backend *be, int exclusive);
+int fs_backend_trim_needed(fs_backend *be);
+
 int fs_backend_need_reload(void);
 #define fs_backend_open_files(b, s, fl, fi) fs_backend_open_files_intl(b, s, fl, fi, __FILE__, __LINE__)
 int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int files, char *file, int line);
 int fs_backend_unlink_indexes(fs_backend *be, fs_segment seg);
+int fs_backend_open_pended(fs_backend *be);
 void fs_backend_ptree_limited_open(fs_backend *be, int n);
 int fs_backend_open_ptree(fs_backend *be, fs_rid pred);
 int fs_backend_close_files(fs_backend *be, fs_segment seg);
 int fs_backend_cleanup_files(fs_backend *be);
 struct _fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object);
+/* the number of pred's trees, or -1 if it doesn't have any */
+int fs_backend_ptree_id(fs_backend *be, fs_rid pred);
+/* pairs in predicate n's S (object=0) or O tree, without opening it if the
+ * count is known */
+long long fs_backend_ptree_count(fs_backend *be, int n, int object);
 
 void fs_bnode_alloc(fs_backend *be, int count, fs_rid *from, fs_rid *to);
 
@@ -52,7 +67,13 @@ void fs_node_segments(fs_backend *be, char *segments);
 fs_import_timing fs_get_import_times(fs_backend *be, int seg);
 fs_query_timing fs_get_query_times(fs_backend *be, int seg);
 
-int fs_start_import(fs_backend *be, int seg);
+/* move live rows of the pairs table and model list down into free ones and
+ * cut the files short, for around budget seconds, returns 1 if there's more
+ * to do */
+int fs_backend_vacuum(fs_backend *be, double budget);
+
+/* flags is 0 or FS_IMPORT_BULK */
+int fs_start_import(fs_backend *be, int seg, int flags);
 int fs_stop_import(fs_backend *be, int seg);
 int fs_backend_transaction(fs_backend *be, fs_segment seg, int op);
 
@@ -0,0 +1,300 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <glib.h>
+
+#include "bloom.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+#define FS_BLOOM_ID 0x4a58424c
+
+/* 10 bits a key and 7 probes gives a false positive rate of around 1% */
+#define FS_BLOOM_BITS_PER_ENTRY 10
+#define FS_BLOOM_PROBES         7
+
+#define FS_BLOOM_BLOCK_BITS  512
+#define FS_BLOOM_BLOCK_WORDS (FS_BLOOM_BLOCK_BITS / 64)
+#define FS_BLOOM_MIN_BLOCKS  8
+
+struct bloom_header {
+    int32_t id;             // "JXBL"
+    uint32_t probes;        // bits set per key
+    uint64_t blocks;        // number of blocks, always a power of 2
+    uint64_t entries;       // keys added
+    uint64_t stamp;         // set by the owner
+    uint32_t replaced;      // a rebuilt filter has been renamed over this one
+    char padding[28];       // keep the blocks cache line aligned
+};
+
+struct _fs_bloom {
+    char *filename;
+    char *tmpname;          // where a new filter is built, till it's installed
+    int flags;
+    size_t length;
+    struct bloom_header *header;
+    uint64_t *bits;
+    fs_bloom *retired;      // filters this one replaced, see fs_bloom_retire()
+};
+
+/* 64 bit finaliser from MurmurHash3, rids are mostly well mixed already, but
+ * the top bits carry type flags */
+static inline uint64_t mix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+static fs_bloom *map_bloom(const char *filename, int fd, size_t length, int writable)
+{
+    void *ptr = mmap(NULL, length, PROT_READ | (writable ? PROT_WRITE : 0),
+                     MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", filename, strerror(errno));
+
+        return NULL;
+    }
+    fs_bloom *b = calloc(1, sizeof(fs_bloom));
+    b->filename = g_strdup(filename);
+    b->flags = writable ? O_RDWR : O_RDONLY;
+    b->length = length;
+    b->header = ptr;
+    b->bits = (uint64_t *)(b->header + 1);
+
+    return b;
+}
+
+fs_bloom *fs_bloom_open(const char *filename, int flags)
+{
+    if (sizeof(struct bloom_header) != 64) {
+        fs_error(LOG_CRIT, "incorrect bloom header size %zd, should be 64",
+                 sizeof(struct bloom_header));
+
+        return NULL;
+    }
+
+    const int writable = (flags & (O_WRONLY | O_RDWR)) != 0;
+    int fd = open(filename, FS_O_NOATIME | (writable ? O_RDWR : O_RDONLY));
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fs_error(LOG_ERR, "cannot open bloom filter '%s': %s", filename, strerror(errno));
+        }
+
+        return NULL;
+    }
+    struct bloom_header header;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.id != FS_BLOOM_ID || header.probes != FS_BLOOM_PROBES ||
+        header.blocks < FS_BLOOM_MIN_BLOCKS || (header.blocks & (header.blocks - 1)) ||
+        st.st_size != sizeof(header) + header.blocks * FS_BLOOM_BLOCK_BITS / 8) {
+        fs_error(LOG_WARNING, "ignoring bad bloom filter '%s'", filename);
+        close(fd);
+
+        return NULL;
+    }
+    /* the mapping outlives the descriptor, so there's no need to hold an fd
+     * per filter */
+    fs_bloom *b = map_bloom(filename, fd, st.st_size, writable);
+    close(fd);
+
+    return b;
+}
+
+fs_bloom *fs_bloom_create(const char *filename, uint64_t entries)
+{
+    uint64_t blocks = FS_BLOOM_MIN_BLOCKS;
+    while (blocks * FS_BLOOM_BLOCK_BITS < entries * FS_BLOOM_BITS_PER_ENTRY) {
+        blocks *= 2;
+    }
+    const size_t length = sizeof(struct bloom_header) + blocks * FS_BLOOM_BLOCK_BITS / 8;
+
+    /* other processes may have the current filter mapped, so the new one is
+     * built to one side and renamed over it by fs_bloom_install() */
+    char *tmpname = g_strdup_printf("%s.%d", filename, (int)getpid());
+    int fd = open(tmpname, FS_O_NOATIME | O_RDWR | O_CREAT | O_TRUNC, FS_FILE_MODE);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "cannot create bloom filter '%s': %s", tmpname, strerror(errno));
+        g_free(tmpname);
+
+        return NULL;
+    }
+    if (ftruncate(fd, length) == -1) {
+        fs_error(LOG_ERR, "failed to size bloom filter '%s': %s", tmpname, strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        g_free(tmpname);
+
+        return NULL;
+    }
+    fs_bloom *b = map_bloom(filename, fd, length, 1);
+    close(fd);
+    if (!b) {
+        unlink(tmpname);
+        g_free(tmpname);
+
+        return NULL;
+    }
+    b->tmpname = tmpname;
+    b->header->id = FS_BLOOM_ID;
+    b->header->probes = FS_BLOOM_PROBES;
+    b->header->blocks = blocks;
+
+    return b;
+}
+
+int fs_bloom_install(fs_bloom *b)
+{
+    if (!b->tmpname) {
+        return 0;
+    }
+    /* the filter being replaced is flagged once it's been unlinked, so that
+     * anyone with it mapped knows to look again */
+    int old = open(b->filename, FS_O_NOATIME | O_RDWR);
+    if (rename(b->tmpname, b->filename) == -1) {
+        fs_error(LOG_ERR, "failed to rename '%s': %s", b->tmpname, strerror(errno));
+        if (old != -1) close(old);
+
+        return 1;
+    }
+    if (old != -1) {
+        const uint32_t replaced = 1;
+        if (pwrite(old, &replaced, sizeof(replaced),
+                   offsetof(struct bloom_header, replaced)) != sizeof(replaced)) {
+            fs_error(LOG_ERR, "failed to flag '%s' as replaced: %s", b->filename, strerror(errno));
+        }
+        close(old);
+    }
+    g_free(b->tmpname);
+    b->tmpname = NULL;
+
+    return 0;
+}
+
+int fs_bloom_replaced(fs_bloom *b)
+{
+    return b->header->replaced;
+}
+
+fs_bloom *fs_bloom_reopen(fs_bloom *b)
+{
+    return fs_bloom_open(b->filename, b->flags);
+}
+
+void fs_bloom_retire(fs_bloom *b, fs_bloom *old)
+{
+    while (b->retired) {
+        b = b->retired;
+    }
+    b->retired = old;
+}
+
+/* the low bits of the hash pick the block, the probes take 9 bit slices of a
+ * second hash */
+static inline uint64_t *key_block(fs_bloom *b, uint64_t key, uint64_t *probes)
+{
+    const uint64_t h = mix(key);
+    *probes = mix(h ^ 0x9e3779b97f4a7c15ULL);
+
+    return b->bits + (h & (b->header->blocks - 1)) * FS_BLOOM_BLOCK_WORDS;
+}
+
+void fs_bloom_add(fs_bloom *b, uint64_t key)
+{
+    uint64_t g;
+    uint64_t *block = key_block(b, key, &g);
+    for (int i=0; i<FS_BLOOM_PROBES; i++, g >>= 9) {
+        const int bit = g & (FS_BLOOM_BLOCK_BITS - 1);
+        block[bit / 64] |= 1ULL << (bit % 64);
+    }
+    b->header->entries++;
+}
+
+int fs_bloom_test(fs_bloom *b, uint64_t key)
+{
+    uint64_t g;
+    const uint64_t *block = key_block(b, key, &g);
+    for (int i=0; i<FS_BLOOM_PROBES; i++, g >>= 9) {
+        const int bit = g & (FS_BLOOM_BLOCK_BITS - 1);
+        if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int fs_bloom_full(fs_bloom *b)
+{
+    return b->header->entries * FS_BLOOM_BITS_PER_ENTRY >
+           b->header->blocks * FS_BLOOM_BLOCK_BITS;
+}
+
+uint64_t fs_bloom_entries(fs_bloom *b)
+{
+    return b->header->entries;
+}
+
+uint64_t fs_bloom_size(fs_bloom *b)
+{
+    return b->length;
+}
+
+uint64_t fs_bloom_get_stamp(fs_bloom *b)
+{
+    return b->header->stamp;
+}
+
+void fs_bloom_set_stamp(fs_bloom *b, uint64_t stamp)
+{
+    b->header->stamp = stamp;
+}
+
+void fs_bloom_close(fs_bloom *b)
+{
+    while (b) {
+        fs_bloom *next = b->retired;
+        if (munmap(b->header, b->length) == -1) {
+            fs_error(LOG_CRIT, "failed to unmap '%s'", b->filename);
+        }
+        if (b->tmpname) {
+            /* never installed */
+            unlink(b->tmpname);
+            g_free(b->tmpname);
+        }
+        g_free(b->filename);
+        free(b);
+        b = next;
+    }
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,53 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+/* persistent, mmap'd Bloom filter over 64 bit keys, the bits for each key are
+ * all in one 64 byte block, so a test costs at most one cache miss */
+
+typedef struct _fs_bloom fs_bloom;
+
+/* open an existing filter, returns NULL if there isn't a valid one */
+fs_bloom *fs_bloom_open(const char *filename, int flags);
+
+/* create an empty filter with room for about entries keys, it's built in a
+ * temporary file and only replaces filename once it's installed */
+fs_bloom *fs_bloom_create(const char *filename, uint64_t entries);
+
+/* rename a new filter over the current one, which is flagged as replaced */
+int fs_bloom_install(fs_bloom *b);
+
+/* true once a rebuilt filter has been installed over b, it's still safe to
+ * use but will miss keys added since, so it should be reopened */
+int fs_bloom_replaced(fs_bloom *b);
+
+/* open whatever filter is at b's filename now, with the same flags */
+fs_bloom *fs_bloom_reopen(fs_bloom *b);
+
+/* keep old mapped till b is closed, as other threads may still be using it */
+void fs_bloom_retire(fs_bloom *b, fs_bloom *old);
+
+void fs_bloom_add(fs_bloom *b, uint64_t key);
+
+/* returns 0 if key was never added, 1 if it may have been */
+int fs_bloom_test(fs_bloom *b, uint64_t key);
+
+/* returns true once more keys have been added than the filter was sized
+ * for, and the false positive rate starts to climb */
+int fs_bloom_full(fs_bloom *b);
+
+uint64_t fs_bloom_entries(fs_bloom *b);
+uint64_t fs_bloom_size(fs_bloom *b);
+
+/* an opaque value stored with the filter, used by the owner to check that the
+ * filter is in step with the data it covers */
+uint64_t fs_bloom_get_stamp(fs_bloom *b);
+void fs_bloom_set_stamp(fs_bloom *b, uint64_t stamp);
+
+/* also closes any filters retired in its favour */
+void fs_bloom_close(fs_bloom *b);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
@@ -0,0 +1,308 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "backend.h"
+#include "backend-intl.h"
+#include "commit.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+/* below this many queued pairs it's not worth starting threads */
+#define COMMIT_PARALLEL_MIN 4096
+
+#define COMMIT_JOB_INIT_SIZE 256
+
+struct commit_row {
+    fs_rid pk;
+    fs_rid pair[2];
+    int *skip;
+};
+
+/* the pairs queued for one tree */
+struct commit_job {
+    fs_rid pred;
+    int object;
+    int n;
+    fs_ptree *pt;
+    int force;
+    int sorted;
+    int replay;
+    struct commit_row *rows;
+    int length;
+    int size;
+    long long added;
+};
+
+struct _fs_commit_batch {
+    fs_backend *be;
+    int force;
+    int sorted;
+    int threads;
+    struct commit_job jobs[FS_COMMIT_BATCH_TREES];
+    int job_count;
+    struct commit_job *current;
+    long rows;
+    long long added;
+};
+
+fs_commit_batch *fs_commit_batch_new(fs_backend *be, int force, int sorted)
+{
+    fs_commit_batch *cb = calloc(1, sizeof(fs_commit_batch));
+    cb->be = be;
+    cb->force = force;
+    cb->sorted = sorted;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cb->threads = cpus < 1 ? 1 : cpus > FS_COMMIT_THREADS ? FS_COMMIT_THREADS : cpus;
+
+    return cb;
+}
+
+/* an update replayed from the log may have reached the tree before a crash */
+static int pair_exists(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
+{
+    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
+    if (!it) {
+        return 0;
+    }
+    fs_rid found[2];
+    const int ret = fs_ptree_it_next(it, found);
+    fs_ptree_it_free(it);
+
+    return ret;
+}
+
+/* the rows for each pk are passed to fs_ptree_add_run() in one go */
+static void run_job_sorted(struct commit_job *job)
+{
+    fs_rid (*pairs)[2] = NULL;
+    int size = 0;
+
+    for (int i=0; i<job->length; ) {
+        int n = 0;
+        const fs_rid pk = job->rows[i].pk;
+        int rows = 0;
+        for (int j=i; j<job->length && job->rows[j].pk == pk; j++, rows++) {
+            if (job->replay && pair_exists(job->pt, pk, job->rows[j].pair)) {
+                continue;
+            }
+            if (n == size) {
+                size = size ? size * 2 : COMMIT_JOB_INIT_SIZE;
+                pairs = realloc(pairs, size * sizeof(fs_rid[2]));
+            }
+            pairs[n][0] = job->rows[j].pair[0];
+            pairs[n][1] = job->rows[j].pair[1];
+            n++;
+        }
+        if (fs_ptree_add_run(job->pt, pk, pairs, n)) {
+            fs_error(LOG_ERR, "failed to add run of %d pairs for %016llx", n, pk);
+        } else {
+            job->added += n;
+        }
+        i += rows;
+    }
+    free(pairs);
+}
+
+static void run_job(gpointer data, gpointer user_data)
+{
+    struct commit_job *job = data;
+
+    if (job->sorted) {
+        run_job_sorted(job);
+
+        return;
+    }
+
+    for (int i=0; i<job->length; i++) {
+        struct commit_row *r = job->rows + i;
+        if (job->replay && pair_exists(job->pt, r->pk, r->pair)) {
+            continue;
+        }
+        if (fs_ptree_add(job->pt, r->pk, r->pair, job->force)) {
+            if (r->skip) *r->skip = 1;
+        } else {
+            job->added++;
+        }
+    }
+}
+
+/* biggest first, so that the longest jobs aren't left till last */
+static int job_sort_length(const void *va, const void *vb)
+{
+    const struct commit_job *a = va;
+    const struct commit_job *b = vb;
+
+    return b->length - a->length;
+}
+
+/* insert the queued pairs, and unpin the trees */
+static void run_batch(fs_commit_batch *cb)
+{
+    if (cb->job_count == 0) return;
+
+    int threads = cb->job_count < cb->threads ? cb->job_count : cb->threads;
+    /* replay is only ever a few updates, each looked up before it's added */
+    if (cb->rows < COMMIT_PARALLEL_MIN || cb->be->wal_replay) {
+        threads = 1;
+    }
+
+    /* chain revision trees all write to the shared pairs table, which
+     * remaps when it grows, so they're kept on this thread, and only block
+     * revision trees are handed to the workers */
+    int blocks = 0;
+    for (int i=0; i<cb->job_count; i++) {
+        if (!fs_ptree_uses_table(cb->jobs[i].pt)) {
+            blocks++;
+        }
+    }
+    if (blocks < threads) {
+        threads = blocks;
+    }
+
+    GThreadPool *pool = NULL;
+    if (threads > 1) {
+        if (!g_thread_supported()) g_thread_init(NULL);
+        GError *err = NULL;
+        pool = g_thread_pool_new(run_job, NULL, threads, TRUE, &err);
+        if (!pool) {
+            fs_error(LOG_ERR, "cannot start commit threads: %s", err->message);
+            g_error_free(err);
+        }
+    }
+
+    if (pool) {
+        qsort(cb->jobs, cb->job_count, sizeof(struct commit_job), job_sort_length);
+        for (int i=0; i<cb->job_count; i++) {
+            if (!fs_ptree_uses_table(cb->jobs[i].pt)) {
+                g_thread_pool_push(pool, cb->jobs + i, NULL);
+            }
+        }
+        for (int i=0; i<cb->job_count; i++) {
+            if (fs_ptree_uses_table(cb->jobs[i].pt)) {
+                run_job(cb->jobs + i, NULL);
+            }
+        }
+        /* waits for the jobs to finish */
+        g_thread_pool_free(pool, FALSE, TRUE);
+    } else {
+        for (int i=0; i<cb->job_count; i++) {
+            run_job(cb->jobs + i, NULL);
+        }
+    }
+
+    for (int i=0; i<cb->job_count; i++) {
+        struct commit_job *job = cb->jobs + i;
+        cb->added += job->added;
+        cb->be->ptrees_priv[job->n].pinned--;
+        job->length = 0;
+        job->added = 0;
+    }
+    cb->job_count = 0;
+    cb->current = NULL;
+    cb->rows = 0;
+}
+
+static struct commit_job *get_job(fs_commit_batch *cb, fs_rid pred, int object)
+{
+    for (int i=0; i<cb->job_count; i++) {
+        if (cb->jobs[i].pred == pred && cb->jobs[i].object == object) {
+            return cb->jobs + i;
+        }
+    }
+
+    if (cb->job_count == FS_COMMIT_BATCH_TREES) {
+        run_batch(cb);
+    }
+
+    fs_backend *be = cb->be;
+    int n = fs_backend_ptree_id(be, pred);
+    if (n == -1) {
+        /* it's a new ptree pair */
+        n = fs_backend_open_ptree(be, pred);
+        fs_list_add(be->predicates, &pred);
+    } else {
+        fs_backend_ptree_limited_open(be, n);
+    }
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+    fs_ptree *pt = object ? ref->ptree_o : ref->ptree_s;
+    if (!pt) {
+        fs_error(LOG_CRIT, "failed to get ptree for %016llx", pred);
+
+        return NULL;
+    }
+    ref->pinned++;
+
+    struct commit_job *job = cb->jobs + cb->job_count++;
+    job->pred = pred;
+    job->object = object;
+    job->n = n;
+    job->pt = pt;
+    job->force = cb->force;
+    job->sorted = cb->sorted;
+    job->replay = be->wal_replay;
+    job->length = 0;
+    job->added = 0;
+
+    return job;
+}
+
+int fs_commit_batch_add(fs_commit_batch *cb, fs_rid pred, int object, fs_rid pk, fs_rid pair[2], int *skip)
+{
+    if (!cb->current || cb->current->pred != pred ||
+        cb->current->object != object) {
+        cb->current = get_job(cb, pred, object);
+        if (!cb->current) {
+            return 1;
+        }
+    }
+
+    struct commit_job *job = cb->current;
+    if (job->length == job->size) {
+        job->size = job->size ? job->size * 2 : COMMIT_JOB_INIT_SIZE;
+        job->rows = realloc(job->rows, job->size * sizeof(struct commit_row));
+    }
+    struct commit_row *r = job->rows + job->length++;
+    r->pk = pk;
+    r->pair[0] = pair[0];
+    r->pair[1] = pair[1];
+    r->skip = skip;
+
+    if (++cb->rows >= FS_COMMIT_BATCH_ROWS) {
+        run_batch(cb);
+    }
+
+    return 0;
+}
+
+long long fs_commit_batch_finish(fs_commit_batch *cb)
+{
+    run_batch(cb);
+    const long long added = cb->added;
+    for (int i=0; i<FS_COMMIT_BATCH_TREES; i++) {
+        free(cb->jobs[i].rows);
+    }
+    free(cb);
+
+    return added;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
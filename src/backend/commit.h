@@ -0,0 +1,33 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include "backend.h"
+
+/* batches of pairs for many ptrees, the pairs are queued by tree, then
+ * inserted with a thread per tree, so trees are written in parallel but no
+ * tree is written by more than one thread. Only block revision trees go to
+ * the threads, chain revision trees share the pairs table, so they're all
+ * written by the calling thread. The trees with queued pairs are pinned
+ * open. Pairs should be added in predicate order, for the batches to
+ * fill evenly */
+
+typedef struct _fs_commit_batch fs_commit_batch;
+
+/* force is passed to fs_ptree_add(). If sorted is set the pairs for each
+ * tree must come sorted on pk, pair[0] then pair[1], distinct, and not
+ * already in the tree, and they're added with fs_ptree_add_run() */
+fs_commit_batch *fs_commit_batch_new(fs_backend *be, int force, int sorted);
+
+/* queue pair for pk in pred's S (object=0) or O tree, creating the trees if
+ * pred is new. If skip isn't NULL *skip is set if fs_ptree_add() fails, which
+ * happens some time before fs_commit_batch_finish() returns. Can insert the
+ * pairs queued so far */
+int fs_commit_batch_add(fs_commit_batch *cb, fs_rid pred, int object, fs_rid pk, fs_rid pair[2], int *skip);
+
+/* insert everything still queued and free the batch, returns the number of
+ * pairs fs_ptree_add() accepted, over the life of the batch */
+long long fs_commit_batch_finish(fs_commit_batch *cb);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
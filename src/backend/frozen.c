@@ -0,0 +1,853 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "frozen.h"
+#include "backend-intl.h"
+#include "list.h"
+#include "sort.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+#define FS_FROZEN_ID 0x4a58465a
+#define FS_FROZEN_REVISION 1
+
+#define FS_FROZEN_BLOCK_ROWS 128
+
+/* row flags, a row that starts a new pk or model has the value stored in full,
+ * otherwise it's coded as the difference from the value before */
+#define ROW_NEW_PK    0x01
+#define ROW_NEW_MODEL 0x02
+
+/* flags byte, plus three 64 bit varints */
+#define MAX_ROW_BYTES (1 + 3 * 10)
+
+struct frozen_header {
+    int32_t id;             // "JXFZ"
+    int32_t revision;
+    int32_t segment;
+    int32_t block_rows;     // max rows in a block
+    uint64_t preds;         // entries in the predicate directory
+    uint64_t pred_offset;   // file offset of the directory
+    uint64_t blocks;        // entries in the block index
+    uint64_t block_offset;  // file offset of the block index
+    uint64_t rows;
+    char padding[456];      // allign to a block
+};
+
+/* the rows of one ptree, blocks are contiguous in the block index */
+struct _fs_frozen_run {
+    uint64_t generation;    // of the ptree when it was frozen
+    uint64_t rows;
+    uint64_t first_block;
+    uint64_t blocks;
+};
+
+struct frozen_pred {
+    fs_rid pred;
+    fs_frozen_run run[2];   // S and O trees
+};
+
+struct frozen_block {
+    fs_rid pk;              // first pk in the block
+    uint64_t offset;        // file offset of the coded rows
+    uint32_t rows;
+    uint32_t length;        // in bytes
+};
+
+/* the change log, next to the frozen file, records each pk changed since the
+ * freeze. Rows for any other pk are still good */
+struct change_record {
+    fs_rid pred;
+    uint32_t object;
+    uint32_t padding;
+    fs_rid pk;
+    uint64_t generation;    // of the tree after the change
+};
+
+struct run_state {
+    uint64_t generation;    // the tree generation the run and changed cover
+    GHashTable *changed;    // pks to read from the tree, NULL if none
+};
+
+struct _fs_frozen {
+    char *filename;
+    unsigned char *ptr;
+    size_t length;
+    const struct frozen_header *header;
+    const struct frozen_pred *preds;
+    const struct frozen_block *blocks;
+    struct run_state *state;    // by pred, then S and O
+    char *log_filename;
+    int log_fd;
+    off_t log_read;             // how much of the log state covers
+    GStaticRWLock lock;         // guards state
+};
+
+struct _fs_frozen_it {
+    fs_frozen *fz;
+    const struct frozen_block *block;   // next block, when traversing
+    const struct frozen_block *end;
+    const struct run_state *state;      // pks to skip, when traversing
+    fs_rid mrid;
+    fs_rid (*rows)[3];
+    int length;             // rows decoded
+    int size;               // rows allocated
+    int pos;
+    long long total;
+};
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+
+    return p;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+    uint64_t r = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t b = *p++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static int pred_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const struct frozen_pred *b = vb;
+
+    if (*a < b->pred) return -1;
+    if (*a > b->pred) return 1;
+
+    return 0;
+}
+
+static int pred_sort(const void *va, const void *vb)
+{
+    return pred_cmp(&((const struct frozen_pred *)va)->pred, vb);
+}
+
+static char *log_name(const char *filename)
+{
+    return g_strdup_printf("%s.log", filename);
+}
+
+static guint rid_hash(gconstpointer p)
+{
+    const fs_rid *r = p;
+
+    return (guint)*r;
+}
+
+static gboolean rid_equal(gconstpointer va, gconstpointer vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    return *a == *b;
+}
+
+/* runs come from the pred directory, S then O for each pred */
+static struct run_state *run_state(fs_frozen *fz, const fs_frozen_run *run)
+{
+    const uint64_t p = ((const char *)run - (const char *)fz->preds) /
+                       sizeof(struct frozen_pred);
+    const int object = run == &fz->preds[p].run[1];
+
+    return &fz->state[p * 2 + object];
+}
+
+/* apply the changes other processes, or this one before it started, have
+ * logged since we last looked. Called with the write lock held */
+static void log_catch_up(fs_frozen *fz)
+{
+    if (fz->log_fd == -1) return;
+
+    struct change_record rec[256];
+    ssize_t got;
+    while ((got = pread(fz->log_fd, rec, sizeof(rec), fz->log_read)) > 0) {
+        const int count = got / sizeof(struct change_record);
+        if (count == 0) break;
+        fz->log_read += count * sizeof(struct change_record);
+        for (int i=0; i<count; i++) {
+            const struct frozen_pred *p = bsearch(&rec[i].pred, fz->preds,
+                fz->header->preds, sizeof(struct frozen_pred), pred_cmp);
+            if (!p || rec[i].object > 1) continue;
+            struct run_state *st = &fz->state[(p - fz->preds) * 2 + rec[i].object];
+            /* a change that wasn't logged breaks the chain, after that
+             * nothing more can be trusted for the run */
+            if (rec[i].generation != st->generation + 1) continue;
+            if (!st->changed) {
+                st->changed = g_hash_table_new_full(rid_hash, rid_equal,
+                                                    g_free, NULL);
+            }
+            fs_rid *pk = g_new(fs_rid, 1);
+            *pk = rec[i].pk;
+            g_hash_table_replace(st->changed, pk, pk);
+            st->generation = rec[i].generation;
+        }
+    }
+}
+
+fs_frozen *fs_frozen_open(fs_backend *be, fs_segment seg)
+{
+    char *filename = g_strdup_printf(FS_FROZEN, fs_backend_get_kb(be), seg);
+    if (access(filename, F_OK) == -1) {
+        g_free(filename);
+
+        return NULL;
+    }
+    fs_frozen *fz = fs_frozen_open_filename(filename);
+    g_free(filename);
+
+    return fz;
+}
+
+fs_frozen *fs_frozen_open_filename(const char *filename)
+{
+    if (sizeof(struct frozen_header) != 512) {
+        fs_error(LOG_CRIT, "incorrect frozen header size %zd, should be 512",
+                 sizeof(struct frozen_header));
+
+        return NULL;
+    }
+
+    int fd = open(filename, FS_O_NOATIME | O_RDONLY);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "cannot open frozen segment '%s': %s", filename, strerror(errno));
+
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct frozen_header)) {
+        fs_error(LOG_ERR, "frozen segment '%s' is truncated", filename);
+        close(fd);
+
+        return NULL;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", filename, strerror(errno));
+
+        return NULL;
+    }
+
+    fs_frozen *fz = calloc(1, sizeof(fs_frozen));
+    fz->filename = g_strdup(filename);
+    fz->log_fd = -1;
+    fz->ptr = ptr;
+    fz->length = st.st_size;
+    fz->header = ptr;
+    const struct frozen_header *h = fz->header;
+    if (h->id != FS_FROZEN_ID || h->revision != FS_FROZEN_REVISION ||
+        h->block_rows != FS_FROZEN_BLOCK_ROWS ||
+        h->pred_offset + h->preds * sizeof(struct frozen_pred) > fz->length ||
+        h->block_offset + h->blocks * sizeof(struct frozen_block) > fz->length) {
+        fs_error(LOG_ERR, "%s does not appear to be a frozen segment", filename);
+        fs_frozen_close(fz);
+
+        return NULL;
+    }
+    fz->preds = (const struct frozen_pred *)(fz->ptr + h->pred_offset);
+    fz->blocks = (const struct frozen_block *)(fz->ptr + h->block_offset);
+    /* the blocks are read in order, so let the kernel read ahead */
+    madvise(fz->ptr, fz->length, MADV_WILLNEED);
+
+    fz->state = calloc(h->preds * 2 + 1, sizeof(struct run_state));
+    for (uint64_t p=0; p<h->preds; p++) {
+        fz->state[p * 2].generation = fz->preds[p].run[0].generation;
+        fz->state[p * 2 + 1].generation = fz->preds[p].run[1].generation;
+    }
+    g_static_rw_lock_init(&fz->lock);
+    fz->log_filename = log_name(filename);
+    fz->log_fd = open(fz->log_filename, FS_O_NOATIME | O_RDWR | O_APPEND);
+    if (fz->log_fd == -1 && errno != ENOENT) {
+        fs_error(LOG_ERR, "cannot open '%s': %s", fz->log_filename, strerror(errno));
+    }
+    g_static_rw_lock_writer_lock(&fz->lock);
+    log_catch_up(fz);
+    g_static_rw_lock_writer_unlock(&fz->lock);
+
+    return fz;
+}
+
+const fs_frozen_run *fs_frozen_get_run(fs_frozen *fz, fs_rid pred, int object)
+{
+    const struct frozen_pred *p = bsearch(&pred, fz->preds, fz->header->preds,
+                                          sizeof(struct frozen_pred), pred_cmp);
+    if (!p) {
+        return NULL;
+    }
+    const fs_frozen_run *run = &p->run[object ? 1 : 0];
+    if (run->first_block + run->blocks > fz->header->blocks) {
+        fs_error(LOG_ERR, "run for %016llx in %s is out of range", pred, fz->filename);
+
+        return NULL;
+    }
+
+    return run;
+}
+
+uint64_t fs_frozen_run_generation(const fs_frozen_run *run)
+{
+    return run->generation;
+}
+
+int fs_frozen_run_current(fs_frozen *fz, const fs_frozen_run *run, uint64_t generation)
+{
+    struct run_state *st = run_state(fz, run);
+
+    g_static_rw_lock_reader_lock(&fz->lock);
+    int current = st->generation == generation;
+    g_static_rw_lock_reader_unlock(&fz->lock);
+    if (current) return 1;
+
+    /* another process may have logged changes */
+    g_static_rw_lock_writer_lock(&fz->lock);
+    log_catch_up(fz);
+    current = st->generation == generation;
+    g_static_rw_lock_writer_unlock(&fz->lock);
+
+    return current;
+}
+
+int fs_frozen_changed(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk)
+{
+    const struct run_state *st = run_state(fz, run);
+
+    g_static_rw_lock_reader_lock(&fz->lock);
+    const int changed = st->changed && g_hash_table_lookup(st->changed, &pk);
+    g_static_rw_lock_reader_unlock(&fz->lock);
+
+    return changed;
+}
+
+int fs_frozen_any_changed(fs_frozen *fz, const fs_frozen_run *run)
+{
+    return run_state(fz, run)->changed != NULL;
+}
+
+void fs_frozen_log_change(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk,
+                          uint64_t generation)
+{
+    struct run_state *st = run_state(fz, run);
+
+    g_static_rw_lock_writer_lock(&fz->lock);
+    log_catch_up(fz);
+    if (st->generation + 1 != generation) {
+        /* the run was already stale, it stays that way */
+        g_static_rw_lock_writer_unlock(&fz->lock);
+
+        return;
+    }
+    if (fz->log_fd == -1) {
+        fz->log_fd = open(fz->log_filename, FS_O_NOATIME | O_RDWR | O_APPEND | O_CREAT, FS_FILE_MODE);
+        if (fz->log_fd == -1) {
+            fs_error(LOG_ERR, "cannot create '%s': %s", fz->log_filename, strerror(errno));
+            g_static_rw_lock_writer_unlock(&fz->lock);
+
+            return;
+        }
+    }
+    struct change_record rec;
+    memset(&rec, 0, sizeof(rec));
+    const uint64_t p = run_state(fz, run) - fz->state;
+    rec.pred = fz->preds[p / 2].pred;
+    rec.object = p % 2;
+    rec.pk = pk;
+    rec.generation = generation;
+    /* if it doesn't make it the run is stale, which is safe */
+    if (write(fz->log_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        fs_error(LOG_ERR, "cannot write to '%s': %s", fz->log_filename, strerror(errno));
+    }
+    /* pick it up the same way as other processes' changes */
+    log_catch_up(fz);
+    g_static_rw_lock_writer_unlock(&fz->lock);
+}
+
+int fs_frozen_unlink(const char *filename)
+{
+    char *log = log_name(filename);
+    /* the log first, so a crash in between leaves the runs stale, never
+     * missing a change */
+    int ret = 0;
+    if (unlink(log) == -1 && errno != ENOENT) ret = -1;
+    if (unlink(filename) == -1 && errno != ENOENT) ret = -1;
+    g_free(log);
+
+    return ret;
+}
+
+/* returns the number of rows decoded, or -1 */
+static int decode_block(fs_frozen *fz, const struct frozen_block *b, fs_rid rows[][3])
+{
+    if (b->offset + b->length > fz->length || b->rows > FS_FROZEN_BLOCK_ROWS) {
+        fs_error(LOG_ERR, "block at %lld in %s is out of range",
+                 (long long)b->offset, fz->filename);
+
+        return -1;
+    }
+    const unsigned char *p = fz->ptr + b->offset;
+    const unsigned char *end = p + b->length;
+    fs_rid prev[3] = { 0, 0, 0 };
+    for (int i=0; i<b->rows; i++) {
+        if (p >= end) goto corrupt;
+        const int flags = *p++;
+        uint64_t v;
+        if (flags & ROW_NEW_PK) {
+            if (!(p = get_varint(p, end, &v))) goto corrupt;
+            prev[0] += v;
+        }
+        if (flags & ROW_NEW_MODEL) {
+            if (!(p = get_varint(p, end, &v))) goto corrupt;
+            prev[1] = v;
+        }
+        if (!(p = get_varint(p, end, &v))) goto corrupt;
+        if (flags & (ROW_NEW_PK | ROW_NEW_MODEL)) {
+            prev[2] = v;
+        } else {
+            prev[2] += v;
+        }
+        rows[i][0] = prev[0];
+        rows[i][1] = prev[1];
+        rows[i][2] = prev[2];
+    }
+
+    return b->rows;
+
+corrupt:
+    fs_error(LOG_ERR, "corrupt block at %lld in %s", (long long)b->offset,
+             fz->filename);
+
+    return -1;
+}
+
+/* index of the first block of run whose first pk is >= pk */
+static uint64_t lower_bound(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk)
+{
+    const struct frozen_block *blocks = fz->blocks + run->first_block;
+    uint64_t lo = 0, hi = run->blocks;
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (blocks[mid].pk < pk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+fs_frozen_it *fs_frozen_search(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk, fs_rid pair[2])
+{
+    const struct frozen_block *blocks = fz->blocks + run->first_block;
+    fs_frozen_it *it = NULL;
+    fs_rid rows[FS_FROZEN_BLOCK_ROWS][3];
+
+    /* the block before the first one that starts at or after pk may end
+     * with some of pk's rows */
+    uint64_t b = lower_bound(fz, run, pk);
+    if (b > 0) b--;
+    for (; b < run->blocks && blocks[b].pk <= pk; b++) {
+        const int n = decode_block(fz, blocks + b, rows);
+        for (int i=0; i<n; i++) {
+            if (rows[i][0] < pk) continue;
+            if (rows[i][0] > pk) goto done;
+            if (pair[0] != FS_RID_NULL && pair[0] != rows[i][1]) continue;
+            if (pair[1] != FS_RID_NULL && pair[1] != rows[i][2]) continue;
+            if (!it) {
+                it = calloc(1, sizeof(fs_frozen_it));
+                it->fz = fz;
+                it->size = 16;
+                it->rows = malloc(it->size * sizeof(fs_rid) * 3);
+            } else if (it->length == it->size) {
+                it->size *= 2;
+                it->rows = realloc(it->rows, it->size * sizeof(fs_rid) * 3);
+            }
+            memcpy(it->rows[it->length++], rows[i], sizeof(fs_rid) * 3);
+        }
+    }
+
+done:
+    if (it) {
+        it->total = it->length;
+    }
+
+    return it;
+}
+
+fs_frozen_it *fs_frozen_traverse(fs_frozen *fz, const fs_frozen_run *run, fs_rid mrid)
+{
+    fs_frozen_it *it = calloc(1, sizeof(fs_frozen_it));
+    it->fz = fz;
+    it->block = fz->blocks + run->first_block;
+    it->end = it->block + run->blocks;
+    it->mrid = mrid;
+    if (fs_frozen_any_changed(fz, run)) {
+        it->state = run_state(fz, run);
+    }
+    it->size = FS_FROZEN_BLOCK_ROWS;
+    it->rows = malloc(it->size * sizeof(fs_rid) * 3);
+    it->total = run->rows;
+
+    return it;
+}
+
+int fs_frozen_it_next(fs_frozen_it *it, fs_rid row[3])
+{
+    while (it->pos == it->length) {
+        if (it->block == it->end) {
+            return 0;
+        }
+        const int n = decode_block(it->fz, it->block++, it->rows);
+        if (n < 0) {
+            it->block = it->end;
+
+            return 0;
+        }
+        it->length = 0;
+        it->pos = 0;
+        fs_rid pk = FS_RID_NULL;
+        int changed = 0;
+        for (int i=0; i<n; i++) {
+            if (it->state && it->rows[i][0] != pk) {
+                /* the rows are in pk order, so look each one up once */
+                pk = it->rows[i][0];
+                g_static_rw_lock_reader_lock(&it->fz->lock);
+                changed = g_hash_table_lookup(it->state->changed, &pk) != NULL;
+                g_static_rw_lock_reader_unlock(&it->fz->lock);
+            }
+            if (changed) continue;
+            if (it->mrid == FS_RID_NULL || it->mrid == it->rows[i][1]) {
+                if (i != it->length) {
+                    memcpy(it->rows[it->length], it->rows[i], sizeof(fs_rid) * 3);
+                }
+                it->length++;
+            }
+        }
+    }
+    memcpy(row, it->rows[it->pos++], sizeof(fs_rid) * 3);
+
+    return 1;
+}
+
+int fs_frozen_it_get_length(fs_frozen_it *it)
+{
+    return it->total;
+}
+
+void fs_frozen_it_free(fs_frozen_it *it)
+{
+    if (!it) return;
+
+    free(it->rows);
+    free(it);
+}
+
+unsigned long long fs_frozen_estimate(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk)
+{
+    const struct frozen_block *blocks = fz->blocks + run->first_block;
+    unsigned long long estimate = 0;
+
+    uint64_t b = lower_bound(fz, run, pk);
+    if (b > 0) b--;
+    for (; b < run->blocks && blocks[b].pk <= pk; b++) {
+        /* blocks between two that start with pk are all pk's, at either end
+         * we guess that half the block is */
+        if (blocks[b].pk == pk && b + 1 < run->blocks && blocks[b+1].pk == pk) {
+            estimate += blocks[b].rows;
+        } else {
+            estimate += (blocks[b].rows + 1) / 2;
+        }
+    }
+
+    return estimate;
+}
+
+void fs_frozen_close(fs_frozen *fz)
+{
+    if (!fz) return;
+
+    if (fz->state) {
+        for (uint64_t r=0; r<fz->header->preds * 2; r++) {
+            if (fz->state[r].changed) g_hash_table_destroy(fz->state[r].changed);
+        }
+        free(fz->state);
+        g_static_rw_lock_free(&fz->lock);
+    }
+    if (munmap(fz->ptr, fz->length) == -1) {
+        fs_error(LOG_CRIT, "failed to unmap '%s'", fz->filename);
+    }
+    if (fz->log_fd != -1) close(fz->log_fd);
+    g_free(fz->log_filename);
+    g_free(fz->filename);
+    free(fz);
+}
+
+struct writer {
+    FILE *f;
+    uint64_t offset;
+    struct frozen_block *blocks;
+    uint64_t block_count;
+    uint64_t block_size;
+    unsigned char buffer[FS_FROZEN_BLOCK_ROWS * MAX_ROW_BYTES];
+    int length;
+    int rows;
+    fs_rid first_pk;
+    fs_rid prev[3];
+    int err;
+};
+
+static void flush_block(struct writer *w)
+{
+    if (!w->rows) return;
+
+    if (w->block_count == w->block_size) {
+        w->block_size = w->block_size ? w->block_size * 2 : 1024;
+        w->blocks = realloc(w->blocks, w->block_size * sizeof(struct frozen_block));
+    }
+    struct frozen_block *b = w->blocks + w->block_count++;
+    memset(b, 0, sizeof(struct frozen_block));
+    b->pk = w->first_pk;
+    b->offset = w->offset;
+    b->rows = w->rows;
+    b->length = w->length;
+    if (fwrite(w->buffer, w->length, 1, w->f) != 1) {
+        w->err = errno;
+    }
+    w->offset += w->length;
+    w->length = 0;
+    w->rows = 0;
+}
+
+static void add_row(struct writer *w, const fs_rid row[3])
+{
+    if (w->rows == FS_FROZEN_BLOCK_ROWS) {
+        flush_block(w);
+    }
+    int flags = 0;
+    if (w->rows == 0) {
+        /* blocks are decoded independently, so the first row starts from 0 */
+        flags = ROW_NEW_PK | ROW_NEW_MODEL;
+        w->prev[0] = 0;
+        w->first_pk = row[0];
+    } else {
+        if (row[0] != w->prev[0]) flags |= ROW_NEW_PK;
+        if (row[1] != w->prev[1]) flags |= ROW_NEW_MODEL;
+    }
+    unsigned char *p = w->buffer + w->length;
+    *p++ = flags;
+    if (flags & ROW_NEW_PK) {
+        p = put_varint(p, row[0] - w->prev[0]);
+    }
+    if (flags & ROW_NEW_MODEL) {
+        p = put_varint(p, row[1]);
+    }
+    if (flags) {
+        p = put_varint(p, row[2]);
+    } else {
+        p = put_varint(p, row[2] - w->prev[2]);
+    }
+    w->length = p - w->buffer;
+    w->rows++;
+    w->prev[0] = row[0];
+    w->prev[1] = row[1];
+    w->prev[2] = row[2];
+}
+
+static void end_run(struct writer *w, fs_frozen_run *run)
+{
+    if (!run) return;
+
+    flush_block(w);
+    run->blocks = w->block_count - run->first_block;
+}
+
+int fs_frozen_write(fs_backend *be, const char *filename)
+{
+    const int npreds = be->ptree_length;
+    struct frozen_pred *preds = calloc(npreds ? npreds : 1, sizeof(struct frozen_pred));
+    fs_list *l = fs_list_open(be, "freeze", sizeof(fs_rid) * 4, O_CREAT | O_TRUNC | O_RDWR);
+    if (!l) {
+        free(preds);
+
+        return 1;
+    }
+
+    /* the O trees hold the same quads as the S trees, so one copy of the
+     * quads, sorted two ways, gives us both runs */
+    for (int i=0; i<npreds; i++) {
+        fs_backend_ptree_limited_open(be, i);
+        struct ptree_ref *ref = &be->ptrees_priv[i];
+        if (!ref->ptree_s || !ref->ptree_o) {
+            fs_error(LOG_ERR, "cannot open ptrees for %016llx", ref->pred);
+            fs_list_unlink(l);
+            fs_list_close(l);
+            free(preds);
+
+            return 1;
+        }
+        preds[i].pred = ref->pred;
+        preds[i].run[0].generation = fs_ptree_generation(ref->ptree_s);
+        preds[i].run[1].generation = fs_ptree_generation(ref->ptree_o);
+        fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, ref->pred, FS_RID_NULL };
+        fs_ptree_it *it = fs_ptree_traverse(ref->ptree_s, FS_RID_NULL);
+        while (it && fs_ptree_traverse_next(it, quad)) {
+            fs_list_add(l, quad);
+        }
+        fs_ptree_it_free(it);
+    }
+    qsort(preds, npreds, sizeof(struct frozen_pred), pred_sort);
+
+    char *tmp = g_strdup_printf("%s.tmp", filename);
+    struct writer *w = calloc(1, sizeof(struct writer));
+    w->f = fopen(tmp, "w");
+    if (!w->f) {
+        fs_error(LOG_ERR, "cannot create '%s': %s", tmp, strerror(errno));
+        fs_list_unlink(l);
+        fs_list_close(l);
+        g_free(tmp);
+        free(w);
+        free(preds);
+
+        return 1;
+    }
+    struct frozen_header header;
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, w->f) != 1) {
+        w->err = errno;
+    }
+    w->offset = sizeof(header);
+
+    for (int object=0; object<2; object++) {
+        fs_list_rewind(l);
+        fs_list_sort_chunked(l, object ? quad_sort_by_poms : quad_sort_by_psmo);
+        fs_frozen_run *run = NULL;
+        fs_rid pred = FS_RID_NULL;
+        fs_rid quad[4];
+        /* keep any duplicates, so the run matches what the tree returns */
+        while (fs_list_next_sort(l, quad)) {
+            if (!run || quad[2] != pred) {
+                end_run(w, run);
+                pred = quad[2];
+                struct frozen_pred *p = bsearch(&pred, preds, npreds,
+                                    sizeof(struct frozen_pred), pred_cmp);
+                if (!p) {
+                    fs_error(LOG_CRIT, "quad with unknown predicate %016llx", pred);
+                    w->err = EINVAL;
+                    run = NULL;
+
+                    break;
+                }
+                run = &p->run[object];
+                run->first_block = w->block_count;
+            }
+            const fs_rid row[3] = { object ? quad[3] : quad[1], quad[0],
+                                    object ? quad[1] : quad[3] };
+            add_row(w, row);
+            run->rows++;
+            header.rows++;
+        }
+        end_run(w, run);
+    }
+    fs_list_unlink(l);
+    fs_list_close(l);
+
+    header.id = FS_FROZEN_ID;
+    header.revision = FS_FROZEN_REVISION;
+    header.segment = fs_backend_get_segment(be);
+    header.block_rows = FS_FROZEN_BLOCK_ROWS;
+    header.blocks = w->block_count;
+    header.block_offset = w->offset;
+    if (w->block_count && fwrite(w->blocks, sizeof(struct frozen_block),
+                                 w->block_count, w->f) != w->block_count) {
+        w->err = errno;
+    }
+    w->offset += w->block_count * sizeof(struct frozen_block);
+    header.preds = npreds;
+    header.pred_offset = w->offset;
+    if (npreds && fwrite(preds, sizeof(struct frozen_pred), npreds, w->f) != npreds) {
+        w->err = errno;
+    }
+    if (fseek(w->f, 0, SEEK_SET) == -1 ||
+        fwrite(&header, sizeof(header), 1, w->f) != 1 ||
+        fflush(w->f) == EOF || fsync(fileno(w->f)) == -1) {
+        w->err = errno;
+    }
+    fclose(w->f);
+    const int err = w->err;
+    free(w->blocks);
+    free(w);
+    free(preds);
+
+    if (err) {
+        fs_error(LOG_ERR, "failed writing '%s': %s", tmp, strerror(err));
+        unlink(tmp);
+        g_free(tmp);
+
+        return 1;
+    }
+    /* changes logged against the old runs mean nothing to the new ones */
+    char *log = log_name(filename);
+    if (unlink(log) == -1 && errno != ENOENT) {
+        fs_error(LOG_ERR, "cannot remove '%s': %s", log, strerror(errno));
+        unlink(tmp);
+        g_free(log);
+        g_free(tmp);
+
+        return 1;
+    }
+    g_free(log);
+    if (rename(tmp, filename) == -1) {
+        fs_error(LOG_ERR, "failed to rename '%s': %s", tmp, strerror(errno));
+        unlink(tmp);
+        g_free(tmp);
+
+        return 1;
+    }
+    g_free(tmp);
+
+    return 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
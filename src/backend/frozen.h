@@ -0,0 +1,68 @@
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include "backend.h"
+
+/* an immutable, read optimised copy of a segment's ptrees, for each predicate
+ * the (pk, model, value) rows of the S and O trees are stored sorted and
+ * delta coded in blocks, with a sparse index of the first pk in each block.
+ * Rows are kept exactly as the trees hold them, duplicates included.
+ *
+ * Changes made to the trees after the freeze are logged by pk, in a file
+ * next to the frozen one. The frozen rows for any other pk are still used,
+ * a tree whose changes weren't all logged isn't read from the copy at all */
+
+typedef struct _fs_frozen fs_frozen;
+typedef struct _fs_frozen_run fs_frozen_run;
+typedef struct _fs_frozen_it fs_frozen_it;
+
+/* returns NULL if the segment hasn't been frozen */
+fs_frozen *fs_frozen_open(fs_backend *be, fs_segment seg);
+fs_frozen *fs_frozen_open_filename(const char *filename);
+
+/* write a frozen copy of every ptree in the backend's open segment */
+int fs_frozen_write(fs_backend *be, const char *filename);
+
+/* returns the rows of pred's S (object=0) or O tree, or NULL if pred wasn't
+ * in the segment when it was frozen */
+const fs_frozen_run *fs_frozen_get_run(fs_frozen *fz, fs_rid pred, int object);
+
+/* the fs_ptree_generation() of the tree when it was frozen */
+uint64_t fs_frozen_run_generation(const fs_frozen_run *run);
+
+/* true if every change since the freeze, up to the tree's generation, has
+ * been logged, so the run can be used for the pks that haven't changed */
+int fs_frozen_run_current(fs_frozen *fz, const fs_frozen_run *run, uint64_t generation);
+
+/* true if pk's rows have changed since the freeze, and have to be read from
+ * the tree */
+int fs_frozen_changed(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk);
+int fs_frozen_any_changed(fs_frozen *fz, const fs_frozen_run *run);
+
+/* record that the tree's rows for pk changed, taking it to generation */
+void fs_frozen_log_change(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk,
+                          uint64_t generation);
+
+/* like fs_ptree_search(), returns NULL if nothing matches */
+fs_frozen_it *fs_frozen_search(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk, fs_rid pair[2]);
+
+/* iterate over all the rows of a run in model mrid, or all models if mrid is
+ * FS_RID_NULL, skipping the pks that have changed */
+fs_frozen_it *fs_frozen_traverse(fs_frozen *fz, const fs_frozen_run *run, fs_rid mrid);
+
+/* row is { pk, pair[0], pair[1] } */
+int fs_frozen_it_next(fs_frozen_it *it, fs_rid row[3]);
+int fs_frozen_it_get_length(fs_frozen_it *it);
+void fs_frozen_it_free(fs_frozen_it *it);
+
+/* cheap estimate of the number of rows for pk, from the index alone */
+unsigned long long fs_frozen_estimate(fs_frozen *fz, const fs_frozen_run *run, fs_rid pk);
+
+void fs_frozen_close(fs_frozen *fz);
+
+/* remove a frozen copy and its change log */
+int fs_frozen_unlink(const char *filename);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
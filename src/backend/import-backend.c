@@ -39,53 +39,82 @@
 #include "import-backend.h"
 #include "query-backend.h"
 #include "lock.h"
+#include "commit.h"
 
 #define RES_BUF_SIZE  10240
 #define QUAD_BUF_SIZE 10240
 
 #define CACHE_SIZE 32768
 #define CACHE_MASK (CACHE_SIZE - 1)
-#define CACHE_ENTRY(r) (rid_cache[((r)>>10) & CACHE_MASK])
-
-static long res_pos;
-static long quad_pos;
-
-static fs_rid rid_cache[CACHE_SIZE];
-
-static fs_resource res_buffer[RES_BUF_SIZE];
+#define CACHE_ENTRY(ib, r) ((ib)->rid_cache[((r)>>10) & CACHE_MASK])
 
 struct q_buf {
     int skip;
     fs_rid quad[4];
 };
 
-static struct q_buf quad_buffer[QUAD_BUF_SIZE];
+/* the updates not yet committed to the indexes, kept with the backend rather
+ * than in statics, so that a threaded server can import into several
+ * segments at once */
+struct import_buffer {
+    long res_pos;
+    long quad_pos;
+    fs_rid rid_cache[CACHE_SIZE];
+    fs_resource res_buffer[RES_BUF_SIZE];
+    struct q_buf quad_buffer[QUAD_BUF_SIZE];
+};
+
+static struct import_buffer *import_buffer(fs_backend *be)
+{
+    if (!be->import_buf) {
+	be->import_buf = calloc(1, sizeof(struct import_buffer));
+    }
+
+    return be->import_buf;
+}
+
+void fs_import_buffer_free(fs_backend *be)
+{
+    struct import_buffer *ib = be->import_buf;
+    if (!ib) return;
+
+    for (int i=0; i<ib->res_pos; i++) {
+	g_free(ib->res_buffer[i].lex);
+    }
+    free(ib);
+    be->import_buf = NULL;
+}
 
 int quick_res_check(fs_backend *be, int seg, fs_rid rid, char *lex)
 {
-    if (CACHE_ENTRY(rid) == rid) {
+    struct import_buffer *ib = import_buffer(be);
+    if (CACHE_ENTRY(ib, rid) == rid) {
 	return 1;
     }
-    CACHE_ENTRY(rid) = rid;
+    CACHE_ENTRY(ib, rid) = rid;
 
     return 0;
 }
 
 int fs_res_import(fs_backend *be, int seg, long count, fs_resource buffer[])
 {
+    struct import_buffer *ib = import_buffer(be);
     double then = fs_time();
+    if (FS_LOG_UPDATES(be)) {
+	fs_wal_add_resources(be->wal, buffer, count);
+    }
     int i = 0;
     while (i < count) {
-	for (; i < count && res_pos < RES_BUF_SIZE; i++) {
+	for (; i < count && ib->res_pos < RES_BUF_SIZE; i++) {
 	    /* don't remember why this is commented out anymore. swh 2009-07-06 */
 	    //XXX if (!quick_res_check(be, seg, buffer[i].rid, buffer[i].lex)) {
-		res_buffer[res_pos].rid = buffer[i].rid;
-		res_buffer[res_pos].attr = buffer[i].attr;
-		res_buffer[res_pos].lex = g_strdup(buffer[i].lex);
-		res_pos++;
+		ib->res_buffer[ib->res_pos].rid = buffer[i].rid;
+		ib->res_buffer[ib->res_pos].attr = buffer[i].attr;
+		ib->res_buffer[ib->res_pos].lex = g_strdup(buffer[i].lex);
+		ib->res_pos++;
 	    //}
 	}
-	if (res_pos == RES_BUF_SIZE) {
+	if (ib->res_pos == RES_BUF_SIZE) {
 	    fs_res_import_commit(be, seg, 0);
 	}
     }
@@ -97,17 +126,22 @@ int fs_res_import(fs_backend *be, int seg, long count, fs_resource buffer[])
 
 int fs_res_import_commit(fs_backend *be, int seg, int account)
 {
+    struct import_buffer *ib = import_buffer(be);
     if (seg < 0 || seg >= be->segments) {
 	fs_error(LOG_ERR, "segment number %d out of range", seg);
     }
     double then = fs_time();
 
-    fs_rhash_put_multi(be->res, res_buffer, res_pos);
-    for (int i=0; i<res_pos; i++) {
-	g_free(res_buffer[i].lex);
+    if (be->bulk_import) {
+	fs_rhash_bulk_put_multi(be->res, ib->res_buffer, ib->res_pos);
+    } else {
+	fs_rhash_put_multi(be->res, ib->res_buffer, ib->res_pos);
+    }
+    for (int i=0; i<ib->res_pos; i++) {
+	g_free(ib->res_buffer[i].lex);
     }
 
-    res_pos = 0;
+    ib->res_pos = 0;
 
     if (account) {
 	double now = fs_time();
@@ -119,6 +153,7 @@ int fs_res_import_commit(fs_backend *be, int seg, int account)
 
 int fs_quad_import(fs_backend *be, int seg, int flags, int count, fs_rid buffer[][4])
 {
+    struct import_buffer *ib = import_buffer(be);
     if ((flags & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT)) == 0) {
 	fs_error(LOG_ERR, "neither FS_BIND_BY_SUBJECT or FS_BIND_BY_OBJECT set");
 
@@ -137,24 +172,21 @@ int fs_quad_import(fs_backend *be, int seg, int flags, int count, fs_rid buffer[
     }
 
     double then = fs_time();
+    if (FS_LOG_UPDATES(be)) {
+	fs_wal_add_quads(be->wal, FS_WAL_QUADS, buffer, count);
+    }
     int i = 0;
     while (i < count) {
-	for (; i < count && quad_pos < QUAD_BUF_SIZE; i++, quad_pos++) {
-	    quad_buffer[quad_pos].skip = 0;
-	    quad_buffer[quad_pos].quad[0] = buffer[i][0];
-	    quad_buffer[quad_pos].quad[1] = buffer[i][1];
-	    quad_buffer[quad_pos].quad[2] = buffer[i][2];
-	    quad_buffer[quad_pos].quad[3] = buffer[i][3];
+	for (; i < count && ib->quad_pos < QUAD_BUF_SIZE; i++, ib->quad_pos++) {
+	    ib->quad_buffer[ib->quad_pos].skip = 0;
+	    ib->quad_buffer[ib->quad_pos].quad[0] = buffer[i][0];
+	    ib->quad_buffer[ib->quad_pos].quad[1] = buffer[i][1];
+	    ib->quad_buffer[ib->quad_pos].quad[2] = buffer[i][2];
+	    ib->quad_buffer[ib->quad_pos].quad[3] = buffer[i][3];
 	}
-	if (quad_pos == QUAD_BUF_SIZE) {
-	    if (!be->pended_import) {
-		be->pended_import = 1;
-		for (int pend=0; pend < FS_PENDED_LISTS; pend++) {
-		    char label[256];
-		    snprintf(label, 255, "pl-%1x", pend);
-		    be->pended[pend] = fs_list_open(be, label,
-			sizeof(fs_rid) * 4, O_CREAT | O_TRUNC | O_RDWR);
-		}
+	if (ib->quad_pos == QUAD_BUF_SIZE) {
+	    if (fs_backend_open_pended(be)) {
+		return 4;
 	    }
 	    int ret = fs_quad_import_commit(be, seg, flags, 0);
 	    if (ret) {
@@ -227,6 +259,7 @@ static int qbuf_sort_m(const void *va, const void *vb)
 
 int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 {
+    struct import_buffer *ib = import_buffer(be);
     if ((flags & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT)) == 0) {
 	fs_error(LOG_ERR, "neither FS_BIND_BY_SUBJECT or FS_BIND_BY_OBJECT set");
 
@@ -249,77 +282,62 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
     TIME(NULL);
 
     if (be->pended_import) {
-	for (int i=0; i<quad_pos; i++) {
-	    if (quad_buffer[i].skip) continue;
+	for (int i=0; i<ib->quad_pos; i++) {
+	    if (ib->quad_buffer[i].skip) continue;
 
-	    const fs_rid pred = quad_buffer[i].quad[2];
+	    const fs_rid pred = ib->quad_buffer[i].quad[2];
 	    const int pend_list = (pred >> 40) % FS_PENDED_LISTS;
-	    fs_list_add(be->pended[pend_list], quad_buffer[i].quad);
+	    fs_list_add(be->pended[pend_list], ib->quad_buffer[i].quad);
 	}
     } else {
 	for (int pass=0; pass<2; pass++) {
 	    if (pass == 0) {
-		qsort(quad_buffer, quad_pos, sizeof(struct q_buf),
+		qsort(ib->quad_buffer, ib->quad_pos, sizeof(struct q_buf),
 		      qbuf_sort_ps);
-		for (int i=1; i<quad_pos; i++) {
-		    if (quad_buffer[i].quad[0] == quad_buffer[i-1].quad[0] &&
-			quad_buffer[i].quad[1] == quad_buffer[i-1].quad[1] &&
-			quad_buffer[i].quad[2] == quad_buffer[i-1].quad[2] &&
-			quad_buffer[i].quad[3] == quad_buffer[i-1].quad[3]) {
-			quad_buffer[i].skip = 1;
+		for (int i=1; i<ib->quad_pos; i++) {
+		    if (ib->quad_buffer[i].quad[0] == ib->quad_buffer[i-1].quad[0] &&
+			ib->quad_buffer[i].quad[1] == ib->quad_buffer[i-1].quad[1] &&
+			ib->quad_buffer[i].quad[2] == ib->quad_buffer[i-1].quad[2] &&
+			ib->quad_buffer[i].quad[3] == ib->quad_buffer[i-1].quad[3]) {
+			ib->quad_buffer[i].skip = 1;
 		    }
 		}
 	    } else {
-		qsort(quad_buffer, quad_pos, sizeof(struct q_buf),
+		qsort(ib->quad_buffer, ib->quad_pos, sizeof(struct q_buf),
 		      qbuf_sort_po);
 	    }
-	    const int force = pass == 1 ? 1 : 0;
-	    fs_rid last_pred = FS_RID_NULL;
-	    fs_ptree *pt = NULL;
-
-	    for (int i=0; i<quad_pos; i++) {
-		if (quad_buffer[i].skip) continue;
-
-		const fs_rid pred = quad_buffer[i].quad[2];
-		if (last_pred != pred) {
-		    pt = NULL;
-		    pt = fs_backend_get_ptree(be, pred, pass);
-		    if (!pt) {
-			fs_backend_open_ptree(be, pred);
-			int id = fs_list_add(be->predicates, &pred);
-			if (pass == 0) pt = be->ptrees_priv[id].ptree_s;
-			else pt = be->ptrees_priv[id].ptree_o;
-		    }
-		    last_pred = pred;
-		}
+	    fs_commit_batch *cb = fs_commit_batch_new(be, pass == 1 ? 1 : 0, 0);
+	    for (int i=0; i<ib->quad_pos; i++) {
+		if (ib->quad_buffer[i].skip) continue;
+
 		int ds0, ds1, pk;
 		if (pass == 0) {
 		    ds0 = 0; ds1 = 3; pk = 1;
 		} else {
 		    ds0 = 0; ds1 = 1; pk = 3;
 		}
-		fs_rid pair[2] = { quad_buffer[i].quad[ds0], quad_buffer[i].quad[ds1] };
-		int ret = fs_ptree_add(pt, quad_buffer[i].quad[pk], pair, force);
-		if (pass == 0 && ret) {
-		    quad_buffer[i].skip = 1;
-		}
-		if (pass == 0 && !ret) {
-		    (be->approx_size)++;
-		}
+		fs_rid pair[2] = { ib->quad_buffer[i].quad[ds0], ib->quad_buffer[i].quad[ds1] };
+		fs_commit_batch_add(cb, ib->quad_buffer[i].quad[2], pass,
+				    ib->quad_buffer[i].quad[pk], pair,
+				    pass == 0 ? &ib->quad_buffer[i].skip : NULL);
+	    }
+	    const long long added = fs_commit_batch_finish(cb);
+	    if (pass == 0) {
+		be->approx_size += added;
 	    }
 	}
     }
     fs_list_flush(be->predicates);
 
     /* append to model indexes */
-    qsort(quad_buffer, quad_pos, sizeof(struct q_buf), qbuf_sort_m);
+    qsort(ib->quad_buffer, ib->quad_pos, sizeof(struct q_buf), qbuf_sort_m);
     fs_tlist *tl = NULL;
     fs_rid last_model = FS_RID_NULL;
     fs_index_node model_node = 0;
-    for (int i=0; i<quad_pos; i++) {
-	if (quad_buffer[i].skip) continue;
+    for (int i=0; i<ib->quad_pos; i++) {
+	if (ib->quad_buffer[i].skip) continue;
 
-	const fs_rid model = quad_buffer[i].quad[0];
+	const fs_rid model = ib->quad_buffer[i].quad[0];
 	if (model != last_model) {
 	    if (tl) {
 		fs_tlist_close(tl);
@@ -350,14 +368,14 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 	}
 
 	if (tl) {
-	    fs_tlist_add(tl, &quad_buffer[i].quad[1]);
+	    fs_tlist_add(tl, &ib->quad_buffer[i].quad[1]);
 	} else {
 	    if (!model_node) {
 		model_node = fs_tbchain_new_chain(be->model_list);
 		fs_mhash_put(be->models, model, model_node);
 	    }
 	    fs_index_node new_node = fs_tbchain_add_triple(be->model_list,
-		model_node, &quad_buffer[i].quad[1]);
+		model_node, &ib->quad_buffer[i].quad[1]);
 	    if (new_node != model_node) {
 		model_node = new_node;
 		fs_mhash_put(be->models, model, model_node);
@@ -370,7 +388,7 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
     
     TIME("list append");
 
-    quad_pos = 0;
+    ib->quad_pos = 0;
 
     if (account) {
 	double now = fs_time();
@@ -383,6 +401,18 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
 {
     int errors = 0;
+    if (FS_LOG_UPDATES(be)) {
+	const int count = quads[0]->length;
+	fs_rid (*rows)[4] = malloc(count * sizeof(fs_rid[4]));
+	for (int i=0; i<count; i++) {
+	    for (int c=0; c<4; c++) {
+		rows[i][c] = quads[c]->data[i];
+	    }
+	}
+	fs_wal_add_quads(be->wal, FS_WAL_DELETE_QUADS, rows, count);
+	free(rows);
+	errors += fs_wal_commit(be->wal);
+    }
     fs_rid_set *preds = fs_rid_set_new();
     for (int i=0; i<quads[2]->length; i++) {
 	fs_rid_set_add(preds, quads[2]->data[i]);
@@ -431,6 +461,9 @@ int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
 	}
     }
     fs_rid_set_free(models);
+    if (be->wal) {
+	errors += fs_wal_end(be->wal);
+    }
 
     return errors;
 }
@@ -487,7 +520,25 @@ static int remove_by_search(fs_backend *be, fs_rid model, fs_index_node model_id
     return errors;
 }
 
+static int delete_models(fs_backend *be, int seg, fs_rid_vector *mvec);
+
 int fs_delete_models(fs_backend *be, int seg, fs_rid_vector *mvec)
+{
+    int errs = 0;
+    if (FS_LOG_UPDATES(be)) {
+	fs_wal_add_models(be->wal, mvec->data, mvec->length);
+	errs += fs_wal_commit(be->wal);
+    }
+    errs += delete_models(be, seg, mvec);
+    /* deleting everything reopens the files, and with them the log */
+    if (be->wal) {
+	errs += fs_wal_end(be->wal);
+    }
+
+    return errs;
+}
+
+static int delete_models(fs_backend *be, int seg, fs_rid_vector *mvec)
 {
     double then = fs_time();
     int errs = 0;
@@ -581,6 +632,9 @@ int fs_delete_models(fs_backend *be, int seg, fs_rid_vector *mvec)
     double now = fs_time();
     be->in_time[seg].remove += now - then;
 
+    /* replacing graphs leaves holes in the pairs table and model list */
+    fs_backend_vacuum(be, FS_VACUUM_STEP);
+
     return errs;
 }
 
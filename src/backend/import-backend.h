@@ -15,10 +15,13 @@ int fs_delete_models(fs_backend *be, int seg, fs_rid_vector *mvec);
 
 int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4]);
 
-int fs_start_import(fs_backend *be, int seg);
+int fs_start_import(fs_backend *be, int seg, int flags);
 
 int fs_stop_import(fs_backend *be, int seg);
 
+/* discard anything buffered by the functions above */
+void fs_import_buffer_free(fs_backend *be);
+
 /* vi:set ts=8 sts=4 sw=4: */
 
 #endif
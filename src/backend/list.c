@@ -222,8 +222,9 @@ void fs_list_rewind(fs_list *l)
     lseek(l->fd, 0, SEEK_SET);
 }
 
-/* return the next item from a sorted list, uniqs as well */
-int fs_list_next_sort_uniqed(fs_list *l, void *out)
+/* return the next item from a sorted list, merging the sorted chunks, and
+ * skipping duplicates if uniq */
+static int next_sort(fs_list *l, void *out, int uniq)
 {
     if (!l) {
         fprintf(out, "NULL list\n");
@@ -304,7 +305,7 @@ again:;
         return 0;
     }
 
-    if (bcmp(l->last, l->map + l->chunk_pos[best_c], l->width) == 0) {
+    if (uniq && bcmp(l->last, l->map + l->chunk_pos[best_c], l->width) == 0) {
         /* it's a duplicate */
         l->chunk_pos[best_c] += l->width;
         (l->count)++;
@@ -320,6 +321,16 @@ again:;
     }
 }
 
+int fs_list_next_sort_uniqed(fs_list *l, void *out)
+{
+    return next_sort(l, out, 1);
+}
+
+int fs_list_next_sort(fs_list *l, void *out)
+{
+    return next_sort(l, out, 0);
+}
+
 int fs_list_next_value(fs_list *l, void *out)
 {
     if (!l) {
@@ -467,6 +478,32 @@ int fs_list_sort_chunked(fs_list *l, int (*comp)(const void *, const void *))
     return 0;
 }
 
+int fs_list_apply(fs_list *l, void (*fn)(void *, void *), void *data)
+{
+    /* make sure it's flushed to disk */
+    fs_list_flush(l);
+
+    for (off_t c=0; c < l->offset; c += CHUNK_SIZE/l->width) {
+        off_t length = l->offset - c;
+        if (length > CHUNK_SIZE/l->width) length = CHUNK_SIZE/l->width;
+        char *map = mmap(NULL, length * l->width, PROT_READ | PROT_WRITE,
+                         MAP_FILE | MAP_SHARED, l->fd, c * l->width);
+        if (map == (void *)-1) {
+            fs_error(LOG_ERR, "failed to map '%s', %lld+%lld: %s",
+                     l->filename, (long long)c * l->width,
+                     (long long)length * l->width, strerror(errno));
+
+            return 1;
+        }
+        for (off_t i=0; i<length; i++) {
+            fn(map + i * l->width, data);
+        }
+        munmap(map, length * l->width);
+    }
+
+    return 0;
+}
+
 int fs_list_lock(fs_list *l, int action)
 {
     return flock(l->fd, action);
@@ -25,6 +25,8 @@ int32_t fs_list_add(fs_list *l, const void *data);
 void fs_list_rewind(fs_list *l);
 int fs_list_next_value(fs_list *l, void *out);
 int fs_list_next_sort_uniqed(fs_list *l, void *out);
+/* as fs_list_next_sort_uniqed(), but duplicates are returned too */
+int fs_list_next_sort(fs_list *l, void *out);
 
 int fs_list_get(fs_list *l, int32_t pos, void *data);
 
@@ -32,6 +34,8 @@ int fs_list_length(fs_list *l);
 
 int fs_list_sort(fs_list *l, int (*comp)(const void *, const void *));
 int fs_list_sort_chunked(fs_list *l, int (*comp)(const void *, const void *));
+/* call fn(entry, data) on every entry, entries can be changed in place */
+int fs_list_apply(fs_list *l, void (*fn)(void *, void *), void *data);
 
 void fs_list_print(fs_list *l, FILE *out, int verbosity);
 
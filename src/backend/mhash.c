@@ -328,11 +328,11 @@ fs_rid_vector *fs_mhash_get_keys(fs_mhash *mh)
     fs_mhash_entry e;
 
     if (!mh->locked) flock(mh->fd, LOCK_SH);
-    if (lseek(mh->fd, sizeof(struct mhash_header), SEEK_SET) == -1) {
-        fs_error(LOG_ERR, "seek error on mhash: %s", strerror(errno));
-    }
-    while (read(mh->fd, &e, sizeof(e)) == sizeof(e)) {
+    /* pread, so that threads sharing the fd don't move each other's offset */
+    off_t pos = sizeof(struct mhash_header);
+    while (pread(mh->fd, &e, sizeof(e), pos) == sizeof(e)) {
         if (e.val) fs_rid_vector_append(v, e.rid);
+        pos += sizeof(e);
     }
     if (!mh->locked) flock(mh->fd, LOCK_UN);
 
@@ -35,7 +35,19 @@
 #include "../common/error.h"
 
 #define PTABLE_ID 0x4a585430 /* JXT0 */
-#define PTABLE_REVISION 1
+
+/* rev=1 - one raw pair per row
+ * rev=2 - each row holds a sorted run of pairs, delta + varint encoded */
+#define PTABLE_REVISION_RAW    1
+#define PTABLE_REVISION_PACKED 2
+#ifdef FS_PTABLE_PACKED
+#define PTABLE_REVISION PTABLE_REVISION_PACKED
+#else
+#define PTABLE_REVISION PTABLE_REVISION_RAW
+#endif
+
+#define PACKED_ROW_SIZE  64
+#define PACKED_ROW_BYTES (PACKED_ROW_SIZE - 8)
 
 struct ptable_header {
     int32_t id;
@@ -43,7 +55,13 @@ struct ptable_header {
     int32_t length;
     int32_t free_list;
     int32_t revision;
-    char padding[492];
+    int32_t free_count;     /* length of the free list, if counted is set */
+    int32_t counted;
+    int32_t vacuum_limit;   /* rows from here on are being moved down by a
+                             * vacuum, 0 if none is running */
+    int32_t vacuum_free;    /* free rows past vacuum_limit */
+    int32_t vacuum_cursor;  /* for the caller, to resume a vacuum from */
+    char padding[472];
 };
 
 typedef struct _row {
@@ -51,6 +69,20 @@ typedef struct _row {
     fs_rid data[2];
 } row;
 
+/* must start with cont, so that chains and the free list can be walked
+ * without caring about the revision */
+typedef struct _packed_row {
+    fs_row_id cont;
+    uint8_t count;      /* number of pairs encoded in data */
+    uint8_t bytes;      /* number of bytes of data used */
+    uint16_t padding;
+    unsigned char data[PACKED_ROW_BYTES];
+} packed_row;
+
+#define ROW_REF(pt, b) ((row *)((char *)(pt)->data + (size_t)(b) * (pt)->row_size))
+#define PACKED_REF(pt, b) ((packed_row *)ROW_REF(pt, b))
+#define IS_PACKED(pt) ((pt)->revision == PTABLE_REVISION_PACKED)
+
 struct _fs_ptable {
   struct ptable_header *header;
   char *filename;
@@ -60,6 +92,8 @@ struct _fs_ptable {
   int flags;		/* flags used in open call */
   row *data;    	/* array of used rows, points into mmap'd space */
   fs_row_id *cons_data;
+  int revision;		/* revision of the file */
+  size_t row_size;	/* size of one row, depends on revision */
 };
 
 static char *fname_from_label(fs_backend *be, const char *label)
@@ -87,7 +121,7 @@ static int map_pt(fs_ptable *pt, long length, long size)
         return 1;
     }
 
-    pt->len = sizeof(struct ptable_header) + size * sizeof(row);
+    pt->len = sizeof(struct ptable_header) + size * pt->row_size;
     if (lseek(pt->fd, pt->len, SEEK_SET) == -1) {
         fs_error(LOG_CRIT, "failed to seek in ptable file %s: %s", pt->filename, strerror(errno));
     }
@@ -107,7 +141,7 @@ static int map_pt(fs_ptable *pt, long length, long size)
         pt->header->id = PTABLE_ID;
         pt->header->size = size;
         pt->header->length = length;
-        pt->header->revision = PTABLE_REVISION;
+        pt->header->revision = pt->revision;
     }
     pt->data = (row *)(((char *)pt->ptr) + sizeof(struct ptable_header));
 
@@ -152,14 +186,23 @@ fs_ptable *fs_ptable_open_filename(const char *fname, int flags)
 
         return NULL;
     }
-    if (header.revision != PTABLE_REVISION) {
+    if (header.revision == PTABLE_REVISION_RAW) {
+        pt->row_size = sizeof(row);
+    } else if (header.revision == PTABLE_REVISION_PACKED) {
+        pt->row_size = sizeof(packed_row);
+    } else {
         fs_error(LOG_CRIT, "%s is wrong revision of ptable file", pt->filename);
 
         return NULL;
     }
+    pt->revision = header.revision;
     if (map_pt(pt, header.length, header.size)) {
         return NULL;
     }
+    if (header.length == 0 && (flags & (O_RDWR | O_WRONLY))) {
+        pt->header->free_count = 0;
+        pt->header->counted = 1;
+    }
 
     return pt;
 }
@@ -180,16 +223,25 @@ void fs_ptable_print(fs_ptable *pt, FILE *out, int verbosity)
     fprintf(out, "PT %p %s\n", pt, pt->filename);
     fprintf(out, "  image size: %zd bytes\n", pt->len);
     fprintf(out, "  image:      %p - %p\n", pt->ptr, pt->ptr + pt->len);
+    fprintf(out, "  revision:   %d\n", pt->revision);
     fprintf(out, "  length:     %d rows\n", pt->header->length);
     fprintf(out, "  freed:      %d rows\n", fs_ptable_free_length(pt));
+    if (pt->header->vacuum_limit) {
+        fprintf(out, "  vacuum:     moving rows from %d, cursor %d\n",
+                pt->header->vacuum_limit, pt->header->vacuum_cursor);
+    }
     if (verbosity > 0) {
         for (int i=1; i<pt->header->length; i++) {
             fprintf(out, " %cR%08d", i == pt->header->free_list ? 'F' : ' ', i);
             if (verbosity > 1) {
-                printf("  %016llx %016llx", pt->data[i].data[0], pt->data[i].data[1]);
+                fs_rid pairs[FS_PTABLE_ROW_PAIRS][2];
+                int count = fs_ptable_get_rows(pt, i, pairs);
+                for (int p=0; p<count; p++) {
+                    fprintf(out, "  %016llx %016llx", pairs[p][0], pairs[p][1]);
+                }
             }
-            if (pt->data[i].cont) {
-                fprintf(out, " -> R%08d\n", pt->data[i].cont);
+            if (ROW_REF(pt, i)->cont) {
+                fprintf(out, " -> R%08d\n", ROW_REF(pt, i)->cont);
             } else {
                 fprintf(out, "\n");
             }
@@ -214,14 +266,17 @@ int fs_ptable_check_consistency(fs_ptable *pt, FILE *out, fs_row_id src, fs_row_
 
             return 1;
         }
-        for (fs_row_id f = pt->header->free_list; f; f=pt->data[f].cont) {
+        for (fs_row_id f = pt->header->free_list; f; f=ROW_REF(pt, f)->cont) {
+            pt->cons_data[f] = free_magic;
+        }
+        for (fs_row_id f = pt->header->vacuum_free; f; f=ROW_REF(pt, f)->cont) {
             pt->cons_data[f] = free_magic;
         }
     }
 
     int len = 0;
-    for (fs_row_id r = start; r; r = pt->data[r].cont) {
-        len++;
+    for (fs_row_id r = start; r; r = ROW_REF(pt, r)->cont) {
+        len += IS_PACKED(pt) ? PACKED_REF(pt, r)->count : 1;
         if (pt->cons_data[r] != 0) {
             fprintf(out, "ERROR: some kind of badness\n");
 
@@ -273,11 +328,10 @@ fs_row_id fs_ptable_new_row(fs_ptable *pt)
     /* we can reuse a free'd row */
     if (pt->header->free_list) {
         fs_row_id newr = pt->header->free_list;
-        row *r = &pt->data[newr];
+        row *r = ROW_REF(pt, newr);
         pt->header->free_list = r->cont;
-        r->cont = 0;
-        r->data[0] = 0;
-        r->data[1] = 0;
+        pt->header->free_count--;
+        memset(r, 0, pt->row_size);
 
         return newr;
     }
@@ -289,10 +343,7 @@ fs_row_id fs_ptable_new_row(fs_ptable *pt)
         map_pt(pt, length, size * 2);
     }
 
-    row *r = &pt->data[pt->header->length];
-    r->cont = 0;
-    r->data[0] = 0;
-    r->data[1] = 0;
+    memset(ROW_REF(pt, pt->header->length), 0, pt->row_size);
 
     return (pt->header->length)++;
 }
@@ -315,7 +366,7 @@ int fs_ptable_remove_chain(fs_ptable *pt, fs_row_id b)
         return 1;
     }
     do {
-        fs_row_id next = pt->data[b].cont;
+        fs_row_id next = ROW_REF(pt, b)->cont;
         fs_ptable_free_row(pt, b);
         b = next;
         if (b > pt->header->size) {
@@ -328,6 +379,88 @@ int fs_ptable_remove_chain(fs_ptable *pt, fs_row_id b)
     return 0;
 }
 
+static inline int put_varint(unsigned char *out, uint64_t v)
+{
+    int len = 0;
+    while (v >= 0x80) {
+        out[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[len++] = v;
+
+    return len;
+}
+
+static inline int get_varint(const unsigned char *in, uint64_t *v)
+{
+    int len = 0;
+    int shift = 0;
+    *v = 0;
+    do {
+        *v |= (uint64_t)(in[len] & 0x7f) << shift;
+        shift += 7;
+    } while (in[len++] & 0x80);
+
+    return len;
+}
+
+/* decode all the pairs held in packed row r, returns the number of pairs */
+static int unpack_row(const packed_row *r, fs_rid pairs[][2])
+{
+    const unsigned char *in = r->data;
+    fs_rid last[2] = { 0, 0 };
+    for (int i=0; i<r->count; i++) {
+        uint64_t d0, d1;
+        in += get_varint(in, &d0);
+        in += get_varint(in, &d1);
+        pairs[i][0] = last[0] + d0;
+        /* the second column is only delta encoded within a run of equal first
+         * columns */
+        pairs[i][1] = d0 ? d1 : last[1] + d1;
+        last[0] = pairs[i][0];
+        last[1] = pairs[i][1];
+    }
+
+    return r->count;
+}
+
+/* encode count sorted pairs into r, returns 1 if they don't fit, in which
+ * case r is untouched */
+static int pack_row(packed_row *r, fs_rid pairs[][2], int count)
+{
+    /* enough space for the worst case of a whole row of maximal varints */
+    unsigned char buf[FS_PTABLE_ROW_PAIRS * 20];
+    int len = 0;
+    fs_rid last[2] = { 0, 0 };
+    if (count > FS_PTABLE_ROW_PAIRS) return 1;
+    for (int i=0; i<count; i++) {
+        const uint64_t d0 = pairs[i][0] - last[0];
+        len += put_varint(buf+len, d0);
+        len += put_varint(buf+len, d0 ? pairs[i][1] : pairs[i][1] - last[1]);
+        if (len > PACKED_ROW_BYTES) return 1;
+        last[0] = pairs[i][0];
+        last[1] = pairs[i][1];
+    }
+    memcpy(r->data, buf, len);
+    r->count = count;
+    r->bytes = len;
+
+    return 0;
+}
+
+static int pair_sort(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    if (a[0] < b[0]) return -1;
+    if (a[0] > b[0]) return 1;
+    if (a[1] < b[1]) return -1;
+    if (a[1] > b[1]) return 1;
+
+    return 0;
+}
+
 fs_row_id fs_ptable_add_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
 {
     if (!pt) {
@@ -346,8 +479,33 @@ fs_row_id fs_ptable_add_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
         return 0;
     }
 
+    if (IS_PACKED(pt)) {
+        /* try to merge the pair into the run in the head row */
+        if (b) {
+            fs_rid pairs[FS_PTABLE_ROW_PAIRS+1][2];
+            int count = unpack_row(PACKED_REF(pt, b), pairs);
+            int pos = count;
+            while (pos > 0 && pair_sort(pairs[pos-1], pair) > 0) {
+                pairs[pos][0] = pairs[pos-1][0];
+                pairs[pos][1] = pairs[pos-1][1];
+                pos--;
+            }
+            pairs[pos][0] = pair[0];
+            pairs[pos][1] = pair[1];
+            if (!pack_row(PACKED_REF(pt, b), pairs, count+1)) {
+                return b;
+            }
+        }
+        fs_row_id newrid = fs_ptable_new_row(pt);
+        packed_row *newr = PACKED_REF(pt, newrid);
+        newr->cont = b;
+        pack_row(newr, (fs_rid (*)[2])pair, 1);
+
+        return newrid;
+    }
+
     fs_row_id newrid = fs_ptable_new_row(pt);
-    row *newr = &(pt->data[newrid]);
+    row *newr = ROW_REF(pt, newrid);
     newr->cont = b;
     newr->data[0] = pair[0];
     newr->data[1] = pair[1];
@@ -368,13 +526,50 @@ int fs_ptable_get_row(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
         return 1;
     }
 
-    row *r = &(pt->data[b]);
+    if (IS_PACKED(pt)) {
+        fs_rid pairs[FS_PTABLE_ROW_PAIRS][2];
+        if (unpack_row(PACKED_REF(pt, b), pairs) == 0) {
+            fs_error(LOG_CRIT, "tried to read empty row\n");
+
+            return 1;
+        }
+        pair[0] = pairs[0][0];
+        pair[1] = pairs[0][1];
+
+        return 0;
+    }
+
+    row *r = ROW_REF(pt, b);
     pair[0] = r->data[0];
     pair[1] = r->data[1];
 
     return 0;
 }
 
+int fs_ptable_get_rows(fs_ptable *pt, fs_row_id b, fs_rid pairs[][2])
+{
+    if (b == 0) {
+        fs_error(LOG_CRIT, "tried to read row 0\n");
+
+        return 0;
+    }
+    if (b > pt->header->length) {
+        fs_error(LOG_CRIT, "tried to read off end of ptable\n");
+
+        return 0;
+    }
+
+    if (IS_PACKED(pt)) {
+        return unpack_row(PACKED_REF(pt, b), pairs);
+    }
+
+    row *r = ROW_REF(pt, b);
+    pairs[0][0] = r->data[0];
+    pairs[0][1] = r->data[1];
+
+    return 1;
+}
+
 int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
 {
     if (b == 0) {
@@ -388,19 +583,99 @@ int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
         return 0;
     }
 
-    row *r = &(pt->data[b]);
     while (b != 0) {
-        if (r->data[0] == pair[0] && r->data[1] == pair[1]) {
+        fs_rid pairs[FS_PTABLE_ROW_PAIRS][2];
+        int count = fs_ptable_get_rows(pt, b, pairs);
+        for (int i=0; i<count; i++) {
+            if (pairs[i][0] == pair[0] && pairs[i][1] == pair[1]) {
+                return 1;
+            }
+        }
+        b = ROW_REF(pt, b)->cont;
+    }
+
+    return 0;
+}
+
+/* the pairs go into rows taken from the end of the table in ascending order,
+ * so a new chain is a run, and the rows are written sequentially */
+fs_row_id fs_ptable_add_run(fs_ptable *pt, fs_row_id b, fs_rid pairs[][2], int count)
+{
+    if (!pt) {
+        fs_error(LOG_CRIT, "tried to add pairs to NULL ptable");
+
+        return 0;
+    }
+    if (!pt->header) {
+        fs_error(LOG_CRIT, "tried to add pairs to ptable with NULL header");
+
+        return 0;
+    }
+    if (b > pt->header->length) {
+        fs_error(LOG_CRIT, "tried to write off end of ptable\n");
+
+        return 0;
+    }
+    if (count == 0) {
+        return b;
+    }
+
+    fs_row_id head = 0, last = 0;
+    for (int i=0; i<count; ) {
+        const fs_row_id r = fs_ptable_new_row(pt);
+        if (!r) {
+            break;
+        }
+        if (IS_PACKED(pt)) {
+            /* as many pairs as will fit */
+            int n = count - i < FS_PTABLE_ROW_PAIRS ? count - i : FS_PTABLE_ROW_PAIRS;
+            while (pack_row(PACKED_REF(pt, r), pairs + i, n)) {
+                n--;
+            }
+            i += n;
+        } else {
+            ROW_REF(pt, r)->data[0] = pairs[i][0];
+            ROW_REF(pt, r)->data[1] = pairs[i][1];
+            i++;
+        }
+        if (last) {
+            ROW_REF(pt, last)->cont = r;
+        } else {
+            head = r;
+        }
+        last = r;
+    }
+    if (!head) {
+        return b;
+    }
+    ROW_REF(pt, last)->cont = b;
+
+    return head;
+}
+
+/* returns true if row should be removed given the pattern in pair, adds the
+ * model to models where the pattern requires it */
+static int remove_match(const fs_rid row[2], const fs_rid pair[2], fs_rid_set *models)
+{
+    if (pair[0] != FS_RID_NULL && pair[1] == FS_RID_NULL) {
+        return row[0] == pair[0];
+    } else if (pair[0] == FS_RID_NULL && pair[1] != FS_RID_NULL) {
+        if (row[1] == pair[1]) {
+            if (models) {
+                fs_rid_set_add(models, row[0]);
+            }
+
             return 1;
         }
-        b = r->cont;
-        r = &(pt->data[b]);
+    } else if (pair[0] != FS_RID_NULL && pair[1] != FS_RID_NULL) {
+        return row[0] == pair[0] && row[1] == pair[1];
+    } else {
+        fs_error(LOG_CRIT, "trying to remove with unsupported pattern");
     }
 
     return 0;
 }
 
-/* we add models to the models set, if the matching RID is set to a wildcard */
 fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int *removed, fs_rid_set *models)
 {
     fs_row_id ret = b;
@@ -421,12 +696,15 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
         /* loop over the chain, count length, remove entries, and set all
          * models to be marked as sparse */
         while (b != 0) {
-            (*removed)++;
-            row *r = &(pt->data[b]);
+            fs_rid pairs[FS_PTABLE_ROW_PAIRS][2];
+            int count = fs_ptable_get_rows(pt, b, pairs);
+            (*removed) += count;
             if (models) {
-                fs_rid_set_add(models, r->data[0]);
+                for (int i=0; i<count; i++) {
+                    fs_rid_set_add(models, pairs[i][0]);
+                }
             }
-            fs_row_id nextb = r->cont;
+            fs_row_id nextb = ROW_REF(pt, b)->cont;
             fs_ptable_free_row(pt, b);
             b = nextb;
         }
@@ -436,49 +714,41 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
 
     row *prevr = NULL;
     while (b != 0) {
-        row *r = &(pt->data[b]);
+        row *r = ROW_REF(pt, b);
         fs_row_id nextb = r->cont;
-        if (pair[0] != FS_RID_NULL && pair[1] == FS_RID_NULL) {
-            if (r->data[0] == pair[0]) {
-                if (prevr) {
-                    prevr->cont = nextb;
+        int keep = 1;
+        if (IS_PACKED(pt)) {
+            fs_rid pairs[FS_PTABLE_ROW_PAIRS][2];
+            int count = unpack_row(PACKED_REF(pt, b), pairs);
+            int out = 0;
+            for (int i=0; i<count; i++) {
+                if (remove_match(pairs[i], pair, models)) {
+                    (*removed)++;
                 } else {
-                    ret = nextb;
+                    pairs[out][0] = pairs[i][0];
+                    pairs[out][1] = pairs[i][1];
+                    out++;
                 }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
-            } else {
-                prevr = r;
             }
-        } else if (pair[0] == FS_RID_NULL && pair[1] != FS_RID_NULL) {
-            if (r->data[1] == pair[1]) {
-                if (models) {
-                    fs_rid_set_add(models, r->data[0]);
-                }
-                if (prevr) {
-                    prevr->cont = nextb;
-                } else {
-                    ret = nextb;
-                }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
-            } else {
-                prevr = r;
+            if (out == 0) {
+                keep = 0;
+            } else if (out < count) {
+                /* a subset of a run always fits */
+                pack_row(PACKED_REF(pt, b), pairs, out);
             }
-        } else if (pair[0] != FS_RID_NULL && pair[1] != FS_RID_NULL) {
-            if (r->data[0] == pair[0] && r->data[1] == pair[1]) {
-                if (prevr) {
-                    prevr->cont = nextb;
-                } else {
-                    ret = nextb;
-                }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
+        } else if (remove_match(r->data, pair, models)) {
+            (*removed)++;
+            keep = 0;
+        }
+        if (keep) {
+            prevr = r;
+        } else {
+            if (prevr) {
+                prevr->cont = nextb;
             } else {
-                prevr = r;
+                ret = nextb;
             }
-        } else {
-            fs_error(LOG_CRIT, "trying to remove with unsupported pattern");
+            fs_ptable_free_row(pt, b);
         }
         b = nextb;
     }
@@ -494,7 +764,7 @@ fs_row_id fs_ptable_get_next(fs_ptable *pt, fs_row_id r)
         return 0;
     }
 
-    return pt->data[r].cont;
+    return ROW_REF(pt, r)->cont;
 }
 
 int fs_ptable_free_row(fs_ptable *pt, fs_row_id b)
@@ -505,9 +775,17 @@ int fs_ptable_free_row(fs_ptable *pt, fs_row_id b)
         return 1;
     }
     
-    row *r = &(pt->data[b]);
-    r->cont = pt->header->free_list;
-    pt->header->free_list = b;
+    row *r = ROW_REF(pt, b);
+    /* rows past the limit of a running vacuum are kept aside, so they're not
+     * reused before the table is cut short */
+    if (pt->header->vacuum_limit && b >= pt->header->vacuum_limit) {
+        r->cont = pt->header->vacuum_free;
+        pt->header->vacuum_free = b;
+    } else {
+        r->cont = pt->header->free_list;
+        pt->header->free_list = b;
+    }
+    pt->header->free_count++;
 
     return 0;
 }
@@ -525,21 +803,13 @@ unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max
         return 0;
     }
 
-    int length = 1;
-    row *r = &(pt->data[b]);
-    if (max) {
-        while (r->cont != 0) {
-            length++;
-            r = &(pt->data[r->cont]);
-            if (length > max) {
-                fs_error(LOG_ERR, "max length (%d) exceeded", max);
-                break;
-            }
-        }
-    } else {
-        while (r->cont != 0) {
-            length++;
-            r = &(pt->data[r->cont]);
+    unsigned int length = 0;
+    while (b != 0) {
+        length += IS_PACKED(pt) ? PACKED_REF(pt, b)->count : 1;
+        b = ROW_REF(pt, b)->cont;
+        if (max && length > max) {
+            fs_error(LOG_ERR, "max length (%d) exceeded", max);
+            break;
         }
     }
 
@@ -555,11 +825,257 @@ uint32_t fs_ptable_free_length(fs_ptable *pt)
 {
     uint32_t ret = 0;
 
-    for (uint32_t i = pt->header->free_list; ret++, i; i=pt->data[i].cont);
+    for (uint32_t i = pt->header->free_list; ret++, i; i=ROW_REF(pt, i)->cont);
 
     return ret;
 }
 
+/* tables written before the free list was counted are counted on first use */
+static void count_free(fs_ptable *pt)
+{
+    if (pt->header->counted) return;
+
+    int32_t count = 0;
+    for (fs_row_id f = pt->header->free_list; f; f = ROW_REF(pt, f)->cont) {
+        count++;
+    }
+    for (fs_row_id f = pt->header->vacuum_free; f; f = ROW_REF(pt, f)->cont) {
+        count++;
+    }
+    pt->header->free_count = count;
+    pt->header->counted = 1;
+}
+
+/* returns a bitmap with the free rows set */
+static uint64_t *free_rows(fs_ptable *pt)
+{
+    uint64_t *map = calloc(pt->header->length / 64 + 1, sizeof(uint64_t));
+    if (!map) {
+        fs_error(LOG_ERR, "cannot allocate free row map for %s", pt->filename);
+
+        return NULL;
+    }
+    for (fs_row_id f = pt->header->free_list; f; f = ROW_REF(pt, f)->cont) {
+        map[f / 64] |= 1ULL << (f % 64);
+    }
+    for (fs_row_id f = pt->header->vacuum_free; f; f = ROW_REF(pt, f)->cont) {
+        map[f / 64] |= 1ULL << (f % 64);
+    }
+
+    return map;
+}
+
+#define IS_FREE(map, r) ((map)[(r) / 64] & (1ULL << ((r) % 64)))
+
+int fs_ptable_vacuum_start(fs_ptable *pt, double fraction)
+{
+    if (!(pt->flags & (O_RDWR | O_WRONLY))) {
+        return 1;
+    }
+    if (pt->header->vacuum_limit) {
+        /* carry on with the one that's running */
+        return 0;
+    }
+    count_free(pt);
+    if (pt->header->length <= 1024 || pt->header->free_count == 0 ||
+        pt->header->free_count < pt->header->length * fraction) {
+        return 1;
+    }
+
+    uint64_t *map = free_rows(pt);
+    if (!map) {
+        return 1;
+    }
+    /* there are exactly as many free rows below the limit as there are live
+     * rows past it, so moving every row past it down fills the holes */
+    const fs_row_id limit = pt->header->length - pt->header->free_count;
+    pt->header->free_list = 0;
+    pt->header->vacuum_free = 0;
+    /* lowest free row first, so moved chains come out in contiguous runs */
+    for (fs_row_id r = pt->header->length - 1; r > 0; r--) {
+        if (!IS_FREE(map, r)) continue;
+        if (r >= limit) {
+            ROW_REF(pt, r)->cont = pt->header->vacuum_free;
+            pt->header->vacuum_free = r;
+        } else {
+            ROW_REF(pt, r)->cont = pt->header->free_list;
+            pt->header->free_list = r;
+        }
+    }
+    free(map);
+    pt->header->vacuum_cursor = 0;
+    pt->header->vacuum_limit = limit > 1 ? limit : 1;
+
+    return 0;
+}
+
+int fs_ptable_vacuum_running(fs_ptable *pt)
+{
+    return pt->header->vacuum_limit != 0;
+}
+
+uint32_t fs_ptable_vacuum_get_cursor(fs_ptable *pt)
+{
+    return pt->header->vacuum_cursor;
+}
+
+void fs_ptable_vacuum_set_cursor(fs_ptable *pt, uint32_t cursor)
+{
+    pt->header->vacuum_cursor = cursor;
+}
+
+fs_row_id fs_ptable_vacuum_chain(fs_ptable *pt, fs_row_id b)
+{
+    const fs_row_id limit = pt->header->vacuum_limit;
+    if (!limit || b == 0 || b >= pt->header->length) {
+        return b;
+    }
+
+    /* chains that are already a run below the limit are left alone */
+    int length = 0;
+    int high = 0;
+    int scattered = 0;
+    for (fs_row_id r = b, prev = 0; r; prev = r, r = ROW_REF(pt, r)->cont) {
+        if (r >= limit) {
+            high = 1;
+        } else if (prev && r != prev + 1 && r + 1 != prev) {
+            scattered = 1;
+        }
+        length++;
+    }
+    if (!high && !scattered) {
+        return b;
+    }
+
+    fs_row_id *to = malloc(length * sizeof(fs_row_id));
+    int got = 0;
+    int run = 1;
+    while (got < length && pt->header->free_list) {
+        to[got] = pt->header->free_list;
+        pt->header->free_list = ROW_REF(pt, to[got])->cont;
+        if (got && to[got] != to[got-1] + 1) run = 0;
+        got++;
+    }
+    /* only worth moving a chain that's below the limit if it ends up in a
+     * run, otherwise put the rows back as they were */
+    if (got < length || !(run || high)) {
+        while (got > 0) {
+            got--;
+            ROW_REF(pt, to[got])->cont = pt->header->free_list;
+            pt->header->free_list = to[got];
+        }
+        free(to);
+        if (!high) {
+            return b;
+        }
+
+        /* there's not room for the whole chain, but there's always room for
+         * the rows past the limit */
+        fs_row_id prev = 0;
+        for (fs_row_id r = b; r; ) {
+            const fs_row_id next = ROW_REF(pt, r)->cont;
+            if (r >= limit && pt->header->free_list) {
+                const fs_row_id nr = pt->header->free_list;
+                pt->header->free_list = ROW_REF(pt, nr)->cont;
+                pt->header->free_count--;
+                memcpy(ROW_REF(pt, nr), ROW_REF(pt, r), pt->row_size);
+                if (prev) {
+                    ROW_REF(pt, prev)->cont = nr;
+                } else {
+                    b = nr;
+                }
+                fs_ptable_free_row(pt, r);
+                r = nr;
+            }
+            prev = r;
+            r = next;
+        }
+
+        return b;
+    }
+    pt->header->free_count -= length;
+
+    fs_row_id r = b;
+    for (int i=0; i<length; i++) {
+        const fs_row_id next = ROW_REF(pt, r)->cont;
+        memcpy(ROW_REF(pt, to[i]), ROW_REF(pt, r), pt->row_size);
+        ROW_REF(pt, to[i])->cont = i+1 < length ? to[i+1] : 0;
+        fs_ptable_free_row(pt, r);
+        r = next;
+    }
+    const fs_row_id head = to[0];
+    free(to);
+
+    return head;
+}
+
+fs_row_id fs_ptable_vacuum_finish(fs_ptable *pt)
+{
+    if (!pt->header->vacuum_limit) {
+        return 0;
+    }
+
+    uint64_t *map = free_rows(pt);
+    if (!map) {
+        return 0;
+    }
+    /* rows added while the vacuum was running go on the end, so cut off
+     * after the last live row, rather than at the limit */
+    fs_row_id length = pt->header->length;
+    while (length > 1 && IS_FREE(map, length - 1)) {
+        length--;
+    }
+    pt->header->free_list = 0;
+    pt->header->vacuum_free = 0;
+    pt->header->vacuum_limit = 0;
+    pt->header->vacuum_cursor = 0;
+    int32_t count = 0;
+    for (fs_row_id r = length - 1; r > 0; r--) {
+        if (IS_FREE(map, r)) {
+            ROW_REF(pt, r)->cont = pt->header->free_list;
+            pt->header->free_list = r;
+            count++;
+        }
+    }
+    free(map);
+    const fs_row_id reclaimed = pt->header->length - length;
+    pt->header->free_count = count;
+    pt->header->length = length;
+
+    /* the file stays the size it was, forked readers can still have all of
+     * it mapped, so the rows past the new length are only reused, see
+     * fs_ptable_trim() */
+
+    return reclaimed;
+}
+
+fs_row_id fs_ptable_trim(fs_ptable *pt)
+{
+    if (!(pt->flags & (O_RDWR | O_WRONLY)) || pt->header->vacuum_limit) {
+        return 0;
+    }
+
+    /* keep to the sizes the table would have grown through */
+    int32_t size = 1024;
+    while (size < pt->header->length) size *= 2;
+    const int32_t old_size = pt->header->size;
+    if (size >= old_size) {
+        return 0;
+    }
+    const fs_row_id length = pt->header->length;
+    unmap_pt(pt);
+    if (ftruncate(pt->fd, sizeof(struct ptable_header) + (off_t)size * pt->row_size) == -1) {
+        fs_error(LOG_ERR, "failed to truncate %s: %s", pt->filename, strerror(errno));
+    }
+    if (map_pt(pt, length, size)) {
+        fs_error(LOG_CRIT, "failed to remap %s after trim", pt->filename);
+
+        return 0;
+    }
+
+    return old_size - size;
+}
+
 int fs_ptable_unlink(fs_ptable *pt)
 {
     if (!pt) return 1;
@@ -6,6 +6,10 @@
 typedef struct _fs_ptable fs_ptable;
 typedef uint32_t fs_row_id;
 
+/* maximum number of pairs that can be held in one row, packed tables store
+ * runs of up to this many pairs per row, other tables store one */
+#define FS_PTABLE_ROW_PAIRS 28
+
 /* basic file operations */
 fs_ptable *fs_ptable_open(fs_backend *be, const char *label, int flags);
 fs_ptable *fs_ptable_open_filename(const char *fname, int flags);
@@ -30,9 +34,19 @@ int fs_ptable_remove_chain(fs_ptable *pt, fs_row_id b);
  * chain ID. If b is 0 then a new chain will be created */
 fs_row_id fs_ptable_add_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2]);
 
-/* fetch the contents of row b from the table */
+/* add count distinct pairs, sorted on pair[0] then pair[1], to the chain b, and
+ * return the new chain ID. Unlike fs_ptable_add_pair() the pairs are packed
+ * into fresh rows, the head row isn't merged into */
+fs_row_id fs_ptable_add_run(fs_ptable *pt, fs_row_id b, fs_rid pairs[][2], int count);
+
+/* fetch the contents of row b from the table, for packed tables this is
+ * only the first pair in the row */
 int fs_ptable_get_row(fs_ptable *pt, fs_row_id b, fs_rid pair[2]);
 
+/* fetch all the pairs held in row b, pairs must have space for
+ * FS_PTABLE_ROW_PAIRS entries, returns the number of pairs */
+int fs_ptable_get_rows(fs_ptable *pt, fs_row_id b, fs_rid pairs[][2]);
+
 /* return true if the pair exists in the chain */
 int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2]);
 
@@ -43,7 +57,7 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
  * links */
 int fs_ptable_free_row(fs_ptable *pt, fs_row_id b);
 
-/* return the length of a chain in rows, stop counting at max, unless max is 0 */
+/* return the length of a chain in pairs, stop counting at max, unless max is 0 */
 unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max);
 
 /* return the length of table in rows */
@@ -54,4 +68,35 @@ uint32_t fs_ptable_free_length(fs_ptable *pt);
 /* return the next row in the chain, or 0 is there is none */
 fs_row_id fs_ptable_get_next(fs_ptable *pt, fs_row_id r);
 
+/* vacuuming, while a vacuum is running the live rows past the number of live
+ * rows are moved down into the holes left by freed ones, and chains are
+ * moved into contiguous runs where there's room, then the table's length is
+ * cut back to after the last live row. A vacuum carries on across closes and
+ * reopens */
+
+/* start a vacuum if at least fraction of the table is free rows, returns 0
+ * if one is running */
+int fs_ptable_vacuum_start(fs_ptable *pt, double fraction);
+int fs_ptable_vacuum_running(fs_ptable *pt);
+
+/* somewhere for the caller to note how far through its chains it is */
+uint32_t fs_ptable_vacuum_get_cursor(fs_ptable *pt);
+void fs_ptable_vacuum_set_cursor(fs_ptable *pt, uint32_t cursor);
+
+/* move chain b, returns its new head, which the caller must store in place
+ * of b */
+fs_row_id fs_ptable_vacuum_chain(fs_ptable *pt, fs_row_id b);
+
+/* cut the table's length short once every chain has been moved, returns the
+ * number of rows reclaimed. The file keeps its size, the rows are reused. Rows added while the vacuum was running can take holes
+ * that rows past the limit needed, in which case less is reclaimed and the
+ * next vacuum gets the rest */
+fs_row_id fs_ptable_vacuum_finish(fs_ptable *pt);
+
+/* shrink the file down to the size it would have grown to for its length,
+ * returns the number of rows cut off. The table is remapped, so it must only
+ * be called when nothing else has the file mapped, eg. before the backend
+ * starts serving */
+fs_row_id fs_ptable_trim(fs_ptable *pt);
+
 #endif
@@ -0,0 +1,725 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <glib.h>
+
+#include "backend.h"
+#include "backend-intl.h"
+#include "ptpack.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+#define FS_PTPACK_ID      0x4a58504b
+#define FS_PTPACK_DIR_ID  0x4a585044
+#define FS_PTPACK_SLOT_ID 0x4a585053
+
+/* a slot holds a few hundred pks, depending on the ptree revision, the file
+ * grows by extents of slots, which are mapped once and never move */
+#define FS_PTPACK_SLOT_SIZE    65536
+#define FS_PTPACK_EXTENT_SLOTS 64
+#define FS_PTPACK_HEADER_SIZE  4096
+#define FS_PTPACK_DIR_MIN      256
+
+#define EXTENT_BYTES ((size_t)FS_PTPACK_SLOT_SIZE * FS_PTPACK_EXTENT_SLOTS)
+#define SLOT_OFFSET(s) (FS_PTPACK_HEADER_SIZE + (off_t)(s) * FS_PTPACK_SLOT_SIZE)
+#define WRITABLE(pk) ((pk)->flags & (O_WRONLY | O_RDWR))
+
+#define SLOT_FREE 0
+#define SLOT_NEW  1         // allocated, but the tree isn't laid out yet
+#define SLOT_TREE 2
+
+#define FS_PACKED __attribute__((__packed__))
+
+struct pack_header {
+    int32_t id;             // "JXPK"
+    uint32_t slot_size;
+    uint32_t slots;         // slots in the file
+    uint32_t used;          // slots handed out, some may since have been freed
+    uint32_t free;          // first free slot + 1, linked by next
+    char padding[4076];
+} FS_PACKED;
+
+struct slot_header {
+    int32_t id;             // "JXPS"
+    int32_t state;          // SLOT_*
+    fs_rid pred;
+    int32_t pk;             // 's' or 'o'
+    uint32_t next;          // next free slot + 1
+    char padding[40];
+} FS_PACKED;
+
+struct dir_header {
+    int32_t id;             // "JXPD"
+    uint32_t reserved;
+    uint64_t length;        // entries used
+    uint64_t size;          // entries allocated
+    char padding[40];
+} FS_PACKED;
+
+struct dir_entry {
+    fs_rid pred;
+    int64_t count[2];       // pairs in the S and O trees, -1 if unknown
+    int32_t slot[2];        // pack slots of the S and O trees, -1 if in files
+} FS_PACKED;
+
+struct _fs_ptpack {
+    char *kb;
+    fs_segment segment;
+    int flags;
+    int untrusted;          // directory is out of date, and we can't fix it
+    int adding;             // we hold a shared flock on the directory
+    int fd;
+    char *filename;
+    struct pack_header *header;
+    int extents;
+    char **extent;
+    int dir_fd;
+    char *dir_filename;
+    size_t dir_length;      // bytes mapped
+    struct dir_header *dir;
+    struct dir_entry *entries;
+};
+
+static int lock_range(fs_ptpack *pk, off_t start, off_t length, short type)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = length;
+    while (fcntl(pk->fd, F_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            fs_error(LOG_ERR, "failed to lock '%s': %s", pk->filename, strerror(errno));
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int map_extents(fs_ptpack *pk)
+{
+    const int extents = pk->header->slots / FS_PTPACK_EXTENT_SLOTS;
+    if (extents <= pk->extents) {
+        return 0;
+    }
+    pk->extent = realloc(pk->extent, extents * sizeof(char *));
+    for (int e=pk->extents; e<extents; e++) {
+        void *ptr = mmap(NULL, EXTENT_BYTES,
+                         PROT_READ | (WRITABLE(pk) ? PROT_WRITE : 0),
+                         MAP_SHARED, pk->fd, SLOT_OFFSET(e * FS_PTPACK_EXTENT_SLOTS));
+        if (ptr == MAP_FAILED) {
+            fs_error(LOG_ERR, "failed to mmap '%s': %s", pk->filename, strerror(errno));
+
+            return 1;
+        }
+        pk->extent[e] = ptr;
+        pk->extents = e + 1;
+    }
+
+    return 0;
+}
+
+static void unmap_extents(fs_ptpack *pk)
+{
+    for (int e=0; e<pk->extents; e++) {
+        munmap(pk->extent[e], EXTENT_BYTES);
+    }
+    free(pk->extent);
+    pk->extent = NULL;
+    pk->extents = 0;
+}
+
+static struct slot_header *slot_ref(fs_ptpack *pk, int32_t s)
+{
+    if (s < 0 || (uint32_t)s >= pk->header->slots) {
+        return NULL;
+    }
+    /* another process may have grown the pack */
+    if (s / FS_PTPACK_EXTENT_SLOTS >= pk->extents && map_extents(pk)) {
+        return NULL;
+    }
+
+    return (struct slot_header *)(pk->extent[s / FS_PTPACK_EXTENT_SLOTS] +
+           (size_t)(s % FS_PTPACK_EXTENT_SLOTS) * FS_PTPACK_SLOT_SIZE);
+}
+
+#ifdef FS_PTREE_PACKING
+static int32_t alloc_slot(fs_ptpack *pk, fs_rid pred, char pkch)
+{
+    if (lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_WRLCK)) {
+        return -1;
+    }
+    int32_t s;
+    struct slot_header *sh;
+    if (pk->header->free) {
+        s = pk->header->free - 1;
+        sh = slot_ref(pk, s);
+        pk->header->free = sh->next;
+        /* trees expect their space to start out zeroed, like a new file */
+        memset(sh, 0, FS_PTPACK_SLOT_SIZE);
+    } else {
+        if (pk->header->used == pk->header->slots) {
+            const uint32_t slots = pk->header->slots + FS_PTPACK_EXTENT_SLOTS;
+            if (ftruncate(pk->fd, SLOT_OFFSET(slots)) == -1) {
+                fs_error(LOG_ERR, "failed to grow '%s': %s", pk->filename, strerror(errno));
+                lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_UNLCK);
+
+                return -1;
+            }
+            pk->header->slots = slots;
+        }
+        s = pk->header->used++;
+        sh = slot_ref(pk, s);
+    }
+    if (sh) {
+        sh->id = FS_PTPACK_SLOT_ID;
+        sh->state = SLOT_NEW;
+        sh->pred = pred;
+        sh->pk = pkch;
+        sh->next = 0;
+    } else {
+        s = -1;
+    }
+    lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_UNLCK);
+
+    return s;
+}
+#endif
+
+static void free_slot(fs_ptpack *pk, int32_t s)
+{
+    if (lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_WRLCK)) {
+        return;
+    }
+    struct slot_header *sh = slot_ref(pk, s);
+    if (sh && sh->state != SLOT_FREE) {
+        sh->state = SLOT_FREE;
+        sh->pred = FS_RID_NULL;
+        sh->next = pk->header->free;
+        pk->header->free = s + 1;
+    }
+    lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_UNLCK);
+}
+
+static int open_pack(fs_ptpack *pk)
+{
+    /* older stores won't have one yet */
+    const int create = WRITABLE(pk) ? O_CREAT : 0;
+    pk->fd = open(pk->filename, FS_O_NOATIME | pk->flags | create, FS_FILE_MODE);
+    if (pk->fd == -1) {
+        if (errno != ENOENT) {
+            fs_error(LOG_ERR, "cannot open ptree pack '%s': %s", pk->filename, strerror(errno));
+        }
+
+        return 1;
+    }
+    struct stat st;
+    if (fstat(pk->fd, &st) == -1) {
+        fs_error(LOG_ERR, "cannot stat '%s': %s", pk->filename, strerror(errno));
+
+        return 1;
+    }
+    if (st.st_size == 0) {
+        if (!WRITABLE(pk) || lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_WRLCK)) {
+            return 1;
+        }
+        /* someone else may have got there first */
+        fstat(pk->fd, &st);
+        if (st.st_size == 0) {
+            struct pack_header header;
+            memset(&header, 0, sizeof(header));
+            header.id = FS_PTPACK_ID;
+            header.slot_size = FS_PTPACK_SLOT_SIZE;
+            if (pwrite(pk->fd, &header, sizeof(header), 0) != sizeof(header)) {
+                fs_error(LOG_ERR, "failed to write header on '%s': %s", pk->filename, strerror(errno));
+            }
+        }
+        lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_UNLCK);
+    }
+    void *ptr = mmap(NULL, FS_PTPACK_HEADER_SIZE,
+                     PROT_READ | (WRITABLE(pk) ? PROT_WRITE : 0),
+                     MAP_SHARED, pk->fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", pk->filename, strerror(errno));
+
+        return 1;
+    }
+    pk->header = ptr;
+    if (pk->header->id != FS_PTPACK_ID ||
+        pk->header->slot_size != FS_PTPACK_SLOT_SIZE) {
+        fs_error(LOG_ERR, "%s does not appear to be a ptree pack file", pk->filename);
+
+        return 1;
+    }
+
+    return map_extents(pk);
+}
+
+static int map_dir(fs_ptpack *pk)
+{
+    struct stat st;
+    if (fstat(pk->dir_fd, &st) == -1) {
+        fs_error(LOG_ERR, "cannot stat '%s': %s", pk->dir_filename, strerror(errno));
+
+        return 1;
+    }
+    if (pk->dir) {
+        munmap(pk->dir, pk->dir_length);
+        pk->dir = NULL;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ | (WRITABLE(pk) ? PROT_WRITE : 0),
+                     MAP_SHARED, pk->dir_fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", pk->dir_filename, strerror(errno));
+
+        return 1;
+    }
+    pk->dir_length = st.st_size;
+    pk->dir = ptr;
+    pk->entries = (struct dir_entry *)(pk->dir + 1);
+
+    return 0;
+}
+
+static int open_dir(fs_ptpack *pk)
+{
+    /* it can always be rebuilt, see fs_ptpack_check() */
+    const int create = WRITABLE(pk) ? O_CREAT : 0;
+    pk->dir_fd = open(pk->dir_filename, FS_O_NOATIME | pk->flags | create, FS_FILE_MODE);
+    if (pk->dir_fd == -1) {
+        if (errno != ENOENT) {
+            fs_error(LOG_ERR, "cannot open ptree directory '%s': %s", pk->dir_filename, strerror(errno));
+        }
+
+        return 1;
+    }
+    struct stat st;
+    fstat(pk->dir_fd, &st);
+    if (st.st_size == 0) {
+        if (!WRITABLE(pk)) {
+            return 1;
+        }
+        if (ftruncate(pk->dir_fd, sizeof(struct dir_header) +
+                      FS_PTPACK_DIR_MIN * sizeof(struct dir_entry)) == -1) {
+            fs_error(LOG_ERR, "failed to size '%s': %s", pk->dir_filename, strerror(errno));
+
+            return 1;
+        }
+        if (map_dir(pk)) {
+            return 1;
+        }
+        pk->dir->id = FS_PTPACK_DIR_ID;
+        pk->dir->size = FS_PTPACK_DIR_MIN;
+
+        return 0;
+    }
+    if (map_dir(pk)) {
+        return 1;
+    }
+    if (pk->dir->id != FS_PTPACK_DIR_ID) {
+        fs_error(LOG_ERR, "%s does not appear to be a ptree directory", pk->dir_filename);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+fs_ptpack *fs_ptpack_open(fs_backend *be, int flags)
+{
+    if (sizeof(struct pack_header) != FS_PTPACK_HEADER_SIZE ||
+        sizeof(struct slot_header) != 64 || sizeof(struct dir_header) != 64 ||
+        sizeof(struct dir_entry) != 32) {
+        fs_error(LOG_CRIT, "incorrect ptree pack structure sizes");
+
+        return NULL;
+    }
+
+    fs_ptpack *pk = calloc(1, sizeof(fs_ptpack));
+    pk->kb = g_strdup(fs_backend_get_kb(be));
+    pk->segment = fs_backend_get_segment(be);
+    pk->flags = flags;
+    pk->fd = -1;
+    pk->dir_fd = -1;
+    pk->filename = g_strdup_printf(FS_PTREE_PACK, pk->kb, pk->segment);
+    pk->dir_filename = g_strdup_printf(FS_PTREE_DIR, pk->kb, pk->segment);
+    if (open_pack(pk) || open_dir(pk)) {
+        fs_ptpack_close(pk);
+
+        return NULL;
+    }
+
+    return pk;
+}
+
+int fs_ptpack_close(fs_ptpack *pk)
+{
+    unmap_extents(pk);
+    if (pk->header) {
+        munmap(pk->header, FS_PTPACK_HEADER_SIZE);
+    }
+    if (pk->dir) {
+        munmap(pk->dir, pk->dir_length);
+    }
+    /* drops any slot locks still held */
+    if (pk->fd != -1) {
+        close(pk->fd);
+    }
+    if (pk->dir_fd != -1) {
+        close(pk->dir_fd);
+    }
+    g_free(pk->kb);
+    g_free(pk->filename);
+    g_free(pk->dir_filename);
+    free(pk);
+
+    return 0;
+}
+
+int fs_ptpack_truncate(fs_ptpack *pk)
+{
+    if (!WRITABLE(pk) || lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_WRLCK)) {
+        return 1;
+    }
+    unmap_extents(pk);
+    if (ftruncate(pk->fd, FS_PTPACK_HEADER_SIZE) == -1) {
+        fs_error(LOG_ERR, "failed to truncate '%s': %s", pk->filename, strerror(errno));
+    }
+    pk->header->slots = 0;
+    pk->header->used = 0;
+    pk->header->free = 0;
+    lock_range(pk, 0, FS_PTPACK_HEADER_SIZE, F_UNLCK);
+    pk->dir->length = 0;
+
+    return 0;
+}
+
+/* NB this may remap the directory, so entry pointers held by the caller are
+ * invalid afterwards */
+static struct dir_entry *dir_entry(fs_ptpack *pk, int n)
+{
+    if (n < 0 || (uint64_t)n >= pk->dir->length) {
+        return NULL;
+    }
+    /* another process may have grown the directory */
+    if (sizeof(struct dir_header) + (n + 1) * sizeof(struct dir_entry) > pk->dir_length &&
+        map_dir(pk)) {
+        return NULL;
+    }
+
+    return pk->entries + n;
+}
+
+static int dir_reserve(fs_ptpack *pk, int n)
+{
+    uint64_t size = pk->dir->size;
+    while ((uint64_t)n >= size) {
+        size *= 2;
+    }
+    const size_t length = sizeof(struct dir_header) + size * sizeof(struct dir_entry);
+    if (size != pk->dir->size && ftruncate(pk->dir_fd, length) == -1) {
+        fs_error(LOG_ERR, "failed to grow '%s': %s", pk->dir_filename, strerror(errno));
+
+        return 1;
+    }
+    if (length > pk->dir_length && map_dir(pk)) {
+        return 1;
+    }
+    pk->dir->size = size;
+
+    return 0;
+}
+
+int fs_ptpack_add(fs_ptpack *pk, int n, fs_rid pred)
+{
+    if (!WRITABLE(pk)) {
+        return 1;
+    }
+    /* our entries aren't in the predicates list until it's written, when
+     * the files are closed, this keeps fs_ptpack_check() off them till then */
+    if (!pk->adding) {
+        while (flock(pk->dir_fd, LOCK_SH) == -1) {
+            if (errno != EINTR) {
+                fs_error(LOG_ERR, "failed to lock '%s': %s", pk->dir_filename, strerror(errno));
+
+                return 1;
+            }
+        }
+        pk->adding = 1;
+    }
+    if (dir_reserve(pk, n)) {
+        return 1;
+    }
+    struct dir_entry *e = pk->entries + n;
+    e->pred = pred;
+    e->count[0] = 0;
+    e->count[1] = 0;
+    e->slot[0] = -1;
+    e->slot[1] = -1;
+#ifdef FS_PTREE_PACKING
+    /* if there's no room the trees go in files, as usual */
+    e->slot[0] = alloc_slot(pk, pred, 's');
+    e->slot[1] = alloc_slot(pk, pred, 'o');
+#endif
+    if ((uint64_t)n >= pk->dir->length) {
+        pk->dir->length = n + 1;
+    }
+
+    return 0;
+}
+
+#ifdef FS_PTREE_PACKING
+/* true if another process has slot s locked, ie. has its tree open */
+static int slot_busy(fs_ptpack *pk, int32_t s)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = SLOT_OFFSET(s);
+    fl.l_len = FS_PTPACK_SLOT_SIZE;
+    if (fcntl(pk->fd, F_GETLK, &fl) == -1) {
+        /* assume the worst */
+        return 1;
+    }
+
+    return fl.l_type != F_UNLCK;
+}
+
+static void release_entry(fs_ptpack *pk, struct dir_entry *e)
+{
+    for (int object=0; object<2; object++) {
+        const int32_t s = e->slot[object];
+        struct slot_header *sh = slot_ref(pk, s);
+        if (sh && sh->state != SLOT_FREE && sh->pred == e->pred && !slot_busy(pk, s)) {
+            free_slot(pk, s);
+        }
+        e->slot[object] = -1;
+    }
+}
+
+/* needs the directory locked exclusively */
+static int repair(fs_ptpack *pk, fs_backend *be, int ok)
+{
+    const int length = be->ptree_length;
+    if (ok) {
+        /* entries past the end of the predicates list were added by a
+         * process that died before the list was written */
+        for (int i=length; i<pk->dir->length; i++) {
+            release_entry(pk, dir_entry(pk, i));
+        }
+        pk->dir->length = length;
+
+        return 0;
+    }
+
+    fs_error(LOG_WARNING, "%s is out of date, rebuilding", pk->dir_filename);
+    if (length > 0 && dir_reserve(pk, length - 1)) {
+        return 1;
+    }
+    for (int i=0; i<length; i++) {
+        struct dir_entry *e = pk->entries + i;
+        e->pred = be->ptrees_priv[i].pred;
+        e->count[0] = -1;
+        e->count[1] = -1;
+        e->slot[0] = -1;
+        e->slot[1] = -1;
+    }
+    pk->dir->length = length;
+
+    /* find the packed trees again, anything left over is freed */
+    for (uint32_t s=0; s<pk->header->used; s++) {
+        struct slot_header *sh = slot_ref(pk, s);
+        if (!sh || sh->state == SLOT_FREE) {
+            continue;
+        }
+        fs_rid pred = sh->pred;
+        long int id = (long int)g_hash_table_lookup(be->rid_id_map, &pred);
+        if (id < length && be->ptrees_priv[id].pred == pred) {
+            pk->entries[id].slot[sh->pk == 'o'] = s;
+        } else if (!slot_busy(pk, s)) {
+            free_slot(pk, s);
+        }
+    }
+
+    return 0;
+}
+#endif
+
+int fs_ptpack_check(fs_ptpack *pk, fs_backend *be)
+{
+    const int length = be->ptree_length;
+    int ok = pk->dir->length >= (uint64_t)length;
+    for (int i=0; i<length && ok; i++) {
+        struct dir_entry *e = dir_entry(pk, i);
+        ok = e && e->pred == be->ptrees_priv[i].pred;
+    }
+    pk->untrusted = !ok;
+
+#ifdef FS_PTREE_PACKING
+    /* if anyone's adding predicates their entries and slots are in use,
+     * though they're not in our copy of the predicates list, so it's left
+     * for a later open */
+    if (!WRITABLE(pk) || flock(pk->dir_fd, LOCK_EX | LOCK_NB) == -1) {
+        return 0;
+    }
+    const int ret = repair(pk, be, ok);
+    if (!ret) {
+        pk->untrusted = 0;
+    }
+    flock(pk->dir_fd, LOCK_UN);
+
+    return ret;
+#else
+    /* without packing there are no slots to find, and the directory is only
+     * a cache of the counts, so one that's out of step is just not used */
+    return 0;
+#endif
+}
+
+long long fs_ptpack_get_count(fs_ptpack *pk, int n, int object)
+{
+    struct dir_entry *e = dir_entry(pk, n);
+    if (!e || pk->untrusted) {
+        return -1;
+    }
+
+    return e->count[object];
+}
+
+fs_ptree *fs_ptpack_open_tree(fs_ptpack *pk, int n, int object, fs_ptable *chain, int flags)
+{
+    struct dir_entry *e = dir_entry(pk, n);
+    if (!e) {
+        fs_error(LOG_ERR, "no %s entry for predicate %d", pk->dir_filename, n);
+
+        return NULL;
+    }
+    const fs_rid pred = e->pred;
+    const int32_t s = e->slot[object];
+    const char pkch = object ? 'o' : 's';
+    const int writable = WRITABLE(pk) && (flags & (O_WRONLY | O_RDWR));
+    char *filename = g_strdup_printf(FS_PTREE, pk->kb, pk->segment, pkch, pred);
+    fs_ptree *pt = NULL;
+
+    if (s >= 0) {
+        if (writable) {
+            lock_range(pk, SLOT_OFFSET(s), FS_PTPACK_SLOT_SIZE, F_WRLCK);
+        }
+        struct slot_header *sh = slot_ref(pk, s);
+        if (sh && sh->id == FS_PTPACK_SLOT_ID && sh->pred == pred && sh->pk == pkch) {
+            if (sh->state == SLOT_NEW && writable) {
+                pt = fs_ptree_open_packed(filename, sh + 1, FS_PTPACK_SLOT_SIZE -
+                                          sizeof(struct slot_header), flags, chain, 1);
+                if (pt) {
+                    sh->state = SLOT_TREE;
+                }
+            } else if (sh->state == SLOT_TREE) {
+                pt = fs_ptree_open_packed(filename, sh + 1, FS_PTPACK_SLOT_SIZE -
+                                          sizeof(struct slot_header), flags, chain, 0);
+                if (!pt && writable) {
+                    /* it was moved out to its own file, by a process that
+                     * didn't get as far as closing it */
+                    free_slot(pk, s);
+                }
+            }
+        }
+        if (!pt && writable) {
+            lock_range(pk, SLOT_OFFSET(s), FS_PTPACK_SLOT_SIZE, F_UNLCK);
+            dir_entry(pk, n)->slot[object] = -1;
+        }
+    }
+    if (!pt) {
+        pt = fs_ptree_open_filename(filename, flags, chain);
+    }
+    g_free(filename);
+
+    /* the count is unknown to everyone else until the tree is closed */
+    if (pt && writable) {
+        dir_entry(pk, n)->count[object] = -1;
+    }
+
+    return pt;
+}
+
+void fs_ptpack_close_tree(fs_ptpack *pk, int n, int object, fs_ptree *pt)
+{
+    if (!pt) {
+        return;
+    }
+    struct dir_entry *e = dir_entry(pk, n);
+    if (!e || !WRITABLE(pk)) {
+        fs_ptree_close(pt);
+
+        return;
+    }
+    e->count[object] = fs_ptree_count(pt);
+    const int32_t s = e->slot[object];
+    if (s < 0) {
+        fs_ptree_close(pt);
+
+        return;
+    }
+    const int moved = !fs_ptree_is_packed(pt);
+    fs_ptree_close(pt);
+    if (moved) {
+        free_slot(pk, s);
+        e->slot[object] = -1;
+    }
+    lock_range(pk, SLOT_OFFSET(s), FS_PTPACK_SLOT_SIZE, F_UNLCK);
+}
+
+void fs_ptpack_print(fs_ptpack *pk, FILE *out, int verbosity)
+{
+    int free_slots = 0;
+    for (uint32_t f = pk->header->free; f; f = slot_ref(pk, f - 1)->next) {
+        free_slots++;
+    }
+    int packed = 0, unknown = 0;
+    for (int i=0; i<pk->dir->length; i++) {
+        struct dir_entry *e = dir_entry(pk, i);
+        for (int object=0; object<2; object++) {
+            if (e->slot[object] >= 0) packed++;
+            if (e->count[object] < 0) unknown++;
+        }
+        if (verbosity > 0) {
+            fprintf(out, "%016llx  %10lld %10lld  %6d %6d\n", e->pred,
+                    (long long)e->count[0], (long long)e->count[1],
+                    e->slot[0], e->slot[1]);
+        }
+    }
+    fprintf(out, "ptpack: %s\n", pk->filename);
+    fprintf(out, "slots:   %d/%d used, %d free\n", pk->header->used - free_slots,
+            pk->header->slots, free_slots);
+    fprintf(out, "trees:   %lld predicates, %d packed trees, %d unknown counts\n",
+            (long long)pk->dir->length, packed, unknown);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
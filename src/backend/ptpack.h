@@ -0,0 +1,54 @@
+#ifndef PTPACK_H
+#define PTPACK_H
+
+#include "backend.h"
+#include "ptable.h"
+#include "ptree.h"
+
+/* the predicate directory and ptree pack of a segment
+ *
+ * The directory has an entry for each predicate, in the order of the
+ * predicates list, with the number of pairs in its S and O trees as of when
+ * they were last closed, so that they can be counted without opening them.
+ * The pack holds the trees of small predicates in fixed size slots of one
+ * shared file, instead of a pair of files each. New predicates start out in
+ * the pack, and a tree moves out to its own file when it outgrows its slot.
+ *
+ * Like ptree files, a packed tree is locked while a writer has it open. */
+
+typedef struct _fs_ptpack fs_ptpack;
+
+fs_ptpack *fs_ptpack_open(fs_backend *be, int flags);
+int fs_ptpack_close(fs_ptpack *pk);
+
+/* empty the directory and pack, the trees should be closed first */
+int fs_ptpack_truncate(fs_ptpack *pk);
+
+/* check the directory agrees with the backend's predicates. In builds with
+ * ptree packing a writer repairs it, under an exclusive lock on the
+ * directory, after a crash or an upgrade the entries that can't be trusted
+ * get unknown counts, and the pack is scanned to find their slots again.
+ * Slots another process has open are left alone. Otherwise, or while another
+ * process is adding predicates, a directory that's out of step isn't used */
+int fs_ptpack_check(fs_ptpack *pk, fs_backend *be);
+
+/* add an entry for a new predicate, number n, holds a shared lock on the
+ * directory until the pack is closed */
+int fs_ptpack_add(fs_ptpack *pk, int n, fs_rid pred);
+
+/* the number of pairs in predicate n's S (object=0) or O tree, or -1 if
+ * it's not known, eg. because a writer has the tree open */
+long long fs_ptpack_get_count(fs_ptpack *pk, int n, int object);
+
+/* open predicate n's S or O tree, from the pack if it's there, otherwise
+ * from its own file */
+fs_ptree *fs_ptpack_open_tree(fs_ptpack *pk, int n, int object, fs_ptable *chain, int flags);
+
+/* record the tree's count and close it, pt may be NULL */
+void fs_ptpack_close_tree(fs_ptpack *pk, int n, int object, fs_ptree *pt);
+
+void fs_ptpack_print(fs_ptpack *pk, FILE *out, int verbosity);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
@@ -26,17 +26,32 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/file.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "backend.h"
 #include "ptree.h"
 #include "chain.h"
+#include "bloom.h"
 #include "../common/4s-datatypes.h"
 #include "../common/4s-hash.h"
 #include "../common/params.h"
 #include "../common/error.h"
 
 #define FS_PTREE_ID 0x4a585031
-#define FS_PTREE_REVISION 0
+
+/* rev=0 - leaves point to linked rows in the shared ptable
+ * rev=1 - leaves point to chains of sorted, columnar blocks held in the
+ *         ptree file itself
+ * rev=2 - as rev=1, but with adaptive 256-way nodes, see wnode */
+#ifdef FS_PTREE_WIDE_NODES
+#define FS_PTREE_REVISION FS_PTREE_REVISION_WIDE
+#elif defined(FS_PTREE_BLOCKS)
+#define FS_PTREE_REVISION FS_PTREE_REVISION_BLOCKS
+#else
+#define FS_PTREE_REVISION FS_PTREE_REVISION_CHAINS
+#endif
 
 #define FS_PTREE_SIZE_INC  32768
 #define FS_PTREE_NULL_NODE 0x80000000U
@@ -51,6 +66,40 @@
 #define LEAF_REF(pt, l) (pt->leaves+(l))
 #define PK_BRANCH(pk, i) (pk >> (((64/FS_PTREE_BRANCH_BITS)-1-i) * FS_PTREE_BRANCH_BITS)) & (FS_PTREE_BRANCHES-1);
 
+/* blocks are allocated in units of sizeof(leaf) bytes, a block of class c is
+ * 2^c units long, the first unit is the block header and the rest holds two
+ * column arrays of 2^c - 1 rids each */
+#define FS_PTREE_BLOCK_INC       65536
+#define FS_PTREE_BLOCK_MIN_CLASS 1
+#define FS_PTREE_BLOCK_MAX_CLASS 6
+#define FS_PTREE_BLOCK_CLASSES   8
+
+#define BLOCK_REF(pt, b) ((block *)((pt)->leaves+(b)))
+#define BLOCK_UNITS(c) (1U << (c))
+#define BLOCK_CAPACITY(c) (BLOCK_UNITS(c) - 1)
+#define BLOCK_COL(bl, col) ((fs_rid *)((bl)+1) + (col) * BLOCK_CAPACITY((bl)->cls))
+#define IS_BLOCKS(pt) ((pt)->header->revision >= FS_PTREE_REVISION_BLOCKS)
+#define IS_WIDE(pt) ((pt)->header->revision == FS_PTREE_REVISION_WIDE)
+
+/* rev=2 nodes consume a byte of the key per level and come in four sizes,
+ * as in the adaptive radix tree, each is allocated as a block, with a
+ * header unit that's followed by:
+ *   WNODE_4:   child[4], keys are held in the header
+ *   WNODE_16:  key[16], child[16]
+ *   WNODE_48:  index[256], child[48], index holds child position + 1
+ *   WNODE_256: child[256] */
+#define WNODE_4   0
+#define WNODE_16  1
+#define WNODE_48  2
+#define WNODE_256 3
+
+#define WNODE_LEVELS 8
+#define WNODE_KEY(pk, i) ((uint8_t)((pk) >> (56 - 8 * (i))))
+#define WNODE_REF(pt, n) ((wnode *)((pt)->leaves + ((n) & 0x7fffffffU)))
+
+static const int wnode_capacity[4] = { 4, 16, 48, 256 };
+static const int wnode_class[4] = { 1, 3, 5, 7 };
+
 #define FS_PACKED __attribute__((__packed__))
 
 typedef uint32_t nodeid;
@@ -65,6 +114,23 @@ typedef struct _leaf {
     uint32_t length;
 } leaf;
 
+typedef struct _block {
+    uint32_t next;          // next block in the leaf, 0 terminates
+    uint16_t length;        // number of pairs used
+    uint8_t cls;            // size class
+    uint8_t flags;
+    uint64_t reserved;
+} block;
+
+/* laid out so that wnodes can go on the block free lists */
+typedef struct _wnode {
+    uint32_t next;          // next free block
+    uint16_t count;         // children used
+    uint8_t cls;            // size class of the allocation
+    uint8_t kind;           // WNODE_*
+    uint8_t key[8];         // keys of a WNODE_4
+} wnode;
+
 struct ptree_header {
     int32_t id;             // "JXP1"
     uint32_t node_base;     // number of next node to be allocated
@@ -76,17 +142,25 @@ struct ptree_header {
     uint32_t leaf_count;    // leaves used
     uint32_t leaf_alloc;    // leaves allocated
     int32_t revision;       // revision of the strucure
-                            // rev=0 - vanilla, rev=1 - with staging
+                            // rev=0 - ptable chains, rev=1 - sorted blocks
+                            // rev=2 - sorted blocks, wide nodes
     int64_t alloc;          // length of file allocated to data (in bytes, not
                             // inc. header)
     int64_t count;
     nodeid node_free;       // list of free nodes, linked by branch[0]
     nodeid leaf_free;       // list of free leaves, linked by block
-    char padding[448];      // allign to a block
+    uint32_t block_base;    // next unit to be allocated to blocks
+    uint32_t block_size;    // end of the current block region
+    uint32_t block_count;   // blocks used
+    uint32_t block_free[FS_PTREE_BLOCK_CLASSES]; // free blocks by class,
+                                                 // linked by next
+    nodeid root;            // rev=2: root node, always a WNODE_256
+    uint64_t generation;    // bumped by every change to the pairs
+    char padding[392];      // allign to a block
 } FS_PACKED;
 
 struct _fs_ptree {
-    int fd;
+    int fd;                 // -1 if the tree is held in a pack slot
     char *filename;
     int flags;              // open() flags
     off_t file_length;
@@ -95,6 +169,11 @@ struct _fs_ptree {
     node *nodes;
     leaf *leaves;
     fs_ptable *table;
+    nodeid root;
+    int revision;           // revision to create new files with
+    fs_bloom *bloom;        // pks with a leaf, may be NULL
+    fs_frozen *frozen;      // read optimised copy of the tree, may be NULL
+    const fs_frozen_run *frozen_run;
 };
 
 typedef struct _tree_pos {
@@ -108,15 +187,28 @@ struct _fs_ptree_it {
     fs_ptree *pt;
     leaf *leaf;
     fs_row_id block;
+    uint32_t pos;           // offset in block, for rev=1 trees
+    int32_t row_length;     // pairs decoded from the current ptable row
+    fs_rid row[FS_PTABLE_ROW_PAIRS][2];
     int32_t step;
     int32_t length;
     fs_rid pair[2];
     int traverse;
     tree_pos *stack;
+    fs_frozen_it *frozen;   // set when reading from the frozen copy
+    int changed_only;       // traversing the tree for the pks the copy lacks
 };
 
 int fs_ptree_grow_nodes(fs_ptree *pt);
 int fs_ptree_grow_leaves(fs_ptree *pt);
+static nodeid wnode_new(fs_ptree *pt, int kind);
+static void wnode_free(fs_ptree *pt, nodeid n);
+static void bloom_open(fs_ptree *pt);
+static fs_bloom *bloom_current(fs_ptree *pt);
+static int check_header(fs_ptree *pt, fs_ptable *chain);
+static void init_root(fs_ptree *pt);
+static int unpack(fs_ptree *pt);
+static void frozen_log(fs_ptree *pt, fs_rid pk);
 
 fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptable *chain)
 {
@@ -145,18 +237,28 @@ node *node_ref(fs_ptree *pt, nodeid n)
     return pt->nodes+offset;
 }
 
+static void map_pointers(fs_ptree *pt)
+{
+    pt->header = pt->ptr;
+    pt->nodes = (node *)((char *)(pt->ptr) + sizeof(struct ptree_header));
+    pt->leaves = (leaf *)(pt->nodes);
+}
+
 static void map_file(fs_ptree *pt)
 {
     pt->ptr = mmap(NULL, pt->file_length, PROT_READ | PROT_WRITE, MAP_SHARED, pt->fd, 0);
     if (pt->ptr == (void *)-1) {
         fs_error(LOG_ERR, "failed to mmap '%s'", pt->filename);
     }
-    pt->header = pt->ptr;
-    pt->nodes = (node *)((char *)(pt->ptr) + sizeof(struct ptree_header));
-    pt->leaves = (leaf *)(pt->nodes);
+    map_pointers(pt);
 }
 
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain)
+{
+    return fs_ptree_open_filename_revision(filename, flags, chain, FS_PTREE_REVISION);
+}
+
+fs_ptree *fs_ptree_open_filename_revision(const char *filename, int flags, fs_ptable *chain, int revision)
 {
     if (sizeof(struct ptree_header) != 512) {
         fs_error(LOG_CRIT, "incorrect ptree header size %zd, should be 512",
@@ -164,6 +266,12 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
 
         return NULL;
     }
+    if (sizeof(block) != sizeof(leaf)) {
+        fs_error(LOG_CRIT, "incorrect ptree block header size %zd, should be %zd",
+                 sizeof(block), sizeof(leaf));
+
+        return NULL;
+    }
 
     fs_ptree *pt = calloc(1, sizeof(fs_ptree));
     pt->fd = open(filename, FS_O_NOATIME | flags, FS_FILE_MODE);
@@ -174,6 +282,7 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
         return NULL;
     }
     pt->filename = g_strdup(filename);
+    pt->revision = revision;
     
     if (flags & (O_WRONLY | O_RDWR)) {
         flock(pt->fd, LOCK_EX);
@@ -185,33 +294,153 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
         map_file(pt);
     }
 
+    if (check_header(pt, chain)) {
+        return NULL;
+    }
+    bloom_open(pt);
+
+    return pt;
+}
+
+static int check_header(fs_ptree *pt, fs_ptable *chain)
+{
     if (pt->header->id != FS_PTREE_ID) {
         fs_error(LOG_ERR, "%s does not appear to be a ptree file", pt->filename);
 
-        return NULL;
+        return 1;
     }
-    if (pt->header->revision != FS_PTREE_REVISION) {
-        fs_error(LOG_ERR, "%s is not a revision %d ptree", pt->filename, FS_PTREE_REVISION);
+    if (pt->header->revision < FS_PTREE_REVISION_CHAINS ||
+        pt->header->revision > FS_PTREE_REVISION_WIDE) {
+        fs_error(LOG_ERR, "%s is a revision %d ptree, expected %d-%d",
+                 pt->filename, pt->header->revision,
+                 FS_PTREE_REVISION_CHAINS, FS_PTREE_REVISION_WIDE);
 
-        return NULL;
+        return 1;
+    }
+    if (!IS_BLOCKS(pt) && !chain) {
+        fs_error(LOG_WARNING, "%s uses ptable chains, but no table given",
+                 pt->filename);
     }
     
     pt->table = chain;
+    pt->root = IS_WIDE(pt) ? pt->header->root : FS_PTREE_ROOT_NODE;
 
     if (pt->header->node_free == 0) {
         pt->header->node_free = FS_PTREE_NULL_NODE;
     }
 
+    return 0;
+}
+
+/* a packed tree has all of its regions laid out up front, as it can't grow
+ * in place, wide trees keep their nodes in blocks so only need the reserved
+ * nodes */
+static void write_packed_header(fs_ptree *pt)
+{
+    const uint32_t units = (pt->file_length - sizeof(struct ptree_header)) / sizeof(leaf);
+    uint32_t nodes = units / 2;
+    uint32_t leaves = units - nodes;
+    if (pt->revision == FS_PTREE_REVISION_WIDE) {
+        nodes = 2;
+        leaves = units / 4;
+    } else if (pt->revision == FS_PTREE_REVISION_BLOCKS) {
+        nodes = units / 8;
+        leaves = units / 4;
+    }
+
+    struct ptree_header *header = pt->ptr;
+    memset(header, 0, sizeof(struct ptree_header));
+    header->id = FS_PTREE_ID;
+    header->revision = pt->revision;
+    header->node_size = nodes;
+    header->node_alloc = nodes;
+    header->node_count = 2;
+    header->node_base = 2;
+    header->leaf_size = nodes + leaves;
+    header->leaf_alloc = leaves;
+    header->leaf_count = 2;
+    header->leaf_base = nodes + 1;
+    header->block_base = nodes + leaves;
+    header->block_size = units;
+    header->alloc = (int64_t)units * sizeof(leaf);
+    map_pointers(pt);
+    init_root(pt);
+}
+
+fs_ptree *fs_ptree_open_packed(const char *filename, void *ptr, size_t length, int flags, fs_ptable *chain, int create)
+{
+    if (!create && ((struct ptree_header *)ptr)->id != FS_PTREE_ID) {
+        /* it's been moved out to filename */
+        return NULL;
+    }
+
+    fs_ptree *pt = calloc(1, sizeof(fs_ptree));
+    pt->fd = -1;
+    pt->filename = g_strdup(filename);
+    pt->flags = flags;
+    pt->revision = FS_PTREE_REVISION;
+    pt->ptr = ptr;
+    pt->file_length = length;
+    if (create) {
+        write_packed_header(pt);
+    } else {
+        map_pointers(pt);
+    }
+    if (check_header(pt, chain)) {
+        g_free(pt->filename);
+        free(pt);
+
+        return NULL;
+    }
+    /* packed trees are too small for a bloom filter to pay its way */
+
     return pt;
 }
 
+int fs_ptree_is_packed(fs_ptree *pt)
+{
+    return pt->fd == -1;
+}
+
+int fs_ptree_uses_table(fs_ptree *pt)
+{
+    return !IS_BLOCKS(pt);
+}
+
+/* copy a packed tree out to a file of its own, so that it can grow, the slot
+ * is left without a valid header, so it's seen as vacant */
+static int unpack(fs_ptree *pt)
+{
+    int fd = open(pt->filename, FS_O_NOATIME | O_RDWR | O_CREAT | O_TRUNC, FS_FILE_MODE);
+    if (fd == -1) {
+        fs_error(LOG_CRIT, "cannot create ptree file '%s': %s", pt->filename, strerror(errno));
+
+        return 1;
+    }
+    flock(fd, LOCK_EX);
+    if (pwrite(fd, pt->ptr, pt->file_length, 0) != pt->file_length) {
+        fs_error(LOG_CRIT, "failed to write ptree file '%s': %s", pt->filename, strerror(errno));
+        unlink(pt->filename);
+        close(fd);
+
+        return 1;
+    }
+    struct ptree_header *slot = pt->header;
+    pt->fd = fd;
+    map_file(pt);
+    slot->id = 0;
+    bloom_open(pt);
+
+    return 0;
+}
+
 int fs_ptree_write_header(fs_ptree *pt)
 {
     struct ptree_header header;
 
     memset(&header, 0, sizeof(header));
     header.id = FS_PTREE_ID;
-    header.revision = FS_PTREE_REVISION;
+    header.revision = pt->revision;
     header.node_size = FS_PTREE_SIZE_INC;
     header.node_alloc = FS_PTREE_SIZE_INC;
     header.node_count = 2;
@@ -235,19 +464,33 @@ int fs_ptree_write_header(fs_ptree *pt)
         fs_error(LOG_ERR, "failed to extend ptree file");
     }
     map_file(pt);
+    init_root(pt);
+
+    return 0;
+}
+
+static void init_root(fs_ptree *pt)
+{
     memset(pt->nodes, 0, sizeof(node));
     memset(pt->leaves, 0, sizeof(leaf));
     node *root = pt->nodes+1;
     for (int i=0; i<FS_PTREE_BRANCHES; i++) {
         root->branch[i] = FS_PTREE_NULL_NODE;
     }
-
-    return 0;
+    if (IS_WIDE(pt)) {
+        /* the root is never resized, so make it as big as it'll get */
+        pt->header->node_count = 0;
+        const nodeid root = wnode_new(pt, WNODE_256);
+        pt->header->root = root;
+    }
 }
 
 int fs_ptree_grow_nodes(fs_ptree *pt)
 {
     char junk = '\0';
+    if (pt->fd == -1 && unpack(pt)) {
+        return 1;
+    }
     pt->header->node_base = pt->header->alloc / sizeof(node);
     pt->header->alloc += FS_PTREE_SIZE_INC * sizeof(node);
     pt->header->node_size = pt->header->alloc / sizeof(node);
@@ -270,6 +513,9 @@ int fs_ptree_grow_nodes(fs_ptree *pt)
 int fs_ptree_grow_leaves(fs_ptree *pt)
 {
     char junk = '\0';
+    if (pt->fd == -1 && unpack(pt)) {
+        return 1;
+    }
     pt->header->leaf_base = pt->header->alloc / sizeof(leaf);
     pt->header->alloc += FS_PTREE_SIZE_INC * sizeof(leaf);
     pt->header->leaf_size = pt->header->alloc / sizeof(leaf);
@@ -296,11 +542,16 @@ void fs_ptree_free_node(fs_ptree *pt, nodeid n)
 
         return;
     }
-    if (n == FS_PTREE_ROOT_NODE) {
+    if (n == pt->root) {
         fs_error(LOG_ERR, "tried to free root node");
 
         return;
     }
+    if (IS_WIDE(pt)) {
+        wnode_free(pt, n);
+
+        return;
+    }
     node *nr = NODE_REF(pt, n);
     nr->branch[0] = pt->header->node_free;
     pt->header->node_free = n;
@@ -338,6 +589,13 @@ nodeid fs_ptree_new_node(fs_ptree *pt)
     return n;
 }
 
+/* the filter is in step with the tree as long as no leaves have been
+ * allocated or freed without it seeing, eg. by an older 4store */
+static inline uint64_t bloom_stamp(fs_ptree *pt)
+{
+    return ((uint64_t)pt->header->leaf_base << 32) | pt->header->leaf_free;
+}
+
 void fs_ptree_free_leaf(fs_ptree *pt, nodeid n)
 {
     if (IS_NODE(n)) {
@@ -348,6 +606,11 @@ void fs_ptree_free_leaf(fs_ptree *pt, nodeid n)
     leaf *lr = LEAF_REF(pt, n);
     lr->block = pt->header->leaf_free;
     pt->header->leaf_free = n;
+    fs_bloom *bloom = bloom_current(pt);
+    if (bloom) {
+        /* the pk stays in the filter, which is harmless */
+        fs_bloom_set_stamp(bloom, bloom_stamp(pt));
+    }
 }
 
 nodeid fs_ptree_new_leaf(fs_ptree *pt)
@@ -376,15 +639,610 @@ nodeid fs_ptree_new_leaf(fs_ptree *pt)
     static const leaf init = { FS_RID_NULL, 0, 0 };
     *nl = init;
 
-    return n;
+    return n;
+}
+
+/* hand the unused end of the current block region over to the free lists */
+static void release_block_tail(fs_ptree *pt)
+{
+    for (int c=FS_PTREE_BLOCK_MAX_CLASS; c>=FS_PTREE_BLOCK_MIN_CLASS; c--) {
+        while (pt->header->block_size - pt->header->block_base >= BLOCK_UNITS(c)) {
+            uint32_t b = pt->header->block_base;
+            block *bl = BLOCK_REF(pt, b);
+            bl->cls = c;
+            bl->length = 0;
+            bl->next = pt->header->block_free[c];
+            pt->header->block_free[c] = b;
+            pt->header->block_base += BLOCK_UNITS(c);
+        }
+    }
+}
+
+static int fs_ptree_grow_blocks(fs_ptree *pt)
+{
+    char junk = '\0';
+    if (pt->fd == -1 && unpack(pt)) {
+        return 1;
+    }
+    release_block_tail(pt);
+    pt->header->block_base = pt->header->alloc / sizeof(leaf);
+    pt->header->alloc += FS_PTREE_BLOCK_INC * sizeof(leaf);
+    pt->header->block_size = pt->header->alloc / sizeof(leaf);
+
+    /* need to copy this value as were about to unmap */
+    off_t alloc = pt->header->alloc;
+    munmap(pt->ptr, pt->file_length);
+    pt->file_length = sizeof(struct ptree_header) + alloc;
+    if (pwrite(pt->fd, &junk, 1, pt->file_length) == -1) {
+        fs_error(LOG_ERR, "failed to grow ptree file");
+
+        return 1;
+    }
+    map_file(pt);
+
+    return 0;
+}
+
+/* NB this may remap the file, so any node, leaf or block pointers held by the
+ * caller are invalid afterwards */
+static uint32_t fs_ptree_new_block(fs_ptree *pt, int cls)
+{
+    uint32_t b = pt->header->block_free[cls];
+    if (b) {
+        block *bl = BLOCK_REF(pt, b);
+        pt->header->block_free[cls] = bl->next;
+    } else {
+        if (pt->header->block_size - pt->header->block_base < BLOCK_UNITS(cls)) {
+            if (fs_ptree_grow_blocks(pt)) {
+                return 0;
+            }
+        }
+        b = pt->header->block_base;
+        pt->header->block_base += BLOCK_UNITS(cls);
+    }
+    pt->header->block_count++;
+    block *bl = BLOCK_REF(pt, b);
+    bl->next = 0;
+    bl->length = 0;
+    bl->cls = cls;
+    bl->flags = 0;
+    bl->reserved = 0;
+
+    return b;
+}
+
+static void fs_ptree_free_block(fs_ptree *pt, uint32_t b)
+{
+    block *bl = BLOCK_REF(pt, b);
+    bl->length = 0;
+    bl->next = pt->header->block_free[bl->cls];
+    pt->header->block_free[bl->cls] = b;
+    pt->header->block_count--;
+}
+
+/* NB this may remap the file, like fs_ptree_new_block() */
+static nodeid wnode_new(fs_ptree *pt, int kind)
+{
+    uint32_t b = fs_ptree_new_block(pt, wnode_class[kind]);
+    if (!b) {
+        return FS_PTREE_NULL_NODE;
+    }
+    /* nodes are counted as nodes, not blocks */
+    pt->header->block_count--;
+    pt->header->node_count++;
+    wnode *wn = (wnode *)BLOCK_REF(pt, b);
+    memset(wn, 0, BLOCK_UNITS(wnode_class[kind]) * sizeof(leaf));
+    wn->cls = wnode_class[kind];
+    wn->kind = kind;
+    if (kind == WNODE_256) {
+        nodeid *child = (nodeid *)(wn + 1);
+        for (int i=0; i<256; i++) {
+            child[i] = FS_PTREE_NULL_NODE;
+        }
+    }
+
+    return b | 0x80000000U;
+}
+
+static void wnode_free(fs_ptree *pt, nodeid n)
+{
+    pt->header->node_count--;
+    pt->header->block_count++;
+    fs_ptree_free_block(pt, n & 0x7fffffffU);
+}
+
+static inline nodeid *wnode_children(wnode *wn)
+{
+    switch (wn->kind) {
+    case WNODE_4:
+        return (nodeid *)(wn + 1);
+    case WNODE_16:
+        return (nodeid *)(wn + 2);
+    case WNODE_48:
+        return (nodeid *)(wn + 17);
+    default:
+        return (nodeid *)(wn + 1);
+    }
+}
+
+static inline uint8_t *wnode_keys(wnode *wn)
+{
+    return wn->kind == WNODE_4 ? wn->key : (uint8_t *)(wn + 1);
+}
+
+/* children are visited by position, for WNODE_4 and WNODE_16 that's the
+ * index into child[], for the others it's the key */
+static inline int wnode_positions(wnode *wn)
+{
+    return wn->kind == WNODE_4 || wn->kind == WNODE_16 ? wn->count : 256;
+}
+
+/* returns the position of the child with key k, or -1 */
+static inline int wnode_find(wnode *wn, uint8_t k)
+{
+    switch (wn->kind) {
+    case WNODE_4: {
+        for (int i=0; i<wn->count; i++) {
+            if (wn->key[i] == k) return i;
+        }
+        return -1;
+    }
+    case WNODE_16: {
+        const uint8_t *keys = wnode_keys(wn);
+#ifdef __SSE2__
+        const __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(k),
+                                _mm_loadu_si128((const __m128i *)keys));
+        const int mask = _mm_movemask_epi8(cmp) & ((1 << wn->count) - 1);
+        return mask ? __builtin_ctz(mask) : -1;
+#else
+        for (int i=0; i<wn->count; i++) {
+            if (keys[i] == k) return i;
+        }
+        return -1;
+#endif
+    }
+    case WNODE_48:
+        return wnode_keys(wn)[k] ? k : -1;
+    default:
+        return wnode_children(wn)[k] == FS_PTREE_NULL_NODE ? -1 : k;
+    }
+}
+
+static inline int wnode_key(wnode *wn, int p)
+{
+    return wn->kind == WNODE_4 || wn->kind == WNODE_16 ? wnode_keys(wn)[p] : p;
+}
+
+static inline nodeid wnode_child(wnode *wn, int p)
+{
+    if (wn->kind == WNODE_48) {
+        const int i = wnode_keys(wn)[p];
+
+        return i ? wnode_children(wn)[i - 1] : FS_PTREE_NULL_NODE;
+    }
+
+    return wnode_children(wn)[p];
+}
+
+/* replace the child at position p, which must be in use */
+static inline void wnode_set(wnode *wn, int p, nodeid child)
+{
+    if (wn->kind == WNODE_48) {
+        wnode_children(wn)[wnode_keys(wn)[p] - 1] = child;
+    } else {
+        wnode_children(wn)[p] = child;
+    }
+}
+
+/* wn must have room for another child */
+static void wnode_insert(wnode *wn, uint8_t k, nodeid child)
+{
+    nodeid *children = wnode_children(wn);
+
+    switch (wn->kind) {
+    case WNODE_4:
+    case WNODE_16:
+        wnode_keys(wn)[wn->count] = k;
+        children[wn->count] = child;
+        break;
+    case WNODE_48:
+        children[wn->count] = child;
+        wnode_keys(wn)[k] = wn->count + 1;
+        break;
+    default:
+        children[k] = child;
+    }
+    wn->count++;
+}
+
+/* NB for WNODE_4 and WNODE_16 this moves the last child into position p, so
+ * callers deleting while iterating should work backwards */
+static void wnode_delete(wnode *wn, int p)
+{
+    nodeid *children = wnode_children(wn);
+    const int last = wn->count - 1;
+
+    switch (wn->kind) {
+    case WNODE_4:
+    case WNODE_16: {
+        uint8_t *keys = wnode_keys(wn);
+        keys[p] = keys[last];
+        children[p] = children[last];
+        break;
+    }
+    case WNODE_48: {
+        uint8_t *index = wnode_keys(wn);
+        const int i = index[p] - 1;
+        index[p] = 0;
+        if (i != last) {
+            children[i] = children[last];
+            for (int k=0; k<256; k++) {
+                if (index[k] == last + 1) {
+                    index[k] = i + 1;
+                    break;
+                }
+            }
+        }
+        break;
+    }
+    default:
+        children[p] = FS_PTREE_NULL_NODE;
+    }
+    wn->count--;
+}
+
+/* replace node n with a copy one size up, returns the new node id, NB this
+ * may remap the file. There's no matching shrink, fs_ptree_migrate() with
+ * compact set rewrites a tree with its nodes sized to fit */
+static nodeid wnode_grow(fs_ptree *pt, nodeid n)
+{
+    const int kind = WNODE_REF(pt, n)->kind + 1;
+    nodeid nn = wnode_new(pt, kind);
+    if (nn == FS_PTREE_NULL_NODE) {
+        return nn;
+    }
+    wnode *from = WNODE_REF(pt, n);
+    wnode *to = WNODE_REF(pt, nn);
+    for (int p=0; p<wnode_positions(from); p++) {
+        const nodeid child = wnode_child(from, p);
+        if (child != FS_PTREE_NULL_NODE) {
+            wnode_insert(to, wnode_key(from, p), child);
+        }
+    }
+    wnode_free(pt, n);
+
+    return nn;
+}
+
+/* the remaining node functions work with nodes of any revision, rev<2
+ * nodes have FS_PTREE_BRANCHES positions, indexed by 2 bits of the key per
+ * level */
+
+static inline int node_levels(fs_ptree *pt)
+{
+    return IS_WIDE(pt) ? WNODE_LEVELS : 64/FS_PTREE_BRANCH_BITS;
+}
+
+static inline int node_positions(fs_ptree *pt, nodeid n)
+{
+    return IS_WIDE(pt) ? wnode_positions(WNODE_REF(pt, n)) : FS_PTREE_BRANCHES;
+}
+
+/* position of the child of n for pk at level, or -1 */
+static inline int node_find(fs_ptree *pt, nodeid n, fs_rid pk, int level)
+{
+    if (IS_WIDE(pt)) {
+        return wnode_find(WNODE_REF(pt, n), WNODE_KEY(pk, level));
+    }
+
+    return PK_BRANCH(pk, level);
+}
+
+/* child at position p, or FS_PTREE_NULL_NODE */
+static inline nodeid node_child(fs_ptree *pt, nodeid n, int p)
+{
+    if (IS_WIDE(pt)) {
+        return p == -1 ? FS_PTREE_NULL_NODE : wnode_child(WNODE_REF(pt, n), p);
+    }
+
+    return NODE_REF(pt, n)->branch[p];
+}
+
+/* replace the child at position p, which must be in use */
+static inline void node_set(fs_ptree *pt, nodeid n, int p, nodeid child)
+{
+    if (IS_WIDE(pt)) {
+        wnode_set(WNODE_REF(pt, n), p, child);
+    } else {
+        NODE_REF(pt, n)->branch[p] = child;
+    }
+}
+
+static inline int node_key(fs_ptree *pt, nodeid n, int p)
+{
+    return IS_WIDE(pt) ? wnode_key(WNODE_REF(pt, n), p) : p;
+}
+
+static inline void node_clear(fs_ptree *pt, nodeid n, int p)
+{
+    if (IS_WIDE(pt)) {
+        wnode_delete(WNODE_REF(pt, n), p);
+    } else {
+        NODE_REF(pt, n)->branch[p] = FS_PTREE_NULL_NODE;
+    }
+}
+
+static inline int pair_cmp(const fs_rid a0, const fs_rid a1, const fs_rid b0, const fs_rid b1)
+{
+    if (a0 < b0) return -1;
+    if (a0 > b0) return 1;
+    if (a1 < b1) return -1;
+    if (a1 > b1) return 1;
+
+    return 0;
+}
+
+/* returns the position of the first pair in bl that sorts after pair */
+static int block_upper_bound(block *bl, const fs_rid pair[2])
+{
+    const fs_rid *c0 = BLOCK_COL(bl, 0);
+    const fs_rid *c1 = BLOCK_COL(bl, 1);
+    int low = 0, high = bl->length;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (pair_cmp(c0[mid], c1[mid], pair[0], pair[1]) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/* returns the position of the first pair in bl with a first column >= r */
+static int block_lower_bound(block *bl, const fs_rid r)
+{
+    const fs_rid *c0 = BLOCK_COL(bl, 0);
+    int low = 0, high = bl->length;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (c0[mid] < r) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/* copy n pairs from position from in src to position to in dest */
+static void block_copy(block *dest, int to, block *src, int from, int n)
+{
+    memmove(BLOCK_COL(dest, 0)+to, BLOCK_COL(src, 0)+from, n * sizeof(fs_rid));
+    memmove(BLOCK_COL(dest, 1)+to, BLOCK_COL(src, 1)+from, n * sizeof(fs_rid));
+}
+
+/* point the reference to b (either the leaf, or the previous block in the
+ * chain) at nb */
+static void block_relink(fs_ptree *pt, nodeid lid, uint32_t prev, uint32_t nb)
+{
+    if (prev) {
+        BLOCK_REF(pt, prev)->next = nb;
+    } else {
+        LEAF_REF(pt, lid)->block = nb;
+    }
+}
+
+/* insert pair into the sorted block chain of leaf lid, returns 1 if the pair
+ * was added */
+static int blocks_add_pair(fs_ptree *pt, nodeid lid, fs_rid pair[2])
+{
+    if (!LEAF_REF(pt, lid)->block) {
+        uint32_t nb = fs_ptree_new_block(pt, FS_PTREE_BLOCK_MIN_CLASS);
+        if (!nb) return 0;
+        LEAF_REF(pt, lid)->block = nb;
+    }
+
+    /* find the first block whose last pair sorts after pair, or the tail */
+    uint32_t prev = 0;
+    uint32_t b = LEAF_REF(pt, lid)->block;
+    block *bl = BLOCK_REF(pt, b);
+    while (bl->next && bl->length &&
+           pair_cmp(BLOCK_COL(bl, 0)[bl->length-1],
+                    BLOCK_COL(bl, 1)[bl->length-1], pair[0], pair[1]) <= 0) {
+        prev = b;
+        b = bl->next;
+        bl = BLOCK_REF(pt, b);
+    }
+    int pos = block_upper_bound(bl, pair);
+#ifdef FS_INSERT_DEDUP
+    if (pos > 0 && BLOCK_COL(bl, 0)[pos-1] == pair[0] &&
+        BLOCK_COL(bl, 1)[pos-1] == pair[1]) {
+        /* nothing to be done */
+        return 0;
+    }
+#endif
+
+    if (bl->length == BLOCK_CAPACITY(bl->cls)) {
+        if (bl->cls < FS_PTREE_BLOCK_MAX_CLASS) {
+            /* promote to the next size class */
+            uint32_t nb = fs_ptree_new_block(pt, bl->cls + 1);
+            if (!nb) return 0;
+            bl = BLOCK_REF(pt, b);
+            block *nbl = BLOCK_REF(pt, nb);
+            block_copy(nbl, 0, bl, 0, bl->length);
+            nbl->length = bl->length;
+            nbl->next = bl->next;
+            block_relink(pt, lid, prev, nb);
+            fs_ptree_free_block(pt, b);
+            b = nb;
+            bl = nbl;
+        } else {
+            /* split the block in half */
+            uint32_t nb = fs_ptree_new_block(pt, FS_PTREE_BLOCK_MAX_CLASS);
+            if (!nb) return 0;
+            bl = BLOCK_REF(pt, b);
+            block *nbl = BLOCK_REF(pt, nb);
+            const int half = bl->length / 2;
+            block_copy(nbl, 0, bl, half, bl->length - half);
+            nbl->length = bl->length - half;
+            bl->length = half;
+            nbl->next = bl->next;
+            bl->next = nb;
+            if (pos > half) {
+                pos -= half;
+                b = nb;
+                bl = nbl;
+            }
+        }
+    }
+
+    block_copy(bl, pos+1, bl, pos, bl->length - pos);
+    BLOCK_COL(bl, 0)[pos] = pair[0];
+    BLOCK_COL(bl, 1)[pos] = pair[1];
+    bl->length++;
+
+    return 1;
+}
+
+/* add count sorted, distinct pairs to leaf lid, returns the number added. If
+ * they all sort after the leaf's last pair they're appended, filling each
+ * block, otherwise they're added one at a time */
+static int blocks_add_run(fs_ptree *pt, nodeid lid, fs_rid pairs[][2], int count)
+{
+    uint32_t tail = LEAF_REF(pt, lid)->block;
+    while (tail && BLOCK_REF(pt, tail)->next) {
+        tail = BLOCK_REF(pt, tail)->next;
+    }
+    if (tail) {
+        block *bl = BLOCK_REF(pt, tail);
+        if (bl->length && pair_cmp(BLOCK_COL(bl, 0)[bl->length-1],
+                BLOCK_COL(bl, 1)[bl->length-1], pairs[0][0], pairs[0][1]) >= 0) {
+            int added = 0;
+            for (int i=0; i<count; i++) {
+                added += blocks_add_pair(pt, lid, pairs[i]);
+            }
+
+            return added;
+        }
+    }
+
+    int i = 0;
+    while (i < count) {
+        block *bl = tail ? BLOCK_REF(pt, tail) : NULL;
+        if (!bl || bl->length == BLOCK_CAPACITY(bl->cls)) {
+            /* the smallest class that holds the rest, or the largest */
+            int cls = FS_PTREE_BLOCK_MIN_CLASS;
+            while (cls < FS_PTREE_BLOCK_MAX_CLASS && BLOCK_CAPACITY(cls) < count - i) {
+                cls++;
+            }
+            const uint32_t nb = fs_ptree_new_block(pt, cls);
+            if (!nb) break;
+            if (tail) {
+                BLOCK_REF(pt, tail)->next = nb;
+            } else {
+                LEAF_REF(pt, lid)->block = nb;
+            }
+            tail = nb;
+            bl = BLOCK_REF(pt, nb);
+        }
+        for (; i < count && bl->length < BLOCK_CAPACITY(bl->cls); i++) {
+            BLOCK_COL(bl, 0)[bl->length] = pairs[i][0];
+            BLOCK_COL(bl, 1)[bl->length] = pairs[i][1];
+            bl->length++;
+        }
+    }
+
+    return i;
+}
+
+/* remove pairs matching pair from the block chain of leaf lid, with the same
+ * semantics as fs_ptable_remove_pair(), returns the number removed */
+static int blocks_remove_pair(fs_ptree *pt, nodeid lid, fs_rid pair[2], fs_rid_set *models)
+{
+    if (pair[0] == FS_RID_NULL && pair[1] == FS_RID_NULL) {
+        if (models) {
+            /* mark all models as sparse */
+            for (uint32_t b = LEAF_REF(pt, lid)->block; b; b = BLOCK_REF(pt, b)->next) {
+                block *bl = BLOCK_REF(pt, b);
+                for (int i=0; i<bl->length; i++) {
+                    fs_rid_set_add(models, BLOCK_COL(bl, 0)[i]);
+                }
+            }
+        }
+    }
+
+    int removed = 0;
+    uint32_t prev = 0;
+    uint32_t b = LEAF_REF(pt, lid)->block;
+    while (b) {
+        block *bl = BLOCK_REF(pt, b);
+        fs_rid *c0 = BLOCK_COL(bl, 0);
+        fs_rid *c1 = BLOCK_COL(bl, 1);
+        int out = 0;
+        for (int i=0; i<bl->length; i++) {
+            int match;
+            if (pair[0] == FS_RID_NULL && pair[1] == FS_RID_NULL) {
+                match = 1;
+            } else if (pair[1] == FS_RID_NULL) {
+                match = c0[i] == pair[0];
+            } else if (pair[0] == FS_RID_NULL) {
+                match = c1[i] == pair[1];
+                if (match && models) {
+                    fs_rid_set_add(models, c0[i]);
+                }
+            } else {
+                match = c0[i] == pair[0] && c1[i] == pair[1];
+            }
+            if (match) {
+                removed++;
+            } else {
+                c0[out] = c0[i];
+                c1[out] = c1[i];
+                out++;
+            }
+        }
+        bl->length = out;
+        uint32_t next = bl->next;
+        if (out == 0) {
+            block_relink(pt, lid, prev, next);
+            fs_ptree_free_block(pt, b);
+        } else {
+            prev = b;
+        }
+        b = next;
+    }
+
+    return removed;
+}
+
+/* remove pairs from leaf lid in whatever format the tree uses, returns the
+ * number removed */
+static int leaf_remove_pair(fs_ptree *pt, nodeid lid, fs_rid pair[2], fs_rid_set *models)
+{
+    if (IS_BLOCKS(pt)) {
+        return blocks_remove_pair(pt, lid, pair, models);
+    }
+
+    int removed = 0;
+    leaf *lref = LEAF_REF(pt, lid);
+    fs_row_id newblock = fs_ptable_remove_pair(pt->table, lref->block, pair,
+                                               &removed, models);
+    if (lref->block != newblock) {
+        lref->block = newblock;
+    }
+
+    return removed;
 }
 
 static nodeid get_leaf_and_parent(fs_ptree *pt, fs_rid pk, nodeid *parent)
 {
-    nodeid pos = FS_PTREE_ROOT_NODE;
-    for (int i=0; i < 64/FS_PTREE_BRANCH_BITS; i++) {
-        int kbranch = PK_BRANCH(pk, i);
-        nodeid newpos = node_ref(pt, pos)->branch[kbranch];
+    nodeid pos = pt->root;
+    const int levels = node_levels(pt);
+    for (int i=0; i < levels; i++) {
+        nodeid newpos = node_child(pt, pos, node_find(pt, pos, pk, i));
         if (newpos == FS_PTREE_NULL_NODE) {
             return 0;
         } else if (IS_LEAF(newpos)) {
@@ -419,8 +1277,64 @@ static nodeid get_leaf(fs_ptree *pt, fs_rid pk)
     return get_leaf_and_parent(pt, pk, NULL);
 }
 
+/* as get_or_create_leaf() for rev=2 trees, leaves are hung as close to the
+ * root as they can be, and full nodes are replaced by the next size up */
+static nodeid get_or_create_wide_leaf(fs_ptree *pt, fs_rid pk)
+{
+    nodeid parent = FS_PTREE_NULL_NODE;
+    int parent_pos = -1;
+    nodeid pos = pt->root;
+    for (int i=0; i < WNODE_LEVELS; i++) {
+        const uint8_t k = WNODE_KEY(pk, i);
+        wnode *wn = WNODE_REF(pt, pos);
+        const int p = wnode_find(wn, k);
+        if (p == -1) {
+            if (wn->count == wnode_capacity[wn->kind]) {
+                /* the root is a WNODE_256, so this always has a parent */
+                pos = wnode_grow(pt, pos);
+                if (pos == FS_PTREE_NULL_NODE) {
+                    break;
+                }
+                wnode_set(WNODE_REF(pt, parent), parent_pos, pos);
+            }
+            nodeid lid = fs_ptree_new_leaf(pt);
+            LEAF_REF(pt, lid)->pk = pk;
+            wnode_insert(WNODE_REF(pt, pos), k, lid);
+
+            return lid;
+        }
+        nodeid child = wnode_child(wn, p);
+        if (IS_LEAF(child)) {
+            const fs_rid existpk = LEAF_REF(pt, child)->pk;
+            if (pk == existpk) {
+                return child;
+            }
+            /* push the existing leaf down a level, we'll go round again if
+             * the keys still match */
+            nodeid split = wnode_new(pt, WNODE_4);
+            if (split == FS_PTREE_NULL_NODE) {
+                break;
+            }
+            wnode_insert(WNODE_REF(pt, split), WNODE_KEY(existpk, i+1), child);
+            wnode_set(WNODE_REF(pt, pos), p, split);
+            child = split;
+        }
+        parent = pos;
+        parent_pos = p;
+        pos = child;
+    }
+
+    fs_error(LOG_ERR, "fell through get_or_create_leaf(%016llx)", pk);
+
+    return 0;
+}
+
 static nodeid get_or_create_leaf(fs_ptree *pt, fs_rid pk)
 {
+    if (IS_WIDE(pt)) {
+        return get_or_create_wide_leaf(pt, pk);
+    }
+
     nodeid pos = FS_PTREE_ROOT_NODE;
     for (int i=0; i < 64/FS_PTREE_BRANCH_BITS; i++) {
         int kbranch = PK_BRANCH(pk, i);
@@ -476,6 +1390,135 @@ again:;
     return 0;
 }
 
+static void bloom_recurse(fs_ptree *pt, nodeid n, fs_bloom *bloom)
+{
+    for (int b=0; b<node_positions(pt, n); b++) {
+        const nodeid child = node_child(pt, n, b);
+        if (child == FS_PTREE_NULL_NODE) {
+            continue;
+        } else if (IS_NODE(child)) {
+            bloom_recurse(pt, child, bloom);
+        } else {
+            fs_bloom_add(bloom, LEAF_REF(pt, child)->pk);
+        }
+    }
+}
+
+int fs_ptree_bloom_rebuild(fs_ptree *pt)
+{
+    char *filename = g_strdup_printf("%s.bloom", pt->filename);
+    /* leave room to grow, so the filter doesn't fill up again soon */
+    fs_bloom *bloom = fs_bloom_create(filename, (uint64_t)pt->header->leaf_count * 2);
+    g_free(filename);
+    if (!bloom) {
+        return 1;
+    }
+    bloom_recurse(pt, pt->root, bloom);
+    fs_bloom_set_stamp(bloom, bloom_stamp(pt));
+    if (fs_bloom_install(bloom)) {
+        fs_bloom_close(bloom);
+
+        return 1;
+    }
+    /* searches in other threads may still be using the old one */
+    if (pt->bloom) {
+        fs_bloom_retire(bloom, pt->bloom);
+    }
+    pt->bloom = bloom;
+
+    return 0;
+}
+
+static int vacuum_recurse(fs_ptree *pt, nodeid n)
+{
+    int moved = 0;
+    for (int b=0; b<node_positions(pt, n); b++) {
+        const nodeid child = node_child(pt, n, b);
+        if (child == FS_PTREE_NULL_NODE) {
+            continue;
+        } else if (IS_NODE(child)) {
+            moved += vacuum_recurse(pt, child);
+        } else {
+            leaf *lref = LEAF_REF(pt, child);
+            const fs_row_id nb = fs_ptable_vacuum_chain(pt->table, lref->block);
+            if (nb != lref->block) {
+                lref->block = nb;
+                moved++;
+            }
+        }
+    }
+
+    return moved;
+}
+
+int fs_ptree_vacuum(fs_ptree *pt)
+{
+    /* the pairs of block trees aren't in the ptable */
+    if (!pt || IS_BLOCKS(pt) || !pt->table) {
+        return 0;
+    }
+
+    /* the pairs don't change, so the generation and any frozen copy are
+     * still good */
+    return vacuum_recurse(pt, pt->root);
+}
+
+static void bloom_open(fs_ptree *pt)
+{
+    if (!(pt->flags & O_TRUNC)) {
+        char *filename = g_strdup_printf("%s.bloom", pt->filename);
+        pt->bloom = fs_bloom_open(filename, pt->flags);
+        g_free(filename);
+        if (pt->bloom && fs_bloom_get_stamp(pt->bloom) != bloom_stamp(pt)) {
+            fs_bloom_close(pt->bloom);
+            pt->bloom = NULL;
+        }
+    }
+    /* without a filter every search goes to the tree, which is slower but
+     * still correct */
+    if (!pt->bloom && (pt->flags & (O_WRONLY | O_RDWR))) {
+        fs_ptree_bloom_rebuild(pt);
+    }
+}
+
+/* the filter another process has renamed over ours, if it has, readers
+ * remap it, and until they can they do without one */
+static fs_bloom *bloom_current(fs_ptree *pt)
+{
+    fs_bloom *bloom = pt->bloom;
+    if (!bloom || !fs_bloom_replaced(bloom)) {
+        return bloom;
+    }
+    fs_bloom *fresh = fs_bloom_reopen(bloom);
+    if (!fresh) {
+        return NULL;
+    }
+    if (!g_atomic_pointer_compare_and_exchange((gpointer *)&pt->bloom, bloom, fresh)) {
+        /* another thread got there first */
+        fs_bloom_close(fresh);
+
+        return pt->bloom;
+    }
+    fs_bloom_retire(fresh, bloom);
+
+    return fresh;
+}
+
+static void bloom_add(fs_ptree *pt, fs_rid pk)
+{
+    fs_bloom *bloom = bloom_current(pt);
+    if (!bloom) {
+        return;
+    }
+    /* pk's leaf is already in the tree, so the rebuild picks it up, if it
+     * fails the full filter is still correct, just less selective */
+    if (fs_bloom_full(bloom) && !fs_ptree_bloom_rebuild(pt)) {
+        return;
+    }
+    fs_bloom_add(bloom, pk);
+    fs_bloom_set_stamp(bloom, bloom_stamp(pt));
+}
+
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 {
     if (!pt) {
@@ -484,7 +1527,20 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
         return 1;
     }
     nodeid lid = get_or_create_leaf(pt, pk);
+    if (pt->bloom && LEAF_REF(pt, lid)->length == 0) {
+        bloom_add(pt, pk);
+    }
     if (!pair) return 1;
+    if (IS_BLOCKS(pt)) {
+        if (blocks_add_pair(pt, lid, pair)) {
+            LEAF_REF(pt, lid)->length++;
+            pt->header->count++;
+            pt->header->generation++;
+            frozen_log(pt, pk);
+        }
+
+        return 0;
+    }
     leaf *lref = LEAF_REF(pt, lid);
 #ifdef FS_INSERT_DEDUP
     if (lref->block && fs_ptable_pair_exists(pt->table, lref->block, pair)) {
@@ -496,63 +1552,96 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
     if (new_block) {
         lref->length++;
         pt->header->count++;
+        pt->header->generation++;
+        frozen_log(pt, pk);
         if (new_block != lref->block) lref->block = new_block;
     }
 
     return 0;
 }
 
+int fs_ptree_add_run(fs_ptree *pt, fs_rid pk, fs_rid pairs[][2], int count)
+{
+    if (!pt) {
+        fs_error(LOG_ERR, "tried to add to NULL ptree");
+
+        return 1;
+    }
+    if (count == 0) return 0;
+
+    nodeid lid = get_or_create_leaf(pt, pk);
+    if (pt->bloom && LEAF_REF(pt, lid)->length == 0) {
+        bloom_add(pt, pk);
+    }
+    int added;
+    if (IS_BLOCKS(pt)) {
+        added = blocks_add_run(pt, lid, pairs, count);
+    } else {
+        leaf *lref = LEAF_REF(pt, lid);
+        const fs_row_id new_block = fs_ptable_add_run(pt->table, lref->block, pairs, count);
+        /* it only fails if the table isn't mapped, before adding any */
+        added = new_block != lref->block ? count : 0;
+        lref->block = new_block;
+    }
+    if (added) {
+        LEAF_REF(pt, lid)->length += added;
+        pt->header->count += added;
+        pt->header->generation++;
+        frozen_log(pt, pk);
+    }
+
+    return added == count ? 0 : 1;
+}
+
 enum recurse_action { NONE, CULL, MERGE };
 
 static enum recurse_action remove_all_recurse(fs_ptree *pt, fs_rid pair[2], nodeid n, int *removed)
 {
-    node *no = node_ref(pt, n);
     int branches = 0;
     int leaves = 0;
-    for (int b=0; b<FS_PTREE_BRANCHES; b++) {
-        if (no->branch[b] == FS_PTREE_NULL_NODE) {
+    /* work backwards, as clearing a branch may move a later one down */
+    for (int b=node_positions(pt, n)-1; b>=0; b--) {
+        const nodeid child = node_child(pt, n, b);
+        if (child == FS_PTREE_NULL_NODE) {
             /* dead end, do nothing */
-        } else if (IS_LEAF(no->branch[b])) {
-            leaf *lref = LEAF_REF(pt, no->branch[b]);
+        } else if (IS_LEAF(child)) {
+            leaf *lref = LEAF_REF(pt, child);
             int sub_removed = 0; 
             if (lref->block) {
-                fs_row_id newblock = fs_ptable_remove_pair(pt->table,
-                                        lref->block, pair, &sub_removed, NULL);
-                if (lref->block != newblock) {
-                    lref->block = newblock;
-                }
+                sub_removed = leaf_remove_pair(pt, child, pair, NULL);
                 if (sub_removed) {
                     lref->length -= sub_removed;
+                    pt->header->generation++;
+                    frozen_log(pt, lref->pk);
                 }
                 if (removed) {
                     (*removed) += sub_removed;
                 }
             }
             if (sub_removed && lref->length == 0) {
-                fs_ptree_free_leaf(pt, no->branch[b]);
-                no->branch[b] = FS_PTREE_NULL_NODE;
+                fs_ptree_free_leaf(pt, child);
+                node_clear(pt, n, b);
             } else {
                 branches++;
                 leaves++;
             }
         } else {
-            enum recurse_action action = remove_all_recurse(pt, pair, no->branch[b], removed);
+            enum recurse_action action = remove_all_recurse(pt, pair, child, removed);
             if (action == CULL) {
-                fs_ptree_free_node(pt, no->branch[b]);
-                no->branch[b] = FS_PTREE_NULL_NODE;
+                fs_ptree_free_node(pt, child);
+                node_clear(pt, n, b);
             } else if (action == MERGE) {
-                node *sub = NODE_REF(pt, no->branch[b]);
                 nodeid subn = FS_PTREE_NULL_NODE;
-                for (int subb=0; subb<FS_PTREE_BRANCHES; subb++) {
-                    if (sub->branch[subb] != FS_PTREE_NULL_NODE) {
-                        subn = sub->branch[subb];
+                for (int subb=0; subb<node_positions(pt, child); subb++) {
+                    if (node_child(pt, child, subb) != FS_PTREE_NULL_NODE) {
+                        subn = node_child(pt, child, subb);
 
                         break;
                     }
                 }
                 if (subn != FS_PTREE_NULL_NODE) {
-                    fs_ptree_free_node(pt, no->branch[b]);
-                    no->branch[b] = subn;
+                    fs_ptree_free_node(pt, child);
+                    node_set(pt, n, b, subn);
                 } else {
                     fs_error(LOG_CRIT, "tried to merge nodes, but no children were available");
                 }
@@ -574,33 +1663,33 @@ static enum recurse_action remove_all_recurse(fs_ptree *pt, fs_rid pair[2], node
 
 static enum recurse_action collapse_by_pk_recurse(fs_ptree *pt, fs_rid pk, fs_index_node n, int level)
 {
-    node *no = node_ref(pt, n);
-    int b = PK_BRANCH(pk, level);
-    if (no->branch[b] == FS_PTREE_NULL_NODE) {
+    const int b = node_find(pt, n, pk, level);
+    const nodeid child = node_child(pt, n, b);
+    if (child == FS_PTREE_NULL_NODE) {
         /* dead end, do nothing */
 
         return NONE;
-    } else if (IS_LEAF(no->branch[b])) {
-        leaf *lref = LEAF_REF(pt, no->branch[b]);
+    } else if (IS_LEAF(child)) {
+        leaf *lref = LEAF_REF(pt, child);
         if (lref->length == 0 && lref->block == 0) {
-            fs_ptree_free_leaf(pt, no->branch[b]);
-            no->branch[b] = FS_PTREE_NULL_NODE;
+            fs_ptree_free_leaf(pt, child);
+            node_clear(pt, n, b);
         } else {
             fs_error(LOG_ERR, "hit an unexpected non-empty leaf recursing pk %016llx in %s", pk, pt->filename);
         }
     } else {
-        enum recurse_action action = collapse_by_pk_recurse(pt, pk, no->branch[b], level+1);
+        enum recurse_action action = collapse_by_pk_recurse(pt, pk, child, level+1);
         if (action == CULL) {
-            fs_ptree_free_node(pt, no->branch[b]);
-            no->branch[b] = FS_PTREE_NULL_NODE;
+            fs_ptree_free_node(pt, child);
+            node_clear(pt, n, b);
         } else if (action == MERGE) {
 	    /* MERGE not currently implemented, harmless, but less efficient
              * than it could be */
         }
     }
     int branches = 0;
-    for (int c=0; c<FS_PTREE_BRANCHES; c++) {
-        if (no->branch[c] != FS_PTREE_NULL_NODE) branches++;
+    for (int c=0; c<node_positions(pt, n); c++) {
+        if (node_child(pt, n, c) != FS_PTREE_NULL_NODE) branches++;
     }
     if (branches == 0) {
         return CULL;
@@ -611,7 +1700,7 @@ static enum recurse_action collapse_by_pk_recurse(fs_ptree *pt, fs_rid pk, fs_in
 
 static int collapse_by_pk(fs_ptree *pt, fs_rid pk)
 {
-    collapse_by_pk_recurse(pt, pk, FS_PTREE_ROOT_NODE, 0);
+    collapse_by_pk_recurse(pt, pk, pt->root, 0);
     
     return 0;
 }
@@ -626,7 +1715,8 @@ int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2])
     if (!pair) return 1;
 
     int removed = 0;
-    remove_all_recurse(pt, pair, FS_PTREE_ROOT_NODE, &removed);
+    remove_all_recurse(pt, pair, pt->root, &removed);
+    /* the generation moved on with each leaf */
     pt->header->count -= removed;
 
     if (removed) {
@@ -657,14 +1747,12 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models)
         return 1;
     }
 
-    int removed = 0;
-    fs_row_id newblock = fs_ptable_remove_pair(pt->table, lref->block, pair, &removed, models);
-    if (lref->block != newblock) {
-        lref->block = newblock;
-    }
+    int removed = leaf_remove_pair(pt, lid, pair, models);
     if (removed) {
         lref->length -= removed;
         pt->header->count -= removed;
+        pt->header->generation++;
+        frozen_log(pt, pk);
         if (lref->length == 0) {
             collapse_by_pk(pt, pk);
 #if 0
@@ -691,6 +1779,98 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models)
     return 1;
 }
 
+/* move a rev=1 iterator forward to the first pair whose first column is >=
+ * it->pair[0], skipping whole blocks where possible */
+static void it_seek(fs_ptree_it *it)
+{
+    while (it->block) {
+        block *bl = BLOCK_REF(it->pt, it->block);
+        if (bl->length && BLOCK_COL(bl, 0)[bl->length-1] >= it->pair[0]) {
+            it->pos = block_lower_bound(bl, it->pair[0]);
+
+            return;
+        }
+        it->block = bl->next;
+        it->pos = 0;
+    }
+}
+
+/* fetch the next stored pair for the iterator, returns 0 when the leaf is
+ * exhausted */
+static int it_fetch(fs_ptree_it *it, fs_rid row[2])
+{
+    if (!IS_BLOCKS(it->pt)) {
+        /* rows in packed ptables hold several pairs, so we decode a row at a
+         * time and use pos to step through it */
+        if (it->pos >= it->row_length) {
+            if (!it->block) return 0;
+            it->row_length = fs_ptable_get_rows(it->pt->table, it->block, it->row);
+            it->block = fs_ptable_get_next(it->pt->table, it->block);
+            it->pos = 0;
+            if (it->row_length == 0) return 0;
+        }
+        row[0] = it->row[it->pos][0];
+        row[1] = it->row[it->pos][1];
+        (it->pos)++;
+
+        return 1;
+    }
+
+    while (it->block) {
+        block *bl = BLOCK_REF(it->pt, it->block);
+        if (it->pos < bl->length) {
+            row[0] = BLOCK_COL(bl, 0)[it->pos];
+            row[1] = BLOCK_COL(bl, 1)[it->pos];
+            (it->pos)++;
+
+            return 1;
+        }
+        it->block = bl->next;
+        it->pos = 0;
+    }
+
+    return 0;
+}
+
+/* in rev=1 trees pairs are sorted, so once we're past a bound first column
+ * there's nothing left to match */
+static inline int it_past_end(fs_ptree_it *it, fs_rid row[2])
+{
+    return IS_BLOCKS(it->pt) && it->pair[0] != FS_RID_NULL &&
+           row[0] > it->pair[0];
+}
+
+/* the frozen copy can be used as long as every change to the tree since has
+ * been logged, and then only for the pks that haven't changed */
+static inline int frozen_valid(fs_ptree *pt)
+{
+    return pt->frozen_run &&
+           fs_frozen_run_current(pt->frozen, pt->frozen_run, pt->header->generation);
+}
+
+static inline int frozen_valid_for(fs_ptree *pt, fs_rid pk)
+{
+    return frozen_valid(pt) && !fs_frozen_changed(pt->frozen, pt->frozen_run, pk);
+}
+
+static void frozen_log(fs_ptree *pt, fs_rid pk)
+{
+    if (pt->frozen_run) {
+        fs_frozen_log_change(pt->frozen, pt->frozen_run, pk, pt->header->generation);
+    }
+}
+
+void fs_ptree_set_frozen(fs_ptree *pt, fs_frozen *fz, const fs_frozen_run *run)
+{
+    pt->frozen = fz;
+    pt->frozen_run = run;
+}
+
+uint64_t fs_ptree_generation(fs_ptree *pt)
+{
+    return pt->header->generation;
+}
+
 fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
 {
     if (!pt) {
@@ -699,6 +1879,25 @@ fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
         return NULL;
     }
 
+    /* most subjects don't have any given predicate, so this saves a walk
+     * down the tree for each of them */
+    fs_bloom *bloom = bloom_current(pt);
+    if (bloom && !fs_bloom_test(bloom, pk)) {
+        return NULL;
+    }
+    if (frozen_valid_for(pt, pk)) {
+        fs_frozen_it *fit = fs_frozen_search(pt->frozen, pt->frozen_run, pk, pair);
+        if (!fit) {
+            return NULL;
+        }
+        fs_ptree_it *it = calloc(1, sizeof(fs_ptree_it));
+        it->pt = pt;
+        it->pk = pk;
+        it->frozen = fit;
+        it->length = fs_frozen_it_get_length(fit);
+
+        return it;
+    }
     nodeid lid = get_leaf(pt, pk);
     if (!lid) {
         return NULL;
@@ -710,6 +1909,9 @@ fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
     it->block = it->leaf->block;
     it->pair[0] = pair[0];
     it->pair[1] = pair[1];
+    if (IS_BLOCKS(pt) && pair[0] != FS_RID_NULL) {
+        it_seek(it);
+    }
 
     return it;
 }
@@ -731,21 +1933,33 @@ int fs_ptree_it_next(fs_ptree_it *it, fs_rid pair[2])
 
     (it->step)++;
 
-    while (it->block) {
-        int matched = 0;
-        fs_rid row[2];
-        fs_ptable_get_row(it->pt->table, it->block, row);
+    if (it->frozen) {
+        fs_rid row[3];
+        if (!fs_frozen_it_next(it->frozen, row)) {
+            return 0;
+        }
+        pair[0] = row[1];
+        pair[1] = row[2];
+
+        return 1;
+    }
+
+    fs_rid row[2];
+    while (it_fetch(it, row)) {
+        if (it_past_end(it, row)) {
+            it->block = 0;
+
+            return 0;
+        }
         if ((it->pair[0] == FS_RID_NULL ||
              it->pair[0] == row[0]) &&
             (it->pair[1] == FS_RID_NULL ||
              it->pair[1] == row[1])) {
             pair[0] = row[0];
             pair[1] = row[1];
-            matched = 1;
-        }
-        it->block = fs_ptable_get_next(it->pt->table, it->block);
 
-        if (matched) return 1;
+            return 1;
+        }
     }
 
     return 0;
@@ -763,9 +1977,17 @@ fs_ptree_it *fs_ptree_traverse(fs_ptree *pt, fs_rid mrid)
     fs_ptree_it *it = calloc(1, sizeof(fs_ptree_it));
     it->pt = pt;
     it->traverse = 1;
+    if (frozen_valid(pt)) {
+        it->frozen = fs_frozen_traverse(pt->frozen, pt->frozen_run, mrid);
+        if (!fs_frozen_any_changed(pt->frozen, pt->frozen_run)) {
+            return it;
+        }
+        /* the copy skips the changed pks, the tree walk after it gets them */
+        it->changed_only = 1;
+    }
     it->stack = malloc(sizeof(tree_pos));
     it->pair[0] = mrid;
-    it->stack->node = FS_PTREE_ROOT_NODE;
+    it->stack->node = pt->root;
     it->stack->branch = 0;
     it->stack->next = NULL;
 
@@ -774,42 +1996,67 @@ fs_ptree_it *fs_ptree_traverse(fs_ptree *pt, fs_rid mrid)
 
 int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4])
 {
+    if (it->frozen) {
+        fs_rid row[3];
+        if (fs_frozen_it_next(it->frozen, row)) {
+            quad[0] = row[1];
+            quad[1] = row[0];
+            quad[3] = row[2];
+
+            return 1;
+        }
+        fs_frozen_it_free(it->frozen);
+        it->frozen = NULL;
+    }
+
     top:;
-    while (it->block) {
-        int matched = 0;
-        fs_rid row[2];
-        fs_ptable_get_row(it->pt->table, it->block, row);
+    fs_rid row[2];
+    while (it_fetch(it, row)) {
+        if (it_past_end(it, row)) {
+            it->block = 0;
+
+            break;
+        }
         if ((it->pair[0] == FS_RID_NULL ||
              it->pair[0] == row[0])) {
             quad[0] = row[0];
             quad[1] = it->pk;
             /* don't fill out the predicate */
             quad[3] = row[1];
-            matched = 1;
-        }
-        it->block = fs_ptable_get_next(it->pt->table, it->block);
 
-        if (matched) return 1;
+            return 1;
+        }
     }
 
     if (!it->stack) return 0;
 
     it->block = 0;
     tree_pos *pos = it->stack;
-    node *no = node_ref(it->pt, pos->node);
-    for (int b=pos->branch; b<FS_PTREE_BRANCHES; b++) {
-        if (no->branch[b] == FS_PTREE_NULL_NODE) {
+    const int positions = node_positions(it->pt, pos->node);
+    for (int b=pos->branch; b<positions; b++) {
+        const nodeid child = node_child(it->pt, pos->node, b);
+        if (child == FS_PTREE_NULL_NODE) {
             /* dead end, do nothing */
-        } else if (IS_LEAF(no->branch[b])) {
-            leaf *l = LEAF_REF(it->pt, no->branch[b]);
+        } else if (IS_LEAF(child)) {
+            leaf *l = LEAF_REF(it->pt, child);
+            if (it->changed_only &&
+                !fs_frozen_changed(it->pt->frozen, it->pt->frozen_run, l->pk)) {
+                /* the frozen copy had these */
+                continue;
+            }
             it->block = l->block;
+            it->pos = 0;
+            it->row_length = 0;
             it->pk = l->pk;
             pos->branch = b+1;
+            if (IS_BLOCKS(it->pt) && it->pair[0] != FS_RID_NULL) {
+                it_seek(it);
+            }
 
             goto top;
         } else {
             tree_pos *newpos = malloc(sizeof(tree_pos));
-            newpos->node = no->branch[b];
+            newpos->node = child;
             newpos->branch = 0;
             newpos->next = pos->next;
             pos->next = newpos;
@@ -824,7 +2071,24 @@ int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4])
 
 void fs_ptree_it_free(fs_ptree_it *it)
 {
-    if (it) free(it);
+    if (!it) return;
+
+    fs_frozen_it_free(it->frozen);
+    free(it);
+}
+
+unsigned long long fs_ptree_estimate(fs_ptree *pt, fs_rid pk)
+{
+    fs_bloom *bloom = bloom_current(pt);
+    if (bloom && !fs_bloom_test(bloom, pk)) {
+        return 0;
+    }
+    if (frozen_valid_for(pt, pk)) {
+        return fs_frozen_estimate(pt->frozen, pt->frozen_run, pk);
+    }
+    nodeid lid = get_leaf(pt, pk);
+
+    return lid ? LEAF_REF(pt, lid)->length : 0;
 }
 
 int fs_ptree_count(fs_ptree *pt)
@@ -844,6 +2108,14 @@ int fs_ptree_unlink(fs_ptree *pt)
 
         return 1;
     }
+    if (pt->fd == -1) {
+        pt->header->id = 0;
+
+        return 0;
+    }
+    char *bloom = g_strdup_printf("%s.bloom", pt->filename);
+    unlink(bloom);
+    g_free(bloom);
 
     return unlink(pt->filename);
 }
@@ -860,12 +2132,18 @@ int fs_ptree_close(fs_ptree *pt)
 
         return 1;
     }
-    if (munmap(pt->ptr, pt->file_length) == -1) {
-        fs_error(LOG_CRIT, "failed to unmap '%s'", pt->filename);
+    if (pt->bloom) {
+        fs_bloom_close(pt->bloom);
+    }
+    /* a packed tree's memory belongs to the pack */
+    if (pt->fd != -1) {
+        if (munmap(pt->ptr, pt->file_length) == -1) {
+            fs_error(LOG_CRIT, "failed to unmap '%s'", pt->filename);
+        }
+        flock(pt->fd, LOCK_UN);
+        close(pt->fd);
+        pt->fd = -1;
     }
-    flock(pt->fd, LOCK_UN);
-    close(pt->fd);
-    pt->fd = -1;
     g_free(pt->filename);
     pt->filename = NULL;
     free(pt);
@@ -873,74 +2151,230 @@ int fs_ptree_close(fs_ptree *pt)
     return 0;
 }
 
+/* copy the pairs of every leaf under n into dest, or if dest is NULL free the
+ * ptable chains of the leaves, returns the number of pairs */
+static long long migrate_recurse(fs_ptree *pt, nodeid n, fs_ptree *dest)
+{
+    long long count = 0;
+    for (int b=0; b<node_positions(pt, n); b++) {
+        const nodeid child = node_child(pt, n, b);
+        if (child == FS_PTREE_NULL_NODE) {
+            continue;
+        } else if (IS_NODE(child)) {
+            count += migrate_recurse(pt, child, dest);
+
+            continue;
+        }
+        leaf *l = LEAF_REF(pt, child);
+        if (!dest) {
+            if (l->block) {
+                fs_ptable_remove_chain(pt->table, l->block);
+            }
+
+            continue;
+        }
+        fs_ptree_it it;
+        memset(&it, 0, sizeof(it));
+        it.pt = pt;
+        it.block = l->block;
+        fs_rid pair[2];
+        while (it_fetch(&it, pair)) {
+            fs_ptree_add(dest, l->pk, pair, 0);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int fs_ptree_migrate(const char *filename, fs_ptable *chain, int revision, int compact)
+{
+    if (revision < FS_PTREE_REVISION_CHAINS || revision > FS_PTREE_REVISION_WIDE) {
+        fs_error(LOG_ERR, "unknown ptree revision %d", revision);
+
+        return 1;
+    }
+    fs_ptree *pt = fs_ptree_open_filename(filename, O_RDWR, chain);
+    if (!pt) {
+        return 1;
+    }
+    if (pt->header->revision == revision && !compact) {
+        fs_ptree_close(pt);
+
+        return 0;
+    }
+    if (!chain && (!IS_BLOCKS(pt) || revision == FS_PTREE_REVISION_CHAINS)) {
+        fs_error(LOG_ERR, "migrating %s needs the ptable", filename);
+        fs_ptree_close(pt);
+
+        return 1;
+    }
+
+    char *tmp = g_strdup_printf("%s.migrate", filename);
+    fs_ptree *dest = fs_ptree_open_filename_revision(tmp, O_RDWR | O_CREAT | O_TRUNC, chain, revision);
+    if (!dest) {
+        g_free(tmp);
+        fs_ptree_close(pt);
+
+        return 1;
+    }
+    long long count = migrate_recurse(pt, pt->root, dest);
+    if (count != pt->header->count) {
+        fs_error(LOG_WARNING, "%s: header says %lld pairs, copied %lld",
+                 filename, (long long)pt->header->count, count);
+    }
+    /* if the pairs came through unchanged a frozen copy of the tree is still
+     * good, otherwise make sure it looks stale */
+    dest->header->generation = pt->header->generation +
+                               (dest->header->count != pt->header->count);
+    fs_ptree_close(dest);
+    if (rename(tmp, filename) == -1) {
+        fs_error(LOG_ERR, "failed to rename %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        g_free(tmp);
+        fs_ptree_close(pt);
+
+        return 1;
+    }
+    /* the new tree's filter belongs with it, if it's missing the tree will
+     * rebuild one when it's next opened */
+    char *tmp_bloom = g_strdup_printf("%s.bloom", tmp);
+    char *bloom = g_strdup_printf("%s.bloom", filename);
+    if (rename(tmp_bloom, bloom) == -1) {
+        unlink(bloom);
+    }
+    g_free(bloom);
+    g_free(tmp_bloom);
+    g_free(tmp);
+    /* the old tree is still mapped, so once the new one is in place we can
+     * release any rows it had in the shared ptable */
+    if (!IS_BLOCKS(pt)) {
+        migrate_recurse(pt, pt->root, NULL);
+    }
+    fs_ptree_close(pt);
+
+    return 0;
+}
+
 struct ptree_stats {
     int count;
     int nodes;
     int leaves;
     int deadends;
+    int positions;
 };
 
+/* check that the block chain of leaf lid is sorted and well formed, returns
+ * the number of pairs found */
+static int check_blocks(fs_ptree *pt, FILE *out, nodeid lid)
+{
+    int count = 0;
+    int blocks = 0;
+    fs_rid last[2] = { 0, 0 };
+    for (uint32_t b = LEAF_REF(pt, lid)->block; b; b = BLOCK_REF(pt, b)->next) {
+        block *bl = BLOCK_REF(pt, b);
+        if (bl->cls < FS_PTREE_BLOCK_MIN_CLASS || bl->cls > FS_PTREE_BLOCK_MAX_CLASS) {
+            fprintf(out, "ERROR: block %08x has bad class %d\n", b, bl->cls);
+
+            break;
+        }
+        if (bl->length == 0 || bl->length > BLOCK_CAPACITY(bl->cls)) {
+            fprintf(out, "ERROR: block %08x has length %d, capacity %d\n", b, bl->length, BLOCK_CAPACITY(bl->cls));
+        }
+        for (int i=0; i<bl->length; i++) {
+            if (count && pair_cmp(last[0], last[1], BLOCK_COL(bl, 0)[i], BLOCK_COL(bl, 1)[i]) > 0) {
+                fprintf(out, "ERROR: block %08x is out of order at %d\n", b, i);
+            }
+            last[0] = BLOCK_COL(bl, 0)[i];
+            last[1] = BLOCK_COL(bl, 1)[i];
+            count++;
+        }
+        if (++blocks > pt->header->block_count) {
+            fprintf(out, "ERROR: probable loop in blocks of leaf %08x\n", lid);
+
+            break;
+        }
+    }
+
+    return count;
+}
+
 static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct ptree_stats *stats, FILE *out, int verbosity)
 {
     unsigned int len = 0;
-    node *no = node_ref(pt, n);
     int branches = 0;
     int leaves = 0;
-    for (int b=0; b<FS_PTREE_BRANCHES; b++) {
-        sprintf(buffer+pos, "%x", b);
-        if (no->branch[b] == FS_PTREE_NULL_NODE) {
-            (stats->deadends)++;
-        } else if (IS_LEAF(no->branch[b])) {
+    /* rev=2 nodes take a byte of the key, so need two digits */
+    const int width = IS_WIDE(pt) ? 2 : 1;
+    const int positions = node_positions(pt, n);
+    stats->positions += IS_WIDE(pt) ? wnode_capacity[WNODE_REF(pt, n)->kind] : positions;
+    for (int b=0; b<positions; b++) {
+        const nodeid child = node_child(pt, n, b);
+        sprintf(buffer+pos, "%0*x", width, node_key(pt, n, b));
+        if (child == FS_PTREE_NULL_NODE) {
+            if (!IS_WIDE(pt)) (stats->deadends)++;
+        } else if (IS_LEAF(child)) {
             branches++;
             leaves++;
             (stats->leaves)++;
-            buffer[pos+1] ='\0';
+            buffer[pos+width] ='\0';
             fprintf(out, "%-32s [B%08x, %016llx x %d]\n", buffer,
-                    LEAF_REF(pt, no->branch[b])->block,
-                    LEAF_REF(pt, no->branch[b])->pk,
-                    LEAF_REF(pt, no->branch[b])->length);
-            if (pt->table) {
+                    LEAF_REF(pt, child)->block,
+                    LEAF_REF(pt, child)->pk,
+                    LEAF_REF(pt, child)->length);
+            if (IS_BLOCKS(pt)) {
+                int check_len = check_blocks(pt, out, child);
+                if (LEAF_REF(pt, child)->length != check_len) {
+                    fprintf(out, "ERROR: tree leaf has length %d, but blocks hold %d\n", LEAF_REF(pt, child)->length, check_len);
+                }
+                if (LEAF_REF(pt, child)->length == 0) {
+                    fprintf(out, "ERROR: tree leaf has 0 length, should have been colected\n");
+                }
+            } else if (pt->table) {
                 int check_len = 0;
-                fs_ptable_check_consistency(pt->table, out, no->branch[b], LEAF_REF(pt, no->branch[b])->block, &check_len);
-                if (LEAF_REF(pt, no->branch[b])->length != check_len) {
-                    fprintf(out, "ERROR: tree leaf has length %d, but consistency check says %d\n", LEAF_REF(pt, no->branch[b])->length, check_len);
+                fs_ptable_check_consistency(pt->table, out, child, LEAF_REF(pt, child)->block, &check_len);
+                if (LEAF_REF(pt, child)->length != check_len) {
+                    fprintf(out, "ERROR: tree leaf has length %d, but consistency check says %d\n", LEAF_REF(pt, child)->length, check_len);
                 }
-                if (LEAF_REF(pt, no->branch[b])->length == 0) {
-                    if (LEAF_REF(pt, no->branch[b])->block != 0) {
+                if (LEAF_REF(pt, child)->length == 0) {
+                    if (LEAF_REF(pt, child)->block != 0) {
                         fprintf(out, "ERROR: tree leaf has 0 length, but block is non-zero\n");
                     } else {
                         fprintf(out, "ERROR: tree leaf has 0 length, should have been colected\n");
                     }
-                } else if (LEAF_REF(pt, no->branch[b])->length < 0) {
-                    fprintf(out, "ERROR: tree node length is %d\n", LEAF_REF(pt, no->branch[b])->length < 0);
-                } else if (LEAF_REF(pt, no->branch[b])->block == 0) {
+                } else if (LEAF_REF(pt, child)->length < 0) {
+                    fprintf(out, "ERROR: tree node length is %d\n", LEAF_REF(pt, child)->length < 0);
+                } else if (LEAF_REF(pt, child)->block == 0) {
                     fprintf(out, "ERROR: tree node references block zero, but has non-zero length\n");
-                } else if ((len = fs_ptable_chain_length(pt->table, LEAF_REF(pt, no->branch[b])->block, LEAF_REF(pt, no->branch[b])->length + 100)) != LEAF_REF(pt, no->branch[b])->length) {
-                    if (LEAF_REF(pt, no->branch[b])->length + 101 == len) {
+                } else if ((len = fs_ptable_chain_length(pt->table, LEAF_REF(pt, child)->block, LEAF_REF(pt, child)->length + 100)) != LEAF_REF(pt, child)->length) {
+                    if (LEAF_REF(pt, child)->length + 101 == len) {
                         fprintf(out, "ERROR: probable loop in table, tree node length %d, table length > %d\n",
-                            LEAF_REF(pt, no->branch[b])->length,
+                            LEAF_REF(pt, child)->length,
                             len);
                     } else {
                         fprintf(out, "ERROR: tree node length %d != table length %d\n",
-                            LEAF_REF(pt, no->branch[b])->length,
+                            LEAF_REF(pt, child)->length,
                             len);
                     }
                 }
             }
-            stats->count += LEAF_REF(pt, no->branch[b])->length;
+            stats->count += LEAF_REF(pt, child)->length;
             for (int c=0; c<pos; c++) {
                 buffer[c] = '.';
             }
         } else {
             (stats->nodes)++;
             branches++;
-            recurse_print(pt, no->branch[b], buffer, pos+1, stats, out, verbosity);
+            recurse_print(pt, child, buffer, pos+width, stats, out, verbosity);
         }
     }
-    if (branches == 1 && leaves == 1 && pos > 2 && n != FS_PTREE_ROOT_NODE) {
+    if (IS_WIDE(pt)) {
+        stats->deadends += wnode_capacity[WNODE_REF(pt, n)->kind] - branches;
+    }
+    if (branches == 1 && leaves == 1 && pos > 2 && n != pt->root) {
         fprintf(out, "ERROR: node %08x has 1 leaf at depth %d, should have "
                      "been merged up\n", n, pos);
-    } else if (branches == 0 && n != FS_PTREE_ROOT_NODE) {
+    } else if (branches == 0 && n != pt->root) {
         fprintf(out, "ERROR: node %08x has 0 branches at depth %d, should "
                      "have been culled\n", n, pos);
     }
@@ -948,16 +2382,31 @@ static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct
 
 void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
 {
-    fprintf(out, "ptree: %s\n", pt->filename);
+    fprintf(out, "ptree: %s%s\n", pt->filename, pt->fd == -1 ? " (packed)" : "");
     fprintf(out, "nodes: %d/%d\n", pt->header->node_count, pt->header->node_alloc);
     fprintf(out, "leaves: %d/%d\n", pt->header->leaf_count, pt->header->leaf_alloc);
     fprintf(out, "rows:    %lld\n", (long long)pt->header->count);
+    if (IS_BLOCKS(pt)) {
+        fprintf(out, "blocks:  %d\n", pt->header->block_count);
+    }
+    if (pt->frozen_run) {
+        fprintf(out, "frozen:  %s\n", frozen_valid(pt) ? "yes" : "stale");
+    }
+    if (pt->bloom) {
+        fprintf(out, "bloom:   %lld keys, %lld bytes\n",
+                (long long)fs_bloom_entries(pt->bloom),
+                (long long)fs_bloom_size(pt->bloom));
+    }
     fprintf(out, "\n");
 
     char buffer[256];
     /* tree walk doesn't count the root, or null nodes and leaves */
-    struct ptree_stats stats = { 0, 2, 2, 0 };
-    recurse_print(pt, FS_PTREE_ROOT_NODE, buffer, 0, &stats, out, verbosity);
+    struct ptree_stats stats = { 0, 2, 2, 0, 0 };
+    if (IS_WIDE(pt)) {
+        /* there's no null node in rev=2 trees */
+        stats.nodes = 1;
+    }
+    recurse_print(pt, pt->root, buffer, 0, &stats, out, verbosity);
     int free_leaves = 0;
     int free_nodes = 0;
     nodeid n = pt->header->leaf_free;
@@ -966,7 +2415,7 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
         leaf *lr = LEAF_REF(pt, n);
         n = lr->block;
     }
-    n = pt->header->node_free;
+    n = IS_WIDE(pt) ? 0 : pt->header->node_free;
     while (n) {
         free_nodes++;
         node *nr = NODE_REF(pt, n);
@@ -977,7 +2426,16 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
     fprintf(out, "leaves:       %d\n", stats.leaves);
     fprintf(out, "freed nodes:  %d\n", free_nodes);
     fprintf(out, "freed leaves: %d\n", free_leaves);
-    fprintf(out, "deadends:     %d (%d%%)\n", stats.deadends, 100 * stats.deadends / (stats.nodes * FS_PTREE_BRANCHES));
+    if (IS_BLOCKS(pt)) {
+        for (int c=FS_PTREE_BLOCK_MIN_CLASS; c<=FS_PTREE_BLOCK_MAX_CLASS; c++) {
+            int free_blocks = 0;
+            for (uint32_t b = pt->header->block_free[c]; b; b = BLOCK_REF(pt, b)->next) {
+                free_blocks++;
+            }
+            fprintf(out, "freed blocks: %d x %d pairs\n", free_blocks, BLOCK_CAPACITY(c));
+        }
+    }
+    fprintf(out, "deadends:     %d (%d%%)\n", stats.deadends, 100 * stats.deadends / stats.positions);
     if (stats.count != pt->header->count) {
         fprintf(out, "ERROR: number of rows in header (%d) does not match data (%d) in %s\n", (int)pt->header->count, stats.count, pt->filename);
     }
@@ -985,7 +2443,12 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
         fprintf(out, "ERROR: %d leaves have been leaked\n", 
                      pt->header->leaf_count - free_leaves - stats.leaves);
     }
-    if (stats.nodes + free_nodes != pt->header->node_count + 1) {
+    if (IS_WIDE(pt)) {
+        if (stats.nodes != pt->header->node_count) {
+            fprintf(out, "ERROR: %d nodes have been leaked\n",
+                         pt->header->node_count - stats.nodes);
+        }
+    } else if (stats.nodes + free_nodes != pt->header->node_count + 1) {
         fprintf(out, "ERROR: %d nodes have been leaked\n", 
                      pt->header->node_count + 1 - free_nodes - stats.nodes);
     }
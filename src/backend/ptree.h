@@ -3,18 +3,58 @@
 
 #include "backend.h"
 #include "ptable.h"
+#include "frozen.h"
 
 typedef struct _fs_ptree fs_ptree;
 typedef struct _fs_ptree_it fs_ptree_it;
 typedef uint32_t fs_ptree_leafid;
 
+/* revisions of the on disk layout, see ptree.c */
+#define FS_PTREE_REVISION_CHAINS 0
+#define FS_PTREE_REVISION_BLOCKS 1
+#define FS_PTREE_REVISION_WIDE   2
+
 fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptable *chain);
 
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain);
+/* as above, but new files are created with the given revision */
+fs_ptree *fs_ptree_open_filename_revision(const char *filename, int flags, fs_ptable *chain, int revision);
+
+/* open a small tree held in length bytes of a pack file at ptr, see ptpack.h,
+ * if create is set an empty tree is laid out there. The tree is moved to
+ * filename when it outgrows the space, returns NULL if that's already
+ * happened */
+fs_ptree *fs_ptree_open_packed(const char *filename, void *ptr, size_t length, int flags, fs_ptable *chain, int create);
+
+/* true if the tree is still held in a pack file */
+int fs_ptree_is_packed(fs_ptree *pt);
+
+/* true if the tree's leaves are chains in the shared ptable, rev=0 */
+int fs_ptree_uses_table(fs_ptree *pt);
+
+/* rewrite the tree in filename with the given revision, chain is the ptable
+ * used by the old or new tree, if either is rev=0. A tree that's already in
+ * that revision is left alone unless compact is set. Nodes grow to fit their
+ * children but never shrink when deletes empty them, rewriting the tree
+ * sizes them for what's left */
+int fs_ptree_migrate(const char *filename, fs_ptable *chain, int revision, int compact);
 
 int fs_ptree_write_header(fs_ptree *pt);
 
+/* replace the tree's bloom filter of pks with a freshly sized one, should be
+ * called after anything that frees a lot of leaves */
+int fs_ptree_bloom_rebuild(fs_ptree *pt);
+
+/* move the tree's ptable chains for a running ptable vacuum, returns the
+ * number of chains moved */
+int fs_ptree_vacuum(fs_ptree *pt);
+
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force);
+/* add count pairs for pk, the pairs must be sorted on pair[0] then pair[1],
+ * distinct and not already in the tree, as when loading a sorted run into a
+ * new tree. The pairs are written to fresh blocks or rows without the checks
+ * fs_ptree_add() makes, returns non 0 if some couldn't be added */
+int fs_ptree_add_run(fs_ptree *pt, fs_rid pk, fs_rid pairs[][2], int count);
 int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models);
 int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2]);
 
@@ -36,6 +76,16 @@ int fs_ptree_close(fs_ptree *pt);
 
 int fs_ptree_count(fs_ptree *pt);
 
+/* cheap estimate of the number of pairs for pk */
+unsigned long long fs_ptree_estimate(fs_ptree *pt, fs_rid pk);
+
+/* changes every time pairs are added or removed */
+uint64_t fs_ptree_generation(fs_ptree *pt);
+
+/* serve searches and traversals from a frozen copy of the tree, for as long
+ * as the tree is unchanged since it was frozen */
+void fs_ptree_set_frozen(fs_ptree *pt, fs_frozen *fz, const fs_frozen_run *run);
+
 /* vi:set expandtab sts=4 sw=4: */
 
 #endif
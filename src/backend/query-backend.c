@@ -26,6 +26,7 @@
 #include <glib/gprintf.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
 
 #include "../common/timing.h"
 #include "../common/error.h"
@@ -33,6 +34,7 @@
 #include "backend.h"
 #include "backend-intl.h"
 #include "query-backend.h"
+#include "../common/server.h"
 
 #define TMP_SIZE 512
 
@@ -45,6 +47,22 @@ static int slot_bits[4] = {
     FS_BIND_OBJECT
 };
 
+/* rows looked at between checks that the request still has time */
+#define EXPIRY_STEPS 4096
+
+/* true once the request being served has run out of time or been
+ * cancelled, see fsp_request_expired(), after which it stays true */
+static int expired(int *steps)
+{
+    if (*steps < 0) return 1;
+    if ((++*steps & (EXPIRY_STEPS - 1)) == 0 && fsp_request_expired()) {
+	*steps = -1;
+	return 1;
+    }
+
+    return 0;
+}
+
 static fs_ptree_it *fs_backend_get_matches(fs_backend *be, fs_rid quad[4], int flags)
 {
     fs_ptree *pt = NULL;
@@ -222,8 +240,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 	ret[0] = fs_rid_vector_new(length);
 	int outpos = 0;
 	for (int i=0; i<length; i++) {
-	    fs_backend_ptree_limited_open(be, i);
-	    if (fs_ptree_count(be->ptrees_priv[i].ptree_s) > 0) {
+	    if (fs_backend_ptree_count(be, i, 0) > 0) {
 		ret[0]->data[outpos++] = be->ptrees_priv[i].pred;
 	    }
 	}
@@ -239,6 +256,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 	ret[i] = fs_rid_vector_new(0);
     }
     int count = 0;
+    int steps = 0;
 
     /* if the query looks like DISINTCT (_ _ p ?o) we can use a set to get a
      * cheap DISTINCT */
@@ -251,7 +269,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 	    fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, pv->data[0],
 			       FS_RID_NULL };
 	    fs_ptree_it *it = fs_ptree_traverse(pt, FS_RID_NULL);
-	    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+	    while (it && fs_ptree_traverse_next(it, quad) && count<limit && !expired(&steps)) {
 		if (!bind_same(quad, tobind)) continue;
 		if (!graph_ok(quad, tobind)) continue;
 		count++;
@@ -283,7 +301,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 		if (!tl) continue;
 		fs_rid triple[3];
 		fs_tlist_rewind(tl);
-		while (fs_tlist_next_value(tl, triple) && count < limit) {
+		while (fs_tlist_next_value(tl, triple) && count < limit && !expired(&steps)) {
 		    const fs_rid quad[4] =
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
@@ -297,7 +315,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 		fs_tbchain_it *it =
 		    fs_tbchain_new_iterator(be->model_list, model, mnode);
 		fs_rid triple[3];
-		while (fs_tbchain_it_next(it, triple) && count < limit) {
+		while (fs_tbchain_it_next(it, triple) && count < limit && !expired(&steps)) {
 		    const fs_rid quad[4] =
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
@@ -332,7 +350,7 @@ fs_error(LOG_INFO, "bind() branch");
 		    if (mvl) mrid = mv->data[m];
 		    else mrid = FS_RID_NULL;
 		    fs_ptree_it *it = fs_ptree_traverse(pt, mrid);
-		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+		    while (it && fs_ptree_traverse_next(it, quad) && count<limit && !expired(&steps)) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
 			count++;
@@ -357,7 +375,7 @@ fs_error(LOG_INFO, "bind() branch");
 		    if (mvl) mrid = mv->data[m];
 		    else mrid = FS_RID_NULL;
 		    fs_ptree_it *it = fs_ptree_traverse(pt, mrid);
-		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+		    while (it && fs_ptree_traverse_next(it, quad) && count<limit && !expired(&steps)) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
 			count++;
@@ -385,7 +403,7 @@ fs_error(LOG_INFO, "bind() branch");
 			    if (mvl) pair[0] = mv->data[m];
 			    if (ovl) pair[1] = ov->data[o];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 				const fs_rid quad[4] =
 				    { pair[0], pk, pv->data[0], pair[1] };
 				if (!bind_same(quad, tobind)) continue;
@@ -415,7 +433,7 @@ fs_error(LOG_INFO, "bind() branch");
 			if (mvl) pair[0] = mv->data[m];
 			if (ovl) pair[1] = ov->data[o];
 			fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 			    const fs_rid quad[4] =
 				{ pair[0], pk, pv->data[p], pair[1] };
 			    if (!bind_same(quad, tobind)) continue;
@@ -447,7 +465,7 @@ fs_error(LOG_INFO, "bind() branch");
 			    if (mvl) pair[0] = mv->data[m];
 			    if (svl) pair[1] = sv->data[s];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 				const fs_rid quad[4] = {
 				    pair[0], pair[1], pv->data[0], pk
 				};
@@ -475,7 +493,7 @@ fs_error(LOG_INFO, "bind() branch");
 			if (mvl) pair[0] = mv->data[m];
 			if (svl) pair[1] = sv->data[s];
 			fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 			    const fs_rid quad[4] = {
 				pair[0], pair[1], pv->data[p], pk
 			    };
@@ -508,7 +526,7 @@ fs_error(LOG_INFO, "bind() branch");
 			    if (mvl) pair[0] = mv->data[m];
 			    if (ovl) pair[1] = ov->data[o];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 				const fs_rid quad[4] =
 				    { pair[0], pk, be->ptrees_priv[p].pred, pair[1] };
 				if (!bind_same(quad, tobind)) continue;
@@ -539,7 +557,7 @@ fs_error(LOG_INFO, "bind() branch");
 			    if (mvl) pair[0] = mv->data[m];
 			    if (svl) pair[1] = sv->data[s];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
 				const fs_rid quad[4] =
 				    { pair[0], pair[1], be->ptrees_priv[p].pred, pk };
 				if (!bind_same(quad, tobind)) continue;
@@ -571,6 +589,677 @@ fs_error(LOG_INFO, "bind() branch");
     return ret;
 }
 
+fs_rid_vector **fs_bind_join(fs_backend *be, fs_segment segment,
+                             unsigned int tobind, int keyslots,
+                             fs_rid_vector *keys[4], fs_rid_vector *mv,
+                             fs_rid_vector *pv, int limit)
+{
+    const int by_subject = tobind & FS_BIND_BY_SUBJECT;
+    if (!(tobind & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT)) ||
+        (tobind & FS_BIND_BY_SUBJECT && tobind & FS_BIND_BY_OBJECT)) {
+	fs_error(LOG_ERR, "tried to join without a single s/o spec");
+
+	return NULL;
+    }
+    /* the slot that's the index key, and the one stored in the pairs */
+    const int pks = by_subject ? 1 : 3;
+    const int other = by_subject ? 3 : 1;
+    if (!(keyslots & slot_bits[pks])) {
+	fs_error(LOG_ERR, "tried to join without keys for the %s",
+                 by_subject ? "subject" : "object");
+
+	return NULL;
+    }
+    double then = fs_time();
+
+    limit = (limit == -1) ? INT_MAX : limit;
+
+    int cols = 0;
+    for (int i=0; i<4; i++) {
+	if (tobind & slot_bits[i]) {
+	    cols++;
+	}
+    }
+
+    fs_rid_vector **ret;
+    if (cols == 0) {
+	ret = calloc(1, sizeof(fs_rid_vector *));
+	limit = 1;
+    } else {
+	ret = calloc(cols, sizeof(fs_rid_vector *));
+    }
+    for (int i=0; i<cols; i++) {
+	ret[i] = fs_rid_vector_new(0);
+    }
+
+    fs_rid_vector *key[4] = { NULL, NULL, NULL, NULL };
+    for (int i=0; i<4; i++) {
+	if (keyslots & slot_bits[i]) key[i] = keys[i];
+    }
+    const int rows = key[pks]->length;
+    const int mvl = fs_rid_vector_length(mv);
+    const int pvl = fs_rid_vector_length(pv);
+    const int ml = key[0] || !mvl ? 1 : mvl;
+    /* with no predicates every tree is probed */
+    const int pl = key[2] ? 1 : pvl ? pvl : be->ptree_length;
+    int count = 0;
+    int steps = 0;
+
+    for (int r=0; r<rows && count<limit; r++) {
+	const fs_rid pk = key[pks]->data[r];
+	if (pk == FS_RID_NULL) continue;
+	/* skip repeated rows */
+	if (r > 0) {
+	    int same = 1;
+	    for (int i=0; i<4 && same; i++) {
+		if (key[i] && key[i]->data[r] != key[i]->data[r-1]) same = 0;
+	    }
+	    if (same) continue;
+	}
+	for (int p=0; p<pl && count<limit; p++) {
+	    fs_rid pred;
+	    fs_ptree *pt;
+	    if (key[2] || pvl) {
+		pred = key[2] ? key[2]->data[r] : pv->data[p];
+		pt = fs_backend_get_ptree(be, pred, !by_subject);
+	    } else {
+		fs_backend_ptree_limited_open(be, p);
+		pred = be->ptrees_priv[p].pred;
+		pt = by_subject ? be->ptrees_priv[p].ptree_s :
+				  be->ptrees_priv[p].ptree_o;
+	    }
+	    if (!pt) continue;
+	    for (int m=0; m<ml && count<limit; m++) {
+		fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
+		if (key[0]) pair[0] = key[0]->data[r];
+		else if (mvl) pair[0] = mv->data[m];
+		if (key[other]) pair[1] = key[other]->data[r];
+		fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
+		while (it && fs_ptree_it_next(it, pair) && count<limit && !expired(&steps)) {
+		    fs_rid quad[4] = { pair[0], pk, pred, pair[1] };
+		    if (!by_subject) {
+			quad[1] = pair[1];
+			quad[3] = pk;
+		    }
+		    if (!bind_same(quad, tobind)) continue;
+		    if (!graph_ok(quad, tobind)) continue;
+		    count++;
+		    bind_results(quad, tobind, ret);
+		}
+		fs_ptree_it_free(it);
+	    }
+	}
+    }
+
+    TIME("bind join");
+
+    be->out_time[segment].bind_count++;
+    be->out_time[segment].bind += fs_time() - then;
+
+    if (count == 0 && cols == 0) {
+	free(ret);
+
+	return NULL;
+    }
+
+    return ret;
+}
+
+/* the candidate subjects of a star, from the arm likely to match fewest: one
+ * with fixed objects is looked up in the O index, otherwise the smallest S
+ * index is scanned */
+static fs_rid_vector *star_subjects(fs_backend *be, unsigned int tobind,
+                                    fs_rid_vector *mv, int arm_count,
+                                    fs_star_arm *arms)
+{
+    const int mvl = fs_rid_vector_length(mv);
+    const int ml = mvl ? mvl : 1;
+    int best = -1;
+    long long best_count = 0;
+
+    for (int a=0; a<arm_count; a++) {
+	long long count;
+	if (arms[a].objects->length) {
+	    /* a guess, but nearly always fewer than a scan */
+	    count = -1;
+	} else {
+	    const int n = fs_backend_ptree_id(be, arms[a].predicate);
+	    if (n == -1) return fs_rid_vector_new(0);
+	    count = fs_backend_ptree_count(be, n, 0);
+	}
+	if (best == -1 || count < best_count) {
+	    best = a;
+	    best_count = count;
+	}
+    }
+
+    const fs_rid pred = arms[best].predicate;
+    fs_rid_set *set = fs_rid_set_new();
+    if (arms[best].objects->length) {
+	fs_ptree *pt = fs_backend_get_ptree(be, pred, 1);
+	for (int o=0; pt && o<arms[best].objects->length; o++) {
+	    const fs_rid obj = arms[best].objects->data[o];
+	    if (obj == FS_RID_NULL) continue;
+	    for (int m=0; m<ml; m++) {
+		fs_rid pair[2] = { mvl ? mv->data[m] : FS_RID_NULL,
+				   FS_RID_NULL };
+		fs_ptree_it *it = fs_ptree_search(pt, obj, pair);
+		while (it && fs_ptree_it_next(it, pair)) {
+		    fs_rid quad[4] = { pair[0], pair[1], pred, obj };
+		    if (!graph_ok(quad, tobind)) continue;
+		    fs_rid_set_add(set, pair[1]);
+		}
+		fs_ptree_it_free(it);
+	    }
+	}
+    } else {
+	fs_ptree *pt = fs_backend_get_ptree(be, pred, 0);
+	for (int m=0; pt && m<ml; m++) {
+	    fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, pred, FS_RID_NULL };
+	    fs_ptree_it *it = fs_ptree_traverse(pt, mvl ? mv->data[m] :
+						    FS_RID_NULL);
+	    while (it && fs_ptree_traverse_next(it, quad)) {
+		if (!graph_ok(quad, tobind)) continue;
+		fs_rid_set_add(set, quad[1]);
+	    }
+	    fs_ptree_it_free(it);
+	}
+    }
+
+    fs_rid_vector *subjects = fs_rid_vector_new(0);
+    fs_rid_vector_append_set(subjects, set);
+    fs_rid_set_free(set);
+    fs_rid_vector_sort(subjects);
+
+    return subjects;
+}
+
+fs_rid_vector **fs_bind_star(fs_backend *be, fs_segment segment,
+                             unsigned int tobind, fs_rid_vector *sv,
+                             fs_rid_vector *mv, int arm_count,
+                             fs_star_arm *arms, int limit)
+{
+    double then = fs_time();
+
+    limit = (limit == -1) ? INT_MAX : limit;
+
+    int cols = 1;
+    for (int a=0; a<arm_count; a++) {
+	if (arms[a].bind) cols++;
+    }
+    fs_rid_vector **ret = calloc(cols, sizeof(fs_rid_vector *));
+    for (int i=0; i<cols; i++) {
+	ret[i] = fs_rid_vector_new(0);
+    }
+    if (arm_count == 0) return ret;
+
+    /* if any predicate is missing nothing can match */
+    fs_ptree *pts[arm_count];
+    for (int a=0; a<arm_count; a++) {
+	pts[a] = fs_backend_get_ptree(be, arms[a].predicate, 0);
+	if (!pts[a]) return ret;
+    }
+
+    fs_rid_vector *subjects;
+    if (sv->length) {
+	subjects = sv;
+	fs_rid_vector_sort(subjects);
+	fs_rid_vector_uniq(subjects, 1);
+    } else {
+	subjects = star_subjects(be, tobind, mv, arm_count, arms);
+    }
+
+    const int mvl = fs_rid_vector_length(mv);
+    const int ml = mvl ? mvl : 1;
+    fs_rid_vector *matches[arm_count];
+    for (int a=0; a<arm_count; a++) {
+	matches[a] = fs_rid_vector_new(0);
+    }
+    int count = 0;
+    int steps = 0;
+
+    for (int s=0; s<subjects->length && count<limit && !expired(&steps); s++) {
+	const fs_rid subj = subjects->data[s];
+	int a;
+	/* the objects of each arm, in turn, stopping at an empty one */
+	for (a=0; a<arm_count; a++) {
+	    fs_rid_vector *ov = arms[a].objects;
+	    const int ol = ov->length ? ov->length : 1;
+	    fs_rid_vector_clear(matches[a]);
+	    for (int m=0; m<ml; m++) {
+		for (int o=0; o<ol; o++) {
+		    fs_rid pair[2] = { mvl ? mv->data[m] : FS_RID_NULL,
+				       ov->length ? ov->data[o] : FS_RID_NULL };
+		    fs_ptree_it *it = fs_ptree_search(pts[a], subj, pair);
+		    while (it && fs_ptree_it_next(it, pair)) {
+			fs_rid quad[4] = { pair[0], subj, arms[a].predicate,
+					   pair[1] };
+			if (!graph_ok(quad, tobind)) continue;
+			fs_rid_vector_append(matches[a], pair[1]);
+		    }
+		    fs_ptree_it_free(it);
+		}
+	    }
+	    if (matches[a]->length == 0) break;
+	}
+	if (a < arm_count) continue;
+
+	/* the rows are every combination of the arms' matches */
+	int pos[arm_count];
+	memset(pos, 0, sizeof(pos));
+	while (count < limit && !expired(&steps)) {
+	    int col = 0;
+	    fs_rid_vector_append(ret[col++], subj);
+	    for (a=0; a<arm_count; a++) {
+		if (arms[a].bind) {
+		    fs_rid_vector_append(ret[col++], matches[a]->data[pos[a]]);
+		}
+	    }
+	    count++;
+	    for (a=arm_count-1; a>=0; a--) {
+		if (++pos[a] < matches[a]->length) break;
+		pos[a] = 0;
+	    }
+	    if (a < 0) break;
+	}
+    }
+
+    for (int a=0; a<arm_count; a++) {
+	fs_rid_vector_free(matches[a]);
+    }
+    if (subjects != sv) {
+	fs_rid_vector_free(subjects);
+    }
+
+    TIME("bind star");
+
+    be->out_time[segment].bind_count++;
+    be->out_time[segment].bind += fs_time() - then;
+
+    return ret;
+}
+
+/* a term of a filter program, as sent by fsp_filter_add() */
+struct filter_term {
+    int op;
+    int column;
+    int cmp;
+    int negate;
+    unsigned int count;
+    const fs_rid *operands;
+    fs_rid_set *set;	/* the operands of FS_FILTER_IN and _ATTR_IN */
+};
+
+static void filter_terms_free(struct filter_term *terms, int count)
+{
+    for (int t=0; t<count; t++) {
+	if (terms[t].set) fs_rid_set_free(terms[t].set);
+    }
+    free(terms);
+}
+
+/* returns the number of terms in the program, or -1 if it's malformed */
+static int filter_parse(const unsigned char *code, unsigned int length,
+			int cols, struct filter_term **terms)
+{
+    struct filter_term *ret = NULL;
+    int count = 0;
+    unsigned int pos = 0;
+
+    while (pos < length) {
+	struct filter_term t;
+	if (length - pos < 8) goto malformed;
+	t.op = code[pos];
+	t.column = code[pos+1];
+	t.cmp = code[pos+2];
+	t.negate = code[pos+3] & FS_FILTER_NOT;
+	memcpy(&t.count, code + pos + 4, sizeof(t.count));
+	if (t.count > (length - pos - 8) / 8) goto malformed;
+	t.operands = (const fs_rid *) (code + pos + 8);
+	t.set = NULL;
+	pos += 8 + t.count * 8;
+
+	if (t.column >= cols) goto malformed;
+	switch (t.op) {
+	case FS_FILTER_IN:
+	case FS_FILTER_ATTR_IN:
+	    if (t.op == FS_FILTER_ATTR_IN && t.negate) goto malformed;
+	    t.set = fs_rid_set_new();
+	    for (int o=0; o<t.count; o++) {
+		fs_rid_set_add(t.set, t.operands[o]);
+	    }
+	    break;
+	case FS_FILTER_IS_URI:
+	case FS_FILTER_IS_BNODE:
+	case FS_FILTER_IS_LITERAL:
+	    if (t.count != 0) goto malformed;
+	    break;
+	case FS_FILTER_NUMBER:
+	case FS_FILTER_DATETIME:
+	    if (t.negate || t.cmp < FS_FILTER_LT || t.cmp > FS_FILTER_GT) {
+		goto malformed;
+	    }
+	    if (t.count != (t.op == FS_FILTER_NUMBER ?
+			    FS_FILTER_NUMBER_OPERANDS : 2)) {
+		goto malformed;
+	    }
+	    break;
+	default:
+	    goto malformed;
+	}
+	ret = realloc(ret, (count + 1) * sizeof(struct filter_term));
+	ret[count++] = t;
+	continue;
+
+      malformed:
+	fs_error(LOG_ERR, "malformed filter program");
+	filter_terms_free(ret, count);
+
+	return -1;
+    }
+    *terms = ret;
+
+    return count;
+}
+
+/* the literal's lexical value and attr, if it's held by this segment */
+static fs_resource *filter_resolve(fs_backend *be, fs_segment segment,
+				   fs_rid rid, fs_resource *res, int *state)
+{
+    if (*state == 0) {
+	*state = -1;
+	if (FS_IS_LITERAL(rid) &&
+	    FS_RID_SEGMENT(rid, be->segments) == segment) {
+	    res->lex = NULL;
+	    if (fs_resolve_rid(be, segment, rid, res) == 0 && res->lex) {
+		*state = 1;
+	    } else {
+		free(res->lex);
+	    }
+	}
+    }
+
+    return *state == 1 ? res : NULL;
+}
+
+/* true unless a and b are in the wrong order for cmp. Lexical values that
+ * the frontend compares exactly are compared here as doubles, so values
+ * that are too close to tell apart always pass */
+static int filter_compare(int cmp, double a, double b)
+{
+    double diff = a - b;
+    double scale = a < 0.0 ? -a : a;
+    if (b > scale) scale = b;
+    if (-b > scale) scale = -b;
+    if (scale < 1.0) scale = 1.0;
+    if ((diff < 0.0 ? -diff : diff) <= scale * 1e-9) return 1;
+
+    switch (cmp) {
+    case FS_FILTER_LT:
+    case FS_FILTER_LE:
+	return diff < 0.0;
+    case FS_FILTER_GE:
+    case FS_FILTER_GT:
+	return diff > 0.0;
+    }
+
+    return 0;
+}
+
+/* parses the lexical value of a literal with one of the numeric datatypes
+ * as the frontend would, returns false if it's not sure it can */
+static int filter_number_value(const struct filter_term *t,
+			       const fs_resource *res, double *value)
+{
+    const char *lex = res->lex;
+    char *end = NULL;
+
+    if (*lex == '\0') return 0;
+    if (res->attr == t->operands[1]) {
+	/* xsd:integer */
+	*value = strtoll(lex, &end, 10);
+
+	return *end == '\0';
+    } else if (res->attr == t->operands[2]) {
+	/* xsd:decimal, only the plain forms the frontend surely accepts */
+	int digits = 0, point = 0;
+	for (const char *c = lex; *c; c++) {
+	    if (*c >= '0' && *c <= '9') {
+		digits++;
+	    } else if (*c == '.' && !point) {
+		point = 1;
+	    } else if ((*c != '-' && *c != '+') || c != lex) {
+		return 0;
+	    }
+	}
+	if (digits == 0 || digits > 30) return 0;
+	*value = strtod(lex, &end);
+
+	return *end == '\0';
+    } else if (res->attr == t->operands[3] || res->attr == t->operands[4]) {
+	/* xsd:double and xsd:float */
+	*value = strtod(lex, &end);
+
+	return *end == '\0' && isfinite(*value);
+    }
+
+    return 0;
+}
+
+/* false if the value certainly fails the term, as the frontend would
+ * evaluate it */
+static int filter_term_keep(fs_backend *be, fs_segment segment,
+			    const struct filter_term *t, fs_rid rid,
+			    fs_resource *res, int *state)
+{
+    int keep;
+    fs_resource *r;
+
+    /* unbound values are left to the frontend */
+    if (rid == FS_RID_NULL) return 1;
+
+    switch (t->op) {
+    case FS_FILTER_IN:
+	keep = fs_rid_set_contains(t->set, rid);
+	break;
+    case FS_FILTER_IS_URI:
+	keep = FS_IS_URI(rid);
+	break;
+    case FS_FILTER_IS_BNODE:
+	keep = FS_IS_BNODE(rid);
+	break;
+    case FS_FILTER_IS_LITERAL:
+	keep = FS_IS_LITERAL(rid);
+	break;
+    case FS_FILTER_ATTR_IN:
+	/* lang() and datatype() are errors for URIs and bNodes */
+	if (FS_IS_URI_BN(rid)) return 0;
+	r = filter_resolve(be, segment, rid, res, state);
+
+	return r ? fs_rid_set_contains(t->set, r->attr) : 1;
+    case FS_FILTER_NUMBER: {
+	/* URIs and bNodes are never <=, >= or = to a number */
+	if (FS_IS_URI_BN(rid)) {
+	    return t->cmp == FS_FILTER_LT || t->cmp == FS_FILTER_GT;
+	}
+	double value, operand;
+	r = filter_resolve(be, segment, rid, res, state);
+	if (!r || !filter_number_value(t, r, &value)) return 1;
+	memcpy(&operand, t->operands, sizeof(operand));
+
+	return filter_compare(t->cmp, value, operand);
+    }
+    case FS_FILTER_DATETIME: {
+	if (FS_IS_URI_BN(rid)) {
+	    return t->cmp != FS_FILTER_LE && t->cmp != FS_FILTER_GE;
+	}
+	r = filter_resolve(be, segment, rid, res, state);
+	if (!r || r->attr != t->operands[1]) return 1;
+	time_t value;
+	if (!fs_time_from_iso8601(r->lex, &value) &&
+	    !fs_time_from_date(r->lex, &value)) {
+	    return 1;
+	}
+	const long long operand = (long long) t->operands[0];
+
+	switch (t->cmp) {
+	case FS_FILTER_LT:
+	    return value < operand;
+	case FS_FILTER_LE:
+	    return value <= operand;
+	case FS_FILTER_EQ:
+	    return value == operand;
+	case FS_FILTER_GE:
+	    return value >= operand;
+	case FS_FILTER_GT:
+	    return value > operand;
+	}
+
+	return 1;
+    }
+    default:
+	return 1;
+    }
+
+    return t->negate ? !keep : keep;
+}
+
+int fs_bind_filter(fs_backend *be, fs_segment segment,
+		   const unsigned char *code, unsigned int length,
+		   int cols, fs_rid_vector **bindings)
+{
+    double then = fs_time();
+
+    struct filter_term *terms = NULL;
+    const int count = filter_parse(code, length, cols, &terms);
+    if (count < 0) return 1;
+    if (count == 0 || cols == 0) {
+	free(terms);
+
+	return 0;
+    }
+
+    const int rows = bindings[0]->length;
+    fs_resource res[cols];
+    int state[cols];
+    int out = 0;
+
+    for (int row=0; row<rows; row++) {
+	int keep = 1;
+	for (int c=0; c<cols; c++) {
+	    state[c] = 0;
+	}
+	for (int t=0; t<count && keep; t++) {
+	    const int c = terms[t].column;
+	    keep = filter_term_keep(be, segment, terms + t,
+				    bindings[c]->data[row], res + c,
+				    state + c);
+	}
+	for (int c=0; c<cols; c++) {
+	    if (state[c] == 1) free(res[c].lex);
+	}
+	if (!keep) continue;
+	for (int c=0; c<cols; c++) {
+	    bindings[c]->data[out] = bindings[c]->data[row];
+	}
+	out++;
+    }
+    for (int c=0; c<cols; c++) {
+	bindings[c]->length = out;
+    }
+    filter_terms_free(terms, count);
+
+    TIME("bind filter");
+
+    be->out_time[segment].bind += fs_time() - then;
+
+    return 0;
+}
+
+struct group_row {
+    fs_rid col[4];
+};
+
+static int group_row_compare(const void *va, const void *vb)
+{
+    const struct group_row *a = va;
+    const struct group_row *b = vb;
+
+    for (int c=0; c<4; c++) {
+	if (a->col[c] > b->col[c]) return 1;
+	if (a->col[c] < b->col[c]) return -1;
+    }
+
+    return 0;
+}
+
+fs_rid_vector **fs_bind_group(fs_backend *be, fs_segment segment,
+			      unsigned int tobind,
+			      fs_rid_vector *mv, fs_rid_vector *sv,
+			      fs_rid_vector *pv, fs_rid_vector *ov)
+{
+    double then = fs_time();
+
+    int cols = 0;
+    for (int i=0; i<4; i++) {
+	if (tobind & slot_bits[i]) cols++;
+    }
+    /* something has to be bound to count the matches */
+    unsigned int flags = tobind & ~FS_BIND_DISTINCT;
+    if (cols == 0) {
+	flags |= (tobind & FS_BIND_BY_OBJECT) ? FS_BIND_OBJECT :
+						FS_BIND_SUBJECT;
+    }
+
+    fs_rid_vector **bindings = fs_bind(be, segment, flags, mv, sv, pv, ov,
+				       0, -1);
+    if (!bindings) return NULL;
+
+    const int rows = bindings[0]->length;
+    fs_rid_vector **ret = NULL;
+    if (rows > 0) {
+	ret = calloc(cols + 1, sizeof(fs_rid_vector *));
+	for (int c=0; c<cols+1; c++) {
+	    ret[c] = fs_rid_vector_new(0);
+	}
+    }
+    if (rows > 0 && cols == 0) {
+	fs_rid_vector_append(ret[0], rows);
+    } else if (rows > 0) {
+	struct group_row *grows = calloc(rows, sizeof(struct group_row));
+	for (int row=0; row<rows; row++) {
+	    for (int c=0; c<cols; c++) {
+		grows[row].col[c] = bindings[c]->data[row];
+	    }
+	}
+	qsort(grows, rows, sizeof(struct group_row), group_row_compare);
+	fs_rid count = 0;
+	for (int row=0; row<rows; row++) {
+	    count++;
+	    if (row + 1 < rows &&
+		!group_row_compare(grows + row, grows + row + 1)) {
+		continue;
+	    }
+	    for (int c=0; c<cols; c++) {
+		fs_rid_vector_append(ret[c], grows[row].col[c]);
+	    }
+	    fs_rid_vector_append(ret[cols], count);
+	    count = 0;
+	}
+	free(grows);
+    }
+    for (int c=0; c<(cols ? cols : 1); c++) {
+	fs_rid_vector_free(bindings[c]);
+    }
+    free(bindings);
+
+    TIME("bind group");
+
+    be->out_time[segment].bind += fs_time() - then;
+
+    return ret;
+}
+
 /* WARNING: this has completly different semantics to fs_bind,
    () () (:x :y) ("foo" "bar") means find common subjects like
    ?x :x "foo" . ?y :y "bar", only m and s slots are disjunctive */
@@ -650,12 +1339,13 @@ fs_rid_vector **fs_reverse_bind(fs_backend *be, fs_segment segment,
     }
 
     fs_rid lpair[2];
+    int steps = 0;
     fs_rid_vector *inter[2];
     for (int s=0; s<2; s++) {
 	inter[s] = fs_rid_vector_new(0);
     }
     for (int i=0; i<iters; i++) {
-	while (res[i] && fs_ptree_it_next(res[i], lpair)) {
+	while (res[i] && fs_ptree_it_next(res[i], lpair) && !expired(&steps)) {
 	    int match = 1;
 	    if (mv && !fs_rid_vector_contains(mv, lpair[0])) match = 0;
 	    if (match && sv && !fs_rid_vector_contains(sv, lpair[1])) match = 0;
@@ -793,9 +1483,36 @@ unsigned long long int fs_bind_price(fs_backend *be, fs_segment segment,
 			     fs_rid_vector *mv, fs_rid_vector *sv,
 			     fs_rid_vector *pv, fs_rid_vector *ov)
 {
-    /* NB this isn't implemented in this branch */
+    if (!(tobind & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT))) {
+	fs_error(LOG_ERR, "tried to price bind without s/o spec");
 
-    return 0;
+	return 0;
+    }
+    const int object = (tobind & FS_BIND_BY_OBJECT) ? 1 : 0;
+    fs_rid_vector *kv = object ? ov : sv;
+    const int kvl = fs_rid_vector_length(kv);
+
+    /* without a predicate we'd have to look in every ptree */
+    if (fs_rid_vector_length(pv) == 0) {
+	return be->approx_size;
+    }
+
+    /* the model and the other slot only filter the pairs, so this is an upper
+     * bound, which is cheap to get from the frozen index if there is one */
+    unsigned long long int rows = 0;
+    for (int p=0; p<pv->length; p++) {
+	fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], object);
+	if (!pt) continue;
+	if (kvl == 0) {
+	    rows += fs_ptree_count(pt);
+	} else {
+	    for (int k=0; k<kvl; k++) {
+		rows += fs_ptree_estimate(pt, kv->data[k]);
+	    }
+	}
+    }
+
+    return rows;
 }
 
 int fs_resolve(fs_backend *be, fs_segment segment, fs_rid_vector *v,
@@ -865,9 +1582,8 @@ fs_data_size fs_get_data_size(fs_backend *be, int seg)
     ret.quads_s = 0;
     ret.quads_sr = 0;
     for (int i=0; i<be->ptree_length; i++) {
-	fs_backend_ptree_limited_open(be, i);
-	ret.quads_s += fs_ptree_count(be->ptrees_priv[i].ptree_s);
-	ret.quads_sr += fs_ptree_count(be->ptrees_priv[i].ptree_o);
+	ret.quads_s += fs_backend_ptree_count(be, i, 0);
+	ret.quads_sr += fs_backend_ptree_count(be, i, 1);
     }
     ret.quads_o = -1;
     ret.resources = fs_rhash_count(be->res);
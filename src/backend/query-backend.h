@@ -30,6 +30,42 @@ fs_rid_vector **fs_reverse_bind(fs_backend *be, fs_segment segment,
 			       fs_rid_vector *pv, fs_rid_vector *ov,
                                int offset, int limit);
 
+/* semi-join: each row of the key columns, keys[slot] for the slots set in
+ * keyslots, is probed in the S or O index, which must be keyed by subject or
+ * object, and only quads matching a whole row are bound. mv and pv are
+ * alternatives for the model and predicate slots, as for fs_bind(), if those
+ * aren't keys. Rows should come sorted on the index key, and distinct */
+fs_rid_vector **fs_bind_join(fs_backend *be, fs_segment segment,
+                             unsigned int tobind, int keyslots,
+                             fs_rid_vector *keys[4], fs_rid_vector *mv,
+                             fs_rid_vector *pv, int limit);
+
+/* evaluates a star of patterns sharing a subject variable, ?s arm[0] ?o0 .
+ * ?s arm[1] ?o1 ... and returns joined rows, the subject column, then the
+ * object column of each arm with bind set. The subjects are taken from sv,
+ * or if it's empty, from the arm likely to match fewest. mv holds
+ * alternatives for the model of every arm */
+fs_rid_vector **fs_bind_star(fs_backend *be, fs_segment segment,
+                             unsigned int tobind, fs_rid_vector *sv,
+                             fs_rid_vector *mv, int arm_count,
+                             fs_star_arm *arms, int limit);
+
+/* removes the rows of bindings that certainly fail the filter program code,
+ * see docs/protocol. Only literals held by this segment can be tested, the
+ * rest pass. Returns non-zero, leaving the rows alone, if code is malformed */
+int fs_bind_filter(fs_backend *be, fs_segment segment,
+                   const unsigned char *code, unsigned int length,
+                   int cols, fs_rid_vector **bindings);
+
+/* partial aggregation, binds as fs_bind() but returns each distinct row of
+ * the bound columns once, with an extra last column holding the number of
+ * matches it stands for. With no columns bound the reply is just the count.
+ * Returns NULL if nothing matches */
+fs_rid_vector **fs_bind_group(fs_backend *be, fs_segment segment,
+                              unsigned int tobind,
+                              fs_rid_vector *mv, fs_rid_vector *sv,
+                              fs_rid_vector *pv, fs_rid_vector *ov);
+
 fs_rid_vector **fs_bind_first(fs_backend *be, fs_segment segment, unsigned int tobind,
                              fs_rid_vector *mv, fs_rid_vector *sv,
                              fs_rid_vector *pv, fs_rid_vector *ov,
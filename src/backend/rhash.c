@@ -28,11 +28,19 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "backend.h"
 #include "rhash.h"
 #include "list.h"
 #include "prefix-trie.h"
+#include "symtab.h"
 #include "../common/4s-hash.h"
 #include "../common/params.h"
 #include "../common/error.h"
@@ -42,13 +50,36 @@
 #define FS_RHASH_DEFAULT_BUCKET_SIZE      16
 #define FS_MAX_PREFIXES                  256
 
+/* lex file reads closer than this are merged into one readahead range */
+#define FS_RHASH_READAHEAD_GAP         65536
+/* amount of each lex entry we ask to be read ahead */
+#define FS_RHASH_READAHEAD_TAIL         4096
+
+/* bytes of out of line literals sampled to train the symbol table */
+#define FS_RHASH_SYMTAB_SAMPLE        131072
+/* a flush will train on a sample at least this big, rather than wait */
+#define FS_RHASH_SYMTAB_MIN_SAMPLE     16384
+/* longest prefix of each literal that's sampled */
+#define FS_RHASH_SYMTAB_SAMPLE_STR       256
+
 #define FS_RHASH_ID 0x4a585230
 
+/* written into the header when the .keys file is in step with the entries,
+ * older code zeroes the padding when writing headers, which invalidates it */
+#define FS_RHASH_KEYS_MAGIC 0x4b455953
+
 /* maximum distance that we wil allow the resource to be from its hash value */
 
 #define FS_PACKED __attribute__((__packed__))
 
-#define FS_RHASH_ENTRY(rh, rid) (((uint64_t)(rid >> 10) & ((uint64_t)(rh->size - 1)))*rh->bucket_size)
+#define FS_RHASH_ENTRY_SIZE(rid, size, bsize) (((uint64_t)(rid >> 10) & ((uint64_t)((size) - 1)))*(bsize))
+#define FS_RHASH_ENTRY(rh, rid) FS_RHASH_ENTRY_SIZE(rid, rh->size, rh->bucket_size)
+/* position of the entry in the table before the current resize started */
+#define FS_RHASH_OLD_ENTRY(rh, rid) FS_RHASH_ENTRY_SIZE(rid, rh->migrate_from, rh->bucket_size)
+
+/* number of buckets of the old table migrated by each put or get while a
+ * resize is in progress */
+#define FS_RHASH_MIGRATE_STEP 8
 
 #define DISP_I_UTF8         'i'
 #define DISP_I_NUMBER       'N'
@@ -57,6 +88,7 @@
 #define DISP_F_UTF8         'f'
 #define DISP_F_PREFIX       'P'
 #define DISP_F_ZCOMP        'Z'
+#define DISP_F_SYMTAB       'S'
 
 struct rhash_header {
     int32_t id;             // "JXR0"
@@ -67,7 +99,10 @@ struct rhash_header {
     uint32_t bucket_size;   // number of entries per bucket
     uint32_t revision;      // revision of the strucure
                             // rev=1: 32 byte, packed entries
-    char padding[488];      // allign to a block
+                            // rev=2: with .keys file
+    uint32_t migrate_from;  // size before the resize in progress, or 0
+    uint32_t keys_magic;    // FS_RHASH_KEYS_MAGIC if .keys file is valid
+    char padding[480];      // allign to a block
 } FS_PACKED;
  
 #define INLINE_STR_LEN 15
@@ -96,6 +131,13 @@ struct _fs_rhash {
     char *filename;
     FILE *lex_f;
     char *lex_filename;
+    int lex_fd;             // read only fd for lex file, for pread()
+    int lex_dirty;          // lex_f has unflushed writes
+    const char *lex_map;    // read only mapping of the lex file, or NULL
+    size_t lex_map_len;     // bytes mapped, may run past the end of the file
+    int64_t lex_size;       // bytes of the file readable through lex_map
+    GStaticRWLock lex_lock; // held for reading while using lex_map
+    GStaticMutex lex_mutex; // held while loading the symtab
     int flags;
     int locked;
     fs_prefix_trie *ptrie;
@@ -105,6 +147,31 @@ struct _fs_rhash {
     fs_list *prefix_file;
     char *z_buffer;
     int z_buffer_size;
+    fs_symtab *symtab;      // literal symbol table, or NULL until trained
+    char *symtab_filename;
+    char *sample;           // literals collected to train the symbol table
+    int sample_len;
+    fs_rid *keys;           // dense copy of entries[].rid, or NULL
+    int keys_fd;
+    char *keys_filename;
+    uint32_t migrate_from;  // size we're resizing from, 0 if not resizing
+    uint32_t migrate_pos;   // next old bucket to consider migrating
+    uint32_t migrate_done;  // old buckets migrated so far
+    unsigned char *migrated; // bitmap of migrated old buckets
+    int threaded;           // read by several threads, see fs_rhash_set_threaded()
+    fs_list *bulk;          // resources spilled by a bulk load, or NULL
+    FILE *bulk_lex_f;       // their lexical values
+    char *bulk_lex_filename;
+    int64_t bulk_lex_len;
+};
+
+/* a resource spilled by a bulk load, lex is an offset in the bulk lex file,
+ * padded so that fs_list's chunks hold a whole number of them */
+struct bulk_res {
+    fs_rid rid;
+    fs_rid attr;
+    int64_t lex;
+    uint64_t entry;     /* set just before the sort, see set_bulk_entry() */
 };
 
 /* this is much wider than it needs to be to match fs_list requirements */
@@ -114,8 +181,61 @@ struct prefix_file_line {
 };
 
 static fs_rhash *global_sort_rh = NULL;
+/* held while global_sort_rh is in use */
+G_LOCK_DEFINE_STATIC(global_sort);
+
+/* number of entries that can be probed from entry without running off the end
+ * of the table */
+static inline int probe_range(fs_rhash *rh, int entry)
+{
+    const int64_t left = (int64_t) rh->size * rh->bucket_size - entry;
+
+    return left < rh->search_dist ? left : rh->search_dist;
+}
+
+/* returns the index of the first of the n keys that equals rid, or -1, this
+ * compares several keys per instruction where the CPU allows */
+static inline int key_search(const fs_rid *keys, const fs_rid rid, const int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi64x(rid);
+    for (; i + 4 <= n; i += 4) {
+        const __m256i k = _mm256_loadu_si256((const __m256i *)(keys + i));
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k, needle)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    /* SSE2 has no 64 bit compare, so compare 32 bit halves and require both
+     * halves of a lane to match */
+    const __m128i needle = _mm_set1_epi64x(rid);
+    for (; i + 2 <= n; i += 2) {
+        const __m128i k = _mm_loadu_si128((const __m128i *)(keys + i));
+        __m128i eq = _mm_cmpeq_epi32(k, needle);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        const int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (keys[i] == rid) {
+            return i;
+        }
+    }
+
+    return -1;
+}
 
 static int double_size(fs_rhash *rh);
+static void migrate_bucket(fs_rhash *rh, uint32_t b);
+static void migrate_window(fs_rhash *rh, uint64_t entry, int64_t range);
+static void migrate_steps(fs_rhash *rh, uint32_t steps);
+static void migrate_start(fs_rhash *rh, uint32_t from);
+static void bulk_close(fs_rhash *rh);
 int fs_rhash_write_header(fs_rhash *rh);
 
 static int compress_bcd(const char *in, char *out);
@@ -152,6 +272,61 @@ void fs_rhash_ensure_size(fs_rhash *rh)
 }
 
 fs_rhash *fs_rhash_open_filename(const char *filename, int flags)
+{
+    return fs_rhash_open_filename_revision(filename, flags, FS_RHASH_REVISION);
+}
+
+static size_t keys_length(fs_rhash *rh)
+{
+    return ((size_t) rh->size) * ((size_t) rh->bucket_size) * sizeof(fs_rid);
+}
+
+/* map the .keys file, if it's not in step with the entries it's rebuilt
+ * when we can write, and ignored when we can't, returns non zero if the keys
+ * can't be used */
+static int map_keys(fs_rhash *rh, int valid)
+{
+    const int writable = rh->flags & (O_WRONLY | O_RDWR);
+    rh->keys_fd = open(rh->keys_filename, FS_O_NOATIME | (writable ? O_RDWR | O_CREAT : O_RDONLY), FS_FILE_MODE);
+    if (rh->keys_fd == -1) {
+        return 1;
+    }
+    const size_t len = keys_length(rh);
+    if (writable) {
+        if (ftruncate(rh->keys_fd, len) == -1) {
+            fs_error(LOG_ERR, "couldn't size '%s': %s", rh->keys_filename, strerror(errno));
+            close(rh->keys_fd);
+
+            return 1;
+        }
+    } else if (!valid || lseek(rh->keys_fd, 0, SEEK_END) < len) {
+        close(rh->keys_fd);
+
+        return 1;
+    }
+    void *ptr = mmap(NULL, len, PROT_READ | (writable ? PROT_WRITE : 0),
+                     MAP_SHARED, rh->keys_fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", rh->keys_filename, strerror(errno));
+        close(rh->keys_fd);
+
+        return 1;
+    }
+    rh->keys = ptr;
+    if (!valid) {
+        if (rh->count) {
+            fs_error(LOG_INFO, "rebuilding rhash keys (%s)", rh->keys_filename);
+        }
+        const size_t n = ((size_t) rh->size) * ((size_t) rh->bucket_size);
+        for (size_t i=0; i<n; i++) {
+            rh->keys[i] = rh->entries[i].rid;
+        }
+    }
+
+    return 0;
+}
+
+fs_rhash *fs_rhash_open_filename_revision(const char *filename, int flags, int revision)
 {
     struct rhash_header header;
     if (sizeof(struct rhash_header) != 512) {
@@ -181,8 +356,11 @@ fs_rhash *fs_rhash_open_filename(const char *filename, int flags)
     rh->size = FS_RHASH_DEFAULT_LENGTH;
     rh->search_dist = FS_RHASH_DEFAULT_SEARCH_DIST;
     rh->bucket_size = FS_RHASH_DEFAULT_BUCKET_SIZE;
-    rh->revision = 1;
+    rh->revision = revision;
     rh->lex_filename = g_strdup_printf("%s.lex", filename);
+    rh->keys_filename = g_strdup_printf("%s.keys", filename);
+    rh->symtab_filename = g_strdup_printf("%s.symtab", filename);
+    int keys_valid = 0;
     char *mode;
     if (flags & (O_WRONLY | O_RDWR)) {
         mode = "a+";
@@ -224,6 +402,11 @@ fs_rhash *fs_rhash_open_filename(const char *filename, int flags)
             rh->bucket_size = 1;
         }
         rh->revision = header.revision;
+        rh->migrate_from = header.migrate_from;
+        keys_valid = header.revision >= FS_RHASH_REVISION_KEYED &&
+                     header.keys_magic == FS_RHASH_KEYS_MAGIC;
+        /* existing files keep their layout, older versions of 4store can't
+         * read newer ones, so upgrades are left to fs_rhash_upgrade() */
     }
     fs_rhash_ensure_size(rh);
     const size_t len = sizeof(header) + ((size_t) rh->size) * ((size_t) rh->bucket_size) * sizeof(fs_rhash_entry);
@@ -233,6 +416,24 @@ fs_rhash *fs_rhash_open_filename(const char *filename, int flags)
         fs_error(LOG_ERR, "failed to mmap rhash file “%s”: %s", rh->filename, strerror(errno));
         return NULL;
     }
+    if (rh->revision >= FS_RHASH_REVISION_KEYED && map_keys(rh, keys_valid)) {
+        fs_error(LOG_WARNING, "not using keys for %s", rh->filename);
+    }
+    if (rh->flags & (O_WRONLY | O_RDWR)) {
+        fs_rhash_write_header(rh);
+    }
+    if (flags & O_TRUNC) {
+        unlink(rh->symtab_filename);
+    }
+    rh->symtab = fs_symtab_read(rh->symtab_filename);
+    if (!rh->symtab && (flags & (O_WRONLY | O_RDWR))) {
+        rh->sample = malloc(FS_RHASH_SYMTAB_SAMPLE);
+    }
+    if (rh->migrate_from) {
+        /* a resize was interrupted, the bitmap was lost, but migrating a
+         * bucket twice is harmless, so just start again */
+        migrate_start(rh, rh->migrate_from);
+    }
     rh->lex_f = fopen(rh->lex_filename, mode);
     if (!rh->lex_f) {
         fs_error(LOG_ERR, "failed to open rhash lex file “%s”: %s",
@@ -240,6 +441,15 @@ fs_rhash *fs_rhash_open_filename(const char *filename, int flags)
 
         return NULL;
     }
+    rh->lex_fd = open(rh->lex_filename, FS_O_NOATIME | O_RDONLY);
+    if (rh->lex_fd == -1) {
+        fs_error(LOG_ERR, "failed to open rhash lex file “%s”: %s",
+                 rh->lex_filename, strerror(errno));
+
+        return NULL;
+    }
+    g_static_mutex_init(&rh->lex_mutex);
+    g_static_rw_lock_init(&rh->lex_lock);
 
     return rh;
 }
@@ -254,6 +464,8 @@ int fs_rhash_write_header(fs_rhash *rh)
     header.search_dist = rh->search_dist;
     header.bucket_size = rh->bucket_size;
     header.revision = rh->revision;
+    header.migrate_from = rh->migrate_from;
+    header.keys_magic = rh->keys ? FS_RHASH_KEYS_MAGIC : 0;
     memset(&header.padding, 0, sizeof(header.padding));
     if (pwrite(rh->fd, &header, sizeof(header), 0) == -1) {
         fs_error(LOG_CRIT, "failed to write header on %s: %s",
@@ -265,8 +477,29 @@ int fs_rhash_write_header(fs_rhash *rh)
     return 0;
 }
 
+/* build the symbol table from the literals sampled so far, literals written
+ * after this can be stored with DISP_F_SYMTAB */
+static void train_symtab(fs_rhash *rh)
+{
+    fs_symtab *st = fs_symtab_train(rh->sample, rh->sample_len);
+    free(rh->sample);
+    rh->sample = NULL;
+    rh->sample_len = 0;
+    if (fs_symtab_write(st, rh->symtab_filename)) {
+        /* carry on without it, it'll be retrained on next open */
+        fs_symtab_free(st);
+
+        return;
+    }
+    rh->symtab = st;
+    fs_error(LOG_INFO, "trained %d symbols for %s", fs_symtab_count(st), rh->filename);
+}
+
 int fs_rhash_flush(fs_rhash *rh)
 {
+    if (rh->sample && rh->sample_len >= FS_RHASH_SYMTAB_MIN_SAMPLE) {
+        train_symtab(rh);
+    }
     if (rh->flags & (O_WRONLY | O_RDWR)) {
         fs_rhash_write_header(rh);
         fflush(rh->lex_f);
@@ -275,19 +508,64 @@ int fs_rhash_flush(fs_rhash *rh)
     return 0;
 }
 
+int fs_rhash_upgrade(const char *filename, int revision)
+{
+    if (revision < FS_RHASH_REVISION_ENTRIES || revision > FS_RHASH_REVISION) {
+        fs_error(LOG_ERR, "unknown rhash revision %d", revision);
+
+        return 1;
+    }
+    fs_rhash *rh = fs_rhash_open_filename(filename, O_RDWR);
+    if (!rh) {
+        return 1;
+    }
+    int ret = 0;
+    if (rh->revision < revision) {
+        /* the keys are built from the entries */
+        if (revision >= FS_RHASH_REVISION_KEYED && !rh->keys && map_keys(rh, 0)) {
+            fs_error(LOG_ERR, "cannot build keys for %s", rh->filename);
+            ret = 1;
+        } else {
+            rh->revision = revision;
+        }
+    }
+
+    return fs_rhash_close(rh) || ret;
+}
+
 int fs_rhash_close(fs_rhash *rh)
 {
     if (rh->flags & (O_WRONLY | O_RDWR)) {
+        /* leave a clean table behind */
+        migrate_steps(rh, UINT32_MAX);
         fs_rhash_write_header(rh);
     }
+    free(rh->migrated);
+    /* an unfinished bulk load is abandoned */
+    bulk_close(rh);
 
     fclose(rh->lex_f);
+    close(rh->lex_fd);
+    if (rh->lex_map) {
+        munmap((void *)rh->lex_map, rh->lex_map_len);
+    }
+    g_static_rw_lock_free(&rh->lex_lock);
     if (rh->prefix_file) {
         fs_list_close(rh->prefix_file);
     }
     if (rh->locked) flock(rh->fd, LOCK_UN);
     const size_t len = sizeof(struct rhash_header) + ((size_t) rh->size) * ((size_t) rh->bucket_size) * sizeof(fs_rhash_entry);
     munmap(rh->entries - sizeof(struct rhash_header), len);
+    if (rh->keys) {
+        munmap(rh->keys, keys_length(rh));
+        close(rh->keys_fd);
+    }
+    g_free(rh->keys_filename);
+    if (rh->symtab) {
+        fs_symtab_free(rh->symtab);
+    }
+    free(rh->sample);
+    g_free(rh->symtab_filename);
     close(rh->fd);
     g_free(rh->filename);
     free(rh);
@@ -298,20 +576,45 @@ int fs_rhash_close(fs_rhash *rh)
 int fs_rhash_put(fs_rhash *rh, fs_resource *res)
 {
     int entry = FS_RHASH_ENTRY(rh, res->rid);
+    if (rh->migrate_from) {
+        migrate_steps(rh, FS_RHASH_MIGRATE_STEP);
+        if (rh->migrate_from) {
+            /* make sure anything that's moving into or out of the search range
+             * of the resource has moved, in the old layout and the new, the
+             * range spans many buckets when the search distance is bigger than
+             * a bucket */
+            const uint64_t old_entry = FS_RHASH_OLD_ENTRY(rh, res->rid);
+            migrate_window(rh, old_entry, rh->search_dist);
+            migrate_window(rh, entry, probe_range(rh, entry));
+        }
+    }
     if (entry >= rh->size * rh->bucket_size) {
         fs_error(LOG_CRIT, "tried to write into rhash '%s' with bad entry number %d", rh->filename, entry);
         return 1;
     }
-    fs_rhash_entry *buffer = rh->entries + entry;
     int new = -1;
-    for (int i= 0; i < rh->search_dist && entry + i < rh->size * rh->bucket_size; i++) {
-        if (buffer[i].rid == res->rid) {
+    const int range = probe_range(rh, entry);
+    if (rh->keys) {
+        if (key_search(rh->keys + entry, res->rid, range) != -1) {
             /* resource is already there, we're done */
-            // TODO could check for collision
 
             return 0;
-        } else if (buffer[i].rid == 0 && new == -1) {
-            new = entry + i;
+        }
+        const int free_slot = key_search(rh->keys + entry, 0, range);
+        if (free_slot != -1) {
+            new = entry + free_slot;
+        }
+    } else {
+        fs_rhash_entry *buffer = rh->entries + entry;
+        for (int i= 0; i < range; i++) {
+            if (buffer[i].rid == res->rid) {
+                /* resource is already there, we're done */
+                // TODO could check for collision
+
+                return 0;
+            } else if (buffer[i].rid == 0 && new == -1) {
+                new = entry + i;
+            }
         }
     }
     if (new == -1) {
@@ -371,6 +674,7 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res)
             }
             e.val.offset = pos;
             e.disp = DISP_F_PREFIX;
+            rh->lex_dirty = 1;
         } else {
             strncpy((char *)(e.aval.pstr)+1, suffix, 7);
             if (suffix_len > 7) {
@@ -410,9 +714,10 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res)
 
         /* check to see if there's any milage in compressing */
         int32_t lex_len = strlen(res->lex);
-        /* grow z buffer if neccesary */
-        if (rh->z_buffer_size < lex_len * 1.01 + 12) {
-            while (rh->z_buffer_size < (lex_len * 1.01 + 12)) {
+        /* grow z buffer if neccesary, it's also used for symbol table coding */
+        const int32_t z_need = FS_SYMTAB_COMPRESS_BOUND(lex_len) + compressBound(lex_len);
+        if (rh->z_buffer_size < z_need) {
+            while (rh->z_buffer_size < z_need) {
                 rh->z_buffer_size *= 2;
             }
             free(rh->z_buffer);
@@ -425,12 +730,33 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res)
         char *data = res->lex;
         int32_t data_len = lex_len;
         char disp = DISP_F_UTF8;
-        /* if the lex string is more than 100 chars long, try compressing it */
-        if (lex_len > 100) {
-            int ret = compress((Bytef *)rh->z_buffer, &compsize, (Bytef *)res->lex, (unsigned long)lex_len);
+        if (rh->symtab) {
+            compsize = fs_symtab_compress(rh->symtab, res->lex, lex_len,
+                                          (unsigned char *)rh->z_buffer);
+            if ((int32_t)compsize < lex_len - 4) {
+                data = rh->z_buffer;
+                data_len = compsize;
+                disp = DISP_F_SYMTAB;
+            }
+        } else if (rh->sample) {
+            const int32_t len = lex_len < FS_RHASH_SYMTAB_SAMPLE_STR ?
+                                lex_len : FS_RHASH_SYMTAB_SAMPLE_STR;
+            memcpy(rh->sample + rh->sample_len, res->lex, len);
+            rh->sample_len += len;
+            rh->sample[rh->sample_len++] = '\0';
+            if (rh->sample_len + FS_RHASH_SYMTAB_SAMPLE_STR + 1 > FS_RHASH_SYMTAB_SAMPLE) {
+                train_symtab(rh);
+            }
+        }
+        /* if the lex string is more than 100 chars long, try compressing it,
+         * zlib may still win over the symbol table on long strings */
+        if (lex_len > 100 && (disp == DISP_F_UTF8 || data_len > lex_len / 2)) {
+            char *zdata = disp == DISP_F_SYMTAB ? rh->z_buffer + data_len : rh->z_buffer;
+            compsize = rh->z_buffer_size - (zdata - rh->z_buffer);
+            int ret = compress((Bytef *)zdata, &compsize, (Bytef *)res->lex, (unsigned long)lex_len);
             if (ret == Z_OK) {
-                if (compsize && compsize < lex_len - 4) {
-                    data = rh->z_buffer;
+                if (compsize && compsize < data_len - 4) {
+                    data = zdata;
                     data_len = compsize;
                     disp = DISP_F_ZCOMP;
                 }
@@ -457,7 +783,7 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res)
 
             return 1;
         }
-        if (disp == DISP_F_ZCOMP) {
+        if (disp == DISP_F_ZCOMP || disp == DISP_F_SYMTAB) {
             /* write the length of the uncompressed string too */
             if (fwrite(&lex_len, sizeof(lex_len), 1, rh->lex_f) == 0) {
                 fs_error(LOG_CRIT, "failed writing to lexical file “%s”",
@@ -471,8 +797,12 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res)
                      rh->lex_filename);
         }
         e.val.offset = pos;
+        rh->lex_dirty = 1;
     }
     rh->entries[new] = e;
+    if (rh->keys) {
+        rh->keys[new] = e.rid;
+    }
     rh->count++;
 
     return 0;
@@ -492,14 +822,119 @@ static int sort_by_hash(const void *va, const void *vb)
     return 0;
 }
 
-static int double_size(fs_rhash *rh)
+/* where the entry at old slot k goes in the new half, normally the same
+ * position, but if that's been taken the first free slot in the resource's
+ * search range, or -1 if it has to stay where it is */
+static int64_t migrate_dest(fs_rhash *rh, uint64_t k, uint64_t offset)
 {
-    long int oldsize = rh->size;
-    long int errs = 0;
+    const fs_rid rid = rh->entries[k].rid;
+    if (rh->entries[k + offset].rid == 0 || rh->entries[k + offset].rid == rid) {
+        return k + offset;
+    }
+    const int entry = FS_RHASH_ENTRY(rh, rid);
+    const int range = probe_range(rh, entry);
+    for (int i=0; i<range; i++) {
+        if (rh->entries[entry + i].rid == rid) {
+            return entry + i;
+        }
+    }
+    for (int i=0; i<range; i++) {
+        if (rh->entries[entry + i].rid == 0) {
+            return entry + i;
+        }
+    }
 
-    fs_error(LOG_INFO, "doubling rhash (%s)", rh->filename);
+    return -1;
+}
 
-    rh->size *= 2;
+/* move the entries of old bucket b that hash into the new half of the table
+ * to the same position in the new half. Only a process with the table locked
+ * exclusively does this, readers look in both places */
+static void migrate_bucket(fs_rhash *rh, uint32_t b)
+{
+    if (!rh->migrated || !rh->locked || rh->migrated[b / 8] & (1 << (b % 8))) {
+        return;
+    }
+
+    const uint64_t offset = (uint64_t)rh->migrate_from * rh->bucket_size;
+    for (int j=0; j < rh->bucket_size; j++) {
+        const uint64_t k = (uint64_t)b * rh->bucket_size + j;
+        if (rh->entries[k].rid == 0) continue;
+
+        if (FS_RHASH_ENTRY(rh, rh->entries[k].rid) >= offset) {
+            const int64_t dest = migrate_dest(rh, k, offset);
+            if (dest == -1) {
+                fs_error(LOG_ERR, "no room to migrate %016llx in %s",
+                         rh->entries[k].rid, rh->filename);
+                continue;
+            }
+            /* a copy that's already there is left alone */
+            if (rh->entries[dest].rid == 0) {
+                rh->entries[dest] = rh->entries[k];
+                if (rh->keys) {
+                    rh->keys[dest] = rh->keys[k];
+                }
+            }
+            memset(rh->entries + k, 0, sizeof(fs_rhash_entry));
+            if (rh->keys) {
+                rh->keys[k] = 0;
+            }
+        }
+    }
+    rh->migrated[b / 8] |= (1 << (b % 8));
+    rh->migrate_done++;
+    if (rh->migrate_done == rh->migrate_from) {
+        fs_error(LOG_INFO, "finished resizing rhash (%s)", rh->filename);
+        rh->migrate_from = 0;
+        free(rh->migrated);
+        rh->migrated = NULL;
+        fs_rhash_write_header(rh);
+    }
+}
+
+/* migrate all the old buckets under range entries from entry, which may be in
+ * either half of the table */
+static void migrate_window(fs_rhash *rh, uint64_t entry, int64_t range)
+{
+    if (range <= 0) return;
+
+    const uint64_t first = entry / rh->bucket_size;
+    const uint64_t last = (entry + range - 1) / rh->bucket_size;
+    for (uint64_t b = first; b <= last && rh->migrate_from; b++) {
+        const uint64_t old = b >= rh->migrate_from ? b - rh->migrate_from : b;
+        if (old < rh->migrate_from) {
+            migrate_bucket(rh, old);
+        }
+    }
+}
+
+/* migrate up to steps buckets that haven't been migrated yet */
+static void migrate_steps(fs_rhash *rh, uint32_t steps)
+{
+    if (!rh->migrated || !rh->locked) return;
+
+    while (steps-- && rh->migrate_from) {
+        while (rh->migrated[rh->migrate_pos / 8] & (1 << (rh->migrate_pos % 8))) {
+            rh->migrate_pos++;
+        }
+        migrate_bucket(rh, rh->migrate_pos);
+    }
+}
+
+static void migrate_start(fs_rhash *rh, uint32_t from)
+{
+    rh->migrate_from = from;
+    rh->migrate_pos = 0;
+    rh->migrate_done = 0;
+    /* read only users can find entries in either place, but can't move them */
+    if ((rh->flags & (O_WRONLY | O_RDWR)) && rh->locked) {
+        rh->migrated = calloc(from / 8 + 1, 1);
+    }
+}
+
+/* map the table again after rh->size has grown from oldsize */
+static int remap(fs_rhash *rh, uint32_t oldsize)
+{
     fs_rhash_ensure_size(rh);
     const size_t oldlen = sizeof(struct rhash_header) + ((size_t) oldsize) * ((size_t) rh->bucket_size) * sizeof(fs_rhash_entry);
     const size_t newlen = sizeof(struct rhash_header) + ((size_t) rh->size) * ((size_t) rh->bucket_size) * sizeof(fs_rhash_entry);
@@ -509,34 +944,49 @@ static int double_size(fs_rhash *rh)
         fs_error(LOG_ERR, "failed to re-mmap rhash file “%s”: %s", rh->filename, strerror(errno));
         return -1;
     }
+    if (rh->keys) {
+        const size_t old_keys_len = ((size_t) oldsize) * ((size_t) rh->bucket_size) * sizeof(fs_rid);
+        munmap(rh->keys, old_keys_len);
+        rh->keys = NULL;
+        close(rh->keys_fd);
+        if (map_keys(rh, 1)) {
+            fs_error(LOG_ERR, "failed to grow rhash keys “%s”", rh->keys_filename);
+            return -1;
+        }
+    }
 
-    fs_rhash_entry blank;
-    memset(&blank, 0, sizeof(blank));
-    fs_rhash_entry buffer_hi[rh->bucket_size];
+    return 0;
+}
+
+/* double the number of buckets, entries that belong in the new half are
+ * moved there a few buckets at a time by subsequent puts and gets, until then
+ * lookups check both the old and new positions */
+static int double_size(fs_rhash *rh)
+{
+    long int oldsize = rh->size;
 
-    for (long int i=0; i<oldsize * rh->bucket_size; i += rh->bucket_size) {
-        memset(buffer_hi, 0, sizeof(buffer_hi));
-        fs_rhash_entry * const from = rh->entries + i;
-        for (int j=0; j < rh->bucket_size; j++) {
-            if (from[j].rid == 0) continue;
+    /* finish off any resize that's still in progress */
+    migrate_steps(rh, UINT32_MAX);
 
-            long int entry = FS_RHASH_ENTRY(rh, from[j].rid);
-            if (entry >= oldsize * rh->bucket_size) {
-                buffer_hi[j] = from[j];
-                from[j] = blank;
-            }
-        }
-        memcpy(from + (oldsize * rh->bucket_size), buffer_hi, sizeof(buffer_hi));
+    fs_error(LOG_INFO, "doubling rhash (%s)", rh->filename);
+
+    rh->size *= 2;
+    if (remap(rh, oldsize)) {
+        return -1;
     }
+
+    migrate_start(rh, oldsize);
     fs_rhash_write_header(rh);
 
-    return errs;
+    return 0;
 }
 
 int fs_rhash_put_multi(fs_rhash *rh, fs_resource *res, int count)
 {
+    G_LOCK(global_sort);
     global_sort_rh = rh;
     qsort(res, count, sizeof(fs_resource), sort_by_hash);
+    G_UNLOCK(global_sort);
     fs_rid last = FS_RID_NULL;
 
     int ret = 0;
@@ -551,6 +1001,272 @@ int fs_rhash_put_multi(fs_rhash *rh, fs_resource *res, int count)
     return ret;
 }
 
+static void bulk_close(fs_rhash *rh)
+{
+    if (rh->bulk) {
+        fs_list_unlink(rh->bulk);
+        fs_list_close(rh->bulk);
+        rh->bulk = NULL;
+    }
+    if (rh->bulk_lex_f) {
+        fclose(rh->bulk_lex_f);
+        unlink(rh->bulk_lex_filename);
+        rh->bulk_lex_f = NULL;
+    }
+    g_free(rh->bulk_lex_filename);
+    rh->bulk_lex_filename = NULL;
+}
+
+int fs_rhash_bulk_start(fs_rhash *rh)
+{
+    if (rh->count || rh->bulk) {
+        fs_error(LOG_ERR, "cannot bulk load rhash '%s', it's not empty", rh->filename);
+
+        return 1;
+    }
+
+    char *filename = g_strdup_printf("%s.bulk", rh->filename);
+    rh->bulk = fs_list_open_filename(filename, sizeof(struct bulk_res), O_CREAT | O_TRUNC | O_RDWR);
+    g_free(filename);
+    rh->bulk_lex_filename = g_strdup_printf("%s.bulk-lex", rh->filename);
+    rh->bulk_lex_f = fopen(rh->bulk_lex_filename, "w");
+    rh->bulk_lex_len = 0;
+    if (!rh->bulk || !rh->bulk_lex_f) {
+        fs_error(LOG_ERR, "cannot create bulk load files for rhash '%s'", rh->filename);
+        bulk_close(rh);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int fs_rhash_bulk_running(fs_rhash *rh)
+{
+    return rh->bulk != NULL;
+}
+
+int fs_rhash_bulk_put_multi(fs_rhash *rh, fs_resource *res, int count)
+{
+    if (!rh->bulk) {
+        return fs_rhash_put_multi(rh, res, count);
+    }
+
+    for (int i=0; i<count; i++) {
+        if (res[i].rid == FS_RID_NULL) continue;
+
+        struct bulk_res r = { res[i].rid, res[i].attr, rh->bulk_lex_len, 0 };
+        const size_t len = strlen(res[i].lex) + 1;
+        if (fwrite(res[i].lex, len, 1, rh->bulk_lex_f) != 1) {
+            fs_error(LOG_CRIT, "failed writing to '%s': %s", rh->bulk_lex_filename, strerror(errno));
+
+            return 1;
+        }
+        rh->bulk_lex_len += len;
+        fs_list_add(rh->bulk, &r);
+    }
+
+    return 0;
+}
+
+/* the table's final size is only known once everything's been spilled, so
+ * the entries are filled in then, rather than the comparator looking at the
+ * table, which could be another segment's in a threaded backend */
+static void set_bulk_entry(void *vr, void *vrh)
+{
+    struct bulk_res *r = vr;
+    const fs_rhash *rh = vrh;
+
+    r->entry = FS_RHASH_ENTRY_SIZE(r->rid, rh->size, 1);
+}
+
+static int sort_bulk(const void *va, const void *vb)
+{
+    const struct bulk_res *a = va;
+    const struct bulk_res *b = vb;
+
+    if (a->entry < b->entry) return -1;
+    if (a->entry > b->entry) return 1;
+    if (a->rid < b->rid) return -1;
+    if (a->rid > b->rid) return 1;
+    if (a->lex < b->lex) return -1;
+    if (a->lex > b->lex) return 1;
+
+    return 0;
+}
+
+/* the table is sized so that it's about half full afterwards, then the spilled
+ * resources are merge sorted into bucket order and put, so the table and the
+ * lex file are each written front to back */
+int fs_rhash_bulk_finish(fs_rhash *rh)
+{
+    if (!rh->bulk) return 0;
+
+    int ret = 0;
+    fs_list_flush(rh->bulk);
+    fflush(rh->bulk_lex_f);
+    const uint64_t length = fs_list_length(rh->bulk);
+
+    if (rh->count == 0 && !rh->migrate_from) {
+        const uint32_t oldsize = rh->size;
+        while ((uint64_t)rh->size * rh->bucket_size < length * 2 &&
+               rh->size < UINT32_MAX / 2 / rh->bucket_size) {
+            rh->size *= 2;
+        }
+        if (rh->size != oldsize) {
+            fs_error(LOG_INFO, "sizing rhash (%s) for %llu resources", rh->filename, (unsigned long long)length);
+            if (remap(rh, oldsize)) {
+                bulk_close(rh);
+
+                return 1;
+            }
+            fs_rhash_write_header(rh);
+        }
+    }
+
+    char *lex = NULL;
+    if (rh->bulk_lex_len > 0) {
+        int fd = open(rh->bulk_lex_filename, O_RDONLY);
+        if (fd != -1) {
+            lex = mmap(NULL, rh->bulk_lex_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+        }
+        if (!lex || lex == MAP_FAILED) {
+            fs_error(LOG_CRIT, "cannot map '%s': %s", rh->bulk_lex_filename, strerror(errno));
+            bulk_close(rh);
+
+            return 1;
+        }
+    }
+
+    fs_list_apply(rh->bulk, set_bulk_entry, rh);
+    fs_list_rewind(rh->bulk);
+    fs_list_sort_chunked(rh->bulk, sort_bulk);
+    struct bulk_res r;
+    fs_rid last = FS_RID_NULL;
+    while (fs_list_next_sort_uniqed(rh->bulk, &r)) {
+        if (r.rid == last) continue;
+        fs_resource res = { .rid = r.rid, .attr = r.attr, .lex = lex + r.lex };
+        ret += fs_rhash_put(rh, &res);
+        last = r.rid;
+    }
+    fs_rhash_write_header(rh);
+
+    if (lex) {
+        munmap(lex, rh->bulk_lex_len);
+    }
+    bulk_close(rh);
+
+    return ret;
+}
+
+/* make sure at least end bytes of the lex file are readable through lex_map,
+ * the mapping is made with room to grow, so it's only replaced when the file
+ * outgrows it, returns non zero if the file isn't that long */
+static int lex_remap(fs_rhash *rh, int64_t end)
+{
+    g_static_rw_lock_writer_lock(&rh->lex_lock);
+    if (rh->lex_map && end <= rh->lex_size) {
+        /* another thread got here first */
+        g_static_rw_lock_writer_unlock(&rh->lex_lock);
+
+        return 0;
+    }
+    struct stat st;
+    if (fstat(rh->lex_fd, &st) == -1 || end > st.st_size) {
+        g_static_rw_lock_writer_unlock(&rh->lex_lock);
+
+        return 1;
+    }
+    if (!rh->lex_map || st.st_size > rh->lex_map_len) {
+        /* pages past the end of the file can't be read until it reaches
+         * them, but they reserve the address space for it to grow into */
+        const long page = sysconf(_SC_PAGESIZE);
+        const size_t len = ((size_t)st.st_size * 2 + page - 1) & ~(page - 1);
+        void *ptr = MAP_FAILED;
+#ifdef MREMAP_MAYMOVE
+        if (rh->lex_map) {
+            ptr = mremap((void *)rh->lex_map, rh->lex_map_len, len, MREMAP_MAYMOVE);
+            if (ptr == MAP_FAILED) {
+                munmap((void *)rh->lex_map, rh->lex_map_len);
+            }
+        } else
+#endif
+        {
+            if (rh->lex_map) munmap((void *)rh->lex_map, rh->lex_map_len);
+            ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, rh->lex_fd, 0);
+        }
+        if (ptr == MAP_FAILED) {
+            fs_error(LOG_WARNING, "failed to map '%s': %s", rh->lex_filename,
+                     strerror(errno));
+            rh->lex_map = NULL;
+            rh->lex_map_len = 0;
+            rh->lex_size = 0;
+            g_static_rw_lock_writer_unlock(&rh->lex_lock);
+
+            return 1;
+        }
+        rh->lex_map = ptr;
+        rh->lex_map_len = len;
+    }
+    rh->lex_size = st.st_size;
+    g_static_rw_lock_writer_unlock(&rh->lex_lock);
+
+    return 0;
+}
+
+/* returns a pointer to len bytes of the lex file at offset, or NULL if that
+ * range can't be mapped, the mapping is held until lex_unref() is called,
+ * which must happen whether or not this returned NULL */
+static const char *lex_ref(fs_rhash *rh, int64_t offset, size_t len)
+{
+    if (rh->lex_dirty) {
+        /* make sure anything we've written is visible through the fd */
+        fflush(rh->lex_f);
+        rh->lex_dirty = 0;
+    }
+
+    g_static_rw_lock_reader_lock(&rh->lex_lock);
+    if (offset < 0) return NULL;
+    if (rh->lex_map && offset + len <= rh->lex_size) {
+        return rh->lex_map + offset;
+    }
+
+    /* the lex file has grown since we looked, or it's the first read */
+    g_static_rw_lock_reader_unlock(&rh->lex_lock);
+    const int fail = lex_remap(rh, offset + len);
+    g_static_rw_lock_reader_lock(&rh->lex_lock);
+    if (fail || !rh->lex_map || offset + len > rh->lex_size) {
+        return NULL;
+    }
+
+    return rh->lex_map + offset;
+}
+
+static void lex_unref(fs_rhash *rh)
+{
+    g_static_rw_lock_reader_unlock(&rh->lex_lock);
+}
+
+/* copy len bytes from offset in the lex file into buf, using the mapping
+ * where possible and pread() otherwise, returns non zero on failure */
+static int lex_read(fs_rhash *rh, int64_t offset, void *buf, size_t len)
+{
+    const char *src = lex_ref(rh, offset, len);
+    if (src) {
+        memcpy(buf, src, len);
+        lex_unref(rh);
+
+        return 0;
+    }
+    lex_unref(rh);
+    if (offset < 0 || pread(rh->lex_fd, buf, len, offset) != (ssize_t)len) {
+        return 1;
+    }
+
+    return 0;
+}
+
 static inline int get_entry(fs_rhash *rh, fs_rhash_entry *e, fs_resource *res)
 {
     /* default, some things want to override this */
@@ -580,22 +1296,16 @@ static inline int get_entry(fs_rhash *rh, fs_rhash_entry *e, fs_resource *res)
         }
     } else if (e->disp == DISP_F_UTF8) {
         int32_t lex_len;
-        if (fseek(rh->lex_f, e->val.offset, SEEK_SET) == -1) {
-            fs_error(LOG_ERR, "seek error reading lexical store '%s': %s", rh->lex_filename, strerror(errno));
-
-            return 1;
-        }
-        if (fread(&lex_len, sizeof(lex_len), 1, rh->lex_f) == 0) {
-            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld: %s", rh->lex_filename, (long long)e->val.offset, strerror(errno));
+        if (lex_read(rh, e->val.offset, &lex_len, sizeof(lex_len)) || lex_len < 0) {
+            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld", rh->lex_filename, (long long)e->val.offset);
 
             return 1;
         }
 
         res->lex = malloc(lex_len + 1);
 
-        if (fread(res->lex, sizeof(char), lex_len, rh->lex_f) < lex_len) {
-            fs_error(LOG_ERR, "partial read %s from lexical store '%s'", ferror(rh->lex_f) ? "error" : "EOF", rh->lex_filename);
-            clearerr(rh->lex_f);
+        if (lex_read(rh, e->val.offset + sizeof(lex_len), res->lex, lex_len)) {
+            fs_error(LOG_ERR, "partial read from lexical store '%s'", rh->lex_filename);
             res->lex[0] = '\0';
 
             return 1;
@@ -611,13 +1321,8 @@ static inline int get_entry(fs_rhash *rh, fs_rhash_entry *e, fs_resource *res)
         int prefix_len = strlen(prefix);
         int32_t lex_len = 0;
         int32_t suffix_len = 0;
-        if (fseek(rh->lex_f, e->val.offset, SEEK_SET) == -1) {
-            fs_error(LOG_ERR, "seek error reading lexical store '%s': %s", rh->lex_filename, strerror(errno));
-
-            return 1;
-        }
-        if (fread(&suffix_len, sizeof(suffix_len), 1, rh->lex_f) == 0) {
-            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld: %s", rh->lex_filename, (long long)e->val.offset, strerror(errno));
+        if (lex_read(rh, e->val.offset, &suffix_len, sizeof(suffix_len)) || suffix_len < 0) {
+            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld", rh->lex_filename, (long long)e->val.offset);
 
             return 1;
         }
@@ -626,57 +1331,83 @@ static inline int get_entry(fs_rhash *rh, fs_rhash_entry *e, fs_resource *res)
         res->lex = malloc(lex_len + 1);
         strcpy(res->lex, prefix);
 
-        if (fread((res->lex) + prefix_len, sizeof(char), suffix_len, rh->lex_f) < suffix_len) {
-            fs_error(LOG_ERR, "partial read %s, of %d bytes (%d+%d) for RID %016llx from lexical store '%s'", ferror(rh->lex_f) ? "error" : "EOF", suffix_len, prefix_len, suffix_len, (long long)e->rid, rh->lex_filename);
-            clearerr(rh->lex_f);
+        if (lex_read(rh, e->val.offset + sizeof(suffix_len), (res->lex) + prefix_len, suffix_len)) {
+            fs_error(LOG_ERR, "partial read of %d bytes (%d+%d) for RID %016llx from lexical store '%s'", suffix_len, prefix_len, suffix_len, (long long)e->rid, rh->lex_filename);
             res->lex[0] = '\0';
 
             return 1;
         }
         res->lex[lex_len] = '\0';
-    } else if (e->disp == DISP_F_ZCOMP) {
-        int32_t data_len;
-        int32_t lex_len;
-        if (fseek(rh->lex_f, e->val.offset, SEEK_SET) == -1) {
-            fs_error(LOG_ERR, "seek error reading lexical store '%s': %s", rh->lex_filename, strerror(errno));
+    } else if (e->disp == DISP_F_ZCOMP || e->disp == DISP_F_SYMTAB) {
+        int32_t lens[2]; /* compressed, then uncompressed length */
+        if (lex_read(rh, e->val.offset, lens, sizeof(lens))) {
+            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld", rh->lex_filename, (long long)e->val.offset);
 
             return 1;
         }
-        if (fread(&data_len, sizeof(data_len), 1, rh->lex_f) == 0) {
-            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld: %s", rh->lex_filename, (long long)e->val.offset, strerror(errno));
+        const int32_t data_len = lens[0];
+        const int32_t lex_len = lens[1];
+        if (data_len < 0 || lex_len < 0) {
+            fs_error(LOG_ERR, "bad compressed entry in lexical store '%s', offset %lld", rh->lex_filename, (long long)e->val.offset);
+            res->lex = strdup("¡read error!");
 
             return 1;
         }
-        if (fread(&lex_len, sizeof(lex_len), 1, rh->lex_f) == 0) {
-            fs_error(LOG_ERR, "read error from lexical store '%s', offset %lld: %s", rh->lex_filename, (long long)e->val.offset, strerror(errno));
 
-            return 1;
-        }
+        /* inflate straight out of the mapped file where we can, otherwise
+         * into a private buffer, rh->z_buffer is not safe to share between
+         * readers */
+        const int64_t data_offset = e->val.offset + sizeof(lens);
+        char *data_copy = NULL;
+        const char *data = lex_ref(rh, data_offset, data_len);
+        if (!data) {
+            lex_unref(rh);
+            data_copy = malloc(data_len);
+            if (!data_copy || pread(rh->lex_fd, data_copy, data_len, data_offset) != data_len) {
+                fs_error(LOG_ERR, "partial read from lexical store '%s'", rh->lex_filename);
+                free(data_copy);
+                res->lex = strdup("¡read error!");
 
-        if (rh->z_buffer_size < data_len) {
-            while (rh->z_buffer_size < data_len) {
-                rh->z_buffer_size *= 2;
+                return 1;
             }
-            free(rh->z_buffer);
-            rh->z_buffer = malloc(rh->z_buffer_size);
+            data = data_copy;
         }
         res->lex = malloc(lex_len + 1);
-        if (fread(rh->z_buffer, sizeof(char), data_len, rh->lex_f) < data_len) {
-            fs_error(LOG_ERR, "partial read %s from lexical store '%s'", ferror(rh->lex_f) ? "error" : "EOF", rh->lex_filename);
-            clearerr(rh->lex_f);
-            res->lex = strdup("¡read error!");
+        if (e->disp == DISP_F_SYMTAB) {
+            if (!rh->symtab) {
+                /* trained since we opened the file */
+                g_static_mutex_lock(&rh->lex_mutex);
+                if (!rh->symtab) {
+                    rh->symtab = fs_symtab_read(rh->symtab_filename);
+                }
+                g_static_mutex_unlock(&rh->lex_mutex);
+            }
+            const long len = rh->symtab ?
+                fs_symtab_decompress(rh->symtab, (const unsigned char *)data,
+                                     data_len, res->lex, lex_len) : -1;
+            if (data_copy) free(data_copy);
+            else lex_unref(rh);
+            if (len != lex_len) {
+                fs_error(LOG_ERR, "bad symbol coded entry in lexical store '%s', offset %lld", rh->lex_filename, (long long)e->val.offset);
+                res->lex[0] = '\0';
 
-            return 1;
+                return 1;
+            }
+            res->lex[lex_len] = '\0';
+
+            return 0;
         }
         unsigned long uncomp_len = lex_len;
         unsigned long dlen = data_len;
         int ret;
-        ret = uncompress((Bytef *)res->lex, &uncomp_len, (Bytef *)rh->z_buffer, dlen);
+        ret = uncompress((Bytef *)res->lex, &uncomp_len, (const Bytef *)data, dlen);
+        if (data_copy) free(data_copy);
+        else lex_unref(rh);
         if (ret == Z_OK) {
             if (uncomp_len != lex_len) {
                 fs_error(LOG_ERR, "something went wrong in decompression");
             }
-            res->lex[lex_len] = '\0';
+            res->lex[uncomp_len] = '\0';
         } else {
             if (ret == Z_MEM_ERROR) {
                 fs_error(LOG_ERR, "zlib error: out of memory");
@@ -698,17 +1429,46 @@ static inline int get_entry(fs_rhash *rh, fs_rhash_entry *e, fs_resource *res)
     return 0;
 }
 
-static int fs_rhash_get_intl(fs_rhash *rh, fs_resource *res)
+/* look for rid in the search range starting at entry */
+static fs_rhash_entry *probe(fs_rhash *rh, int entry, fs_rid rid)
 {
-    const int entry = FS_RHASH_ENTRY(rh, res->rid);
+    const int range = probe_range(rh, entry);
+
+    if (rh->keys) {
+        const int k = key_search(rh->keys + entry, rid, range);
+
+        return k == -1 ? NULL : rh->entries + entry + k;
+    }
+
     fs_rhash_entry *buffer = rh->entries + entry;
+    for (int k = 0; k < range; ++k) {
+        if (buffer[k].rid == rid) {
+            return buffer+k;
+        }
+    }
 
-    for (int k = 0; k < rh->search_dist; ++k) {
-        if (buffer[k].rid == res->rid) {
-            return get_entry(rh, &buffer[k], res);
+    return NULL;
+}
+
+static fs_rhash_entry *find_entry(fs_rhash *rh, fs_rid rid)
+{
+    const int entry = FS_RHASH_ENTRY(rh, rid);
+    fs_rhash_entry *e = probe(rh, entry, rid);
+
+    /* it may not have been moved by the resize in progress yet */
+    if (!e && rh->migrate_from) {
+        const int old_entry = FS_RHASH_OLD_ENTRY(rh, rid);
+        if (old_entry != entry) {
+            e = probe(rh, old_entry, rid);
         }
     }
 
+    return e;
+}
+
+static int not_found(fs_rhash *rh, fs_resource *res)
+{
+    const int entry = FS_RHASH_ENTRY(rh, res->rid);
     fs_error(LOG_WARNING, "resource %016llx not found in § 0x%x-0x%x of %s", res->rid, entry, entry + rh->search_dist - 1, rh->filename);
     res->lex = g_strdup_printf("¡resource %llx not found!", res->rid);
     res->attr = 0;
@@ -716,8 +1476,24 @@ static int fs_rhash_get_intl(fs_rhash *rh, fs_resource *res)
     return 1;
 }
 
+static int fs_rhash_get_intl(fs_rhash *rh, fs_resource *res)
+{
+    fs_rhash_entry *e = find_entry(rh, res->rid);
+    if (e) {
+        return get_entry(rh, e, res);
+    }
+
+    return not_found(rh, res);
+}
+
+void fs_rhash_set_threaded(fs_rhash *rh, int threaded)
+{
+    rh->threaded = threaded;
+}
+
 int fs_rhash_get(fs_rhash *rh, fs_resource *res)
 {
+    if (!rh->threaded) migrate_steps(rh, FS_RHASH_MIGRATE_STEP);
     if (!rh->locked) flock(rh->fd, LOCK_SH);
     int ret = fs_rhash_get_intl(rh, res);
     if (!rh->locked) flock(rh->fd, LOCK_UN);
@@ -725,13 +1501,60 @@ int fs_rhash_get(fs_rhash *rh, fs_resource *res)
     return ret;
 }
 
+/* an entry that has to be read from the lex file */
+struct lex_request {
+    int64_t offset;
+    fs_rhash_entry *entry;
+    fs_resource *res;
+};
+
+static int sort_by_offset(const void *va, const void *vb)
+{
+    const struct lex_request *a = va;
+    const struct lex_request *b = vb;
+
+    if (a->offset < b->offset) return -1;
+    if (a->offset > b->offset) return 1;
+
+    return 0;
+}
+
+/* tell the kernel which parts of the lex file we're about to read, requests
+ * that are close together are merged into one range */
+static void lex_readahead(fs_rhash *rh, struct lex_request *req, int count)
+{
+#ifdef POSIX_FADV_WILLNEED
+    int64_t start = -1, end = -1;
+    for (int i=0; i<count; i++) {
+        if (start != -1 && req[i].offset - end > FS_RHASH_READAHEAD_GAP) {
+            posix_fadvise(rh->lex_fd, start, end - start, POSIX_FADV_WILLNEED);
+            start = -1;
+        }
+        if (start == -1) start = req[i].offset;
+        end = req[i].offset + FS_RHASH_READAHEAD_TAIL;
+    }
+    if (start != -1) {
+        posix_fadvise(rh->lex_fd, start, end - start, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
 int fs_rhash_get_multi(fs_rhash *rh, fs_resource *res, int count)
 {
+    G_LOCK(global_sort);
     global_sort_rh = rh;
     qsort(res, count, sizeof(fs_resource), sort_by_hash);
+    G_UNLOCK(global_sort);
 
     int ret = 0;
+    int lex_count = 0;
+    struct lex_request *req = malloc(count * sizeof(struct lex_request));
+    /* entries must not move while we hold pointers to them */
+    if (!rh->threaded) migrate_steps(rh, FS_RHASH_MIGRATE_STEP);
     if (!rh->locked) flock(rh->fd, LOCK_SH);
+
+    /* first pass: probe the hash in bucket order, resolving anything that's
+     * stored inline and noting where the rest live in the lex file */
     for (int i=0; i<count; i++) {
         res[i].attr = FS_RID_NULL;
         res[i].lex = NULL;
@@ -739,9 +1562,31 @@ int fs_rhash_get_multi(fs_rhash *rh, fs_resource *res, int count)
             res[i].lex = g_strdup_printf("_:b%llx", res[i].rid);
             continue;
         }
-        ret += fs_rhash_get_intl(rh, res+i);
+        fs_rhash_entry *e = find_entry(rh, res[i].rid);
+        if (!e) {
+            ret += not_found(rh, res+i);
+        } else if (req && (e->disp == DISP_F_UTF8 || e->disp == DISP_F_PREFIX ||
+                           e->disp == DISP_F_ZCOMP || e->disp == DISP_F_SYMTAB)) {
+            req[lex_count].offset = e->val.offset;
+            req[lex_count].entry = e;
+            req[lex_count].res = res+i;
+            lex_count++;
+        } else {
+            ret += get_entry(rh, e, res+i);
+        }
+    }
+
+    /* second pass: read the lex file in offset order, so a large batch turns
+     * into something close to a sequential scan */
+    if (lex_count) {
+        qsort(req, lex_count, sizeof(struct lex_request), sort_by_offset);
+        lex_readahead(rh, req, lex_count);
+        for (int i=0; i<lex_count; i++) {
+            ret += get_entry(rh, req[i].entry, req[i].res);
+        }
     }
     if (!rh->locked) flock(rh->fd, LOCK_UN);
+    free(req);
 
     return ret;
 }
@@ -763,7 +1608,21 @@ void fs_rhash_print(fs_rhash *rh, FILE *out, int verbosity)
     fprintf(out, "entries:  %d\n", rh->count);
     fprintf(out, "prefixes:  %d\n", rh->prefix_count);
     fprintf(out, "revision: %d\n", rh->revision);
+    fprintf(out, "keys:     %s\n", rh->keys ? "yes" : "no");
+    if (rh->symtab) {
+        fprintf(out, "symbols:  %d\n", fs_symtab_count(rh->symtab));
+    } else {
+        fprintf(out, "symbols:  untrained, %d bytes sampled\n", rh->sample_len);
+    }
     fprintf(out, "fill:     %.1f%%\n", 100.0 * (double)rh->count / (double)(rh->size * rh->bucket_size));
+    if (rh->migrate_from) {
+        fprintf(out, "resizing: from %d buckets, %d migrated (%.1f%%), next %d\n",
+                rh->migrate_from, rh->migrate_done,
+                100.0 * (double)rh->migrate_done / (double)rh->migrate_from,
+                rh->migrate_pos);
+    } else {
+        fprintf(out, "resizing: no\n");
+    }
 
     if (verbosity < 1) {
         return;
@@ -790,7 +1649,7 @@ void fs_rhash_print(fs_rhash *rh, FILE *out, int verbosity)
                 fprintf(out, "ERROR: failed to get entry for %016llx\n", e.rid);
                 continue;
             }
-            if (e.disp == DISP_F_UTF8 || e.disp == DISP_F_ZCOMP) {
+            if (e.disp == DISP_F_UTF8 || e.disp == DISP_F_ZCOMP || e.disp == DISP_F_SYMTAB) {
                 if (verbosity > 1 || show_next) fprintf(out, "%s %016llx %016llx %c %10lld %s\n", ent_str, e.rid, e.aval.attr, e.disp, (long long)e.val.offset, res.lex);
             } else if (e.disp == DISP_F_PREFIX) {
                 if (verbosity > 1 || show_next) fprintf(out, "%s %016llx %16d %c %10lld %s\n", ent_str, e.rid, (unsigned char)e.aval.pstr[0], e.disp, (long long)e.val.offset, res.lex);
@@ -5,8 +5,21 @@
 
 typedef struct _fs_rhash fs_rhash;
 
+/* rev=1 - 32 byte, packed entries
+ * rev=2 - as rev=1, plus a dense copy of the rids in a .keys file, so that
+ *         probes can compare several rids at a time */
+#define FS_RHASH_REVISION_ENTRIES 1
+#define FS_RHASH_REVISION_KEYED   2
+#define FS_RHASH_REVISION FS_RHASH_REVISION_KEYED
+
 fs_rhash *fs_rhash_open(fs_backend *be, const char *label, int flags);
 fs_rhash *fs_rhash_open_filename(const char *filename, int flags);
+/* as above, but new files are created with the given revision of the on disk
+ * layout, existing files keep the one they have */
+fs_rhash *fs_rhash_open_filename_revision(const char *filename, int flags, int revision);
+/* rewrite an existing file in a later revision, files already at or past it
+ * are left alone, returns non zero on failure */
+int fs_rhash_upgrade(const char *filename, int revision);
 int fs_rhash_flush(fs_rhash *rh);
 int fs_rhash_close(fs_rhash *rh);
 
@@ -14,8 +27,22 @@ int fs_rhash_get(fs_rhash *rh, fs_resource *res);
 int fs_rhash_put(fs_rhash *rh, fs_resource *res);
 
 int fs_rhash_get_multi(fs_rhash *rh, fs_resource *res, int count);
+
+/* if set any number of threads can call the get functions at once, as long as
+ * no put is running. Gets then leave resizes to the puts */
+void fs_rhash_set_threaded(fs_rhash *rh, int threaded);
 int fs_rhash_put_multi(fs_rhash *rh, fs_resource *res, int count);
 
+/* bulk loading into an empty hash, between fs_rhash_bulk_start() and
+ * fs_rhash_bulk_finish() resources passed to fs_rhash_bulk_put_multi() are
+ * spilled to a run file, and can't be looked up. The finish builds the table
+ * from the run in one sequential pass */
+int fs_rhash_bulk_start(fs_rhash *rh);
+int fs_rhash_bulk_running(fs_rhash *rh);
+/* the same as fs_rhash_put_multi() if no bulk load is running */
+int fs_rhash_bulk_put_multi(fs_rhash *rh, fs_resource *res, int count);
+int fs_rhash_bulk_finish(fs_rhash *rh);
+
 void fs_rhash_print(fs_rhash *rh, FILE *out, int verbosity);
 
 /* return number of unique resources stored */
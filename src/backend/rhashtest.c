@@ -14,7 +14,12 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#define _XOPEN_SOURCE 600
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <glib.h>
@@ -26,6 +31,118 @@
 
 #define BIG_PRIME 275604541
 
+/* number of out of line literals used for the resolve benchmark */
+#define LEX_ITS 200000
+
+/* ask the kernel to drop the lex file from the page cache, so the resolve
+ * benchmarks start cold */
+static void drop_lex_cache(const char *file)
+{
+#ifdef POSIX_FADV_DONTNEED
+	char *lex = g_strdup_printf("%s.lex", file);
+	int fd = open(lex, O_RDONLY);
+	if (fd != -1) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	g_free(lex);
+#endif
+}
+
+/* compare resolving literals one at a time in random order with a single
+ * fs_rhash_get_multi() call over the same set */
+static int resolve_benchmark(fs_rhash *rh, const char *file)
+{
+	fs_resource *res = calloc(LEX_ITS, sizeof(fs_resource));
+	for (int i=0; i<LEX_ITS; i++) {
+		char *lex = g_strdup_printf("a literal long enough to go out of line, number %d", i);
+		res[i].rid = ((fs_rid)i * BIG_PRIME + 0x4000) & 0x7fffffffffffffffLL;
+		res[i].lex = lex;
+		if (fs_rhash_put(rh, res+i)) {
+			printf("error @ %d\n", i);
+
+			return 1;
+		}
+		g_free(lex);
+	}
+	fs_rhash_flush(rh);
+	/* shuffle, so single gets don't benefit from write order */
+	for (int i=LEX_ITS-1; i>0; i--) {
+		int j = random() % (i+1);
+		fs_rid tmp = res[i].rid;
+		res[i].rid = res[j].rid;
+		res[j].rid = tmp;
+	}
+
+	drop_lex_cache(file);
+	double then = fs_time();
+	for (int i=0; i<LEX_ITS; i++) {
+		fs_rhash_get(rh, res+i);
+		g_free(res[i].lex);
+	}
+	double now = fs_time();
+	printf("resolved literals singly, %f res/s\n", (double)LEX_ITS/(now-then));
+
+	drop_lex_cache(file);
+	then = fs_time();
+	int errors = fs_rhash_get_multi(rh, res, LEX_ITS);
+	now = fs_time();
+	printf("resolved literals in batch, %f res/s\n", (double)LEX_ITS/(now-then));
+	for (int i=0; i<LEX_ITS; i++) {
+		g_free(res[i].lex);
+	}
+	free(res);
+	if (errors) {
+		printf("%d/%d batch read errors\n", errors, LEX_ITS);
+	}
+
+	return errors != 0;
+}
+
+/* time lookups in tables of the same rids with and without the dense key
+ * array, so the cost of the probe itself can be compared */
+static int probe_benchmark(void)
+{
+	int errors = 0;
+
+	for (int rev = FS_RHASH_REVISION_ENTRIES; rev <= FS_RHASH_REVISION_KEYED; rev++) {
+		char *file = g_strdup_printf("/tmp/test-probe-%d-%d.rhash", getpid(), rev);
+		fs_rhash *rh = fs_rhash_open_filename_revision(file, O_RDWR | O_CREAT | O_TRUNC, rev);
+		fs_resource r = { .rid = 0, .lex = "foo", .attr = 0 };
+		for (int i=0; i<ITS; i++) {
+			r.rid = (fs_rid)i * BIG_PRIME + 23;
+			fs_rhash_put(rh, &r);
+		}
+		fs_rhash_flush(rh);
+		double then = fs_time();
+		for (int pass=0; pass<4; pass++) {
+			for (int i=0; i<ITS; i++) {
+				r.rid = (fs_rid)i * BIG_PRIME + 23;
+				if (fs_rhash_get(rh, &r)) {
+					errors++;
+				}
+				g_free(r.lex);
+			}
+		}
+		double now = fs_time();
+		printf("probed rev %d table, %f lookups/s\n", rev, 4.0*ITS/(now-then));
+		fs_rhash_close(rh);
+		unlink(file);
+		char *aux = g_strdup_printf("%s.lex", file);
+		unlink(aux);
+		g_free(aux);
+		aux = g_strdup_printf("%s.keys", file);
+		unlink(aux);
+		g_free(aux);
+		g_free(file);
+	}
+	if (errors) {
+		printf("%d probe errors\n", errors);
+	}
+
+	return errors != 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -44,7 +161,7 @@ int main(int argc, char *argv[])
 	printf("GOT %llx -> %s\n", res.rid, res.lex);
 	double then = fs_time();
 	for (int i=0; i<ITS; i++) {
-		r1.rid = i * BIG_PRIME + 23;
+		r1.rid = (fs_rid)i * BIG_PRIME + 23;
 		r1.lex = strings[i % 5];
 		if (fs_rhash_put(rh, &r1)) {
 			printf("error @ %d\n", i);
@@ -57,7 +174,7 @@ int main(int argc, char *argv[])
 	then = fs_time();
 	int errors = 0;
 	for (int i=0; i<ITS; i++) {
-		r1.rid = i * BIG_PRIME + 23;
+		r1.rid = (fs_rid)i * BIG_PRIME + 23;
 		if (fs_rhash_get(rh, &r1)) {
 			printf("error @ %d\n", i);
 			errors++;
@@ -76,9 +193,21 @@ int main(int argc, char *argv[])
 	if (errors) {
 		printf("%d/%d read errors\n", errors, ITS);
 	}
+	if (resolve_benchmark(rh, file)) {
+		errors++;
+	}
 	fs_rhash_print(rh, stdout, 0);
 	fs_rhash_close(rh);
 	unlink(file);
+	char *lex = g_strdup_printf("%s.lex", file);
+	unlink(lex);
+	g_free(lex);
+	lex = g_strdup_printf("%s.keys", file);
+	unlink(lex);
+	g_free(lex);
+	if (probe_benchmark()) {
+		errors++;
+	}
 
 	return 0;
 }
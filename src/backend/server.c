@@ -45,7 +45,10 @@
 #define PAD " "
 
 //static const char feature_string[] = PAD "no-o-index freq" PAD;
-static const char feature_string[] = PAD "no-o-index" PAD;
+#define FEATURES PAD "no-o-index bulk-import compact-bind bind-join bind-star bind-filter bind-group shm-reply deadline price-bind" PAD
+static const char feature_string[] = FEATURES;
+/* only a threaded server can answer queries on a second socket per segment */
+static const char threaded_feature_string[] = FEATURES "multiplex" PAD;
 
 static unsigned char *handle_insert_resource(fs_backend *be, fs_segment segment,
                                                unsigned int length,
@@ -277,7 +280,11 @@ static unsigned char * handle_start_import (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
-  if (length > 0) {
+  /* optional import flags */
+  int flags = 0;
+  if (length == sizeof(flags)) {
+    memcpy(&flags, content, sizeof (flags));
+  } else if (length > 0) {
     fs_error(LOG_ERR, "start_import(%d) extraneous content", segment);
     return fsp_error_new(segment, "extraneous content");
   }
@@ -288,7 +295,9 @@ static unsigned char * handle_start_import (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "low disk space");
   }
 
-  fs_start_import(be, segment);
+  if (fs_start_import(be, segment, flags)) {
+    return fsp_error_new(segment, "start import failed");
+  }
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -567,6 +576,37 @@ static unsigned char * handle_get_query_times (fs_backend *be,
   return reply;
 }
 
+/* the filter program at the end of a bind request, which starts at trailer
+   and has remaining bytes, returns non-zero if it's malformed */
+static int bind_filter_program (const unsigned char *trailer,
+                                unsigned long long remaining,
+                                const unsigned char **code,
+                                unsigned int *code_length)
+{
+  unsigned int value;
+
+  if (remaining < 8) return 1;
+  memcpy(&value, trailer, sizeof (value));
+  if (value % 8 || remaining - 8 < value) return 1;
+  *code = trailer + 8;
+  *code_length = value;
+
+  return 0;
+}
+
+/* rows that reached the limit go back unfiltered, so the client can still
+   tell that they did */
+static int bind_filter_apply (fs_backend *be, fs_segment segment,
+                              const unsigned char *code,
+                              unsigned int code_length, int cols,
+                              fs_rid_vector **bindings, int limit)
+{
+  if (!code || !bindings || cols == 0) return 0;
+  if (limit > 0 && bindings[0]->length >= limit) return 0;
+
+  return fs_bind_filter(be, segment, code, code_length, cols, bindings);
+}
+
 static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
                                           unsigned int length,
                                           unsigned char *content)
@@ -588,6 +628,9 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
   int offset, limit;
 
   memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  const int filtered = flags & FS_BIND_FILTER;
+  flags &= ~(FS_BIND_COMPACT | FS_BIND_FILTER);
   memcpy(&offset, content + 4, sizeof (offset));
   memcpy(&limit, content + 8, sizeof (limit));
 
@@ -617,6 +660,18 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
 
   objects.data = (fs_rid *) content;
 
+  const unsigned char *code = NULL;
+  unsigned int code_length = 0;
+  if (filtered) {
+    const unsigned long long used = 32 + (models.size + subjects.size +
+                                    predicates.size + objects.size) * 8ULL;
+    if (bind_filter_program(content + objects.length * 8, length - used,
+                            &code, &code_length)) {
+      fs_error(LOG_ERR, "bind_limit(%d) bad filter", segment);
+      return fsp_error_new(segment, "bad filter");
+    }
+  }
+
   fs_rid_vector **bindings;
 
   bindings = fs_bind(be, segment, flags,
@@ -627,7 +682,10 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
     if (flags & 1 << k) cols++;
   }
 
-  if (bindings == NULL) {
+  if (bind_filter_apply(be, segment, code, code_length, cols, bindings, limit)) {
+    fs_error(LOG_ERR, "bind_limit(%d) bad filter", segment);
+    reply = fsp_error_new(segment, "bad filter");
+  } else if (bindings == NULL) {
     /* NULL => no match */
     reply = message_new(FS_NO_MATCH, segment, 0);
     cols = 0;
@@ -636,13 +694,7 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
     reply = message_new(FS_BIND_LIST, segment, 0);
   } else {
     /* otherwise return bindings */
-    reply = message_new(FS_BIND_LIST, segment, bindings[0]->length * 8 * cols);
-    unsigned char *data = reply + FS_HEADER;
-
-    for (k= 0; k < cols; ++k) {
-      memcpy(data, bindings[k]->data, bindings[k]->length * 8);
-      data += bindings[k]->length * 8;
-    }
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
   }
 
   for (k = 0; k < cols; ++k) {
@@ -674,6 +726,8 @@ static unsigned char * handle_reverse_bind (fs_backend *be, fs_segment segment,
   int offset, limit;
 
   memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  flags &= ~FS_BIND_COMPACT;
   memcpy(&offset, content + 4, sizeof (offset));
   memcpy(&limit, content + 8, sizeof (limit));
 
@@ -724,15 +778,275 @@ static unsigned char * handle_reverse_bind (fs_backend *be, fs_segment segment,
     cols = 0;
   } else {
     /* otherwise return bindings */
-    reply = message_new(FS_BIND_LIST, segment, bindings[0]->length * 8 * cols);
-    unsigned char *data = reply + FS_HEADER;
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
+  }
+
+  for (k = 0; k < cols; ++k) {
+    fs_rid_vector_free(bindings[k]);
+  }
+  free(bindings);
+
+  return reply;
+}
+
+static unsigned char * handle_bind_join (fs_backend *be, fs_segment segment,
+                                         unsigned int length,
+                                         unsigned char *content)
+{
+  unsigned char *reply;
+
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  if (length < 32) {
+    fs_error(LOG_ERR, "bind_join(%d) much too short", segment);
+    return fsp_error_new(segment, "much too short");
+  }
+
+  fs_rid_vector models, predicates, keys[4];
+  fs_rid_vector *key_ptrs[4] = { NULL, NULL, NULL, NULL };
+  unsigned int flags, rows, keyslots, value;
+  int limit;
+
+  memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  const int filtered = flags & FS_BIND_FILTER;
+  flags &= ~(FS_BIND_COMPACT | FS_BIND_FILTER);
+  memcpy(&limit, content + 4, sizeof (limit));
+  memcpy(&rows, content + 8, sizeof (rows));
+  memcpy(&keyslots, content + 12, sizeof (keyslots));
+  memcpy(&value, content + 16, sizeof (value));
+  models.size = models.length = value / 8;
+  memcpy(&value, content + 20, sizeof (value));
+  predicates.size = predicates.length = value / 8;
+  content += 32;
+
+  int key_cols = 0;
+  for (int k = 0; k < 4; ++k) {
+    if (keyslots & 1 << k) key_cols++;
+  }
+
+  const unsigned long long used =
+    ((unsigned long long) rows * key_cols + models.size + predicates.size) * 8 + 32;
+  if (length < used) {
+    fs_error(LOG_ERR, "bind_join(%d) too short", segment);
+    return fsp_error_new(segment, "too short");
+  }
 
-    for (k= 0; k < cols; ++k) {
-      memcpy(data, bindings[k]->data, bindings[k]->length * 8);
-      data += bindings[k]->length * 8;
+  const unsigned char *code = NULL;
+  unsigned int code_length = 0;
+  if (filtered && bind_filter_program(content - 32 + used, length - used,
+                                      &code, &code_length)) {
+    fs_error(LOG_ERR, "bind_join(%d) bad filter", segment);
+    return fsp_error_new(segment, "bad filter");
+  }
+
+  for (int k = 0; k < 4; ++k) {
+    if (keyslots & 1 << k) {
+      keys[k].size = keys[k].length = rows;
+      keys[k].data = (fs_rid *) content;
+      key_ptrs[k] = &keys[k];
+      content += rows * 8;
     }
   }
 
+  models.data = (fs_rid *) content;
+  content += models.length * 8;
+
+  predicates.data = (fs_rid *) content;
+
+  fs_rid_vector **bindings;
+  bindings = fs_bind_join(be, segment, flags, keyslots, key_ptrs, &models,
+                          &predicates, limit);
+
+  int k, cols = 0;
+  for (k = 0; k < 4; ++k) {
+    if (flags & 1 << k) cols++;
+  }
+
+  if (bind_filter_apply(be, segment, code, code_length, cols, bindings, limit)) {
+    fs_error(LOG_ERR, "bind_join(%d) bad filter", segment);
+    reply = fsp_error_new(segment, "bad filter");
+  } else if (bindings == NULL) {
+    /* NULL => no match */
+    reply = message_new(FS_NO_MATCH, segment, 0);
+    cols = 0;
+  } else if (cols == 0) {
+    /* Zero columns => match with no binding */
+    reply = message_new(FS_BIND_LIST, segment, 0);
+  } else {
+    /* otherwise return bindings */
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
+  }
+
+  for (k = 0; k < cols; ++k) {
+    fs_rid_vector_free(bindings[k]);
+  }
+  free(bindings);
+
+  return reply;
+}
+
+static unsigned char * handle_bind_star (fs_backend *be, fs_segment segment,
+                                         unsigned int length,
+                                         unsigned char *content)
+{
+  unsigned char *reply;
+
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  if (length < 32) {
+    fs_error(LOG_ERR, "bind_star(%d) much too short", segment);
+    return fsp_error_new(segment, "much too short");
+  }
+
+  fs_rid_vector subjects, models;
+  unsigned int flags, arm_count, value;
+  int limit;
+
+  memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  const int filtered = flags & FS_BIND_FILTER;
+  flags &= ~(FS_BIND_COMPACT | FS_BIND_FILTER);
+  memcpy(&limit, content + 4, sizeof (limit));
+  memcpy(&arm_count, content + 8, sizeof (arm_count));
+  memcpy(&value, content + 12, sizeof (value));
+  subjects.size = subjects.length = value / 8;
+  memcpy(&value, content + 16, sizeof (value));
+  models.size = models.length = value / 8;
+
+  unsigned long long used = 32 + (unsigned long long) (subjects.length + models.length) * 8;
+  if (arm_count > FS_MAX_STAR_ARMS) {
+    fs_error(LOG_ERR, "bind_star(%d) passed %u arms", segment, arm_count);
+    return fsp_error_new(segment, "too many arms");
+  }
+  if (length < used) {
+    fs_error(LOG_ERR, "bind_star(%d) too short", segment);
+    return fsp_error_new(segment, "too short");
+  }
+
+  subjects.data = (fs_rid *) (content + 32);
+  models.data = subjects.data + subjects.length;
+
+  fs_star_arm arms[arm_count];
+  fs_rid_vector objects[arm_count];
+  for (int a = 0; a < arm_count; ++a) {
+    if (length < used + 16) {
+      fs_error(LOG_ERR, "bind_star(%d) too short", segment);
+      return fsp_error_new(segment, "too short");
+    }
+    memcpy(&arms[a].predicate, content + used, sizeof (fs_rid));
+    memcpy(&value, content + used + 8, sizeof (value));
+    objects[a].size = objects[a].length = value / 8;
+    memcpy(&value, content + used + 12, sizeof (value));
+    arms[a].bind = value & 1;
+    used += 16;
+    if (length < used + objects[a].length * 8ULL) {
+      fs_error(LOG_ERR, "bind_star(%d) too short", segment);
+      return fsp_error_new(segment, "too short");
+    }
+    objects[a].data = (fs_rid *) (content + used);
+    arms[a].objects = &objects[a];
+    used += objects[a].length * 8;
+  }
+
+  const unsigned char *code = NULL;
+  unsigned int code_length = 0;
+  if (filtered && bind_filter_program(content + used, length - used,
+                                      &code, &code_length)) {
+    fs_error(LOG_ERR, "bind_star(%d) bad filter", segment);
+    return fsp_error_new(segment, "bad filter");
+  }
+
+  fs_rid_vector **bindings;
+  bindings = fs_bind_star(be, segment, flags, &subjects, &models, arm_count,
+                          arms, limit);
+
+  int k, cols = 1;
+  for (k = 0; k < arm_count; ++k) {
+    if (arms[k].bind) cols++;
+  }
+
+  if (bind_filter_apply(be, segment, code, code_length, cols, bindings, limit)) {
+    fs_error(LOG_ERR, "bind_star(%d) bad filter", segment);
+    reply = fsp_error_new(segment, "bad filter");
+  } else {
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
+  }
+
+  for (k = 0; k < cols; ++k) {
+    fs_rid_vector_free(bindings[k]);
+  }
+  free(bindings);
+
+  return reply;
+}
+
+static unsigned char * handle_bind_group (fs_backend *be, fs_segment segment,
+                                          unsigned int length,
+                                          unsigned char *content)
+{
+  unsigned char *reply;
+
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  if (length < 24) {
+    fs_error(LOG_ERR, "bind_group(%d) much too short", segment);
+    return fsp_error_new(segment, "much too short");
+  }
+
+  fs_rid_vector models, subjects, predicates, objects;
+  unsigned int flags, value;
+
+  memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  flags &= ~(FS_BIND_COMPACT | FS_BIND_FILTER);
+
+  memcpy(&value, content + 4, sizeof (value));
+  models.size = models.length = value / 8;
+  memcpy(&value, content + 8, sizeof (value));
+  subjects.size = subjects.length = value / 8;
+  memcpy(&value, content + 12, sizeof (value));
+  predicates.size = predicates.length = value / 8;
+  memcpy(&value, content + 16, sizeof (value));
+  objects.size = objects.length = value / 8;
+  content += 24;
+
+  if (length < (models.length + subjects.length + predicates.length +
+                objects.length) * 8ULL + 24) {
+    fs_error(LOG_ERR, "bind_group(%d) too short", segment);
+    return fsp_error_new(segment, "too short");
+  }
+
+  models.data = (fs_rid *) content;
+  subjects.data = models.data + models.length;
+  predicates.data = subjects.data + subjects.length;
+  objects.data = predicates.data + predicates.length;
+
+  fs_rid_vector **bindings;
+  bindings = fs_bind_group(be, segment, flags,
+                           &models, &subjects, &predicates, &objects);
+
+  int k, cols = 1;
+  for (k = 0; k < 4; ++k) {
+    if (flags & 1 << k) cols++;
+  }
+
+  if (bindings == NULL) {
+    reply = message_new(FS_NO_MATCH, segment, 0);
+    cols = 0;
+  } else {
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
+  }
+
   for (k = 0; k < cols; ++k) {
     fs_rid_vector_free(bindings[k]);
   }
@@ -762,6 +1076,8 @@ static unsigned char * handle_bind_first (fs_backend *be, fs_segment segment,
   int count;
 
   memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  flags &= ~FS_BIND_COMPACT;
   memcpy(&count, content + 4, sizeof (count));
   memcpy(&value, content + 12, sizeof (models.length));
   models.size = models.length = value / 8;
@@ -807,13 +1123,7 @@ static unsigned char * handle_bind_first (fs_backend *be, fs_segment segment,
     reply = message_new(FS_BIND_LIST, segment, 0);
   } else {
     /* otherwise return bindings */
-    reply = message_new(FS_BIND_LIST, segment, bindings[0]->length * 8 * cols);
-    unsigned char *data = reply + FS_HEADER;
-
-    for (k= 0; k < cols; ++k) {
-      memcpy(data, bindings[k]->data, bindings[k]->length * 8);
-      data += bindings[k]->length * 8;
-    }
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
   }
 
   for (k = 0; k < cols; ++k) {
@@ -844,6 +1154,8 @@ static unsigned char * handle_bind_next (fs_backend *be, fs_segment segment,
   int count;
 
   memcpy(&flags, content, sizeof (flags));
+  const int compact = flags & FS_BIND_COMPACT;
+  flags &= ~FS_BIND_COMPACT;
   memcpy(&count, content + 4, sizeof (count));
 
   fs_rid_vector **bindings;
@@ -863,13 +1175,7 @@ static unsigned char * handle_bind_next (fs_backend *be, fs_segment segment,
     reply = message_new(FS_BIND_LIST, segment, 0);
   } else {
     /* otherwise return bindings */
-    reply = message_new(FS_BIND_LIST, segment, bindings[0]->length * 8 * cols);
-    unsigned char *data = reply + FS_HEADER;
-
-    for (k= 0; k < cols; ++k) {
-      memcpy(data, bindings[k]->data, bindings[k]->length * 8);
-      data += bindings[k]->length * 8;
-    }
+    reply = fsp_bind_list_new(segment, cols, bindings, compact);
   }
 
   for (k = 0; k < cols; ++k) {
@@ -1022,8 +1328,14 @@ static unsigned char * handle_auth (fs_backend *be,
   }
   
   /* in-band signal, string of features */
-  unsigned char *reply = message_new(FS_DONE_OK, 0, sizeof(feature_string));
-  memcpy(reply + FS_HEADER, feature_string, sizeof(feature_string));
+  const char *features = feature_string;
+  size_t size = sizeof(feature_string);
+  if (be->threaded) {
+    features = threaded_feature_string;
+    size = sizeof(threaded_feature_string);
+  }
+  unsigned char *reply = message_new(FS_DONE_OK, 0, size);
+  memcpy(reply + FS_HEADER, features, size);
   return reply;
 }
 
@@ -1110,6 +1422,9 @@ fsp_backend native_backend = {
   .get_quad_freq = handle_get_quad_freq,
   .choose_segment = handle_choose_segment,
   .get_uuid = handle_get_uuid,
+  .bind_join = handle_bind_join,
+  .bind_star = handle_bind_star,
+  .bind_group = handle_bind_group,
 };
 
 
@@ -1119,14 +1434,16 @@ int main (int argc, char *argv[])
   int daemon = 1;
   int help = 0;
   float disk_limit = 1.0;
+  int threads = 0;
 
   fsp_syslog_enable();
 
   int c, opt_index=0;
-  static const char *optstr = "Dl:";
+  static const char *optstr = "Dl:T:";
   static struct option longopt[] = {
     { "daemon", 0, 0, 'D' },
     { "limit", 1, 0, 'l' },
+    { "threads", 1, 0, 'T' },
     { "help", 0, 0, 'h' },
     { "version", 0, 0, 'v' },
     { 0, 0, 0, 0 }
@@ -1148,6 +1465,9 @@ int main (int argc, char *argv[])
     case 'l':
       disk_limit = atof(optarg);
       break;
+    case 'T':
+      threads = atoi(optarg);
+      break;
     case 'h':
       help_return = 0;
       help = 1;
@@ -1168,7 +1488,8 @@ int main (int argc, char *argv[])
 
   if (help) {
     fprintf(stdout, "%s revision %s\n", argv[0], FS_BACKEND_VER);
-    fprintf(stdout, "Usage: %s [-D,--daemon] [-l,--limit min-free-space] <kbname>\n", argv[0]);
+    fprintf(stdout, "Usage: %s [-D,--daemon] [-l,--limit min-free-space] [-T,--threads count] <kbname>\n", argv[0]);
+    fprintf(stdout, "       -T serves connections with a pool of threads, not a process each\n");
     fprintf(stdout, "       env. var. FS_DISK_LIMIT also controls min free disk\n");
     return help_return;
   }
@@ -1179,7 +1500,7 @@ int main (int argc, char *argv[])
     return 1;
   }
 
-  fsp_serve(kb_name, &native_backend, daemon, disk_limit);
+  fsp_serve(kb_name, &native_backend, daemon, disk_limit, threads);
 
   return 2; /* fsp_serve returns only if there is an error */
 }
@@ -0,0 +1,366 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "symtab.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+#define FS_SYMTAB_ID 0x4a585354
+
+/* code that's followed by a literal byte */
+#define ESCAPE 255
+
+/* each round of training can at most double the length of the symbols, so
+ * this is enough to reach FS_SYMTAB_MAX_SYMBOL_LEN and refine a little */
+#define TRAINING_ROUNDS 5
+
+/* pseudo codes used during training, 0-254 are symbols, 256-511 are escaped
+ * bytes */
+#define TRAINING_CODES 512
+
+struct _fs_symtab {
+    int count;
+    uint8_t len[FS_SYMTAB_MAX_SYMBOLS];
+    char sym[FS_SYMTAB_MAX_SYMBOLS][FS_SYMTAB_MAX_SYMBOL_LEN];
+    /* codes starting with each byte, longest first, the codes for byte b are
+     * by_first[first[b]] ... by_first[first[b+1]-1] */
+    uint16_t first[257];
+    uint8_t by_first[FS_SYMTAB_MAX_SYMBOLS];
+};
+
+struct symtab_header {
+    uint32_t id;
+    uint32_t count;
+};
+
+struct candidate {
+    uint64_t gain;
+    uint8_t len;
+    char sym[FS_SYMTAB_MAX_SYMBOL_LEN];
+};
+
+static void build_index(fs_symtab *st)
+{
+    uint16_t fill[256];
+
+    memset(st->first, 0, sizeof(st->first));
+    for (int c=0; c<st->count; c++) {
+        st->first[(uint8_t)st->sym[c][0] + 1]++;
+    }
+    for (int b=0; b<256; b++) {
+        st->first[b+1] += st->first[b];
+    }
+    memcpy(fill, st->first, sizeof(fill));
+    for (int l=FS_SYMTAB_MAX_SYMBOL_LEN; l>0; l--) {
+        for (int c=0; c<st->count; c++) {
+            if (st->len[c] == l) {
+                st->by_first[fill[(uint8_t)st->sym[c][0]]++] = c;
+            }
+        }
+    }
+}
+
+/* returns the code of the longest symbol at the start of in, or -1 */
+static inline int match(const fs_symtab *st, const char *in, size_t left)
+{
+    const uint8_t b = in[0];
+
+    for (int i=st->first[b]; i<st->first[b+1]; i++) {
+        const int c = st->by_first[i];
+        if (st->len[c] <= left && !memcmp(st->sym[c], in, st->len[c])) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+static int candidate_by_symbol(const void *va, const void *vb)
+{
+    const struct candidate *a = va;
+    const struct candidate *b = vb;
+
+    if (a->len != b->len) return a->len - b->len;
+
+    return memcmp(a->sym, b->sym, a->len);
+}
+
+static int candidate_by_gain(const void *va, const void *vb)
+{
+    const struct candidate *a = va;
+    const struct candidate *b = vb;
+
+    if (a->gain > b->gain) return -1;
+    if (a->gain < b->gain) return 1;
+
+    return candidate_by_symbol(va, vb);
+}
+
+static inline void training_symbol(const fs_symtab *st, int code, const char **sym, int *len, char *byte)
+{
+    if (code < 256) {
+        *sym = st->sym[code];
+        *len = st->len[code];
+    } else {
+        *byte = code - 256;
+        *sym = byte;
+        *len = 1;
+    }
+}
+
+/* this is the FSST training scheme, each round codes the sample with the
+ * current table, counting how often each code, and each pair of adjacent
+ * codes, is used, the most valuable of those symbols and concatenations
+ * become the next table */
+fs_symtab *fs_symtab_train(const char *sample, size_t len)
+{
+    fs_symtab *st = calloc(1, sizeof(fs_symtab));
+    uint32_t *count1 = calloc(TRAINING_CODES, sizeof(uint32_t));
+    uint32_t *count2 = calloc(TRAINING_CODES * TRAINING_CODES, sizeof(uint32_t));
+    size_t cand_size = 1024;
+    struct candidate *cand = malloc(cand_size * sizeof(struct candidate));
+
+    for (int round=0; round<TRAINING_ROUNDS; round++) {
+        memset(count1, 0, TRAINING_CODES * sizeof(uint32_t));
+        memset(count2, 0, TRAINING_CODES * TRAINING_CODES * sizeof(uint32_t));
+        for (size_t p=0; p<len; p++) {
+            /* symbols never span the end of a string */
+            const size_t end = p + strnlen(sample + p, len - p);
+            int prev = -1;
+            while (p < end) {
+                int code = match(st, sample + p, end - p);
+                if (code == -1) {
+                    code = 256 + (uint8_t)sample[p];
+                    p++;
+                } else {
+                    p += st->len[code];
+                }
+                count1[code]++;
+                if (prev != -1) {
+                    count2[prev * TRAINING_CODES + code]++;
+                }
+                prev = code;
+            }
+        }
+
+        size_t ncand = 0;
+        for (int a=0; a<TRAINING_CODES; a++) {
+            if (!count1[a]) continue;
+            const char *asym;
+            int alen;
+            char abyte;
+            training_symbol(st, a, &asym, &alen, &abyte);
+            for (int b=-1; b<TRAINING_CODES; b++) {
+                const char *bsym = NULL;
+                int blen = 0;
+                char bbyte;
+                uint32_t freq;
+                if (b == -1) {
+                    freq = count1[a];
+                } else {
+                    freq = count2[a * TRAINING_CODES + b];
+                    if (!freq) continue;
+                    training_symbol(st, b, &bsym, &blen, &bbyte);
+                    if (alen + blen > FS_SYMTAB_MAX_SYMBOL_LEN) continue;
+                }
+                if (ncand == cand_size) {
+                    cand_size *= 2;
+                    cand = realloc(cand, cand_size * sizeof(struct candidate));
+                }
+                struct candidate *c = cand + ncand++;
+                memset(c, 0, sizeof(struct candidate));
+                memcpy(c->sym, asym, alen);
+                if (bsym) memcpy(c->sym + alen, bsym, blen);
+                c->len = alen + blen;
+                c->gain = (uint64_t)freq * c->len;
+            }
+        }
+
+        /* the same string can be reached by more than one route, so merge
+         * duplicates before ranking them */
+        qsort(cand, ncand, sizeof(struct candidate), candidate_by_symbol);
+        size_t merged = 0;
+        for (size_t i=0; i<ncand; i++) {
+            if (merged && !candidate_by_symbol(cand + merged - 1, cand + i)) {
+                cand[merged - 1].gain += cand[i].gain;
+            } else {
+                cand[merged++] = cand[i];
+            }
+        }
+        qsort(cand, merged, sizeof(struct candidate), candidate_by_gain);
+
+        st->count = merged < FS_SYMTAB_MAX_SYMBOLS ? merged : FS_SYMTAB_MAX_SYMBOLS;
+        for (int c=0; c<st->count; c++) {
+            st->len[c] = cand[c].len;
+            memcpy(st->sym[c], cand[c].sym, FS_SYMTAB_MAX_SYMBOL_LEN);
+        }
+        build_index(st);
+    }
+
+    free(cand);
+    free(count2);
+    free(count1);
+
+    return st;
+}
+
+fs_symtab *fs_symtab_read(const char *filename)
+{
+    int fd = open(filename, FS_O_NOATIME | O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fs_error(LOG_ERR, "cannot open symbol table '%s': %s", filename, strerror(errno));
+        }
+
+        return NULL;
+    }
+
+    fs_symtab *st = calloc(1, sizeof(fs_symtab));
+    struct symtab_header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.id != FS_SYMTAB_ID || header.count > FS_SYMTAB_MAX_SYMBOLS) {
+        fs_error(LOG_ERR, "bad header in symbol table '%s'", filename);
+        goto fail;
+    }
+    st->count = header.count;
+    const ssize_t sym_size = st->count * FS_SYMTAB_MAX_SYMBOL_LEN;
+    if (read(fd, st->len, st->count) != st->count ||
+        read(fd, st->sym, sym_size) != sym_size) {
+        fs_error(LOG_ERR, "short read from symbol table '%s'", filename);
+        goto fail;
+    }
+    for (int c=0; c<st->count; c++) {
+        if (st->len[c] < 1 || st->len[c] > FS_SYMTAB_MAX_SYMBOL_LEN) {
+            fs_error(LOG_ERR, "bad symbol length in symbol table '%s'", filename);
+            goto fail;
+        }
+    }
+    close(fd);
+    build_index(st);
+
+    return st;
+
+fail:
+    close(fd);
+    free(st);
+
+    return NULL;
+}
+
+int fs_symtab_write(fs_symtab *st, const char *filename)
+{
+    /* values coded with the table are unreadable without it, so make sure
+     * we never leave a partial one behind */
+    char *tmp = g_strdup_printf("%s.tmp", filename);
+    int fd = open(tmp, FS_O_NOATIME | O_WRONLY | O_CREAT | O_TRUNC, FS_FILE_MODE);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "cannot create symbol table '%s': %s", tmp, strerror(errno));
+        g_free(tmp);
+
+        return 1;
+    }
+    struct symtab_header header = { .id = FS_SYMTAB_ID, .count = st->count };
+    const ssize_t sym_size = st->count * FS_SYMTAB_MAX_SYMBOL_LEN;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, st->len, st->count) != st->count ||
+        write(fd, st->sym, sym_size) != sym_size || fsync(fd) == -1) {
+        fs_error(LOG_ERR, "failed writing symbol table '%s': %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        g_free(tmp);
+
+        return 1;
+    }
+    close(fd);
+    if (rename(tmp, filename) == -1) {
+        fs_error(LOG_ERR, "failed to rename '%s': %s", tmp, strerror(errno));
+        unlink(tmp);
+        g_free(tmp);
+
+        return 1;
+    }
+    g_free(tmp);
+
+    return 0;
+}
+
+int fs_symtab_count(fs_symtab *st)
+{
+    return st->count;
+}
+
+size_t fs_symtab_compress(fs_symtab *st, const char *in, size_t len, unsigned char *out)
+{
+    size_t o = 0;
+
+    for (size_t p=0; p<len; ) {
+        const int c = match(st, in + p, len - p);
+        if (c == -1) {
+            out[o++] = ESCAPE;
+            out[o++] = in[p++];
+        } else {
+            out[o++] = c;
+            p += st->len[c];
+        }
+    }
+
+    return o;
+}
+
+long fs_symtab_decompress(fs_symtab *st, const unsigned char *in, size_t len, char *out, size_t out_len)
+{
+    size_t o = 0;
+
+    for (size_t p=0; p<len; p++) {
+        const uint8_t c = in[p];
+        if (c == ESCAPE) {
+            if (++p == len || o == out_len) return -1;
+            out[o++] = in[p];
+        } else {
+            if (c >= st->count) return -1;
+            const int l = st->len[c];
+            if (o + FS_SYMTAB_MAX_SYMBOL_LEN <= out_len) {
+                /* copying the whole slot is cheaper than a variable length
+                 * copy, the excess is overwritten by what follows */
+                memcpy(out + o, st->sym[c], FS_SYMTAB_MAX_SYMBOL_LEN);
+            } else if (o + l <= out_len) {
+                memcpy(out + o, st->sym[c], l);
+            } else {
+                return -1;
+            }
+            o += l;
+        }
+    }
+
+    return o;
+}
+
+void fs_symtab_free(fs_symtab *st)
+{
+    free(st);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,37 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stddef.h>
+
+/* static symbol table compression for short strings, up to 255 symbols of 1-8
+ * bytes each are trained from a sample, and strings are coded as one byte per
+ * symbol, with an escape code for bytes not covered by the table */
+
+#define FS_SYMTAB_MAX_SYMBOLS 255
+#define FS_SYMTAB_MAX_SYMBOL_LEN 8
+
+typedef struct _fs_symtab fs_symtab;
+
+/* train a table from len bytes of '\0' separated sample strings */
+fs_symtab *fs_symtab_train(const char *sample, size_t len);
+
+fs_symtab *fs_symtab_read(const char *filename);
+
+int fs_symtab_write(fs_symtab *st, const char *filename);
+
+/* returns the number of symbols in the table */
+int fs_symtab_count(fs_symtab *st);
+
+/* out must have room for FS_SYMTAB_COMPRESS_BOUND(len) bytes, returns the
+ * compressed length */
+#define FS_SYMTAB_COMPRESS_BOUND(len) ((len) * 2)
+size_t fs_symtab_compress(fs_symtab *st, const char *in, size_t len, unsigned char *out);
+
+/* returns the decompressed length, or -1 if it would be more than out_len */
+long fs_symtab_decompress(fs_symtab *st, const unsigned char *in, size_t len, char *out, size_t out_len);
+
+void fs_symtab_free(fs_symtab *st);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
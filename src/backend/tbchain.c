@@ -52,7 +52,12 @@ struct fs_tbc_header {
     int64_t size;
     int64_t length;
     fs_index_node free_list;
-    char padding[484];
+    fs_index_node free_count;   /* length of the free list, if counted is set */
+    fs_index_node counted;
+    fs_index_node vacuum_limit; /* blocks from here on are being moved down by
+                                 * a vacuum, 0 if none is running */
+    fs_index_node vacuum_free;  /* free blocks past vacuum_limit */
+    char padding[468];
 };
 
 typedef struct _fs_tblock {
@@ -194,6 +199,8 @@ fs_tbchain *fs_tbchain_open_filename(const char *fname, int flags)
         return NULL;
     }
     if (init_reqd) {
+        bc->header->free_count = 0;
+        bc->header->counted = 1;
         for (fs_index_node i = 2; i < header.size; i++) {
             fs_tbchain_free_block(bc, i);
         }
@@ -279,13 +286,17 @@ static fs_index_node fs_tbchain_new_block(fs_tbchain *bc)
 
         bc->header->length = size * 2;
         for (fs_index_node i = size; i < size * 2; i++) {
-            fs_tbchain_free_block(bc, i);
+            /* straight onto the free list, even if a vacuum is running */
+            bc->data[i].cont = bc->header->free_list;
+            bc->header->free_list = i;
+            bc->header->free_count++;
         }
     }
 
     if (bc->header->free_list) {
         fs_index_node newb = bc->header->free_list;
         bc->header->free_list = bc->data[newb].cont;
+        bc->header->free_count--;
         memset(&bc->data[newb], 0, sizeof(fs_tblock));
         TIME("reuse + clear block");
 
@@ -440,8 +451,16 @@ static int fs_tbchain_free_block(fs_tbchain *bc, fs_index_node b)
         return 1;
     }
     
-    bc->data[b].cont = bc->header->free_list;
-    bc->header->free_list = b;
+    /* blocks past the limit of a running vacuum are kept aside, so they're
+     * not reused before the chain file is cut short */
+    if (bc->header->vacuum_limit && b >= bc->header->vacuum_limit) {
+        bc->data[b].cont = bc->header->vacuum_free;
+        bc->header->vacuum_free = b;
+    } else {
+        bc->data[b].cont = bc->header->free_list;
+        bc->header->free_list = b;
+    }
+    bc->header->free_count++;
 
     return 0;
 }
@@ -575,6 +594,13 @@ int fs_tbchain_check_leaks(fs_tbchain *bc, FILE *out)
         }
         bc->const_data[f] = UINT_MAX;
     }
+    for (fs_index_node f = bc->header->vacuum_free; f; f = bc->data[f].cont) {
+        if (bc->const_data[f]) {
+            fprintf(out, "ERROR: B%d appears in the vacuum free list and chain %d\n", f, bc->const_data[f]);
+            retval = 1;
+        }
+        bc->const_data[f] = UINT_MAX;
+    }
 
     int lost_range = 0;
     for (fs_index_node i = 2; i < bc->header->size; i++) {
@@ -599,6 +625,253 @@ int fs_tbchain_check_leaks(fs_tbchain *bc, FILE *out)
     return retval;
 }
 
+/* chain files written before the free list was counted are counted on first
+ * use */
+static void count_free(fs_tbchain *bc)
+{
+    if (bc->header->counted) return;
+
+    fs_index_node count = 0;
+    for (fs_index_node f = bc->header->free_list; f; f = bc->data[f].cont) {
+        count++;
+    }
+    for (fs_index_node f = bc->header->vacuum_free; f; f = bc->data[f].cont) {
+        count++;
+    }
+    bc->header->free_count = count;
+    bc->header->counted = 1;
+}
+
+/* returns a bitmap with the free blocks set */
+static uint64_t *free_blocks(fs_tbchain *bc)
+{
+    uint64_t *map = calloc(bc->header->length / 64 + 1, sizeof(uint64_t));
+    if (!map) {
+        fs_error(LOG_ERR, "cannot allocate free block map for %s", bc->filename);
+
+        return NULL;
+    }
+    for (fs_index_node f = bc->header->free_list; f; f = bc->data[f].cont) {
+        map[f / 64] |= 1ULL << (f % 64);
+    }
+    for (fs_index_node f = bc->header->vacuum_free; f; f = bc->data[f].cont) {
+        map[f / 64] |= 1ULL << (f % 64);
+    }
+
+    return map;
+}
+
+#define IS_FREE(map, b) ((map)[(b) / 64] & (1ULL << ((b) % 64)))
+
+int fs_tbchain_vacuum_start(fs_tbchain *bc, double fraction)
+{
+    if (!(bc->flags & (O_RDWR | O_WRONLY))) {
+        return 1;
+    }
+    if (bc->header->vacuum_limit) {
+        return 0;
+    }
+    count_free(bc);
+    /* a new file is mostly free blocks, don't bother until it's grown */
+    if (bc->header->length <= TBCHAIN_INIT_SIZE ||
+        bc->header->free_count < bc->header->length * fraction) {
+        return 1;
+    }
+
+    uint64_t *map = free_blocks(bc);
+    if (!map) {
+        return 1;
+    }
+    /* there are as many free blocks below the limit as there are live
+     * blocks past it */
+    const fs_index_node limit = bc->header->length - bc->header->free_count;
+    bc->header->free_list = 0;
+    bc->header->vacuum_free = 0;
+    for (fs_index_node b = bc->header->length - 1; b > 1; b--) {
+        if (!IS_FREE(map, b)) continue;
+        if (b >= limit) {
+            bc->data[b].cont = bc->header->vacuum_free;
+            bc->header->vacuum_free = b;
+        } else {
+            bc->data[b].cont = bc->header->free_list;
+            bc->header->free_list = b;
+        }
+    }
+    free(map);
+    bc->header->vacuum_limit = limit > 2 ? limit : 2;
+
+    return 0;
+}
+
+fs_index_node fs_tbchain_vacuum_chain(fs_tbchain *bc, fs_index_node b)
+{
+    const fs_index_node limit = bc->header->vacuum_limit;
+    if (!limit || b < 2 || b >= bc->header->length) {
+        return b;
+    }
+
+    int length = 0;
+    int high = 0;
+    int scattered = 0;
+    for (fs_index_node n = b, prev = 0; n; prev = n, n = bc->data[n].cont) {
+        if (n >= limit) {
+            high = 1;
+        } else if (prev && n != prev + 1 && n + 1 != prev) {
+            scattered = 1;
+        }
+        length++;
+    }
+    if (!high && !scattered) {
+        return b;
+    }
+
+    fs_index_node *to = malloc(length * sizeof(fs_index_node));
+    int got = 0;
+    int run = 1;
+    while (got < length && bc->header->free_list) {
+        to[got] = bc->header->free_list;
+        bc->header->free_list = bc->data[to[got]].cont;
+        if (got && to[got] != to[got-1] + 1) run = 0;
+        got++;
+    }
+    /* only worth moving a chain that's below the limit if it ends up in a
+     * run, otherwise put the blocks back as they were */
+    if (got < length || !(run || high)) {
+        while (got > 0) {
+            got--;
+            bc->data[to[got]].cont = bc->header->free_list;
+            bc->header->free_list = to[got];
+        }
+        free(to);
+        if (!high) {
+            return b;
+        }
+
+        /* there's not room for the whole chain, but there's always room for
+         * the blocks past the limit */
+        fs_index_node prev = 0;
+        for (fs_index_node n = b; n; ) {
+            const fs_index_node next = bc->data[n].cont;
+            if (n >= limit && bc->header->free_list) {
+                const fs_index_node nn = bc->header->free_list;
+                bc->header->free_list = bc->data[nn].cont;
+                bc->header->free_count--;
+                memcpy(&bc->data[nn], &bc->data[n], sizeof(fs_tblock));
+                if (prev) {
+                    bc->data[prev].cont = nn;
+                } else {
+                    b = nn;
+                }
+                fs_tbchain_free_block(bc, n);
+                n = nn;
+            }
+            prev = n;
+            n = next;
+        }
+
+        return b;
+    }
+    bc->header->free_count -= length;
+
+    fs_index_node n = b;
+    for (int i=0; i<length; i++) {
+        const fs_index_node next = bc->data[n].cont;
+        memcpy(&bc->data[to[i]], &bc->data[n], sizeof(fs_tblock));
+        bc->data[to[i]].cont = i+1 < length ? to[i+1] : 0;
+        fs_tbchain_free_block(bc, n);
+        n = next;
+    }
+    const fs_index_node head = to[0];
+    free(to);
+
+    return head;
+}
+
+fs_index_node fs_tbchain_vacuum_finish(fs_tbchain *bc)
+{
+    if (!bc->header->vacuum_limit) {
+        return 0;
+    }
+
+    uint64_t *map = free_blocks(bc);
+    if (!map) {
+        return 0;
+    }
+    fs_index_node used = bc->header->length;
+    while (used > 2 && IS_FREE(map, used - 1)) {
+        used--;
+    }
+    /* the file stays the size it was, forked readers can still have all of
+     * it mapped, so it's threaded with free blocks right to the end, lowest
+     * first, see fs_tbchain_trim() */
+    bc->header->free_list = 0;
+    bc->header->vacuum_free = 0;
+    bc->header->vacuum_limit = 0;
+    fs_index_node count = 0;
+    for (fs_index_node b = bc->header->length - 1; b > 1; b--) {
+        if (IS_FREE(map, b)) {
+            bc->data[b].cont = bc->header->free_list;
+            bc->header->free_list = b;
+            count++;
+        }
+    }
+    free(map);
+    const fs_index_node reclaimed = bc->header->length - used;
+    bc->header->free_count = count;
+
+    return reclaimed;
+}
+
+fs_index_node fs_tbchain_trim(fs_tbchain *bc)
+{
+    if (!(bc->flags & (O_RDWR | O_WRONLY)) || bc->header->vacuum_limit) {
+        return 0;
+    }
+
+    uint64_t *map = free_blocks(bc);
+    if (!map) {
+        return 0;
+    }
+    fs_index_node used = bc->header->length;
+    while (used > 2 && IS_FREE(map, used - 1)) {
+        used--;
+    }
+    /* the file is always fully threaded with free blocks, so keep to the
+     * sizes it would have grown through */
+    int64_t size = TBCHAIN_INIT_SIZE;
+    while (size < used) size *= 2;
+    const int64_t old_size = bc->header->size;
+    if (size >= old_size) {
+        free(map);
+
+        return 0;
+    }
+    bc->header->free_list = 0;
+    fs_index_node count = 0;
+    for (fs_index_node b = size - 1; b > 1; b--) {
+        if (IS_FREE(map, b)) {
+            bc->data[b].cont = bc->header->free_list;
+            bc->header->free_list = b;
+            count++;
+        }
+    }
+    free(map);
+    bc->header->free_count = count;
+    bc->header->counted = 1;
+
+    unmap_bc(bc);
+    if (ftruncate(bc->fd, (size + 1) * sizeof(fs_tblock) + sizeof(struct fs_tbc_header)) == -1) {
+        fs_error(LOG_ERR, "failed to truncate %s: %s", bc->filename, strerror(errno));
+    }
+    if (map_bc(bc, size, size)) {
+        fs_error(LOG_CRIT, "failed to remap %s after trim", bc->filename);
+
+        return 0;
+    }
+
+    return old_size - size;
+}
+
 int fs_tbchain_unlink(fs_tbchain *bc)
 {
     if (!bc) return 1;
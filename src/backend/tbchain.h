@@ -49,6 +49,19 @@ int fs_tbchain_check_consistency(fs_tbchain *bc, fs_rid model, fs_index_node cha
  * consistency */
 int fs_tbchain_check_leaks(fs_tbchain *bc, FILE *out);
 
+/* vacuuming, as for ptables, see ptable.h */
+
+/* start a vacuum if at least fraction of the blocks are free, returns 0 if
+ * one is running */
+int fs_tbchain_vacuum_start(fs_tbchain *bc, double fraction);
+/* move chain b, returns its new head */
+fs_index_node fs_tbchain_vacuum_chain(fs_tbchain *bc, fs_index_node b);
+/* finish once every chain has been moved, returns the number of blocks freed
+ * past the last live one, the file keeps its size */
+fs_index_node fs_tbchain_vacuum_finish(fs_tbchain *bc);
+/* shrink the file after its last live block, as fs_ptable_trim() */
+fs_index_node fs_tbchain_trim(fs_tbchain *bc);
+
 /* iterator functions */
 
 /* create an interator, return NULL on fail */
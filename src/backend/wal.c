@@ -0,0 +1,663 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <glib.h>
+#include <zlib.h>
+
+#include "backend.h"
+#include "wal.h"
+#include "../common/params.h"
+#include "../common/error.h"
+
+#define FS_WAL_ID 0x4a58574c
+#define FS_WAL_REVISION 1
+#define FS_WAL_HEADER_SIZE 4096
+
+/* the log is emptied by the first update to finish after it passes
+ * FS_WAL_CHECKPOINT_SIZE, a transaction that would log more than
+ * FS_WAL_MAX_TXN bytes is synced to the indexes instead */
+#define FS_WAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+#define FS_WAL_MAX_TXN         (16 * 1024 * 1024)
+
+/* bytes of the header locked with fcntl(), updaters hold a read lock on
+ * LOCK_TXN while their transaction is open, and checkpoints need a write
+ * lock. LOCK_SYNC is held by the process syncing the log for a group of
+ * commits. LOCK_APPLY is held from a transaction's commit record until it's
+ * been applied, so updates are applied in the order they were committed */
+#define LOCK_TXN   0
+#define LOCK_SYNC  1
+#define LOCK_APPLY 2
+
+#define FS_PACKED __attribute__((__packed__))
+
+struct wal_header {
+    int32_t id;             // "JXWL"
+    int32_t revision;
+    uint64_t synced;        // the log is on disk up to here
+    uint64_t applied;       // transactions committed before here are in the
+                            // indexes, 0 in logs written before it was kept
+    char padding[4072];
+} FS_PACKED;
+
+struct wal_record {
+    uint32_t crc;           // crc32 of the rest of the record
+    uint32_t length;        // bytes of payload
+    uint32_t type;          // FS_WAL_*
+    uint32_t count;
+    uint64_t txn;           // offset of the first record of the transaction,
+                            // or 0 in that record
+} FS_PACKED;
+
+/* a resource in the payload is rid, attr, lex length, then the lex */
+#define RES_FIXED (sizeof(fs_rid) * 2 + sizeof(uint32_t))
+
+struct _fs_wal {
+    char *filename;
+    int fd;
+    struct wal_header *header;
+    int open;               // a transaction is open
+    int unlogged;           // the transaction isn't all in the log
+    int applying;           // we hold LOCK_APPLY
+    int writable;
+    uint64_t txn;           // offset of the transaction's first record
+    uint64_t txn_bytes;
+    uint64_t end;           // end of our last record
+};
+
+static int lock_byte(fs_wal *wal, off_t byte, short type, int wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(wal->fd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+        if (!wait && (errno == EAGAIN || errno == EACCES)) {
+            return 1;
+        }
+        if (errno != EINTR) {
+            fs_error(LOG_ERR, "failed to lock '%s': %s", wal->filename, strerror(errno));
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+fs_wal *fs_wal_open(fs_backend *be, fs_segment seg, int flags)
+{
+    char *filename = g_strdup_printf(FS_WAL, fs_backend_get_kb(be), seg);
+    fs_wal *wal = fs_wal_open_filename(filename, flags);
+    g_free(filename);
+
+    return wal;
+}
+
+fs_wal *fs_wal_open_filename(const char *filename, int flags)
+{
+    if (sizeof(struct wal_header) != FS_WAL_HEADER_SIZE) {
+        fs_error(LOG_CRIT, "incorrect wal header size %zd, should be %d",
+                 sizeof(struct wal_header), FS_WAL_HEADER_SIZE);
+
+        return NULL;
+    }
+
+    /* the log is never truncated on open, that would lose updates */
+    flags &= ~O_TRUNC;
+    int fd = open(filename, FS_O_NOATIME | O_APPEND | flags, FS_FILE_MODE);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "cannot open wal '%s': %s", filename, strerror(errno));
+
+        return NULL;
+    }
+    fs_wal *wal = calloc(1, sizeof(fs_wal));
+    wal->filename = g_strdup(filename);
+    wal->fd = fd;
+    wal->writable = (flags & O_ACCMODE) != O_RDONLY;
+
+    if (lock_byte(wal, LOCK_SYNC, F_WRLCK, 1)) {
+        fs_wal_close(wal);
+
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fs_error(LOG_ERR, "cannot stat wal '%s': %s", filename, strerror(errno));
+        fs_wal_close(wal);
+
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        struct wal_header header;
+        memset(&header, 0, sizeof(header));
+        header.id = FS_WAL_ID;
+        header.revision = FS_WAL_REVISION;
+        header.synced = FS_WAL_HEADER_SIZE;
+        header.applied = FS_WAL_HEADER_SIZE;
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            fs_error(LOG_ERR, "cannot write wal header to '%s': %s", filename, strerror(errno));
+            fs_wal_close(wal);
+
+            return NULL;
+        }
+    } else if (st.st_size < FS_WAL_HEADER_SIZE) {
+        fs_error(LOG_ERR, "wal '%s' is truncated", filename);
+        fs_wal_close(wal);
+
+        return NULL;
+    }
+    lock_byte(wal, LOCK_SYNC, F_UNLCK, 1);
+
+    void *ptr = mmap(NULL, FS_WAL_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", filename, strerror(errno));
+        fs_wal_close(wal);
+
+        return NULL;
+    }
+    wal->header = ptr;
+    if (wal->header->id != FS_WAL_ID || wal->header->revision != FS_WAL_REVISION) {
+        fs_error(LOG_ERR, "%s does not appear to be a wal file", filename);
+        fs_wal_close(wal);
+
+        return NULL;
+    }
+
+    return wal;
+}
+
+static int checkpoint(fs_wal *wal, int wait);
+
+int fs_wal_close(fs_wal *wal)
+{
+    if (!wal) return 1;
+
+    /* a clean close leaves nothing to replay, unless there are updates in
+     * progress elsewhere */
+    if (wal->header && wal->writable && !wal->open && fs_wal_pending(wal)) {
+        checkpoint(wal, 0);
+    }
+    if (wal->header) {
+        munmap(wal->header, FS_WAL_HEADER_SIZE);
+    }
+    /* releases our locks */
+    close(wal->fd);
+    g_free(wal->filename);
+    free(wal);
+
+    return 0;
+}
+
+static int begin(fs_wal *wal)
+{
+    if (wal->open) {
+        return 0;
+    }
+    /* waits for a checkpoint to finish */
+    if (lock_byte(wal, LOCK_TXN, F_RDLCK, 1)) {
+        return 1;
+    }
+    wal->open = 1;
+    wal->unlogged = 0;
+    wal->txn = 0;
+    wal->txn_bytes = 0;
+
+    return 0;
+}
+
+/* buf has room for the record header, followed by length bytes of payload */
+static int append(fs_wal *wal, char *buf, int type, int count, size_t length)
+{
+    if (wal->unlogged) {
+        return 0;
+    }
+    const size_t total = sizeof(struct wal_record) + length;
+    if (type != FS_WAL_COMMIT && wal->txn_bytes + total > FS_WAL_MAX_TXN) {
+        wal->unlogged = 1;
+
+        return 0;
+    }
+
+    struct wal_record *rec = (struct wal_record *)buf;
+    rec->length = length;
+    rec->type = type;
+    rec->count = count;
+    rec->txn = wal->txn;
+    rec->crc = crc32(0, (Bytef *)buf + sizeof(rec->crc), total - sizeof(rec->crc));
+
+    /* O_APPEND, so records from different processes don't overlap */
+    const ssize_t written = write(wal->fd, buf, total);
+    if (written != (ssize_t)total) {
+        fs_error(LOG_CRIT, "failed writing to wal '%s': %s", wal->filename,
+                 written == -1 ? strerror(errno) : "short write");
+        wal->unlogged = 1;
+
+        return 1;
+    }
+    const off_t end = lseek(wal->fd, 0, SEEK_CUR);
+    if (!wal->txn) {
+        wal->txn = end - total;
+    }
+    wal->end = end;
+    wal->txn_bytes += total;
+
+    return 0;
+}
+
+int fs_wal_add_resources(fs_wal *wal, const fs_resource *res, int count)
+{
+    if (count == 0) return 0;
+    if (begin(wal)) return 1;
+
+    size_t length = 0;
+    for (int i=0; i<count; i++) {
+        length += RES_FIXED + (res[i].lex ? strlen(res[i].lex) : 0);
+    }
+    char *buf = malloc(sizeof(struct wal_record) + length);
+    char *pos = buf + sizeof(struct wal_record);
+    for (int i=0; i<count; i++) {
+        const uint32_t len = res[i].lex ? strlen(res[i].lex) : 0;
+        memcpy(pos, &res[i].rid, sizeof(fs_rid));
+        memcpy(pos + sizeof(fs_rid), &res[i].attr, sizeof(fs_rid));
+        memcpy(pos + sizeof(fs_rid) * 2, &len, sizeof(len));
+        memcpy(pos + RES_FIXED, res[i].lex, len);
+        pos += RES_FIXED + len;
+    }
+    const int ret = append(wal, buf, FS_WAL_RESOURCES, count, length);
+    free(buf);
+
+    return ret;
+}
+
+static int add_rids(fs_wal *wal, int type, const fs_rid *rids, int count, int width)
+{
+    if (count == 0) return 0;
+    if (begin(wal)) return 1;
+
+    const size_t length = sizeof(fs_rid) * width * count;
+    char *buf = malloc(sizeof(struct wal_record) + length);
+    memcpy(buf + sizeof(struct wal_record), rids, length);
+    const int ret = append(wal, buf, type, count, length);
+    free(buf);
+
+    return ret;
+}
+
+int fs_wal_add_quads(fs_wal *wal, int type, fs_rid quads[][4], int count)
+{
+    return add_rids(wal, type, (const fs_rid *)quads, count, 4);
+}
+
+int fs_wal_add_models(fs_wal *wal, const fs_rid *models, int count)
+{
+    return add_rids(wal, FS_WAL_DELETE_MODELS, models, count, 1);
+}
+
+/* group commit, the first process to get the lock syncs everything that's
+ * been appended so far, the others find their records already on disk */
+static int sync_to(fs_wal *wal, uint64_t end)
+{
+    if (wal->header->synced >= end) {
+        return 0;
+    }
+    if (lock_byte(wal, LOCK_SYNC, F_WRLCK, 1)) {
+        return 1;
+    }
+    int ret = 0;
+    if (wal->header->synced < end) {
+        struct stat st;
+        if (fstat(wal->fd, &st) == -1 || fsync(wal->fd) == -1) {
+            fs_error(LOG_CRIT, "failed to sync wal '%s': %s", wal->filename, strerror(errno));
+            ret = 1;
+        } else {
+            wal->header->synced = st.st_size;
+        }
+    }
+    lock_byte(wal, LOCK_SYNC, F_UNLCK, 1);
+
+    return ret;
+}
+
+int fs_wal_commit(fs_wal *wal)
+{
+    if (!wal->open) {
+        return 0;
+    }
+    /* released by fs_wal_end(), once the transaction's in the indexes */
+    if (!wal->applying) {
+        if (lock_byte(wal, LOCK_APPLY, F_WRLCK, 1)) {
+            return 1;
+        }
+        wal->applying = 1;
+    }
+    if (wal->unlogged) {
+        return 0;
+    }
+
+    char buf[sizeof(struct wal_record)];
+    if (append(wal, buf, FS_WAL_COMMIT, 0, 0)) {
+        return 1;
+    }
+
+    return sync_to(wal, wal->end);
+}
+
+/* fdatasync() every file under path, skipping the log itself, as closing
+ * another descriptor for it would drop our locks. The directories are synced
+ * too, so that files created since the last sync are found after a crash */
+static int sync_dir(fs_wal *wal, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fs_error(LOG_ERR, "cannot open '%s': %s", path, strerror(errno));
+
+        return 1;
+    }
+    int ret = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        char *name = g_strdup_printf("%s/%s", path, de->d_name);
+        struct stat st;
+        if (lstat(name, &st) == -1) {
+            /* removed since we read the directory */
+        } else if (S_ISDIR(st.st_mode)) {
+            ret += sync_dir(wal, name);
+        } else if (S_ISREG(st.st_mode) && strcmp(name, wal->filename)) {
+            int fd = open(name, FS_O_NOATIME | O_RDONLY);
+            if (fd != -1) {
+                if (fdatasync(fd) == -1) {
+                    fs_error(LOG_CRIT, "failed to sync '%s': %s", name, strerror(errno));
+                    ret++;
+                }
+                close(fd);
+            }
+        }
+        g_free(name);
+    }
+    if (fsync(dirfd(dir)) == -1 && errno != EINVAL) {
+        fs_error(LOG_CRIT, "failed to sync '%s': %s", path, strerror(errno));
+        ret++;
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+/* sync the indexes of the log's segment, the files of the trees that have
+ * been closed since they were written are still found, by name */
+static int sync_segment(fs_wal *wal)
+{
+    char *path = g_strdup(wal->filename);
+    const int ret = sync_dir(wal, dirname(path));
+    g_free(path);
+
+    return ret;
+}
+
+/* the transactions committed before offset are in the indexes, they won't be
+ * replayed */
+static int set_applied(fs_wal *wal, uint64_t offset)
+{
+    wal->header->applied = offset;
+    if (fdatasync(wal->fd) == -1) {
+        fs_error(LOG_CRIT, "failed to sync wal '%s': %s", wal->filename, strerror(errno));
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t applied(fs_wal *wal)
+{
+    return wal->header->applied < FS_WAL_HEADER_SIZE ?
+           FS_WAL_HEADER_SIZE : wal->header->applied;
+}
+
+/* all the indexes have to be on disk before the log can be emptied */
+static int checkpoint(fs_wal *wal, int wait)
+{
+    if (lock_byte(wal, LOCK_TXN, F_WRLCK, wait)) {
+        /* there's an update in progress, a later one will do it */
+        return wait;
+    }
+    int ret = sync_segment(wal);
+    if (!ret && ftruncate(wal->fd, FS_WAL_HEADER_SIZE) == -1) {
+        fs_error(LOG_ERR, "failed to truncate wal '%s': %s", wal->filename, strerror(errno));
+        ret = 1;
+    } else if (!ret) {
+        wal->header->synced = FS_WAL_HEADER_SIZE;
+        ret += set_applied(wal, FS_WAL_HEADER_SIZE);
+    }
+    lock_byte(wal, LOCK_TXN, F_UNLCK, 1);
+
+    return ret;
+}
+
+int fs_wal_end(fs_wal *wal)
+{
+    if (!wal->open) {
+        return 0;
+    }
+
+    int ret = 0;
+    if (wal->applying) {
+        /* a logged transaction is left for the next checkpoint to sync, after
+         * a crash it's replayed, which is harmless if it did reach the
+         * indexes. One that isn't all in the log has to be in the indexes
+         * before it's acknowledged, and as transactions are applied in commit
+         * order so are all the ones before it, none of them need replaying */
+        if (wal->unlogged) {
+            struct stat st;
+            ret = fstat(wal->fd, &st) == -1 || sync_segment(wal);
+            if (!ret && st.st_size > applied(wal)) {
+                ret = set_applied(wal, st.st_size);
+            }
+        }
+        lock_byte(wal, LOCK_APPLY, F_UNLCK, 1);
+        wal->applying = 0;
+    }
+    wal->open = 0;
+    lock_byte(wal, LOCK_TXN, F_UNLCK, 1);
+
+    struct stat st;
+    if (fstat(wal->fd, &st) == 0 && st.st_size > FS_WAL_CHECKPOINT_SIZE) {
+        ret += checkpoint(wal, 0);
+    }
+
+    return ret;
+}
+
+int fs_wal_checkpoint(fs_wal *wal)
+{
+    return checkpoint(wal, 1);
+}
+
+int fs_wal_pending(fs_wal *wal)
+{
+    struct stat st;
+    if (fstat(wal->fd, &st) == -1) {
+        return 0;
+    }
+
+    return st.st_size > applied(wal);
+}
+
+static guint txn_hash(gconstpointer p)
+{
+    const uint64_t *t = p;
+
+    return (guint)(*t ^ (*t >> 32));
+}
+
+static gboolean txn_equal(gconstpointer va, gconstpointer vb)
+{
+    const uint64_t *a = va;
+    const uint64_t *b = vb;
+
+    return *a == *b;
+}
+
+static void free_offsets(gpointer p)
+{
+    g_array_free(p, TRUE);
+}
+
+static int replay_record(const char *ptr, uint64_t offset, fs_wal_replay_fn fn, void *data)
+{
+    const struct wal_record *rec = (const struct wal_record *)(ptr + offset);
+    const char *payload = ptr + offset + sizeof(struct wal_record);
+    fs_wal_record r = { .type = rec->type, .count = rec->count };
+    int ret;
+
+    switch (rec->type) {
+    case FS_WAL_RESOURCES:
+        r.res = calloc(rec->count, sizeof(fs_resource));
+        for (int i=0; i<rec->count; i++) {
+            uint32_t len;
+            memcpy(&r.res[i].rid, payload, sizeof(fs_rid));
+            memcpy(&r.res[i].attr, payload + sizeof(fs_rid), sizeof(fs_rid));
+            memcpy(&len, payload + sizeof(fs_rid) * 2, sizeof(len));
+            r.res[i].lex = g_strndup(payload + RES_FIXED, len);
+            payload += RES_FIXED + len;
+        }
+        ret = fn(data, &r);
+        for (int i=0; i<rec->count; i++) {
+            g_free(r.res[i].lex);
+        }
+        free(r.res);
+        break;
+    case FS_WAL_QUADS:
+    case FS_WAL_DELETE_QUADS:
+        r.quads = malloc(rec->length);
+        memcpy(r.quads, payload, rec->length);
+        ret = fn(data, &r);
+        free(r.quads);
+        break;
+    case FS_WAL_DELETE_MODELS:
+        r.models = malloc(rec->length);
+        memcpy(r.models, payload, rec->length);
+        ret = fn(data, &r);
+        free(r.models);
+        break;
+    default:
+        ret = fn(data, &r);
+        break;
+    }
+
+    return ret;
+}
+
+/* true if the record at offset is whole and its checksum matches */
+static int record_valid(const char *ptr, uint64_t offset, uint64_t size)
+{
+    if (offset + sizeof(struct wal_record) > size) {
+        return 0;
+    }
+    const struct wal_record *rec = (const struct wal_record *)(ptr + offset);
+    if (rec->type < FS_WAL_RESOURCES || rec->type > FS_WAL_COMMIT ||
+        offset + sizeof(struct wal_record) + rec->length > size) {
+        return 0;
+    }
+    const uint32_t crc = crc32(0, (const Bytef *)rec + sizeof(rec->crc),
+                   sizeof(struct wal_record) - sizeof(rec->crc) + rec->length);
+
+    return crc == rec->crc;
+}
+
+int fs_wal_replay(fs_wal *wal, fs_wal_replay_fn fn, void *data)
+{
+    struct stat st;
+    if (fstat(wal->fd, &st) == -1) {
+        fs_error(LOG_ERR, "cannot stat wal '%s': %s", wal->filename, strerror(errno));
+
+        return -1;
+    }
+    const uint64_t size = st.st_size;
+    if (size <= FS_WAL_HEADER_SIZE) {
+        return 0;
+    }
+    char *ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, wal->fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to mmap '%s': %s", wal->filename, strerror(errno));
+
+        return -1;
+    }
+
+    /* the offsets of the records of each open transaction, they're replayed
+     * when its commit record turns up */
+    GHashTable *txns = g_hash_table_new_full(txn_hash, txn_equal, g_free, free_offsets);
+    int replayed = 0, errs = 0;
+    uint64_t offset = FS_WAL_HEADER_SIZE;
+    while (offset < size && record_valid(ptr, offset, size)) {
+        const struct wal_record *rec = (const struct wal_record *)(ptr + offset);
+        uint64_t txn = rec->txn ? rec->txn : offset;
+        GArray *records = g_hash_table_lookup(txns, &txn);
+        if (!records) {
+            records = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+            g_hash_table_insert(txns, g_memdup(&txn, sizeof(txn)), records);
+        }
+        if (rec->type == FS_WAL_COMMIT && offset < applied(wal)) {
+            /* already in the indexes */
+            g_hash_table_remove(txns, &txn);
+        } else if (rec->type == FS_WAL_COMMIT) {
+            for (int i=0; i<records->len; i++) {
+                errs += replay_record(ptr, g_array_index(records, uint64_t, i), fn, data) != 0;
+            }
+            errs += replay_record(ptr, offset, fn, data) != 0;
+            g_hash_table_remove(txns, &txn);
+            replayed++;
+        } else {
+            g_array_append_val(records, offset);
+        }
+        offset += sizeof(struct wal_record) + rec->length;
+    }
+    if (offset < size) {
+        fs_error(LOG_WARNING, "discarding %lld bytes of '%s' after a torn record",
+                 (long long)(size - offset), wal->filename);
+    }
+    if (g_hash_table_size(txns)) {
+        fs_error(LOG_INFO, "discarding %d uncommitted transactions from '%s'",
+                 g_hash_table_size(txns), wal->filename);
+    }
+    g_hash_table_destroy(txns);
+    munmap(ptr, size);
+
+    if (errs) {
+        fs_error(LOG_ERR, "%d records from '%s' failed to replay", errs, wal->filename);
+    }
+
+    return replayed;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,75 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "backend.h"
+
+/* the write-ahead log of a segment
+ *
+ * Updates are appended to the log, as checksummed records, before they're
+ * applied to the indexes. An update is acknowledged once its commit record is
+ * on disk; the processes committing at the same time share a single sync of
+ * the log. Updates are applied one at a time, in commit order. The segment's
+ * files are only synced when the log is emptied, on a clean close, or once
+ * it's grown past a limit and there are no updates in progress. On startup
+ * the committed updates after the applied mark are applied again, in commit
+ * order; the pairs that made it to the indexes before a crash are skipped
+ * then.
+ *
+ * A transaction that would grow too big to log is synced with the indexes by
+ * fs_wal_end(), which then moves the applied mark past it, as everything
+ * committed before it has been applied too. */
+
+typedef struct _fs_wal fs_wal;
+
+#define FS_WAL_RESOURCES     1
+#define FS_WAL_QUADS         2
+#define FS_WAL_DELETE_QUADS  3
+#define FS_WAL_DELETE_MODELS 4
+#define FS_WAL_COMMIT        5
+
+/* a record, as decoded for fs_wal_replay() */
+typedef struct {
+    int type;
+    int count;
+    fs_resource *res;       // FS_WAL_RESOURCES
+    fs_rid (*quads)[4];     // FS_WAL_QUADS and FS_WAL_DELETE_QUADS
+    fs_rid *models;         // FS_WAL_DELETE_MODELS
+} fs_wal_record;
+
+typedef int (*fs_wal_replay_fn)(void *data, const fs_wal_record *rec);
+
+fs_wal *fs_wal_open(fs_backend *be, fs_segment seg, int flags);
+fs_wal *fs_wal_open_filename(const char *filename, int flags);
+
+/* checkpoints first, unless there are updates in progress elsewhere */
+int fs_wal_close(fs_wal *wal);
+
+/* append to this process' transaction, the first record starts it, and
+ * checkpoints wait until it's ended */
+int fs_wal_add_resources(fs_wal *wal, const fs_resource *res, int count);
+int fs_wal_add_quads(fs_wal *wal, int type, fs_rid quads[][4], int count);
+int fs_wal_add_models(fs_wal *wal, const fs_rid *models, int count);
+
+/* append a commit record, returns once it's on disk, and waits for
+ * transactions committed before it to be applied */
+int fs_wal_commit(fs_wal *wal);
+
+/* the transaction has been applied to the indexes, syncs them if it wasn't
+ * all logged, then checkpoints if the log is big enough */
+int fs_wal_end(fs_wal *wal);
+
+/* true if the log holds any records after the applied mark */
+int fs_wal_pending(fs_wal *wal);
+
+/* call fn for each record of each committed transaction that's not been
+ * applied, in the order they were committed, and then for the commit record itself. Stops at the first
+ * torn or corrupt record. Returns the number of transactions replayed, or -1
+ * on error */
+int fs_wal_replay(fs_wal *wal, fs_wal_replay_fn fn, void *data);
+
+/* sync the indexes and empty the log, waits for updates in progress */
+int fs_wal_checkpoint(fs_wal *wal);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
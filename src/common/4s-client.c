@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 #include <glib.h>
@@ -44,7 +45,7 @@ static const char *invalid_response(unsigned char *msg)
 {
   if (!msg) {
     return "no reply";
-  } else if (msg[3] == FS_ERROR) {
+  } else if (msg[3] == FS_ERROR || msg[3] == FS_CANCELLED) {
     return (char *) msg + FS_HEADER;
   } else {
     return "incorrect reply type";
@@ -92,19 +93,21 @@ char *fsp_argv_password (int *argc, char *argv[]) {
   return password;
 }
 
-static int check_message(fsp_link *link, int sock, const char *message)
+static unsigned char *fsp_recv(fsp_link *link, fs_segment segment, int sock,
+                               unsigned int *length);
+static struct fsp_mux *mux_open (fsp_link *link, int server, fs_segment segment);
+
+static int check_message(fsp_link *link, fs_segment segment, int sock, const char *message)
 {
   int ret = 0;
-  fs_segment segment;
   unsigned int ignored;
-  unsigned char *in = message_recv(sock, &segment, &ignored);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &ignored);
 
   if (!in || in[3] != FS_DONE_OK) {
     link_error(LOG_ERR, message, segment, invalid_response(in));
     ret = 1;
   }
-  free(in);
+  message_free(in);
 
   return ret;
 }
@@ -120,6 +123,48 @@ static void features (fsp_link *link, const char *string)
   }
 }
 
+/* send an FS_SHM_ENABLE carrying length bytes of content, and wait for the
+   answer */
+static unsigned char *shm_request (fsp_link *link, int sock,
+                                   const void *content, unsigned int length)
+{
+  unsigned char *out = message_new(FS_SHM_ENABLE, 0, length);
+  if (length) memcpy(out + FS_HEADER, content, length);
+  if (write(sock, out, FS_HEADER + length) != (FS_HEADER + length)) {
+    link_error(LOG_ERR, "write failed: %s", strerror(errno));
+    free(out);
+    return NULL;
+  }
+  free(out);
+
+  fs_segment segment;
+  unsigned int ignored;
+  return message_recv_reply(sock, &segment, &ignored);
+}
+
+/* ask a backend on this host to hand over big replies in shared memory,
+   message_recv_reply() picks them up. The backend answers with a probe
+   object, which we confirm only if we could read it, otherwise (say we're
+   in another IPC namespace) replies keep coming over the socket */
+static void shm_enable (fsp_link *link, int sock)
+{
+  if (!fsp_socket_is_local(sock)) return;
+
+  unsigned char *in = shm_request(link, sock, NULL, 0);
+  if (!in || in[3] != FS_DONE_OK) {
+    message_free(in);
+    return;
+  }
+
+  /* the probe holds its own name */
+  unsigned int length;
+  memcpy(&length, in + 4, sizeof(length));
+  if (length > 0 && in[FS_HEADER + length - 1] == '\0') {
+    message_free(shm_request(link, sock, in + FS_HEADER, length));
+  }
+  message_free(in);
+}
+
 static int fsp_open_socket (fsp_link *link, const char *node, uint16_t port)
 {
   struct addrinfo hints, *info, *list;
@@ -173,7 +218,7 @@ static int fsp_open_socket (fsp_link *link, const char *node, uint16_t port)
   free(out);
 
   fs_segment segment;
-  unsigned char *in = message_recv(sock, &segment, &length);
+  unsigned char *in = message_recv_reply(sock, &segment, &length);
 
   if (!in || in[3] != FS_DONE_OK) {
     link_error(LOG_ERR, "auth failed: %s", invalid_response(in));
@@ -181,7 +226,11 @@ static int fsp_open_socket (fsp_link *link, const char *node, uint16_t port)
     sock = -1;
   }
   features(link, (char *) in + FS_HEADER);
-  free(in);
+  message_free(in);
+
+  if (sock != -1 && link->features && strstr(link->features, " shm-reply ")) {
+    shm_enable(link, sock);
+  }
 
   return sock;
 }
@@ -192,10 +241,10 @@ static unsigned char *segment_list(fsp_link *link, int server, int sock)
   unsigned char *list;
   fs_segment segments;
   unsigned int length;
-  unsigned char *in = message_recv(sock, &segments, &length);
+  unsigned char *in = message_recv_reply(sock, &segments, &length);
 
   if (in && in[3] == FS_ERROR) {
-    free(in);
+    message_free(in);
     unsigned char *out = message_new(FS_SEGMENTS, 0, 0);
     if (write(sock, out, FS_HEADER) != FS_HEADER) {
       link_error(LOG_ERR, "write failed: %s", strerror(errno));
@@ -204,20 +253,20 @@ static unsigned char *segment_list(fsp_link *link, int server, int sock)
     }
     expected = FS_SEGMENT_LIST;
     free(out);
-    in = message_recv(sock, &segments, &length);
+    in = message_recv_reply(sock, &segments, &length);
   }
 
   if (!in || in[3] != expected) {
     link_error(LOG_ERR, "segment list failed for %s port %d: %s",
                link->addrs[server], link->ports[server], invalid_response(in));
-    free(in);
+    message_free(in);
     return NULL;
   }
 
   if (link->segments && link->segments != segments) {
     link_error(LOG_WARNING, "%s port %d offers %d segments not %d",
                link->addrs[server], link->ports[server], segments, link->segments);
-    free(in);
+    message_free(in);
     return NULL;
   } else if (!link->segments) {
     link->segments = segments;
@@ -227,7 +276,7 @@ static unsigned char *segment_list(fsp_link *link, int server, int sock)
     if (length != link->segments) {
       link_error(LOG_WARNING, "segment list wrong size for %s port %d",
                link->addrs[server], link->ports[server]);
-      free(in);
+      message_free(in);
       return NULL;
     }
     list = in;
@@ -310,12 +359,12 @@ static int choose_segment (fsp_link *link, int sock, int server, fs_segment segm
   }
 
   int ret = 0;
-  unsigned char *in = message_recv(sock, &segment, &ignored);
+  unsigned char *in = message_recv_reply(sock, &segment, &ignored);
   if (!in || in[3] != FS_DONE_OK) {
     link_error(LOG_ERR, "choose_segment failed(%d): %s", segment, invalid_response(in));
     ret = 1;
   }
-  free(in);
+  message_free(in);
 
   return ret;
 }
@@ -366,6 +415,9 @@ int fsp_add_backend (fsp_link *link, const char *addr, uint16_t port, int segmen
         link->socks[seg] = link->socks1[seg] = sock;
         sock = -1; /* used this one */
         count++;
+        if (link->features && strstr(link->features, " multiplex ")) {
+          link->mux[seg] = mux_open(link, server, seg);
+        }
         break;
       case 'm':
         if (link->socks2[seg] != -1) {
@@ -376,6 +428,10 @@ int fsp_add_backend (fsp_link *link, const char *addr, uint16_t port, int segmen
         if (choose_segment(link, sock, server, seg)) break; /* something went wrong */
         link->socks2[seg] = sock;
         sock = -1; /* used this one */
+        if (link->features && strstr(link->features, " multiplex ")) {
+          /* reads can go to either copy */
+          link->mux2[seg] = mux_open(link, server, seg);
+        }
         break;
       case '\0':
         /* not present */
@@ -387,7 +443,7 @@ int fsp_add_backend (fsp_link *link, const char *addr, uint16_t port, int segmen
     }
   }
 
-  free(in);
+  message_free(in);
   if (sock != -1) { /* doesn't have any segments we wanted ? */
     close(sock);
   }
@@ -418,11 +474,569 @@ static void fsp_write_primary(fsp_link* link, const void *data, size_t size)
 #endif
 }
 
+/* reads that don't depend on state kept by the backend between requests,
+   so either copy of a segment can answer them, and a backend can give up on
+   them half way */
+static int is_replicated_read (unsigned char type)
+{
+  switch (type) {
+    case FS_BIND_LIMIT:
+    case FS_BIND_JOIN:
+    case FS_BIND_STAR:
+    case FS_BIND_GROUP:
+    case FS_REVERSE_BIND:
+    case FS_PRICE_BIND:
+    case FS_RESOLVE_ATTR:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* A thread running a query tells the backends which query each of its reads
+   belongs to, and when it stops being worth answering, with a context sent
+   ahead of the contents of the request. The query id is made unique to the
+   link with a random base, so cancelling one doesn't touch the queries of
+   other frontends */
+
+struct fsp_query_context {
+  fsp_link *link;
+  uint64_t id;
+  double deadline;
+  int cancelled;  /* a backend replied FS_CANCELLED */
+};
+
+static GStaticPrivate query_context = G_STATIC_PRIVATE_INIT;
+
+static uint64_t query_id (fsp_link *link, unsigned int query)
+{
+  return ((uint64_t) link->query_base << 32) | query;
+}
+
+void fsp_query_begin (fsp_link *link, unsigned int query, double deadline)
+{
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+
+  if (!c) {
+    c = g_new0(struct fsp_query_context, 1);
+    g_static_private_set(&query_context, c, g_free);
+  }
+  c->link = link;
+  c->id = query_id(link, query);
+  c->deadline = deadline;
+  c->cancelled = 0;
+}
+
+void fsp_query_end (fsp_link *link)
+{
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+
+  if (c && c->link == link) c->link = NULL;
+}
+
+int fsp_query_cancelled (fsp_link *link)
+{
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+
+  return c && c->link == link && c->cancelled;
+}
+
+/* in is a reply to this thread, note if its query was given up on */
+static void query_reply (fsp_link *link, const unsigned char *in)
+{
+  if (!in || in[3] != FS_CANCELLED) return;
+
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+  if (c && c->link == link) c->cancelled = 1;
+}
+
+/* write a request to sock, with this thread's query context if it has one
+   and the backends understand it. Returns the count written, not counting
+   the context, or -1 */
+static ssize_t fsp_send (fsp_link *link, int sock, const void *data, size_t size)
+{
+  const unsigned char *msg = data;
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+
+  if (!c || c->link != link || !is_replicated_read(msg[3]) ||
+      !link->features || !strstr(link->features, " deadline ")) {
+    return write(sock, data, FS_HEADER + size);
+  }
+
+  unsigned char header[FS_HEADER];
+  unsigned char context[FS_CONTEXT_LENGTH];
+  const unsigned int length = size + FS_CONTEXT_LENGTH;
+  uint32_t ms = 0;
+
+  if (c->deadline > 0.0) {
+    const double left = (c->deadline - fs_time()) * 1000.0;
+    /* 0 would mean no deadline */
+    ms = left < 1.0 ? 1 : left > 4e9 ? 4000000000U : (uint32_t) left;
+  }
+  memcpy(header, data, FS_HEADER);
+  header[3] |= FS_MESSAGE_CONTEXT;
+  memcpy(header + 4, &length, sizeof(length));
+  memset(context, 0, sizeof(context));
+  memcpy(context, &c->id, sizeof(c->id));
+  memcpy(context + 8, &ms, sizeof(ms));
+
+  struct iovec iov[3] = {
+    { header, FS_HEADER },
+    { context, FS_CONTEXT_LENGTH },
+    { (void *) (msg + FS_HEADER), size },
+  };
+  ssize_t count = writev(sock, iov, 3);
+  if (count == -1) return -1;
+
+  return count == FS_HEADER + length ? FS_HEADER + size : 0;
+}
+
+/* A multiplexed segment socket carries queries from any number of threads at
+   once. Each request is tagged with the id of the thread that sent it, and
+   replies can come back in any order. There's no reader thread, whichever
+   waiting thread finds nobody reading reads replies, handing each to its
+   thread, until its own arrives. Updates stay on the ordinary sockets.
+
+   Where a segment is mirrored there's a multiplexed socket to each copy, and
+   reads go to the one with fewer requests outstanding. With hedging on, a
+   read that's taken longer than most (see fsp_set_hedging()) is sent to the
+   other copy as well, the first reply wins and the other is thrown away
+   when it arrives. A thread can't reuse a mux until its thrown away reply
+   has come in, it reads it itself before its next request if nobody else
+   has. All the muxes of a link share one lock */
+
+struct fsp_mux_wait {
+  unsigned char *reply;
+  unsigned int length;
+  int done;
+  struct fsp_mux *legs[2];  /* the muxes the request went to, the 2nd hedged */
+  int answered[2];          /* set once that leg has replied, or failed */
+  int held;                 /* the waiting tables it's in */
+  int abandoned;            /* its thread has gone, freed when held is 0 */
+  int replicated;           /* either copy could answer */
+  double sent;
+  unsigned char *request;   /* kept until it's hedged, or NULL */
+  size_t size;
+};
+
+struct fsp_mux {
+  int sock;
+  int broken;              /* after a failure, queries go the ordinary way */
+  int reading;             /* a thread is reading replies */
+  GStaticMutex write_lock; /* held while writing a request */
+  GHashTable *waiting;     /* tag -> struct fsp_mux_wait */
+};
+
+/* how often a thread waiting on two sockets looks for replies read by
+   others, in ms */
+#define FS_MUX_POLL 10
+
+/* fewest replies timed before reads are hedged */
+#define FS_HEDGE_MIN_SAMPLES 64
+
+static GStaticPrivate mux_thread_tag = G_STATIC_PRIVATE_INIT;
+static guint32 mux_last_tag = 0;
+G_LOCK_DEFINE_STATIC(mux_last_tag);
+
+/* each thread has at most one request in flight per segment */
+static guint32 mux_tag (void)
+{
+  guint32 tag = GPOINTER_TO_UINT(g_static_private_get(&mux_thread_tag));
+
+  if (!tag) {
+    G_LOCK(mux_last_tag);
+    tag = ++mux_last_tag;
+    G_UNLOCK(mux_last_tag);
+    g_static_private_set(&mux_thread_tag, GUINT_TO_POINTER(tag), NULL);
+  }
+
+  return tag;
+}
+
+static struct fsp_mux *mux_open (fsp_link *link, int server, fs_segment segment)
+{
+  int sock = fsp_open_socket(link, link->addrs[server], link->ports[server]);
+  if (sock == -1) return NULL;
+  if (choose_segment(link, sock, server, segment)) {
+    close(sock);
+    return NULL;
+  }
+
+  if (!g_thread_supported()) g_thread_init(NULL);
+  if (!link->mux_lock) {
+    link->mux_lock = g_mutex_new();
+    link->mux_cond = g_cond_new();
+  }
+  struct fsp_mux *mux = calloc(1, sizeof(struct fsp_mux));
+  mux->sock = sock;
+  g_static_mutex_init(&mux->write_lock);
+  mux->waiting = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  return mux;
+}
+
+static void mux_close (struct fsp_mux *mux)
+{
+  close(mux->sock);
+  g_hash_table_destroy(mux->waiting);
+  g_static_mutex_free(&mux->write_lock);
+  free(mux);
+}
+
+static void mux_wait_free (struct fsp_mux_wait *w)
+{
+  free(w->request);
+  free(w);
+}
+
+/* leg i of w has replied or failed, it's done if no other leg can answer */
+static void mux_leg_failed (struct fsp_mux_wait *w, int i)
+{
+  w->answered[i] = 1;
+  if (!w->legs[!i] || w->answered[!i]) w->done = 1;
+}
+
+static gboolean mux_fail (gpointer key, gpointer value, gpointer user_data)
+{
+  struct fsp_mux_wait *w = (struct fsp_mux_wait *) value;
+
+  mux_leg_failed(w, w->legs[1] == user_data);
+  if (w->abandoned) {
+    if (--w->held == 0) mux_wait_free(w);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* nothing more is coming on mux, fail everything that's waiting on it */
+static void mux_broken (fsp_link *link, struct fsp_mux *mux)
+{
+  mux->broken = 1;
+  g_hash_table_foreach_remove(mux->waiting, mux_fail, mux);
+  g_cond_broadcast(link->mux_cond);
+}
+
+/* hand the reply in to the request it answers */
+static void mux_dispatch (fsp_link *link, struct fsp_mux *mux,
+                          unsigned char *in, unsigned int length)
+{
+  guint32 rtag;
+  memcpy(&rtag, in + FS_HEADER_TAG, sizeof(rtag));
+  struct fsp_mux_wait *r = g_hash_table_lookup(mux->waiting, GUINT_TO_POINTER(rtag));
+  const int leg = r && r->legs[1] == mux;
+
+  if (!r || r->answered[leg]) {
+    link_error(LOG_ERR, "unexpected reply with tag %u", rtag);
+    message_free(in);
+    return;
+  }
+
+  r->answered[leg] = 1;
+  if (r->done) {
+    /* the other copy was quicker */
+    message_free(in);
+    if (r->abandoned) {
+      g_hash_table_remove(mux->waiting, GUINT_TO_POINTER(rtag));
+      if (--r->held == 0) mux_wait_free(r);
+    }
+  } else {
+    r->reply = in;
+    r->length = length;
+    r->done = 1;
+  }
+}
+
+static int mux_usable (struct fsp_mux *mux, guint32 tag)
+{
+  return mux && !mux->broken &&
+         !g_hash_table_lookup(mux->waiting, GUINT_TO_POINTER(tag));
+}
+
+/* the mux a request goes to, NULL if it has to go the ordinary way */
+static struct fsp_mux *mux_choose (fsp_link *link, fs_segment segment,
+                                   unsigned char type, guint32 tag)
+{
+  struct fsp_mux *mux = link->mux[segment];
+  struct fsp_mux *mux2 = link->mux2[segment];
+
+  if (!mux_usable(mux, tag)) mux = NULL;
+  if (!is_replicated_read(type) || !mux_usable(mux2, tag)) return mux;
+  if (!mux || g_hash_table_size(mux2->waiting) < g_hash_table_size(mux->waiting)) {
+    return mux2;
+  }
+
+  return mux;
+}
+
+static int mux_send (fsp_link *link, struct fsp_mux *mux, const void *data, size_t size)
+{
+  g_static_mutex_lock(&mux->write_lock);
+  ssize_t count = fsp_send(link, mux->sock, data, size);
+  g_static_mutex_unlock(&mux->write_lock);
+
+  if (count != FS_HEADER + size) {
+    link_error(LOG_ERR, "multiplexed write failed: %s", strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+/* read whatever replies have already arrived on mux, while this thread's
+   request there is one it's given up on, so the thrown away reply doesn't
+   keep the thread off mux. Nobody else reads it in a thread with only one
+   query at a time. Called with the lock held */
+static void mux_drain (fsp_link *link, struct fsp_mux *mux, guint32 tag)
+{
+  struct fsp_mux_wait *w;
+
+  while (mux && !mux->broken && !mux->reading &&
+         (w = g_hash_table_lookup(mux->waiting, GUINT_TO_POINTER(tag))) &&
+         w->abandoned) {
+    struct pollfd active = { mux->sock, POLLIN, 0 };
+    if (poll(&active, 1, 0) <= 0) return;
+
+    mux->reading = 1;
+    g_mutex_unlock(link->mux_lock);
+    fs_segment segment;
+    unsigned int length;
+    unsigned char *in = message_recv_reply(mux->sock, &segment, &length);
+    g_mutex_lock(link->mux_lock);
+    mux->reading = 0;
+    if (in) {
+      mux_dispatch(link, mux, in, length);
+    } else {
+      link_error(LOG_ERR, "multiplexed connection for segment %d failed", segment);
+      mux_broken(link, mux);
+    }
+    g_cond_broadcast(link->mux_cond);
+  }
+}
+
+/* returns the socket the request went to, or -1 if no mux would take it */
+static int mux_write (fsp_link *link, fs_segment segment, const void *data, size_t size)
+{
+  const guint32 tag = mux_tag();
+  const unsigned char type = ((const unsigned char *) data)[3];
+
+  g_mutex_lock(link->mux_lock);
+  mux_drain(link, link->mux[segment], tag);
+  mux_drain(link, link->mux2[segment], tag);
+  struct fsp_mux *mux = mux_choose(link, segment, type, tag);
+  if (!mux) {
+    g_mutex_unlock(link->mux_lock);
+    return -1;
+  }
+
+  struct fsp_mux_wait *w = calloc(1, sizeof(struct fsp_mux_wait));
+  memcpy((unsigned char *) data + FS_HEADER_TAG, &tag, sizeof(tag));
+  w->legs[0] = mux;
+  w->held = 1;
+  w->replicated = is_replicated_read(type);
+  w->sent = fs_time();
+  if (w->replicated && link->hedge_percentile && link->mux2[segment]) {
+    w->request = malloc(FS_HEADER + size);
+    memcpy(w->request, data, FS_HEADER + size);
+    w->size = size;
+  }
+  g_hash_table_insert(mux->waiting, GUINT_TO_POINTER(tag), w);
+  g_mutex_unlock(link->mux_lock);
+
+  if (!mux_send(link, mux, data, size)) {
+    g_mutex_lock(link->mux_lock);
+    mux_broken(link, mux);
+    g_mutex_unlock(link->mux_lock);
+  }
+
+  return mux->sock;
+}
+
+/* send w to the other copy of its segment too, called with the lock held */
+static void mux_hedge (fsp_link *link, struct fsp_mux_wait *w, guint32 tag)
+{
+  fs_segment segment;
+  memcpy(&segment, w->request + 8, sizeof(segment));
+  struct fsp_mux *other = w->legs[0] == link->mux[segment] ?
+                          link->mux2[segment] : link->mux[segment];
+  unsigned char *request = w->request;
+
+  w->request = NULL;
+  if (!mux_usable(other, tag)) {
+    free(request);
+    return;
+  }
+
+  w->legs[1] = other;
+  w->held++;
+  g_hash_table_insert(other->waiting, GUINT_TO_POINTER(tag), w);
+  g_mutex_unlock(link->mux_lock);
+  const int sent = mux_send(link, other, request, w->size);
+  free(request);
+  g_mutex_lock(link->mux_lock);
+  if (!sent) mux_broken(link, other);
+}
+
+static int double_compare (const void *va, const void *vb)
+{
+  const double a = *(const double *) va;
+  const double b = *(const double *) vb;
+
+  return (a > b) - (a < b);
+}
+
+/* keep the last FS_LATENCY_SAMPLES reply times, and now and then work out
+   how long to wait before hedging */
+static void mux_latency (fsp_link *link, double seconds)
+{
+  link->latency[link->latency_count++ % FS_LATENCY_SAMPLES] = seconds;
+  if (!link->hedge_percentile || link->latency_count < FS_HEDGE_MIN_SAMPLES ||
+      link->latency_count % 16) {
+    return;
+  }
+
+  const int count = MIN(link->latency_count, FS_LATENCY_SAMPLES);
+  double sorted[FS_LATENCY_SAMPLES];
+  memcpy(sorted, link->latency, count * sizeof(double));
+  qsort(sorted, count, sizeof(double), double_compare);
+  link->hedge_after = sorted[MIN(count - 1, count * link->hedge_percentile / 100)];
+}
+
+/* the reply to this thread's request */
+static unsigned char *mux_recv (fsp_link *link, struct fsp_mux *mux, unsigned int *length)
+{
+  const guint32 tag = mux_tag();
+
+  g_mutex_lock(link->mux_lock);
+  struct fsp_mux_wait *w = g_hash_table_lookup(mux->waiting, GUINT_TO_POINTER(tag));
+  if (!w || w->abandoned) {
+    g_mutex_unlock(link->mux_lock);
+    link_error(LOG_ERR, "no multiplexed request in flight");
+    return NULL;
+  }
+
+  while (!w->done) {
+    double hedge_at = 0.0;
+    if (w->request && link->hedge_after > 0.0) {
+      hedge_at = w->sent + link->hedge_after;
+      if (fs_time() >= hedge_at) {
+        mux_hedge(link, w, tag);
+        continue;
+      }
+    }
+
+    /* read from the legs nobody else is reading */
+    struct fsp_mux *legs[2];
+    int count = 0, others = 0;
+    for (int i = 0; i < 2; ++i) {
+      if (!w->legs[i] || w->answered[i]) continue;
+      if (w->legs[i]->reading) {
+        others++;
+      } else {
+        legs[count++] = w->legs[i];
+      }
+    }
+
+    if (count == 0) {
+      if (hedge_at > 0.0) {
+        GTimeVal until;
+        until.tv_sec = (glong) hedge_at;
+        until.tv_usec = (glong) ((hedge_at - until.tv_sec) * 1000000.0);
+        g_cond_timed_wait(link->mux_cond, link->mux_lock, &until);
+      } else {
+        g_cond_wait(link->mux_cond, link->mux_lock);
+      }
+      continue;
+    }
+
+    for (int k = 0; k < count; ++k) {
+      legs[k]->reading = 1;
+    }
+    g_mutex_unlock(link->mux_lock);
+
+    int timeout = -1;
+    if (hedge_at > 0.0) {
+      timeout = (int) ((hedge_at - fs_time()) * 1000.0) + 1;
+      if (timeout < 0) timeout = 0;
+    }
+    if (others && (timeout == -1 || timeout > FS_MUX_POLL)) {
+      timeout = FS_MUX_POLL;
+    }
+
+    int ready[2] = { count == 1 && timeout == -1, 0 };
+    if (!ready[0]) {
+      struct pollfd active[2];
+      for (int k = 0; k < count; ++k) {
+        active[k].fd = legs[k]->sock;
+        active[k].events = POLLIN;
+        active[k].revents = 0;
+      }
+      if (poll(active, count, timeout) > 0) {
+        for (int k = 0; k < count; ++k) {
+          ready[k] = active[k].revents != 0;
+        }
+      }
+    }
+
+    unsigned char *in[2] = { NULL, NULL };
+    unsigned int len[2];
+    for (int k = 0; k < count; ++k) {
+      if (!ready[k]) continue;
+      fs_segment segment;
+      in[k] = message_recv_reply(legs[k]->sock, &segment, &len[k]);
+      if (!in[k]) {
+        link_error(LOG_ERR, "multiplexed connection for segment %d failed", segment);
+      }
+    }
+
+    g_mutex_lock(link->mux_lock);
+    for (int k = 0; k < count; ++k) {
+      legs[k]->reading = 0;
+      if (!ready[k]) continue;
+      if (in[k]) {
+        mux_dispatch(link, legs[k], in[k], len[k]);
+      } else {
+        mux_broken(link, legs[k]);
+      }
+    }
+    /* wake the others, to see if their reply came, or take over reading */
+    g_cond_broadcast(link->mux_cond);
+  }
+
+  if (w->reply && w->replicated) {
+    mux_latency(link, fs_time() - w->sent);
+  }
+
+  /* the legs that haven't answered are left to throw their replies away */
+  for (int i = 0; i < 2; ++i) {
+    if (w->legs[i] && w->answered[i] &&
+        g_hash_table_lookup(w->legs[i]->waiting, GUINT_TO_POINTER(tag)) == w) {
+      g_hash_table_remove(w->legs[i]->waiting, GUINT_TO_POINTER(tag));
+      w->held--;
+    }
+  }
+  unsigned char *in = w->reply;
+  *length = w->length;
+  if (w->held == 0) {
+    mux_wait_free(w);
+  } else {
+    w->abandoned = 1;
+  }
+  g_mutex_unlock(link->mux_lock);
+
+  return in;
+}
+
 static int fsp_write(fsp_link* link, const void *data, size_t size)
 {
   unsigned int * const s = (unsigned int *) (data + 8);
   fs_segment segment = *s;
 
+  if (link->mux_lock) {
+    const int sock = mux_write(link, segment, data, size);
+    if (sock != -1) return sock;
+  }
+
   int sock = link->socks[segment];
 
 #ifdef FS_PROFILE_WRITE
@@ -431,7 +1045,7 @@ static int fsp_write(fsp_link* link, const void *data, size_t size)
   gettimeofday(&start, NULL);
 #endif
   g_static_mutex_lock(&link->mutex[segment]);
-  ssize_t count = write(sock, data, FS_HEADER + size);
+  ssize_t count = fsp_send(link, sock, data, size);
   while (count == -1) {
     link_error(LOG_ERR, "write error for segment %d: %s", segment, strerror(errno));
     if (sock == link->socks1[segment] && link->socks2[segment] != -1) {
@@ -450,7 +1064,7 @@ static int fsp_write(fsp_link* link, const void *data, size_t size)
       sock = -1;
       break;
     }
-    count= write(sock, data, FS_HEADER + size);
+    count = fsp_send(link, sock, data, size);
   }
 #ifdef FS_PROFILE_WRITE
   gettimeofday(&stop, NULL);
@@ -462,6 +1076,28 @@ static int fsp_write(fsp_link* link, const void *data, size_t size)
   return sock;
 }
 
+/* the reply to a request sent with fsp_write() on sock, which releases the
+   segment */
+static unsigned char *fsp_recv(fsp_link *link, fs_segment segment, int sock,
+                               unsigned int *length)
+{
+  struct fsp_mux *mux = link->mux[segment];
+  struct fsp_mux *mux2 = link->mux2[segment];
+  unsigned char *in;
+  if (mux && sock == mux->sock) {
+    in = mux_recv(link, mux, length);
+  } else if (mux2 && sock == mux2->sock) {
+    in = mux_recv(link, mux2, length);
+  } else {
+    fs_segment ignored;
+    in = message_recv_reply(sock, &ignored, length);
+    g_static_mutex_unlock (&link->mutex[segment]);
+  }
+  query_reply(link, in);
+
+  return in;
+}
+
 static void fsp_write_replica(fsp_link* link, const void *data, size_t size)
 {
   unsigned int * const s = (unsigned int *) (data + 8);
@@ -526,22 +1162,22 @@ static unsigned char *message_recv_replica(fsp_link *link, fs_segment segment, u
   unsigned int unused;
 
   if (link->socks2[segment] == -1) {
-    return message_recv(link->socks1[segment], &unused, length);
+    return message_recv_reply(link->socks1[segment], &unused, length);
   }
 
   unsigned int len1, len2;
   unsigned char *msg1, *msg2;
 
-  msg1= message_recv(link->socks1[segment], &unused, &len1);
-  msg2= message_recv(link->socks2[segment], &unused, &len2);
+  msg1= message_recv_reply(link->socks1[segment], &unused, &len1);
+  msg2= message_recv_reply(link->socks2[segment], &unused, &len2);
 
   if (!msg1 || msg1[3] == FS_ERROR) {
     *length = len1;
-    free(msg2);
+    message_free(msg2);
     return msg1;
   } else {
     *length = len2;
-    free(msg1);
+    message_free(msg1);
     return msg2;
   }
 }
@@ -553,11 +1189,9 @@ void get_uuid(fsp_link *link)
   free(out);
 
   unsigned int length;
-  fs_segment segment;
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock(&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, 0, sock, &length);
   link->uuid = g_strdup((char *)in + FS_HEADER);
-  free(in);
+  message_free(in);
   fs_global_skolem_prefix = g_strdup_printf("%s/%s/", FS_SKOLEM_PREFIX, link->uuid);
   fs_global_skolem_prefix_len = strlen(fs_global_skolem_prefix);
 }
@@ -571,6 +1205,7 @@ fsp_link* fsp_open_link (const char *name, char *password, int readonly)
   fsp_link *link = calloc(1, sizeof(fsp_link));
 
   link->kb_name = name;
+  link->query_base = g_random_int() | 1;
 
   /* sockets start zero'd which is no good */
 
@@ -629,6 +1264,12 @@ void fsp_close_link(fsp_link *link)
   for (int k= 0; k < link->segments; ++k) {
     close (link->socks1[k]);
     if (link->socks2[k] != -1) close (link->socks2[k]);
+    if (link->mux[k]) mux_close(link->mux[k]);
+    if (link->mux2[k]) mux_close(link->mux2[k]);
+  }
+  if (link->mux_lock) {
+    g_cond_free(link->mux_cond);
+    g_mutex_free(link->mux_lock);
   }
   if (link->features) {
     free((char *)link->features);
@@ -647,6 +1288,52 @@ const char *fsp_link_features (fsp_link *link)
   return link->features;
 }
 
+void fsp_set_hedging (fsp_link *link, int percentile)
+{
+  if (percentile < 0) percentile = 0;
+  if (percentile > 99) percentile = 99;
+  link->hedge_percentile = percentile;
+  link->hedge_after = 0.0;
+}
+
+/* send FS_CANCEL for the query with context id id down every multiplexed
+   socket, returns the count sent */
+static int send_cancel (fsp_link *link, uint64_t id)
+{
+  if (!link->mux_lock) return 0;
+
+  int sent = 0;
+
+  g_mutex_lock(link->mux_lock);
+  for (fs_segment s = 0; s < link->segments; ++s) {
+    struct fsp_mux *muxes[2] = { link->mux[s], link->mux2[s] };
+    for (int k = 0; k < 2; ++k) {
+      if (!muxes[k] || muxes[k]->broken) continue;
+      unsigned char *out = message_new(FS_CANCEL, s, sizeof(id));
+      memcpy(out + FS_HEADER, &id, sizeof(id));
+      if (mux_send(link, muxes[k], out, sizeof(id))) sent++;
+      free(out);
+    }
+  }
+  g_mutex_unlock(link->mux_lock);
+
+  return sent;
+}
+
+int fsp_cancel_all (fsp_link *link, unsigned int query)
+{
+  return send_cancel(link, query_id(link, query));
+}
+
+int fsp_query_cancel (fsp_link *link)
+{
+  struct fsp_query_context *c = g_static_private_get(&query_context);
+
+  if (!c || c->link != link) return 0;
+
+  return send_cancel(link, c->id);
+}
+
 long long *fsp_profile_write(fsp_link* link)
 {
    return link->tics;
@@ -668,7 +1355,7 @@ static int check_message_replica(fsp_link *link, fs_segment segment, const char
     link_error(LOG_ERR, message, segment, invalid_response(in));
     ret = 1;
   }
-  free(in);
+  message_free(in);
 
   return ret;
 }
@@ -680,7 +1367,93 @@ int fsp_no_op (fsp_link* link,
   int sock = fsp_write(link, out, 0);
   free(out);
 
-  return check_message(link, sock, "no_op(%d) failed: %s");
+  return check_message(link, segment, sock, "no_op(%d) failed: %s");
+}
+
+/* ask for compact bind replies, from backends that can send them */
+static int bind_flags (fsp_link *link, int flags)
+{
+  if (link->features && strstr(link->features, " compact-bind ")) {
+    return flags | FS_BIND_COMPACT;
+  }
+
+  return flags;
+}
+
+fsp_filter *fsp_filter_new (void)
+{
+  fsp_filter *filter = calloc(1, sizeof(fsp_filter));
+  filter->code = fs_rid_vector_new(0);
+
+  return filter;
+}
+
+void fsp_filter_add (fsp_filter *filter, int op, int column, int cmp,
+                     int flags, int count, const fs_rid *operands)
+{
+  unsigned char term[8];
+  fs_rid word;
+
+  term[0] = op;
+  term[1] = column;
+  term[2] = cmp;
+  term[3] = flags;
+  memcpy(term + 4, &count, sizeof(count));
+  memcpy(&word, term, sizeof(word));
+  fs_rid_vector_append(filter->code, word);
+  for (int k = 0; k < count; ++k) {
+    fs_rid_vector_append(filter->code, operands[k]);
+  }
+  filter->terms++;
+}
+
+void fsp_filter_free (fsp_filter *filter)
+{
+  if (!filter) return;
+
+  fs_rid_vector_free(filter->code);
+  free(filter);
+}
+
+/* the bytes a filter program adds to the end of a bind request, none if
+   there's no filter, or the backends can't run it */
+static unsigned int filter_length (fsp_link *link, const fsp_filter *filter)
+{
+  if (!filter || filter->terms == 0) return 0;
+  if (!link->features || !strstr(link->features, " bind-filter ")) return 0;
+
+  return 8 + filter->code->length * 8;
+}
+
+static void filter_put (unsigned char *content, const fsp_filter *filter)
+{
+  unsigned int value = filter->code->length * 8;
+
+  memcpy(content, &value, sizeof(value));
+  memset(content + 4, 0, 4);
+  memcpy(content + 8, filter->code->data, value);
+}
+
+/* append the columns of a bind reply to vectors, returns the number of rows
+   it held, or -1 if it's malformed */
+static int bind_reply (const unsigned char *in, unsigned int length, int cols,
+                       fs_rid_vector **vectors)
+{
+  fs_rid_vector **v = fsp_bind_list_decode(in, length, cols);
+  if (!v) return -1;
+
+  const int count = v[0]->length;
+  for (int k = 0; k < cols; ++k) {
+    if (vectors[k]) {
+      fs_rid_vector_append_vector(vectors[k], v[k]);
+      fs_rid_vector_free(v[k]);
+    } else {
+      vectors[k] = v[k];
+    }
+  }
+  free(v);
+
+  return count;
 }
 
 int fsp_bind_limit (fsp_link *link,
@@ -698,6 +1471,8 @@ int fsp_bind_limit (fsp_link *link,
   unsigned int length, value;
   int ret = 0;
 
+  const int wire_flags = bind_flags(link, flags);
+
   /* fill out */
   length = 32 +
          (mrids->length + srids->length + prids->length + orids->length ) * 8;
@@ -705,7 +1480,7 @@ int fsp_bind_limit (fsp_link *link,
   unsigned char *out = message_new(FS_BIND_LIMIT, segment, length);
   content = out + FS_HEADER;
 
-  memcpy(content, &flags, sizeof(flags));
+  memcpy(content, &wire_flags, sizeof(wire_flags));
   memcpy(content + 4, &offset, sizeof(offset));
   memcpy(content + 8, &limit, sizeof(limit));
   value = mrids->length * 8;
@@ -730,20 +1505,18 @@ int fsp_bind_limit (fsp_link *link,
   int sock = fsp_write(link, out, length);
   free(out);
 
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
-  content = in + FS_HEADER;
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in) {
     link_error(LOG_ERR, "bind(%d) failed: no reply", segment);
     return 1;
   } else if (in[3] == FS_NO_MATCH) {
-    free(in);
+    message_free(in);
     *result = NULL;
     return 0;
-  } else if (in[3] != FS_BIND_LIST) {
+  } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
     link_error(LOG_ERR, "bind(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
@@ -755,21 +1528,17 @@ int fsp_bind_limit (fsp_link *link,
   if (cols == 0) {
     *result = calloc(1, sizeof(fs_rid_vector *));
   } else {
-    int count = length / (8 * cols);
-    if (count == limit) {
-      (link->hit_limits)++;
-    }
-
     *result = calloc(cols, sizeof(fs_rid_vector *));
-    for (k = 0; k < cols; ++k) {
-      fs_rid_vector *v = fs_rid_vector_new(count);
-      (*result)[k] = v;
-      memcpy(v->data, content, count * 8);
-      content += count * 8;
+    int count = bind_reply(in, length, cols, *result);
+    if (count == -1) {
+      link_error(LOG_ERR, "bind(%d) failed: malformed reply", segment);
+      ret = 1;
+    } else if (count == limit) {
+      (link->hit_limits)++;
     }
   }
 
-  free(in);
+  message_free(in);
 
   return ret;
 }
@@ -789,6 +1558,8 @@ int fsp_reverse_bind_all (fsp_link *link,
   unsigned int length, value;
   int sock[link->segments], ret = 0;
 
+  const int wire_flags = bind_flags(link, flags);
+
   /* fill out */
   length = 32 +
          (mrids->length + srids->length + prids->length + orids->length ) * 8;
@@ -796,7 +1567,7 @@ int fsp_reverse_bind_all (fsp_link *link,
   out = message_new(FS_REVERSE_BIND, 0, length);
   content = out + FS_HEADER;
 
-  memcpy(content, &flags, sizeof(flags));
+  memcpy(content, &wire_flags, sizeof(wire_flags));
   memcpy(content + 4, &offset, sizeof(offset));
   memcpy(content + 8, &limit, sizeof(limit));
   value = mrids->length * 8;
@@ -837,20 +1608,18 @@ int fsp_reverse_bind_all (fsp_link *link,
   }
 
   for (segment = 0; segment < link->segments; ++segment) {
-    unsigned char *in = message_recv(sock[segment], &segment, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
-    content = in + FS_HEADER;
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in) {
       link_error(LOG_ERR, "reverse_bind(%d) failed: no reply", segment);
       ret++ ;
       continue;
     } else if (in[3] == FS_NO_MATCH) {
-      free(in);
+      message_free(in);
       continue;
-    } else if (in[3] != FS_BIND_LIST) {
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
       link_error(LOG_ERR, "reverse_bind(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       ret++ ;
       continue;
     }
@@ -858,24 +1627,16 @@ int fsp_reverse_bind_all (fsp_link *link,
     if (cols == 0) {
       matches++;
     } else {
-      int count = length / (8 * cols);
-      if (count == limit) {
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "reverse_bind(%d) failed: malformed reply", segment);
+        ret++;
+      } else if (count == limit) {
         (link->hit_limits)++;
       }
-      for (k = 0; k < cols; ++k) {
-        fs_rid_vector *v = fs_rid_vector_new(count);
-        memcpy(v->data, content, count * 8);
-	if (vectors[k]) {
-          fs_rid_vector_append_vector(vectors[k], v);
-          fs_rid_vector_free(v);
-        } else {
-          vectors[k] = v;
-        }
-        content += count * 8;
-      }
     }
 
-    free(in);
+    message_free(in);
   }
 
   if (cols == 0 && matches == 0) {
@@ -899,20 +1660,39 @@ int fsp_bind_limit_all (fsp_link *link,
                         fs_rid_vector ***result,
                         int offset,
                         int limit)
+{
+  return fsp_bind_filter_all(link, flags, mrids, srids, prids, orids, NULL,
+                             result, offset, limit);
+}
+
+int fsp_bind_filter_all (fsp_link *link,
+                         int flags,
+                         fs_rid_vector *mrids,
+                         fs_rid_vector *srids,
+                         fs_rid_vector *prids,
+                         fs_rid_vector *orids,
+                         const fsp_filter *filter,
+                         fs_rid_vector ***result,
+                         int offset,
+                         int limit)
 {
   fs_segment segment;
   unsigned char *out, *content;
   unsigned int length, value;
   int sock[link->segments], ret = 0;
 
+  const unsigned int filter_bytes = filter_length(link, filter);
+  const int wire_flags = bind_flags(link, flags) |
+                         (filter_bytes ? FS_BIND_FILTER : 0);
+
   /* fill out */
-  length = 32 +
+  length = 32 + filter_bytes +
          (mrids->length + srids->length + prids->length + orids->length ) * 8;
 
   out = message_new(FS_BIND_LIMIT, 0, length);
   content = out + FS_HEADER;
 
-  memcpy(content, &flags, sizeof(flags));
+  memcpy(content, &wire_flags, sizeof(wire_flags));
   memcpy(content + 4, &offset, sizeof(offset));
   memcpy(content + 8, &limit, sizeof(limit));
   value = mrids->length * 8;
@@ -933,6 +1713,7 @@ int fsp_bind_limit_all (fsp_link *link,
   content += prids->length * 8;
   memcpy(content, orids->data, orids->length * 8);
   content += orids->length * 8;
+  if (filter_bytes) filter_put(content, filter);
 
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned int * const s = (unsigned int *) (out + 8);
@@ -953,20 +1734,18 @@ int fsp_bind_limit_all (fsp_link *link,
   }
 
   for (segment = 0; segment < link->segments; ++segment) {
-    unsigned char *in = message_recv(sock[segment], &segment, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
-    content = in + FS_HEADER;
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in) {
       link_error(LOG_ERR, "bind(%d) failed: no reply", segment);
       ret++ ;
       continue;
     } else if (in[3] == FS_NO_MATCH) {
-      free(in);
+      message_free(in);
       continue;
-    } else if (in[3] != FS_BIND_LIST) {
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
       link_error(LOG_ERR, "bind(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       ret++ ;
       continue;
     }
@@ -974,24 +1753,16 @@ int fsp_bind_limit_all (fsp_link *link,
     if (cols == 0) {
       matches++;
     } else {
-      int count = length / (8 * cols);
-      if (count == limit) {
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "bind(%d) failed: malformed reply", segment);
+        ret++;
+      } else if (count == limit) {
         (link->hit_limits)++;
       }
-      for (k = 0; k < cols; ++k) {
-        fs_rid_vector *v = fs_rid_vector_new(count);
-        memcpy(v->data, content, count * 8);
-	if (vectors[k]) {
-          fs_rid_vector_append_vector(vectors[k], v);
-          fs_rid_vector_free(v);
-        } else {
-          vectors[k] = v;
-        }
-        content += count * 8;
-      }
     }
 
-    free(in);
+    message_free(in);
   }
 
   if (cols == 0 && matches == 0) {
@@ -1020,23 +1791,43 @@ int fsp_price_bind (fsp_link *link,
 
   unsigned int length = 24 +
          (mrids->length + srids->length + prids->length + orids->length ) * 8;
+  unsigned int value;
 
   unsigned char *out = message_new(FS_PRICE_BIND, segment, length);
+  unsigned char *content = out + FS_HEADER;
+
+  memcpy(content, &flags, sizeof(flags));
+  value = mrids->length * 8;
+  memcpy(content + 4, &value, sizeof(value));
+  value = srids->length * 8;
+  memcpy(content + 8, &value, sizeof(value));
+  value = prids->length * 8;
+  memcpy(content + 12, &value, sizeof(value));
+  value = orids->length * 8;
+  memcpy(content + 16, &value, sizeof(value));
+  content += 24;
+
+  memcpy(content, mrids->data, mrids->length * 8);
+  content += mrids->length * 8;
+  memcpy(content, srids->data, srids->length * 8);
+  content += srids->length * 8;
+  memcpy(content, prids->data, prids->length * 8);
+  content += prids->length * 8;
+  memcpy(content, orids->data, orids->length * 8);
 
   int sock = fsp_write(link, out, length);
   free(out);
 
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_ESTIMATED_ROWS) {
     link_error(LOG_ERR, "price_bind(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   memcpy(rows, in + FS_HEADER, sizeof(*rows));
-  free(in);
+  message_free(in);
 
   return ret;
 }
@@ -1151,15 +1942,38 @@ int fsp_start_import (fsp_link *link, fs_segment segment)
   fsp_write_replica(link, out, 0);
   free(out);
 
-  return check_message_replica(link, segment, "start_import(%d) failed: %s");
+  return check_message_replica(link, segment, "start_import(%d) failed: %s");
+}
+
+int fsp_start_import_all (fsp_link *link)
+{
+  int errors = 0;
+
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    unsigned char *out = message_new(FS_START_IMPORT, segment, 0);
+    fsp_write_replica(link, out, 0);
+    free(out);
+  }
+
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    errors += check_message_replica(link, segment, "start_import(%d) failed: %s");
+  }
+
+  return errors;
 }
 
-int fsp_start_import_all (fsp_link *link)
+int fsp_start_bulk_import_all (fsp_link *link)
 {
+  if (!link->features || !strstr(link->features, " bulk-import ")) {
+    return fsp_start_import_all(link);
+  }
+
   int errors = 0;
+  const int flags = FS_IMPORT_BULK;
 
   for (fs_segment segment = 0; segment < link->segments; ++segment) {
-    unsigned char *out = message_new(FS_START_IMPORT, segment, 0);
+    unsigned char *out = message_new(FS_START_IMPORT, segment, sizeof(flags));
+    memcpy(out + FS_HEADER, &flags, sizeof(flags));
     fsp_write_replica(link, out, 0);
     free(out);
   }
@@ -1314,23 +2128,22 @@ int fsp_get_data_size (fsp_link *link, fs_segment segment,
   free(out);
 
   unsigned int length;
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_SIZE) {
     link_error(LOG_ERR, "get_data_size(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   if (length != sizeof(fs_old_data_size)) {
     link_error(LOG_ERR, "get_data_size(%d): fs_data_size structure size mis-match", segment);
-    free(in);
+    message_free(in);
     return 3;
   }
   
   memcpy (&old_size, in + FS_HEADER, sizeof(fs_old_data_size));
-  free(in);
+  message_free(in);
 
   size->quads_s = old_size.quads_s;
   size->quads_o = old_size.quads_o;
@@ -1344,28 +2157,27 @@ int fsp_get_data_size (fsp_link *link, fs_segment segment,
   sock = fsp_write(link, out, 0);
   free(out);
 
-  in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_SIZE_REVERSE) {
     if (in && in[3] == FS_ERROR) {
       /* probably just not implemented */
-      free(in);
+      message_free(in);
       return 0;
     }
     link_error(LOG_ERR, "get_data_size(%d) reverse failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   if (length != sizeof(unsigned long long)) {
     link_error(LOG_ERR, "get_data_size(%d): reverse size mis-match", segment);
-    free(in);
+    message_free(in);
     return 3;
   }
 
   memcpy (&(size->quads_sr), in + FS_HEADER, sizeof(unsigned long long));
-  free(in);
+  message_free(in);
 
   return 0;
 }
@@ -1378,24 +2190,23 @@ int fsp_get_import_times (fsp_link *link, fs_segment segment,
   free(out);
 
   unsigned int length;
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_IMPORT_TIMES) {
     link_error(LOG_ERR, "get_import_times(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   if (length != sizeof(fs_import_timing)) {
     link_error(LOG_ERR, "get_import_times(%d): fs_import_timing structure size mis-match", segment);
-    free(in);
+    message_free(in);
     return 3;
   }
   
   memcpy (timing, in + FS_HEADER, sizeof(fs_import_timing));
   
-  free(in);
+  message_free(in);
   return 0;
 }
 
@@ -1407,24 +2218,23 @@ int fsp_get_query_times (fsp_link *link, fs_segment segment,
   free(out);
 
   unsigned int length;
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_QUERY_TIMES) {
     link_error(LOG_ERR, "get_query_times(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   if (length != sizeof(fs_query_timing)) {
     link_error(LOG_ERR, "get_query_times(%d): fs_query_timing structure size mis-match", segment);
-    free(in);
+    message_free(in);
     return 3;
   }
   
   memcpy (timing, in + FS_HEADER, sizeof(fs_query_timing));
   
-  free(in);
+  message_free(in);
   return 0;
 }
 
@@ -1438,12 +2248,30 @@ int fsp_bind_limit_many (fsp_link *link,
                          fs_rid_vector ***result,
                          int offset,
                          int limit)
+{
+  return fsp_bind_filter_many(link, flags, mrids, srids, prids, orids, NULL,
+                              result, offset, limit);
+}
+
+int fsp_bind_filter_many (fsp_link *link,
+                          int flags,
+                          fs_rid_vector *mrids,
+                          fs_rid_vector *srids,
+                          fs_rid_vector *prids,
+                          fs_rid_vector *orids,
+                          const fsp_filter *filter,
+                          fs_rid_vector ***result,
+                          int offset,
+                          int limit)
 {
   fs_rid_vector **vectors;
   fs_segment segment;
   int sock[link->segments];
 
   const int bind_direction = flags & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT);
+  const unsigned int filter_bytes = filter_length(link, filter);
+  const int wire_flags = bind_flags(link, flags) |
+                         (filter_bytes ? FS_BIND_FILTER : 0);
 
   switch (bind_direction) {
   case FS_BIND_BY_SUBJECT:
@@ -1462,7 +2290,8 @@ int fsp_bind_limit_many (fsp_link *link,
       }
 
       for (segment = 0; segment < link->segments; ++segment) {
-        unsigned int value, length = 32 + (subjects[segment] + shared) * 8;
+        unsigned int value, length = 32 + filter_bytes +
+                                     (subjects[segment] + shared) * 8;
         unsigned char *content, *out;
 
         if (subjects[segment] == 0) {
@@ -1472,7 +2301,7 @@ int fsp_bind_limit_many (fsp_link *link,
         out = message_new(FS_BIND_LIMIT, segment, length);
         content = out + FS_HEADER;
 
-        memcpy(content, &flags, sizeof(flags));
+        memcpy(content, &wire_flags, sizeof(wire_flags));
         memcpy(content + 4, &offset, sizeof(offset));
         memcpy(content + 8, &limit, sizeof(limit));
         value = mrids->length * 8;
@@ -1499,6 +2328,7 @@ int fsp_bind_limit_many (fsp_link *link,
         content += prids->length * 8;
         memcpy(content, orids->data, orids->length * 8);
         content += orids->length * 8;
+        if (filter_bytes) filter_put(content, filter);
 
         sock[segment] = fsp_write(link, out, length);
         free(out);
@@ -1516,13 +2346,13 @@ int fsp_bind_limit_many (fsp_link *link,
       }
 
       for (segment = 0; segment < link->segments; ++segment) {
-        unsigned int value, length = 32 + (shared * 8);
+        unsigned int value, length = 32 + filter_bytes + (shared * 8);
         unsigned char *content, *out;
 
         out = message_new(FS_BIND_LIMIT, segment, length);
         content = out + FS_HEADER;
 
-        memcpy(content, &flags, sizeof(flags));
+        memcpy(content, &wire_flags, sizeof(wire_flags));
         memcpy(content + 4, &offset, sizeof(offset));
         memcpy(content + 8, &limit, sizeof(limit));
         value = mrids->length * 8;
@@ -1543,6 +2373,7 @@ int fsp_bind_limit_many (fsp_link *link,
         content += prids->length * 8;
         memcpy(content, orids->data, orids->length * 8);
         content += orids->length * 8;
+        if (filter_bytes) filter_put(content, filter);
 
         sock[segment] = fsp_write(link, out, length);
         free(out);
@@ -1573,46 +2404,178 @@ int fsp_bind_limit_many (fsp_link *link,
   for (segment = 0; segment < link->segments; ++segment) {
     if (sock[segment] == -1) continue;
 
-    unsigned char *in = message_recv(sock[segment], &segment, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in) {
       link_error(LOG_ERR, "bind(%d) failed: no reply", segment);
       errors++ ;
       continue;
     } else if (in[3] == FS_NO_MATCH) {
-      free(in);
+      message_free(in);
       continue;
-    } else if (in[3] != FS_BIND_LIST) {
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
       link_error(LOG_ERR, "bind(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       errors++ ;
       continue;
     }
 
-    unsigned char *content = in + FS_HEADER;
-
     if (cols == 0) {
       matches++;
     } else {
-      int count = length / (8 * cols);
-      if (count == limit) {
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "bind(%d) failed: malformed reply", segment);
+        errors++;
+      } else if (count == limit) {
         (link->hit_limits)++;
       }
+    }
+    message_free(in);
+  }
+
+  if (cols == 0 && matches == 0) {
+    free(vectors);
+    *result = NULL; /* if there are no results, there's no match */
+  } else {
+    *result = vectors;
+  }
+
+  return errors;
+}
+
+int fsp_bind_join_many (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *keys[4],
+                        fs_rid_vector *mrids,
+                        fs_rid_vector *prids,
+                        const fsp_filter *filter,
+                        fs_rid_vector ***result,
+                        int limit)
+{
+  const unsigned int filter_bytes = filter_length(link, filter);
+  const int wire_flags = bind_flags(link, flags) |
+                         (filter_bytes ? FS_BIND_FILTER : 0);
+  const int by_subject = flags & FS_BIND_BY_SUBJECT;
+  fs_segment segment;
+  int sock[link->segments];
+  int keyslots = 0, key_cols = 0, rows = 0;
+
+  for (int k = 0; k < 4; ++k) {
+    if (keys[k]) {
+      keyslots |= 1 << k;
+      key_cols++;
+      rows = keys[k]->length;
+    }
+  }
+  if (!(keyslots & (by_subject ? FS_BIND_SUBJECT : FS_BIND_OBJECT))) {
+    link_error(LOG_ERR, "bind_join passed no keys for the index it uses");
+    return 1;
+  }
+
+  /* by subject each segment gets just the rows with its subjects */
+  int seg_rows[link->segments];
+  for (segment = 0; segment < link->segments; ++segment) {
+    seg_rows[segment] = by_subject ? 0 : rows;
+  }
+  if (by_subject) {
+    for (int r = 0; r < rows; ++r) {
+      seg_rows[FS_RID_SEGMENT(keys[1]->data[r], link->segments)]++;
+    }
+  }
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    if (seg_rows[segment] == 0) {
+      sock[segment] = -1;
+      continue;
+    }
 
-      for (k = 0; k < cols; ++k) {
-        fs_rid_vector *v = fs_rid_vector_new(count);
-        memcpy(v->data, content, count * 8);
-	if (vectors[k]) {
-          fs_rid_vector_append_vector(vectors[k], v);
-          fs_rid_vector_free(v);
-        } else {
-          vectors[k] = v;
+    unsigned int value, length = 32 + filter_bytes +
+      (seg_rows[segment] * key_cols + mrids->length + prids->length) * 8;
+    unsigned char *out = message_new(FS_BIND_JOIN, segment, length);
+    unsigned char *content = out + FS_HEADER;
+
+    memcpy(content, &wire_flags, sizeof(wire_flags));
+    memcpy(content + 4, &limit, sizeof(limit));
+    value = seg_rows[segment];
+    memcpy(content + 8, &value, sizeof(value));
+    memcpy(content + 12, &keyslots, sizeof(keyslots));
+    value = mrids->length * 8;
+    memcpy(content + 16, &value, sizeof(value));
+    value = prids->length * 8;
+    memcpy(content + 20, &value, sizeof(value));
+    content += 32;
+
+    for (int k = 0; k < 4; ++k) {
+      if (!keys[k]) continue;
+      if (!by_subject) {
+        memcpy(content, keys[k]->data, rows * 8);
+        content += rows * 8;
+        continue;
+      }
+      for (int r = 0; r < rows; ++r) {
+        if (FS_RID_SEGMENT(keys[1]->data[r], link->segments) == segment) {
+          memcpy(content, keys[k]->data + r, 8);
+          content += 8;
         }
-        content += count * 8;
       }
     }
-    free(in);
+
+    memcpy(content, mrids->data, mrids->length * 8);
+    content += mrids->length * 8;
+    memcpy(content, prids->data, prids->length * 8);
+    content += prids->length * 8;
+    if (filter_bytes) filter_put(content, filter);
+
+    sock[segment] = fsp_write(link, out, length);
+    free(out);
+  }
+
+  fs_rid_vector **vectors;
+  int matches = 0, cols = 0, k, errors = 0;
+
+  for (k = 0; k < 4; ++k) {
+    if (flags & 1 << k) cols++;
+  }
+
+  if (cols == 0) {
+    vectors = calloc(1, sizeof(fs_rid_vector *));
+  } else {
+    vectors = calloc(cols, sizeof(fs_rid_vector *));
+  }
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    if (sock[segment] == -1) continue;
+
+    unsigned int length;
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
+
+    if (!in) {
+      link_error(LOG_ERR, "bind_join(%d) failed: no reply", segment);
+      errors++;
+      continue;
+    } else if (in[3] == FS_NO_MATCH) {
+      message_free(in);
+      continue;
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
+      link_error(LOG_ERR, "bind_join(%d) failed: %s", segment, invalid_response(in));
+      message_free(in);
+      errors++;
+      continue;
+    }
+
+    if (cols == 0) {
+      matches++;
+    } else {
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "bind_join(%d) failed: malformed reply", segment);
+        errors++;
+      } else if (count == limit) {
+        (link->hit_limits)++;
+      }
+    }
+    message_free(in);
   }
 
   if (cols == 0 && matches == 0) {
@@ -1625,6 +2588,276 @@ int fsp_bind_limit_many (fsp_link *link,
   return errors;
 }
 
+int fsp_bind_star_many (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *srids,
+                        fs_rid_vector *mrids,
+                        int arm_count,
+                        fs_star_arm *arms,
+                        const fsp_filter *filter,
+                        fs_rid_vector ***result,
+                        int limit)
+{
+  const unsigned int filter_bytes = filter_length(link, filter);
+  const int wire_flags = bind_flags(link, flags) |
+                         (filter_bytes ? FS_BIND_FILTER : 0);
+  fs_segment segment;
+  int sock[link->segments];
+
+  if (arm_count > FS_MAX_STAR_ARMS) {
+    link_error(LOG_ERR, "bind_star passed %d arms", arm_count);
+    return 1;
+  }
+
+  unsigned int arm_bytes = 0;
+  for (int a = 0; a < arm_count; ++a) {
+    arm_bytes += 16 + arms[a].objects->length * 8;
+  }
+
+  /* the subjects are split between their segments */
+  int seg_subjects[link->segments];
+  for (segment = 0; segment < link->segments; ++segment) {
+    seg_subjects[segment] = 0;
+  }
+  for (int s = 0; s < srids->length; ++s) {
+    seg_subjects[FS_RID_SEGMENT(srids->data[s], link->segments)]++;
+  }
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    if (srids->length && seg_subjects[segment] == 0) {
+      sock[segment] = -1;
+      continue;
+    }
+
+    unsigned int value, length = 32 + filter_bytes +
+      (seg_subjects[segment] + mrids->length) * 8 + arm_bytes;
+    unsigned char *out = message_new(FS_BIND_STAR, segment, length);
+    unsigned char *content = out + FS_HEADER;
+
+    memcpy(content, &wire_flags, sizeof(wire_flags));
+    memcpy(content + 4, &limit, sizeof(limit));
+    memcpy(content + 8, &arm_count, sizeof(arm_count));
+    value = seg_subjects[segment] * 8;
+    memcpy(content + 12, &value, sizeof(value));
+    value = mrids->length * 8;
+    memcpy(content + 16, &value, sizeof(value));
+    content += 32;
+
+    for (int s = 0; s < srids->length; ++s) {
+      if (FS_RID_SEGMENT(srids->data[s], link->segments) == segment) {
+        memcpy(content, srids->data + s, 8);
+        content += 8;
+      }
+    }
+    memcpy(content, mrids->data, mrids->length * 8);
+    content += mrids->length * 8;
+
+    for (int a = 0; a < arm_count; ++a) {
+      memcpy(content, &arms[a].predicate, 8);
+      value = arms[a].objects->length * 8;
+      memcpy(content + 8, &value, sizeof(value));
+      value = arms[a].bind ? 1 : 0;
+      memcpy(content + 12, &value, sizeof(value));
+      content += 16;
+      memcpy(content, arms[a].objects->data, arms[a].objects->length * 8);
+      content += arms[a].objects->length * 8;
+    }
+    if (filter_bytes) filter_put(content, filter);
+
+    sock[segment] = fsp_write(link, out, length);
+    free(out);
+  }
+
+  int cols = 1, errors = 0;
+  for (int a = 0; a < arm_count; ++a) {
+    if (arms[a].bind) cols++;
+  }
+  fs_rid_vector **vectors = calloc(cols, sizeof(fs_rid_vector *));
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    if (sock[segment] == -1) continue;
+
+    unsigned int length;
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
+
+    if (!in) {
+      link_error(LOG_ERR, "bind_star(%d) failed: no reply", segment);
+      errors++;
+      continue;
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
+      link_error(LOG_ERR, "bind_star(%d) failed: %s", segment, invalid_response(in));
+      message_free(in);
+      errors++;
+      continue;
+    }
+
+    int count = bind_reply(in, length, cols, vectors);
+    if (count == -1) {
+      link_error(LOG_ERR, "bind_star(%d) failed: malformed reply", segment);
+      errors++;
+    } else if (count == limit) {
+      (link->hit_limits)++;
+    }
+    message_free(in);
+  }
+
+  /* segments with no subjects have no rows */
+  for (int k = 0; k < cols; ++k) {
+    if (!vectors[k]) vectors[k] = fs_rid_vector_new(0);
+  }
+  *result = vectors;
+
+  return errors;
+}
+
+struct group_row {
+  fs_rid col[4];
+  fs_rid count;
+};
+
+static int group_row_compare (const void *va, const void *vb)
+{
+  const struct group_row *a = va;
+  const struct group_row *b = vb;
+
+  for (int k = 0; k < 4; ++k) {
+    if (a->col[k] > b->col[k]) return 1;
+    if (a->col[k] < b->col[k]) return -1;
+  }
+
+  return 0;
+}
+
+/* the segments group their own rows, rows in more than one segment are
+   merged here, adding up their counts */
+static void group_merge (fs_rid_vector **vectors, int cols)
+{
+  const int rows = vectors[cols]->length;
+  if (rows < 2) return;
+
+  struct group_row *grows = calloc(rows, sizeof(struct group_row));
+  for (int r = 0; r < rows; ++r) {
+    for (int k = 0; k < cols; ++k) {
+      grows[r].col[k] = vectors[k]->data[r];
+    }
+    grows[r].count = vectors[cols]->data[r];
+  }
+  qsort(grows, rows, sizeof(struct group_row), group_row_compare);
+
+  int out = 0;
+  for (int r = 0; r < rows; ++r) {
+    if (out > 0 && !group_row_compare(grows + out - 1, grows + r)) {
+      grows[out - 1].count += grows[r].count;
+    } else {
+      grows[out++] = grows[r];
+    }
+  }
+  for (int r = 0; r < out; ++r) {
+    for (int k = 0; k < cols; ++k) {
+      vectors[k]->data[r] = grows[r].col[k];
+    }
+    vectors[cols]->data[r] = grows[r].count;
+  }
+  for (int k = 0; k <= cols; ++k) {
+    vectors[k]->length = out;
+  }
+  free(grows);
+}
+
+int fsp_bind_group_all (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *mrids,
+                        fs_rid_vector *srids,
+                        fs_rid_vector *prids,
+                        fs_rid_vector *orids,
+                        fs_rid_vector ***result)
+{
+  fs_segment segment;
+  unsigned char *out, *content;
+  unsigned int length, value;
+  int sock[link->segments], ret = 0;
+
+  const int wire_flags = bind_flags(link, flags);
+
+  length = 24 +
+         (mrids->length + srids->length + prids->length + orids->length) * 8;
+
+  out = message_new(FS_BIND_GROUP, 0, length);
+  content = out + FS_HEADER;
+
+  memcpy(content, &wire_flags, sizeof(wire_flags));
+  value = mrids->length * 8;
+  memcpy(content + 4, &value, sizeof(value));
+  value = srids->length * 8;
+  memcpy(content + 8, &value, sizeof(value));
+  value = prids->length * 8;
+  memcpy(content + 12, &value, sizeof(value));
+  value = orids->length * 8;
+  memcpy(content + 16, &value, sizeof(value));
+  memset(content + 20, 0, 4);
+  content += 24;
+
+  memcpy(content, mrids->data, mrids->length * 8);
+  content += mrids->length * 8;
+  memcpy(content, srids->data, srids->length * 8);
+  content += srids->length * 8;
+  memcpy(content, prids->data, prids->length * 8);
+  content += prids->length * 8;
+  memcpy(content, orids->data, orids->length * 8);
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    unsigned int * const s = (unsigned int *) (out + 8);
+    *s = segment;
+    sock[segment] = fsp_write(link, out, length);
+  }
+  free(out);
+
+  int k, cols = 0, matches = 0;
+  for (k = 0; k < 4; ++k) {
+    if (flags & 1 << k) cols++;
+  }
+  fs_rid_vector **vectors = calloc(cols + 1, sizeof(fs_rid_vector *));
+
+  for (segment = 0; segment < link->segments; ++segment) {
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
+
+    if (!in) {
+      link_error(LOG_ERR, "bind_group(%d) failed: no reply", segment);
+      ret++;
+      continue;
+    } else if (in[3] == FS_NO_MATCH) {
+      message_free(in);
+      continue;
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
+      link_error(LOG_ERR, "bind_group(%d) failed: %s", segment, invalid_response(in));
+      message_free(in);
+      ret++;
+      continue;
+    }
+
+    if (bind_reply(in, length, cols + 1, vectors) == -1) {
+      link_error(LOG_ERR, "bind_group(%d) failed: malformed reply", segment);
+      ret++;
+    } else {
+      matches++;
+    }
+    message_free(in);
+  }
+
+  if (matches == 0) {
+    for (k = 0; k <= cols; ++k) {
+      fs_rid_vector_free(vectors[k]);
+    }
+    free(vectors);
+    *result = NULL;
+  } else {
+    group_merge(vectors, cols);
+    *result = vectors;
+  }
+
+  return ret;
+}
+
 int fsp_bnode_alloc (fsp_link *link, int count,
                      fs_rid *from, fs_rid *to)
 {
@@ -1640,20 +2873,20 @@ int fsp_bnode_alloc (fsp_link *link, int count,
 
   if (!in || in[3] != FS_BNODE_RANGE) {
     link_error(LOG_ERR, "bnode_alloc failed: %s", invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
   if (length != 16) {
     link_error(LOG_ERR, "bnode_alloc wrong reply length %u", length);
-    free(in);
+    message_free(in);
     return 1;
   }
 
   memcpy(from, in + FS_HEADER, sizeof(fs_rid));
   memcpy(to, in + FS_HEADER + 8, sizeof(fs_rid));
 
-  free(in);
+  message_free(in);
   return 0;
 }
 
@@ -1673,12 +2906,11 @@ int fsp_resolve (fsp_link *link,
   int sock = fsp_write(link, out, length);
   free(out);
 
-  unsigned char *in = message_recv(sock, &segment, &length);
-  g_static_mutex_unlock (&link->mutex[segment]);
+  unsigned char *in = fsp_recv(link, segment, sock, &length);
 
   if (!in || in[3] != FS_RESOURCE_ATTR_LIST) {
     link_error(LOG_ERR, "resolve(%d) failed: %s", segment, invalid_response(in));
-    free(in);
+    message_free(in);
     return 1;
   }
 
@@ -1687,7 +2919,7 @@ int fsp_resolve (fsp_link *link,
   for (int k = 0; k < rids->length; ++k) {
     if (content > in + FS_HEADER + length) {
       link_error(LOG_ERR, "resolve(%d) invalid offset", segment);
-      free(in);
+      message_free(in);
       return 1;
     }
     unsigned int offset;
@@ -1698,7 +2930,7 @@ int fsp_resolve (fsp_link *link,
     content += offset;
   }
 
-  free(in);
+  message_free(in);
 
   return 0;
 }
@@ -1726,17 +2958,15 @@ int fsp_resolve_all (fsp_link *link,
   }
 
   for (segment = 0; segment < link->segments; ++segment) {
-    fs_segment ignore;
     unsigned int length;
 
     if (sock[segment] == -1) continue; /* skip, no RIDs */
 
-    unsigned char *in = message_recv(sock[segment], &ignore, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in || in[3] != FS_RESOURCE_ATTR_LIST) {
       link_error(LOG_ERR, "resolve(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       ret ++;
       continue;
     }
@@ -1759,7 +2989,7 @@ int fsp_resolve_all (fsp_link *link,
       content += offset;
     }
 
-    free(in);
+    message_free(in);
   }
 
   return ret;
@@ -1778,6 +3008,8 @@ int fsp_bind_first_all (fsp_link *link, int flags,
   unsigned int length, value;
   int sock[link->segments], ret = 0;
 
+  const int wire_flags = bind_flags(link, flags);
+
   /* fill out */
   length = 32 +
          (mrids->length + srids->length + prids->length + orids->length ) * 8;
@@ -1785,7 +3017,7 @@ int fsp_bind_first_all (fsp_link *link, int flags,
   out = message_new(FS_BIND_FIRST, 0, length);
   content = out + FS_HEADER;
 
-  memcpy(content, &flags, sizeof(flags));
+  memcpy(content, &wire_flags, sizeof(wire_flags));
   memcpy(content + 4, &count, sizeof(count));
   value = mrids->length * 8;
   memcpy(content + 12, &value, sizeof(value));
@@ -1826,20 +3058,18 @@ int fsp_bind_first_all (fsp_link *link, int flags,
   }
 
   for (segment = 0; segment < link->segments; ++segment) {
-    unsigned char *in = message_recv(sock[segment], &segment, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
-    content = in + FS_HEADER;
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in) {
       link_error(LOG_ERR, "bind_first(%d) failed: no reply", segment);
       ret++ ;
       continue;
     } else if (in[3] == FS_NO_MATCH) {
-      free(in);
+      message_free(in);
       continue;
-    } else if (in[3] != FS_BIND_LIST) {
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
       link_error(LOG_ERR, "bind_first(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       ret++;
       continue;
     }
@@ -1847,21 +3077,14 @@ int fsp_bind_first_all (fsp_link *link, int flags,
     if (cols == 0) {
       matches++;
     } else {
-      int count = length / (8 * cols);
-      for (k = 0; k < cols; ++k) {
-        fs_rid_vector *v = fs_rid_vector_new(count);
-        memcpy(v->data, content, count * 8);
-	if (vectors[k]) {
-          fs_rid_vector_append_vector(vectors[k], v);
-          fs_rid_vector_free(v);
-        } else {
-          vectors[k] = v;
-        }
-        content += count * 8;
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "bind_first(%d) failed: malformed reply", segment);
+        ret++;
       }
     }
 
-    free(in);
+    message_free(in);
   }
 
   if (cols == 0 && matches == 0) {
@@ -1881,9 +3104,10 @@ int fsp_bind_next_all (fsp_link *link, int flags,
   fs_segment segment;
   int sock[link->segments], ret = 0;
 
+  const int wire_flags = bind_flags(link, flags);
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned char *out = message_new(FS_BIND_NEXT, segment, 8);
-    memcpy(out + FS_HEADER, &flags, sizeof(flags));
+    memcpy(out + FS_HEADER, &wire_flags, sizeof(wire_flags));
     memcpy(out + FS_HEADER + 4, &count, sizeof(count));
     sock[segment] = fsp_write(link, out, 8);
     free(out);
@@ -1903,43 +3127,33 @@ int fsp_bind_next_all (fsp_link *link, int flags,
 
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned int length;
-    unsigned char *in = message_recv(sock[segment], &segment, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in) {
       link_error(LOG_ERR, "bind_next(%d) failed: no reply", segment);
       ret++ ;
       continue;
     } else if (in[3] == FS_NO_MATCH) {
-      free(in);
+      message_free(in);
       continue;
-    } else if (in[3] != FS_BIND_LIST) {
+    } else if (in[3] != FS_BIND_LIST && in[3] != FS_BIND_LIST_COMPACT) {
       link_error(LOG_ERR, "bind_next(%d) failed: %s", segment, invalid_response(in));
-      free(in);
+      message_free(in);
       ret++ ;
       continue;
     }
 
-    unsigned char *content = in + FS_HEADER;
-
     if (cols == 0) {
       matches++;
     } else {
-      int count = length / (8 * cols);
-      for (k = 0; k < cols; ++k) {
-        fs_rid_vector *v = fs_rid_vector_new(count);
-        memcpy(v->data, content, count * 8);
-        if (vectors[k]) {
-          fs_rid_vector_append_vector(vectors[k], v);
-          fs_rid_vector_free(v);
-        } else {
-          vectors[k] = v;
-        }
-        content += count * 8;
+      int count = bind_reply(in, length, cols, vectors);
+      if (count == -1) {
+        link_error(LOG_ERR, "bind_next(%d) failed: malformed reply", segment);
+        ret++;
       }
     }
 
-    free(in);
+    message_free(in);
   }
 
   if (cols == 0 && matches == 0) {
@@ -1965,7 +3179,7 @@ int fsp_bind_done_all (fsp_link *link)
   int errors = 0;
 
   for (fs_segment segment = 0; segment < link->segments; ++segment) {
-    errors += check_message(link, sock[segment], "bind_done(%d) failed: %s");
+    errors += check_message(link, segment, sock[segment], "bind_done(%d) failed: %s");
   }
 
   return errors;
@@ -2054,7 +3268,7 @@ int fsp_lock (fsp_link *link)
     *s = segment;
     fsp_write_primary(link, out, 0);
 
-    errors += check_message(link, link->socks1[segment], "lock(%d) failed: %s");
+    errors += check_message(link, segment, link->socks1[segment], "lock(%d) failed: %s");
   }
   free(out);
 
@@ -2071,7 +3285,7 @@ int fsp_unlock (fsp_link *link)
     *s = segment;
     fsp_write_primary(link, out, 0);
 
-    errors += check_message(link, link->socks1[segment], "unlock(%d) failed: %s");
+    errors += check_message(link, segment, link->socks1[segment], "unlock(%d) failed: %s");
   }
   free(out);
 
@@ -2116,16 +3330,14 @@ int fsp_get_quad_freq_all (fsp_link *link, int index, int count, fs_quad_freq **
   free(out);
 
   for (fs_segment segment = 0; segment < link->segments; ++segment) {
-    fs_segment ignore;
     unsigned int length;
-    unsigned char *in = message_recv(sock[segment], &ignore, &length);
-    g_static_mutex_unlock (&link->mutex[segment]);
+    unsigned char *in = fsp_recv(link, segment, sock[segment], &length);
 
     if (!in || in[3] != FS_QUAD_FREQ) {
       link_error(LOG_ERR, "get_quad_freq(%d) failed: %s", segment, invalid_response(in));
       free(*freq);
       *freq = NULL;
-      free(in);
+      message_free(in);
       return 1;
     }
 
@@ -2133,14 +3345,14 @@ int fsp_get_quad_freq_all (fsp_link *link, int index, int count, fs_quad_freq **
       link_error(LOG_ERR, "get_quad_freq(%d): result size wrong", segment);
       free(*freq);
       *freq = NULL;
-      free(in);
+      message_free(in);
       return 3;
     }
 
     memcpy (next, in + FS_HEADER, length);
     next += length / sizeof(fs_quad_freq);
 
-    free(in);
+    message_free(in);
   }
 
   next->freq = 0;
@@ -26,6 +26,12 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#ifdef HAVE_SHM_OPEN
+#include <sys/mman.h>
+#endif
 
 #include "error.h"
 
@@ -153,6 +159,371 @@ unsigned char *fsp_error_new(fs_segment segment, const char *message)
   return err;
 }
 
+/* FS_BIND_LIST_COMPACT column encodings */
+#define BIND_RAW   0 /* eight bytes a rid */
+#define BIND_DELTA 1 /* varints, zigzagged difference from the previous rid */
+#define BIND_DICT  2 /* a table of distinct rids, then varint indexes into it */
+
+/* don't bother with a dictionary unless it's this many times shorter */
+#define BIND_DICT_RATIO 4
+
+static int varint_size (guint64 v)
+{
+  int n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+
+  return n;
+}
+
+static unsigned char *varint_put (unsigned char *p, guint64 v)
+{
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+
+  return p;
+}
+
+static const unsigned char *varint_get (const unsigned char *p,
+                                        const unsigned char *end, guint64 *v)
+{
+  guint64 x = 0;
+
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    x |= (guint64) (*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      *v = x;
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+static guint64 zigzag (fs_rid from, fs_rid to)
+{
+  const gint64 d = (gint64) (to - from);
+
+  return ((guint64) d << 1) ^ (guint64) (d >> 63);
+}
+
+static fs_rid unzigzag (fs_rid from, guint64 z)
+{
+  return from + ((z >> 1) ^ -(z & 1));
+}
+
+/* position of r in the sorted, distinct dict, in fs_rid_vector_sort() order */
+static int dict_find (const fs_rid_vector *dict, fs_rid r)
+{
+  int lo = 0, hi = dict->length - 1;
+
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if ((gint64) dict->data[mid] < (gint64) r) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static unsigned char *encode_column (unsigned char *p, const fs_rid_vector *v)
+{
+  const int rows = v->length;
+  long delta = 0;
+  for (int i = 0; i < rows; i++) {
+    delta += varint_size(zigzag(i ? v->data[i-1] : 0, v->data[i]));
+  }
+
+  fs_rid_vector *dict = fs_rid_vector_copy((fs_rid_vector *) v);
+  fs_rid_vector_sort(dict);
+  fs_rid_vector_uniq(dict, 0);
+  long dictionary = -1;
+  if (dict->length * BIND_DICT_RATIO <= rows) {
+    dictionary = varint_size(dict->length) + dict->length * 8 +
+                 (long) rows * varint_size(dict->length - 1);
+  }
+
+  if (dictionary != -1 && dictionary < delta && dictionary < rows * 8) {
+    *p++ = BIND_DICT;
+    p = varint_put(p, dict->length);
+    memcpy(p, dict->data, dict->length * 8);
+    p += dict->length * 8;
+    for (int i = 0; i < rows; i++) {
+      p = varint_put(p, dict_find(dict, v->data[i]));
+    }
+  } else if (delta < rows * 8) {
+    *p++ = BIND_DELTA;
+    for (int i = 0; i < rows; i++) {
+      p = varint_put(p, zigzag(i ? v->data[i-1] : 0, v->data[i]));
+    }
+  } else {
+    *p++ = BIND_RAW;
+    memcpy(p, v->data, rows * 8);
+    p += rows * 8;
+  }
+  fs_rid_vector_free(dict);
+
+  return p;
+}
+
+unsigned char *fsp_bind_list_new(fs_segment segment, int cols,
+                                 fs_rid_vector **bindings, int compact)
+{
+  if (cols == 0) {
+    return message_new(FS_BIND_LIST, segment, 0);
+  }
+
+  const int rows = bindings[0]->length;
+
+  if (!compact) {
+    unsigned char *reply = message_new(FS_BIND_LIST, segment, rows * 8 * cols);
+    unsigned char *data = reply + FS_HEADER;
+
+    for (int k = 0; k < cols; ++k) {
+      memcpy(data, bindings[k]->data, rows * 8);
+      data += rows * 8;
+    }
+
+    return reply;
+  }
+
+  /* room for every column raw, then shrunk to fit */
+  unsigned char *reply = message_new(FS_BIND_LIST_COMPACT, segment,
+                                     4 + (1 + rows * 8) * cols);
+  unsigned char *data = reply + FS_HEADER;
+
+  memcpy(data, &rows, sizeof(rows));
+  data += 4;
+  for (int k = 0; k < cols; ++k) {
+    data = encode_column(data, bindings[k]);
+  }
+
+  unsigned int length = data - (reply + FS_HEADER);
+  memcpy(reply + 4, &length, sizeof(length));
+
+  return realloc(reply, FS_HEADER + length);
+}
+
+static const unsigned char *decode_column (const unsigned char *p,
+                                           const unsigned char *end,
+                                           fs_rid_vector *v)
+{
+  const int rows = v->length;
+  guint64 x;
+
+  if (p >= end) return NULL;
+  switch (*p++) {
+    case BIND_RAW:
+      if (end - p < (long) rows * 8) return NULL;
+      memcpy(v->data, p, rows * 8);
+      return p + rows * 8;
+
+    case BIND_DELTA:
+      for (int i = 0; i < rows; i++) {
+        if (!(p = varint_get(p, end, &x))) return NULL;
+        v->data[i] = unzigzag(i ? v->data[i-1] : 0, x);
+      }
+      return p;
+
+    case BIND_DICT: {
+      if (!(p = varint_get(p, end, &x))) return NULL;
+      if (x > (guint64) (end - p) / 8) return NULL;
+      const fs_rid *dict = (const fs_rid *) p;
+      const guint64 entries = x;
+      p += entries * 8;
+      for (int i = 0; i < rows; i++) {
+        if (!(p = varint_get(p, end, &x)) || x >= entries) return NULL;
+        memcpy(v->data + i, dict + x, sizeof(fs_rid));
+      }
+      return p;
+    }
+
+    default:
+      return NULL;
+  }
+}
+
+fs_rid_vector **fsp_bind_list_decode(const unsigned char *msg,
+                                     unsigned int length, int cols)
+{
+  const unsigned char *p = msg + FS_HEADER;
+  const unsigned char *end = p + length;
+  int rows;
+
+  if (msg[3] == FS_BIND_LIST) {
+    rows = cols ? length / (8 * cols) : 0;
+  } else if (length < 4) {
+    return NULL;
+  } else {
+    memcpy(&rows, p, sizeof(rows));
+    p += 4;
+    /* every row takes at least a byte a column */
+    if (rows < 0 || (unsigned int) rows > length) return NULL;
+  }
+
+  fs_rid_vector **vectors = calloc(cols ? cols : 1, sizeof(fs_rid_vector *));
+  for (int k = 0; k < cols; ++k) {
+    vectors[k] = fs_rid_vector_new(rows);
+    if (msg[3] == FS_BIND_LIST) {
+      memcpy(vectors[k]->data, p, rows * 8);
+      p += rows * 8;
+    } else if (!(p = decode_column(p, end, vectors[k]))) {
+      for (int j = 0; j <= k; ++j) {
+        fs_rid_vector_free(vectors[j]);
+      }
+      free(vectors);
+      return NULL;
+    }
+  }
+
+  return vectors;
+}
+
+int fsp_socket_is_local(int sock)
+{
+  struct sockaddr_storage local, peer;
+  socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+
+  if (getsockname(sock, (struct sockaddr *) &local, &local_len) ||
+      getpeername(sock, (struct sockaddr *) &peer, &peer_len)) {
+    return 0;
+  }
+  if (local.ss_family != peer.ss_family) return 0;
+
+  if (local.ss_family == AF_INET) {
+    return !memcmp(&((struct sockaddr_in *) &local)->sin_addr,
+                   &((struct sockaddr_in *) &peer)->sin_addr,
+                   sizeof(struct in_addr));
+  } else if (local.ss_family == AF_INET6) {
+    return !memcmp(&((struct sockaddr_in6 *) &local)->sin6_addr,
+                   &((struct sockaddr_in6 *) &peer)->sin6_addr,
+                   sizeof(struct in6_addr));
+  }
+
+  return 0;
+}
+
+/* replies handed over in shared memory stay mapped until message_free(),
+   mapped address -> length */
+#ifdef HAVE_SHM_OPEN
+static GHashTable *shm_mapped = NULL;
+G_LOCK_DEFINE_STATIC(shm_mapped);
+#endif
+
+/* the reply itself was left in the shared memory object named by control,
+   header and all, map it and remove the object. If it can't be read the
+   caller gets an FS_ERROR in its place */
+static unsigned char *shm_reply_recv(unsigned char *control,
+                                     unsigned int *segment,
+                                     unsigned int *length)
+{
+  unsigned char *buffer;
+  const unsigned int control_length = *length;
+
+  if (control_length == 0 || control[FS_HEADER + control_length - 1] != '\0') {
+    fs_error(LOG_ERR, "malformed shared memory reply");
+    goto failed;
+  }
+
+#ifdef HAVE_SHM_OPEN
+  const char *name = (const char *) control + FS_HEADER;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) {
+    fs_error(LOG_ERR, "shm_open(%s) failed, %s", name, strerror(errno));
+    goto failed;
+  }
+  shm_unlink(name);
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < FS_HEADER) {
+    fs_error(LOG_ERR, "shared memory reply %s truncated", name);
+    close(fd);
+    goto failed;
+  }
+
+  /* private, so callers can scribble on it as on any other reply */
+  buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    fs_error(LOG_ERR, "mmap shared memory reply failed, %s", strerror(errno));
+    goto failed;
+  }
+
+  unsigned int inner_length;
+  memcpy(&inner_length, buffer + 4, sizeof(inner_length));
+  if (memcmp(buffer, fsp_vermagic, 3) ||
+      FS_HEADER + (off_t) inner_length != st.st_size) {
+    fs_error(LOG_ERR, "shared memory reply %s corrupt", name);
+    munmap(buffer, st.st_size);
+    goto failed;
+  }
+
+  G_LOCK(shm_mapped);
+  if (!shm_mapped) shm_mapped = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(shm_mapped, buffer, GSIZE_TO_POINTER(st.st_size));
+  G_UNLOCK(shm_mapped);
+
+  memcpy(segment, buffer + 8, sizeof(fs_segment));
+  *length = inner_length;
+  free(control);
+
+  return buffer;
+#else
+  fs_error(LOG_ERR, "shared memory replies not supported");
+#endif
+
+failed:
+  buffer = fsp_error_new(*segment, "shared memory reply lost");
+  memcpy(buffer + FS_HEADER_TAG, control + FS_HEADER_TAG, 4);
+  memcpy(length, buffer + 4, sizeof(unsigned int));
+  free(control);
+
+  return buffer;
+}
+
+unsigned char *message_recv_reply(int sock,
+                                  unsigned int *segment,
+                                  unsigned int *length)
+{
+  unsigned char *buffer = message_recv(sock, segment, length);
+
+  if (buffer && buffer[3] == FS_SHM_REPLY) {
+    return shm_reply_recv(buffer, segment, length);
+  }
+
+  return buffer;
+}
+
+void message_free(unsigned char *msg)
+{
+  if (!msg) return;
+
+#ifdef HAVE_SHM_OPEN
+  gpointer mapped = NULL;
+  G_LOCK(shm_mapped);
+  if (shm_mapped && g_hash_table_size(shm_mapped) > 0) {
+    mapped = g_hash_table_lookup(shm_mapped, msg);
+    if (mapped) g_hash_table_remove(shm_mapped, msg);
+  }
+  G_UNLOCK(shm_mapped);
+  if (mapped) {
+    munmap(msg, GPOINTER_TO_SIZE(mapped));
+    return;
+  }
+#endif
+
+  free(msg);
+}
+
 unsigned char *message_recv(int sock,
                             unsigned int *segment,
                             unsigned int *length)
@@ -194,10 +565,86 @@ unsigned char *message_recv(int sock,
     p+= count;
     len-= count;
   }
-  
+
   return buffer;
 }
 
+/* query contexts, for backends */
+
+struct fsp_request {
+  uint64_t query;
+  double deadline;
+  int stopped;
+};
+
+/* most recently cancelled queries remembered */
+#define FS_CANCELLED_MAX 256
+
+static GStaticPrivate request_key = G_STATIC_PRIVATE_INIT;
+static uint64_t cancelled[FS_CANCELLED_MAX];
+static unsigned int cancelled_count = 0;
+G_LOCK_DEFINE_STATIC(cancelled);
+
+void fsp_request_begin(uint64_t query, uint32_t ms)
+{
+  struct fsp_request *r = g_static_private_get(&request_key);
+
+  if (!r) {
+    r = calloc(1, sizeof(struct fsp_request));
+    g_static_private_set(&request_key, r, free);
+  }
+  r->query = query;
+  r->deadline = ms ? fs_time() + ms / 1000.0 : 0.0;
+  r->stopped = 0;
+}
+
+void fsp_request_end(void)
+{
+  struct fsp_request *r = g_static_private_get(&request_key);
+
+  if (r) {
+    r->query = 0;
+    r->deadline = 0.0;
+    r->stopped = 0;
+  }
+}
+
+void fsp_request_cancel(uint64_t query)
+{
+  G_LOCK(cancelled);
+  cancelled[cancelled_count++ % FS_CANCELLED_MAX] = query;
+  G_UNLOCK(cancelled);
+}
+
+int fsp_request_expired(void)
+{
+  struct fsp_request *r = g_static_private_get(&request_key);
+  int expired = 0;
+
+  if (!r) return 0;
+  if (r->stopped) return 1;
+  if (r->deadline > 0.0 && fs_time() > r->deadline) {
+    expired = 1;
+  } else if (r->query) {
+    G_LOCK(cancelled);
+    const unsigned int count = MIN(cancelled_count, FS_CANCELLED_MAX);
+    for (unsigned int k = 0; k < count && !expired; ++k) {
+      expired = cancelled[k] == r->query;
+    }
+    G_UNLOCK(cancelled);
+  }
+  r->stopped = expired;
+
+  return expired;
+}
+
+int fsp_request_stopped(void)
+{
+  struct fsp_request *r = g_static_private_get(&request_key);
+
+  return r && r->stopped;
+}
+
 const char *fsp_kb_name(fsp_link *link)
 {
   return link->kb_name;
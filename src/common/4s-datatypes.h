@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 /* uncomment to get a trace of allocated red_vectors */
 //#define DEBUG_RV_ALLOC
@@ -37,10 +38,14 @@
 #define FS_BIND_SAME_ABAB        0xd000
 #define FS_BIND_SAME_ABBA        0xe000
 
+/* a filter program follows the request, set by the client library */
+#define FS_BIND_FILTER             0x400000
 #define FS_QUERY_RESTRICTED        0x800000
 
 #define FS_BIND_BY_SUBJECT        0x1000000
 #define FS_BIND_BY_OBJECT         0x2000000
+/* reply with FS_BIND_LIST_COMPACT, set by the client library */
+#define FS_BIND_COMPACT           0x4000000
 /* FS_BIND_START is backend-only, never sent over the wire */
 #define FS_BIND_END               0x8000000
 /* FS_BIND_PRICE is backend-only, never sent over the wire */
@@ -49,6 +54,32 @@
 #define FS_QUERY_COUNT           0x40000000
 #define FS_QUERY_DEFAULT_GRAPH   0x80000000
 
+/* filter program terms, see docs/protocol */
+#define FS_FILTER_IN               0x01
+#define FS_FILTER_IS_URI           0x02
+#define FS_FILTER_IS_BNODE         0x03
+#define FS_FILTER_IS_LITERAL       0x04
+#define FS_FILTER_ATTR_IN          0x05
+#define FS_FILTER_NUMBER           0x06
+#define FS_FILTER_DATETIME         0x07
+
+/* comparisons, for FS_FILTER_NUMBER and FS_FILTER_DATETIME */
+#define FS_FILTER_LT               0x01
+#define FS_FILTER_LE               0x02
+#define FS_FILTER_EQ               0x03
+#define FS_FILTER_GE               0x04
+#define FS_FILTER_GT               0x05
+
+/* term flags */
+#define FS_FILTER_NOT              0x01
+
+/* operands of FS_FILTER_NUMBER: the value, then the datatypes it can be
+ * compared with */
+#define FS_FILTER_NUMBER_OPERANDS  5
+
+/* START IMPORT flags */
+#define FS_IMPORT_BULK            0x01
+
 typedef unsigned long long int fs_rid;
 typedef uint32_t fs_segment;
 typedef uint32_t fs_index_node;
@@ -76,6 +107,14 @@ typedef struct {
     char **sdata;
 } fs_rid_str_vector;
 
+/* one triple pattern of a subject star, objects holds the values the object
+ * may take, or is empty for any, and bind is set if the objects are wanted */
+typedef struct {
+    fs_rid predicate;
+    fs_rid_vector *objects;
+    int bind;
+} fs_star_arm;
+
 typedef struct _fs_resource {
     fs_rid  rid;
     char   *lex;
@@ -180,6 +219,11 @@ double fs_time(void);
 
 int fs_resource_cmp(const void *va, const void *vb);
 
+/* parse an xsd:dateTime, or a plain YYYY-MM-DD date, into seconds since the
+ * epoch, UTC, return true if they could */
+int fs_time_from_iso8601(const char *iso_date, time_t *time_);
+int fs_time_from_date(const char *date, time_t *time_);
+
 /* vi:set ts=8 sts=4 sw=4: */
 
 #endif
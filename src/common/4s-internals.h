@@ -28,6 +28,14 @@
 
 #define FS_DEFAULT_PORT 6734
 
+/* bytes 12-15 of the header tag a request, the reply carries the same tag */
+#define FS_HEADER_TAG 12
+
+/* reply times kept to decide when to hedge a read */
+#define FS_LATENCY_SAMPLES 256
+
+struct fsp_mux;
+
 struct fsp_link_struct {
   const char *kb_name;
   fsp_hash_enum hash_type;
@@ -43,6 +51,15 @@ struct fsp_link_struct {
   int socks2[FS_MAX_SEGMENTS]; /* for failover */
   long long tics[FS_MAX_SEGMENTS];
   GStaticMutex mutex[FS_MAX_SEGMENTS];
+  struct fsp_mux *mux[FS_MAX_SEGMENTS]; /* multiplexed query sockets, or NULL */
+  struct fsp_mux *mux2[FS_MAX_SEGMENTS]; /* the same for the mirrors */
+  GMutex *mux_lock;                      /* guards all the muxes */
+  GCond *mux_cond;                       /* broadcast when a reply is handed over */
+  int hedge_percentile;                  /* 0 unless reads are hedged */
+  double hedge_after;                    /* seconds, 0 until there are enough samples */
+  double latency[FS_LATENCY_SAMPLES];    /* recent reply times of reads */
+  unsigned int latency_count;
+  guint32 query_base;                    /* makes query ids unique to the link */
   const char *features;
   int hit_limits;
 #if defined(USE_AVAHI)
@@ -59,6 +76,14 @@ struct fsp_link_struct {
 void default_hints(struct addrinfo *hints);
 unsigned char *message_recv(int sock, fs_segment *segment, unsigned int *length); /* free result pls */
 
+/* as message_recv(), but picks up replies left in shared memory, see
+   FS_SHM_REPLY. Release the result with message_free() */
+unsigned char *message_recv_reply(int sock, fs_segment *segment, unsigned int *length);
+void message_free(unsigned char *msg);
+
+/* true if both ends of the connected socket are on this host */
+int fsp_socket_is_local(int sock);
+
 int fsp_add_backend (fsp_link *link, const char *addr, uint16_t port, int segments);
 
 int fsp_ver_fixup (fsp_link *link, int sock);
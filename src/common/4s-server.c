@@ -20,6 +20,8 @@
 
 #define _GNU_SOURCE
 
+#include <4store-config.h>
+
 #include "4s-internals.h"
 #include "error.h"
 #include "params.h"
@@ -37,6 +39,13 @@
 #include <netdb.h>
 #include <glib.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+#ifdef HAVE_SHM_OPEN
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 static char *global_kb_name = NULL;
 static float global_disk_limit = 0.0f;
@@ -70,156 +79,515 @@ static unsigned char * handle_or_fail(const char *name,
 #define handle(fn, be, segment, length, content) \
          handle_or_fail(#fn, fn, be, segment, length, content)
 
+/* handle one message, *auth is set once the connection has authenticated */
+static unsigned char * handle_message (fsp_backend *backend, fs_backend *be,
+                                       unsigned char *msg, fs_segment segment,
+                                       unsigned int length, int *auth)
+{
+  unsigned char *reply = NULL;
+  unsigned char *content = msg + FS_HEADER;
+
+  if (*auth) {
+    switch (msg[3]) {
+      case FS_NO_OP:
+        reply = fsp_handle_no_op(segment, length, content);
+        break;
+      case FS_RESOLVE:
+        reply = handle(backend->resolve, be, segment, length, content);
+        break;
+      case FS_BIND:
+        reply = handle(backend->bind, be, segment, length, content);
+        break;
+      case FS_PRICE_BIND:
+        reply = handle(backend->price, be, segment, length, content);
+        break;
+      case FS_DELETE_MODEL:
+        reply = handle(backend->delete_models, be, segment, length, content);
+        break;
+      case FS_INSERT_RESOURCE:
+        reply = handle(backend->insert_resource, be, segment, length, content);
+        break;
+      case FS_SEGMENTS:
+        reply = handle(backend->segments, be, segment, length, content);
+        break;
+      case FS_COMMIT_RESOURCE:
+        reply = handle(backend->commit_resource, be, segment, length, content);
+        break;
+      case FS_START_IMPORT:
+        reply = handle(backend->start_import, be, segment, length, content);
+        break;
+      case FS_STOP_IMPORT:
+        reply = handle(backend->stop_import, be, segment, length, content);
+        break;
+      case FS_GET_SIZE:
+        reply = handle(backend->get_data_size, be, segment, length, content);
+        break;
+      case FS_GET_IMPORT_TIMES:
+        reply = handle(backend->get_import_times, be, segment, length, content);
+        break;
+      case FS_INSERT_QUAD:
+        reply = handle(backend->insert_quad, be, segment, length, content);
+        break;
+      case FS_COMMIT_QUAD:
+        reply = handle(backend->commit_quad, be, segment, length, content);
+        break;
+      case FS_GET_QUERY_TIMES:
+        reply = handle(backend->get_query_times, be, segment, length, content);
+        break;
+      case FS_BIND_LIMIT:
+        reply = handle(backend->bind_limit, be, segment, length, content);
+        break;
+      case FS_BNODE_ALLOC:
+        reply = handle(backend->bnode_alloc, be, segment, length, content);
+        break;
+      case FS_RESOLVE_ATTR:
+        reply = handle(backend->resolve_attr, be, segment, length, content);
+        break;
+      case FS_DELETE_MODELS:
+        reply = handle(backend->delete_models, be, segment, length, content);
+        break;
+      case FS_NEW_MODELS:
+        reply = handle(backend->new_models, be, segment, length, content);
+        break;
+      case FS_BIND_FIRST:
+        reply = handle(backend->bind_first, be, segment, length, content);
+        break;
+      case FS_BIND_NEXT:
+        reply = handle(backend->bind_next, be, segment, length, content);
+        break;
+      case FS_BIND_DONE:
+        reply = handle(backend->bind_done, be, segment, length, content);
+        break;
+      case FS_TRANSACTION:
+        reply = handle(backend->transaction, be, segment, length, content);
+        break;
+      case FS_NODE_SEGMENTS:
+        reply = handle(backend->node_segments, be, segment, length, content);
+        break;
+      case FS_REVERSE_BIND:
+        reply = handle(backend->reverse_bind, be, segment, length, content);
+        break;
+      case FS_LOCK:
+        reply = handle(backend->lock, be, segment, length, content);
+        break;
+      case FS_UNLOCK:
+        reply = handle(backend->unlock, be, segment, length, content);
+        break;
+      case FS_GET_SIZE_REVERSE:
+        reply = handle(backend->get_size_reverse, be, segment, length, content);
+        break;
+      case FS_GET_QUAD_FREQ:
+        reply = handle(backend->get_quad_freq, be, segment, length, content);
+        break;
+      case FS_CHOOSE_SEGMENT:
+        reply = handle(backend->choose_segment, be, segment, length, content);
+        break;
+      case FS_DELETE_QUADS:
+        reply = handle(backend->delete_quads, be, segment, length, content);
+        break;
+      case FS_GET_UUID:
+        reply = handle(backend->get_uuid, be, segment, length, content);
+        break;
+      case FS_BIND_JOIN:
+        reply = handle(backend->bind_join, be, segment, length, content);
+        break;
+      case FS_BIND_STAR:
+        reply = handle(backend->bind_star, be, segment, length, content);
+        break;
+      case FS_BIND_GROUP:
+        reply = handle(backend->bind_group, be, segment, length, content);
+        break;
+      default:
+        kb_error(LOG_WARNING, "unexpected message type (%d)", msg[3]);
+        reply = fsp_error_new(segment, "unexpected message type");
+        break;
+    }
+  } else if (msg[3] == FS_AUTH) {
+    if (backend->auth) {
+      reply = backend->auth(be, segment, length, content);
+    } else {
+      reply = message_new(FS_DONE_OK, segment, 0);
+    }
+    if (reply[3] == FS_DONE_OK) *auth = 1;
+  } else  {
+    reply = fsp_error_new(segment, "authenticate before continuing");
+  }
+
+  return reply;
+}
+
+/* replies at least this long go through shared memory, on connections that
+   have asked for it with FS_SHM_ENABLE. FS_SHM_THRESHOLD in the environment
+   overrides it, so the tests can send small replies that way too */
+#define FS_SHM_THRESHOLD (1024 * 1024)
+
+static unsigned int shm_threshold = FS_SHM_THRESHOLD;
+
+/* seconds an object may wait for the client before we remove it ourselves */
+#define FS_SHM_LINGER 30.0
+
+struct shm_state {
+  int enabled;          /* big replies go through shared memory */
+  char probe[64];       /* object offered by FS_SHM_ENABLE, not yet confirmed */
+};
+
+#ifdef HAVE_SHM_OPEN
+struct shm_object {
+  char name[64];
+  double created;
+};
+
+static GStaticMutex shm_mutex = G_STATIC_MUTEX_INIT;
+static unsigned int shm_serial = 0;
+static GQueue *shm_objects = NULL;
+
+/* remove the objects clients haven't picked up in time, or all of them */
+static void shm_sweep (int all)
+{
+  const double now = fs_time();
+
+  g_static_mutex_lock(&shm_mutex);
+  while (shm_objects && !g_queue_is_empty(shm_objects)) {
+    struct shm_object *o = g_queue_peek_head(shm_objects);
+    if (!all && now - o->created < FS_SHM_LINGER) break;
+    /* usually the client got there first */
+    shm_unlink(o->name);
+    free(g_queue_pop_head(shm_objects));
+  }
+  g_static_mutex_unlock(&shm_mutex);
+}
+
+/* a name for a new shared memory object */
+static void shm_name (char *name, size_t size)
+{
+  g_static_mutex_lock(&shm_mutex);
+  snprintf(name, size, "/4s-%d-%u", (int) getpid(), shm_serial++);
+  g_static_mutex_unlock(&shm_mutex);
+}
+
+/* leave data in a new shared memory object called name, returns non-zero
+   on success */
+static int shm_write (const char *name, const unsigned char *data, size_t size)
+{
+  shm_sweep(0);
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    kb_error(LOG_WARNING, "shm_open(%s) failed: %s", name, strerror(errno));
+    return 0;
+  }
+
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    kb_error(LOG_WARNING, "mapping %s failed: %s", name, strerror(errno));
+    shm_unlink(name);
+    return 0;
+  }
+  memcpy(p, data, size);
+  munmap(p, size);
+
+  struct shm_object *o = calloc(1, sizeof(struct shm_object));
+  snprintf(o->name, sizeof(o->name), "%s", name);
+  o->created = fs_time();
+  g_static_mutex_lock(&shm_mutex);
+  if (!shm_objects) shm_objects = g_queue_new();
+  g_queue_push_tail(shm_objects, o);
+  g_static_mutex_unlock(&shm_mutex);
+
+  return 1;
+}
+
+/* the user the other end of conn runs as, from the kernel rather than the
+   client's say so. Returns non-zero if it can't be found */
+static int peer_uid (int conn, uid_t *uid)
+{
+  struct sockaddr_storage local, peer;
+  socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+
+  if (getsockname(conn, (struct sockaddr *) &local, &local_len) ||
+      getpeername(conn, (struct sockaddr *) &peer, &peer_len)) {
+    return 1;
+  }
+
+#ifdef SO_PEERCRED
+  if (local.ss_family == AF_UNIX) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)) return 1;
+    *uid = cred.uid;
+    return 0;
+  }
+#endif
+
+#ifdef __linux__
+  /* TCP has no peer credentials, but the kernel lists who owns the
+     client's end of a loopback connection */
+  uint32_t local_addr[4] = { 0, 0, 0, 0 }, peer_addr[4] = { 0, 0, 0, 0 };
+  unsigned int local_port, peer_port;
+  const char *table;
+  int words;
+
+  if (local.ss_family == AF_INET) {
+    memcpy(local_addr, &((struct sockaddr_in *) &local)->sin_addr, 4);
+    memcpy(peer_addr, &((struct sockaddr_in *) &peer)->sin_addr, 4);
+    local_port = ntohs(((struct sockaddr_in *) &local)->sin_port);
+    peer_port = ntohs(((struct sockaddr_in *) &peer)->sin_port);
+    table = "/proc/net/tcp";
+    words = 1;
+  } else if (local.ss_family == AF_INET6) {
+    memcpy(local_addr, &((struct sockaddr_in6 *) &local)->sin6_addr, 16);
+    memcpy(peer_addr, &((struct sockaddr_in6 *) &peer)->sin6_addr, 16);
+    local_port = ntohs(((struct sockaddr_in6 *) &local)->sin6_port);
+    peer_port = ntohs(((struct sockaddr_in6 *) &peer)->sin6_port);
+    table = "/proc/net/tcp6";
+    words = 4;
+  } else {
+    return 1;
+  }
+
+  FILE *f = fopen(table, "r");
+  if (!f) return 1;
+
+  char line[512];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f)) {
+    char from[33], to[33];
+    unsigned int from_port, to_port;
+    unsigned long owner;
+    if (sscanf(line, " %*d: %32[0-9A-Fa-f]:%x %32[0-9A-Fa-f]:%x %*x %*x:%*x "
+               "%*x:%*x %*x %lu", from, &from_port, to, &to_port, &owner) != 5 ||
+        strlen(from) != 8 * words || strlen(to) != 8 * words) {
+      continue;
+    }
+
+    /* the client's end: from its address to ours */
+    uint32_t from_addr[4] = { 0, 0, 0, 0 }, to_addr[4] = { 0, 0, 0, 0 };
+    for (int w = 0; w < words; ++w) {
+      char word[9];
+      memcpy(word, from + 8 * w, 8);
+      word[8] = '\0';
+      from_addr[w] = strtoul(word, NULL, 16);
+      memcpy(word, to + 8 * w, 8);
+      to_addr[w] = strtoul(word, NULL, 16);
+    }
+    if (from_port == peer_port && to_port == local_port &&
+        !memcmp(from_addr, peer_addr, sizeof(peer_addr)) &&
+        !memcmp(to_addr, local_addr, sizeof(local_addr))) {
+      *uid = owner;
+      found = 1;
+    }
+  }
+  fclose(f);
+
+  return !found;
+#else
+  return 1;
+#endif
+}
+#endif
+
+/* a client on this host, running as our user, can have its big replies left
+   in shared memory instead of written to the socket. It's offered a probe
+   object first, and only once it shows it could read that, so is in our IPC
+   namespace too, are replies sent that way */
+static unsigned char * shm_enable (int conn, fs_segment segment,
+                                   unsigned int length, unsigned char *content,
+                                   struct shm_state *shm)
+{
+#ifdef HAVE_SHM_OPEN
+  if (length > sizeof(uint32_t)) {
+    /* confirming the probe, by its name */
+    if (content[length - 1] != '\0' || !shm->probe[0] ||
+        strcmp((char *) content, shm->probe)) {
+      return fsp_error_new(segment, "shm probe not recognised");
+    }
+    shm->probe[0] = '\0';
+    shm->enabled = 1;
+    return message_new(FS_DONE_OK, segment, 0);
+  }
+
+  /* older clients send their uid, which we don't need */
+  uid_t uid;
+  if (!fsp_socket_is_local(conn) || peer_uid(conn, &uid) || uid != geteuid()) {
+    return fsp_error_new(segment, "shared memory not available");
+  }
+
+  /* the probe is an FS_DONE_OK carrying its own name */
+  char name[64];
+  shm_name(name, sizeof(name));
+  unsigned char *probe = message_new(FS_DONE_OK, segment, strlen(name) + 1);
+  memcpy(probe + FS_HEADER, name, strlen(name) + 1);
+  if (!shm_write(name, probe, FS_HEADER + strlen(name) + 1)) {
+    free(probe);
+    return fsp_error_new(segment, "shared memory not available");
+  }
+  free(probe);
+
+  strcpy(shm->probe, name);
+  unsigned char *reply = message_new(FS_SHM_REPLY, segment, strlen(name) + 1);
+  memcpy(reply + FS_HEADER, name, strlen(name) + 1);
+
+  return reply;
+#else
+  return fsp_error_new(segment, "shared memory not available");
+#endif
+}
+
+/* leave reply in a new shared memory object and send its name, the client
+   maps it and removes it, or we do if it's still there after FS_SHM_LINGER.
+   Returns non-zero if reply should be written to the socket after all */
+static int send_shm_reply (int conn, const unsigned char *reply,
+                           unsigned int length)
+{
+#ifdef HAVE_SHM_OPEN
+  char name[64];
+
+  shm_name(name, sizeof(name));
+  if (!shm_write(name, reply, FS_HEADER + length)) {
+    return 1;
+  }
+
+  fs_segment segment;
+  memcpy(&segment, reply + 8, sizeof(segment));
+  unsigned char *control = message_new(FS_SHM_REPLY, segment, strlen(name) + 1);
+  memcpy(control + FS_HEADER_TAG, reply + FS_HEADER_TAG, 4);
+  memcpy(control + FS_HEADER, name, strlen(name) + 1);
+  if (write(conn, control, FS_HEADER + strlen(name) + 1) <= 0) {
+    kb_error(LOG_WARNING, "write reply failed");
+  }
+  free(control);
+
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/* strip the query context from msg, if it has one, and serve it under that
+   context, see fsp_request_begin(). Returns true if the query has already
+   timed out or been cancelled, so msg shouldn't be served at all */
+static int request_begin (unsigned char *msg, unsigned int *length)
+{
+  if (!(msg[3] & FS_MESSAGE_CONTEXT)) return 0;
+
+  msg[3] &= ~FS_MESSAGE_CONTEXT;
+  if (*length < FS_CONTEXT_LENGTH) {
+    kb_error(LOG_WARNING, "query context truncated");
+    return 0;
+  }
+
+  uint64_t query;
+  uint32_t ms;
+  memcpy(&query, msg + FS_HEADER, sizeof(query));
+  memcpy(&ms, msg + FS_HEADER + 8, sizeof(ms));
+  *length -= FS_CONTEXT_LENGTH;
+  memmove(msg + FS_HEADER, msg + FS_HEADER + FS_CONTEXT_LENGTH, *length);
+  memcpy(msg + 4, length, sizeof(*length));
+  fsp_request_begin(query, ms);
+
+  return fsp_request_expired();
+}
+
+/* a request that stopped short, or was never started, because its query
+   ran out of time gets FS_CANCELLED. Replies that were finished are sent
+   as they are, however late */
+static unsigned char * request_end (fs_segment segment, unsigned char *reply)
+{
+  if (fsp_request_stopped()) {
+    static const char message[] = "query timed out or cancelled";
+    free(reply);
+    reply = message_new(FS_CANCELLED, segment, sizeof(message));
+    memcpy(reply + FS_HEADER, message, sizeof(message));
+  }
+  fsp_request_end();
+
+  return reply;
+}
+
+/* FS_CANCEL, no reply is sent */
+static void cancel_query (unsigned int length, unsigned char *content)
+{
+  uint64_t query;
+
+  if (length < sizeof(query)) {
+    kb_error(LOG_WARNING, "malformed cancel");
+    return;
+  }
+  memcpy(&query, content, sizeof(query));
+  fsp_request_cancel(query);
+}
+
+/* the reply carries the tag of the request it answers */
+static void send_reply (int conn, const unsigned char *msg, unsigned char *reply,
+                        const struct shm_state *shm)
+{
+  if (reply) {
+    memcpy(reply + FS_HEADER_TAG, msg + FS_HEADER_TAG, 4);
+    unsigned int* const l = (unsigned int *) (reply + 4);
+    unsigned int length = *l;
+    if (shm->enabled && length >= shm_threshold && !send_shm_reply(conn, reply, length)) {
+      free(reply);
+      return;
+    }
+    if (write(conn, reply, FS_HEADER + length) <= 0) {
+      kb_error(LOG_WARNING, "write reply failed");
+    }
+    free(reply);
+  }
+}
+
+/* if the connection is in fact closed, this won't matter, but otherwise
+   this error might help */
+static void protocol_mismatch (int conn, fs_segment segment)
+{
+  unsigned char *reply = fsp_error_new(segment, "protocol mismatch");
+  unsigned int* const l = (unsigned int *) (reply + 4);
+  unsigned int length = *l;
+  if (write(conn, reply, FS_HEADER + length) != (FS_HEADER+length)) {
+    fs_error(LOG_ERR, "write failed: %s", strerror(errno));
+  }
+  free(reply);
+}
+
 static void child (int conn, fsp_backend *backend, fs_backend *be)
 {
   int auth = 0;
+  struct shm_state shm = { 0 };
 
   while (1) {
     fs_segment segment;
     unsigned int length;
     unsigned char *msg = message_recv(conn, &segment, &length);
-    unsigned char *reply = NULL;
-    unsigned char *content = msg + FS_HEADER;
+    unsigned char *reply;
 
     if (!msg) {
-      /* if the connection is in fact closed, this won't matter,
-         but otherwise this error might help */
-      reply = fsp_error_new(segment, "protocol mismatch");
-      unsigned int* const l = (unsigned int *) (reply + 4);
-      unsigned int length = *l;
-      if (write(conn, reply, FS_HEADER + length) != (FS_HEADER+length)) {
-        fs_error(LOG_ERR, "write failed: %s", strerror(errno));
-      }
+      protocol_mismatch(conn, segment);
       break;
     }
 
-    if (auth) {
-      switch (msg[3]) {
-        case FS_NO_OP:
-          reply = fsp_handle_no_op(segment, length, content);
-          break;
-        case FS_RESOLVE:
-          reply = handle(backend->resolve, be, segment, length, content);
-          break;
-        case FS_BIND:
-          reply = handle(backend->bind, be, segment, length, content);
-          break;
-        case FS_PRICE_BIND:
-          reply = handle(backend->price, be, segment, length, content);
-          break;
-        case FS_DELETE_MODEL:
-          reply = handle(backend->delete_models, be, segment, length, content);
-          break;
-        case FS_INSERT_RESOURCE:
-          reply = handle(backend->insert_resource, be, segment, length, content);
-          break;
-        case FS_SEGMENTS:
-          reply = handle(backend->segments, be, segment, length, content);
-          break;
-        case FS_COMMIT_RESOURCE:
-          reply = handle(backend->commit_resource, be, segment, length, content);
-          break;
-        case FS_START_IMPORT:
-          reply = handle(backend->start_import, be, segment, length, content);
-          break;
-        case FS_STOP_IMPORT:
-          reply = handle(backend->stop_import, be, segment, length, content);
-          break;
-        case FS_GET_SIZE:
-          reply = handle(backend->get_data_size, be, segment, length, content);
-          break;
-        case FS_GET_IMPORT_TIMES:
-          reply = handle(backend->get_import_times, be, segment, length, content);
-          break;
-        case FS_INSERT_QUAD:
-          reply = handle(backend->insert_quad, be, segment, length, content);
-          break;
-        case FS_COMMIT_QUAD:
-          reply = handle(backend->commit_quad, be, segment, length, content);
-          break;
-        case FS_GET_QUERY_TIMES:
-          reply = handle(backend->get_query_times, be, segment, length, content);
-          break;
-        case FS_BIND_LIMIT:
-          reply = handle(backend->bind_limit, be, segment, length, content);
-          break;
-        case FS_BNODE_ALLOC:
-          reply = handle(backend->bnode_alloc, be, segment, length, content);
-          break;
-        case FS_RESOLVE_ATTR:
-          reply = handle(backend->resolve_attr, be, segment, length, content);
-          break;
-        case FS_DELETE_MODELS:
-          reply = handle(backend->delete_models, be, segment, length, content);
-          break;
-        case FS_NEW_MODELS:
-          reply = handle(backend->new_models, be, segment, length, content);
-          break;
-        case FS_BIND_FIRST:
-          reply = handle(backend->bind_first, be, segment, length, content);
-          break;
-        case FS_BIND_NEXT:
-          reply = handle(backend->bind_next, be, segment, length, content);
-          break;
-        case FS_BIND_DONE:
-          reply = handle(backend->bind_done, be, segment, length, content);
-          break;
-        case FS_TRANSACTION:
-          reply = handle(backend->transaction, be, segment, length, content);
-          break;
-        case FS_NODE_SEGMENTS:
-          reply = handle(backend->node_segments, be, segment, length, content);
-          break;
-        case FS_REVERSE_BIND:
-          reply = handle(backend->reverse_bind, be, segment, length, content);
-          break;
-        case FS_LOCK:
-          reply = handle(backend->lock, be, segment, length, content);
-          break;
-        case FS_UNLOCK:
-          reply = handle(backend->unlock, be, segment, length, content);
-          break;
-        case FS_GET_SIZE_REVERSE:
-          reply = handle(backend->get_size_reverse, be, segment, length, content);
-          break;
-        case FS_GET_QUAD_FREQ:
-          reply = handle(backend->get_quad_freq, be, segment, length, content);
-          break;
-        case FS_CHOOSE_SEGMENT:
-          reply = handle(backend->choose_segment, be, segment, length, content);
-          break;
-	case FS_DELETE_QUADS:
-	  reply = handle(backend->delete_quads, be, segment, length, content);
-	  break;
-	case FS_GET_UUID:
-	  reply = handle(backend->get_uuid, be, segment, length, content);
-	  break;
-        default:
-          kb_error(LOG_WARNING, "unexpected message type (%d)", msg[3]);
-          reply = fsp_error_new(segment, "unexpected message type");
-          break;
-      }
-    } else if (msg[3] == FS_AUTH) {
-      if (backend->auth) {
-        reply = backend->auth(be, segment, length, content);
-      } else {
-        reply = message_new(FS_DONE_OK, segment, 0);
-      }
-      if (reply[3] == FS_DONE_OK) auth = 1;
-    } else  {
-      reply = fsp_error_new(segment, "authenticate before continuing");
-    }
-
-    if (reply) {
-      unsigned int* const l = (unsigned int *) (reply + 4);
-      unsigned int length = *l;
-      if (write(conn, reply, FS_HEADER + length) <= 0) {
-        kb_error(LOG_WARNING, "write reply failed");
-      }
-      free(reply);
+    if (request_begin(msg, &length)) {
+      /* request_end() answers it */
+      reply = NULL;
+    } else if (auth && msg[3] == FS_SHM_ENABLE) {
+      reply = shm_enable(conn, segment, length, msg + FS_HEADER, &shm);
+    } else if (auth && msg[3] == FS_CANCEL) {
+      /* can only be for a query on another connection */
+      cancel_query(length, msg + FS_HEADER);
+      reply = NULL;
+    } else {
+      reply = handle_message(backend, be, msg, segment, length, &auth);
     }
+    send_reply(conn, msg, request_end(segment, reply), &shm);
     free(msg);
   }
+#ifdef HAVE_SHM_OPEN
+  /* this process made them all, and nobody's going to read them now */
+  shm_sweep(1);
+#endif
 }
 
 volatile sig_atomic_t fatal_error_in_progress = 0;
@@ -323,6 +691,420 @@ static void child_exited(GPid pid, gint status, gpointer data)
 
 }
 
+/* threaded serving: the connections are watched with epoll, and each message
+   that arrives is handled by a thread from the pool. All the connections to
+   a segment share one backend, queries hold its read lock and updates its
+   write lock. An import holds the segment from FS_START_IMPORT to
+   FS_STOP_IMPORT, updates from other connections wait for it, without
+   holding a thread */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define FS_SERVER_EVENTS 64
+
+struct connection {
+  int fd;
+  int auth;
+  fs_segment segment;   /* chosen with FS_CHOOSE_SEGMENT, or -1 */
+  int importing;        /* between FS_START_IMPORT and FS_STOP_IMPORT */
+  unsigned char *msg;   /* an update waiting for the segment */
+  GStaticMutex lock;    /* held while writing a reply, guards busy and closed */
+  int busy;             /* messages being served */
+  int closed;           /* the client has gone, close when no longer busy */
+  struct shm_state shm; /* big replies through shared memory, see shm_enable() */
+};
+
+struct shared_segment {
+  fs_backend *be;
+  GStaticRWLock lock;
+  struct connection *writer;  /* the connection with updates in progress */
+  GQueue *waiting;            /* connections with updates to make next */
+};
+
+static fsp_backend *global_backend = NULL;
+static fs_backend *global_base = NULL; /* for messages that aren't to a segment */
+static struct shared_segment global_segments[FS_MAX_SEGMENTS];
+static GStaticMutex global_segments_mutex = G_STATIC_MUTEX_INIT;
+static GThreadPool *global_workers = NULL;
+static int global_epoll = -1;
+
+G_LOCK_DEFINE_STATIC(global_base);
+
+static int is_update (unsigned char type)
+{
+  switch (type) {
+    case FS_DELETE_MODEL:
+    case FS_DELETE_MODELS:
+    case FS_DELETE_QUADS:
+    case FS_NEW_MODELS:
+    case FS_INSERT_RESOURCE:
+    case FS_COMMIT_RESOURCE:
+    case FS_INSERT_QUAD:
+    case FS_COMMIT_QUAD:
+    case FS_START_IMPORT:
+    case FS_STOP_IMPORT:
+    case FS_TRANSACTION:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* messages that don't touch the indexes, answered from the base backend */
+static int is_general (unsigned char type)
+{
+  switch (type) {
+    case FS_NO_OP:
+    case FS_AUTH:
+    case FS_SEGMENTS:
+    case FS_NODE_SEGMENTS:
+    case FS_BNODE_ALLOC:
+    case FS_GET_UUID:
+    case FS_LOCK:
+    case FS_UNLOCK:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* tagged queries are served concurrently, in whatever order they finish,
+   everything else is served in order */
+static int is_concurrent (struct connection *c, const unsigned char *msg)
+{
+  guint32 tag;
+
+  memcpy(&tag, msg + FS_HEADER_TAG, sizeof(tag));
+
+  return tag && c->auth && c->segment != -1 && msg[3] != FS_CHOOSE_SEGMENT &&
+         !is_general(msg[3]) && !is_update(msg[3]);
+}
+
+static void watch_connection (struct connection *c, int op)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = c;
+  if (epoll_ctl(global_epoll, op, c->fd, &ev) == -1) {
+    kb_error(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+  }
+}
+
+/* make c the writer of s, or queue it with msg until the current writer is
+   done, returns 0 if it was queued */
+static int take_segment (struct shared_segment *s, struct connection *c,
+                         unsigned char *msg)
+{
+  int ret = 1;
+
+  g_static_mutex_lock(&global_segments_mutex);
+  if (s->writer && s->writer != c) {
+    c->msg = msg;
+    g_queue_push_tail(s->waiting, c);
+    ret = 0;
+  } else {
+    s->writer = c;
+  }
+  g_static_mutex_unlock(&global_segments_mutex);
+
+  return ret;
+}
+
+/* the next connection in the queue becomes the writer */
+static void release_segment (struct shared_segment *s, struct connection *c)
+{
+  struct connection *next = NULL;
+
+  g_static_mutex_lock(&global_segments_mutex);
+  if (s->writer == c) {
+    next = g_queue_pop_head(s->waiting);
+    s->writer = next;
+  }
+  g_static_mutex_unlock(&global_segments_mutex);
+
+  if (next) {
+    g_thread_pool_push(global_workers, next, NULL);
+  }
+}
+
+static unsigned char * update_segment (struct connection *c,
+                                       unsigned char *msg, fs_segment segment,
+                                       unsigned int length)
+{
+  struct shared_segment *s = &global_segments[c->segment];
+
+  g_static_rw_lock_writer_lock(&s->lock);
+  fs_backend_set_exclusive(s->be, 1);
+  unsigned char *reply = handle_message(global_backend, s->be, msg, segment,
+                                        length, &c->auth);
+  fs_backend_set_exclusive(s->be, 0);
+  g_static_rw_lock_writer_unlock(&s->lock);
+
+  if (msg[3] == FS_START_IMPORT && reply[3] == FS_DONE_OK) {
+    c->importing = 1;
+  } else if (msg[3] == FS_STOP_IMPORT) {
+    c->importing = 0;
+  }
+
+  return reply;
+}
+
+static unsigned char * query_segment (struct connection *c,
+                                      unsigned char *msg, fs_segment segment,
+                                      unsigned int length)
+{
+  struct shared_segment *s = &global_segments[c->segment];
+
+  g_static_rw_lock_reader_lock(&s->lock);
+  unsigned char *reply = handle_message(global_backend, s->be, msg, segment,
+                                        length, &c->auth);
+  const int trim = fs_backend_trim_needed(s->be);
+  g_static_rw_lock_reader_unlock(&s->lock);
+
+  if (trim) {
+    /* close the trees that were opened over the limit */
+    g_static_rw_lock_writer_lock(&s->lock);
+    fs_backend_set_exclusive(s->be, 1);
+    fs_backend_set_exclusive(s->be, 0);
+    g_static_rw_lock_writer_unlock(&s->lock);
+  }
+
+  return reply;
+}
+
+/* the first connection to choose a segment opens its backend */
+static unsigned char * choose_segment (struct connection *c, unsigned char *msg,
+                                       fs_segment segment, unsigned int length)
+{
+  if (segment >= global_backend->segment_count(global_base)) {
+    kb_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  unsigned char *reply = NULL;
+  struct shared_segment *s = &global_segments[segment];
+
+  g_static_mutex_lock(&global_segments_mutex);
+  if (s->be) {
+    reply = message_new(FS_DONE_OK, 0, 0);
+  } else {
+    fs_backend *be = global_backend->open(global_kb_name, 0);
+    if (be) {
+      fs_backend_set_min_free(be, global_disk_limit);
+      fs_backend_set_threaded(be, 1);
+      reply = handle_message(global_backend, be, msg, segment, length, &c->auth);
+      if (reply[3] == FS_DONE_OK) {
+        g_static_rw_lock_init(&s->lock);
+        s->waiting = g_queue_new();
+        s->be = be;
+      } else {
+        global_backend->close(be);
+      }
+    } else {
+      reply = fsp_error_new(segment, "cannot open backend");
+    }
+  }
+  if (reply[3] == FS_DONE_OK) {
+    c->segment = segment;
+  }
+  g_static_mutex_unlock(&global_segments_mutex);
+
+  return reply;
+}
+
+static void close_connection (struct connection *c)
+{
+  if (c->importing) {
+    /* finish what was sent, so the next import starts clean */
+    struct shared_segment *s = &global_segments[c->segment];
+    kb_error(LOG_WARNING, "connection closed during import to segment %d, "
+             "stopping import", c->segment);
+    g_static_rw_lock_writer_lock(&s->lock);
+    fs_backend_set_exclusive(s->be, 1);
+    free(handle(global_backend->stop_import, s->be, c->segment, 0, NULL));
+    fs_backend_set_exclusive(s->be, 0);
+    g_static_rw_lock_writer_unlock(&s->lock);
+    release_segment(s, c);
+  }
+  epoll_ctl(global_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+#ifdef HAVE_SHM_OPEN
+  /* other connections may still have objects to read, only the stale go */
+  shm_sweep(0);
+#endif
+  g_static_mutex_free(&c->lock);
+  free(c);
+}
+
+/* finished with a message, the last one out closes the connection */
+static void connection_done (struct connection *c, int closed)
+{
+  g_static_mutex_lock(&c->lock);
+  if (closed) {
+    c->closed = 1;
+  }
+  const int last = --c->busy == 0 && c->closed;
+  g_static_mutex_unlock(&c->lock);
+
+  if (last) {
+    close_connection(c);
+  }
+}
+
+static void serve_message (gpointer data, gpointer user_data)
+{
+  struct connection *c = (struct connection *) data;
+  fs_segment segment;
+  unsigned int length;
+  unsigned char *msg = c->msg;
+  unsigned char *reply = NULL;
+  int expired = 0;
+
+  c->msg = NULL;
+  if (msg) {
+    memcpy(&length, msg + 4, sizeof(length));
+    memcpy(&segment, msg + 8, sizeof(segment));
+  } else {
+    g_static_mutex_lock(&c->lock);
+    c->busy++;
+    g_static_mutex_unlock(&c->lock);
+    msg = message_recv(c->fd, &segment, &length);
+    if (!msg) {
+      g_static_mutex_lock(&c->lock);
+      protocol_mismatch(c->fd, segment);
+      g_static_mutex_unlock(&c->lock);
+      connection_done(c, 1);
+      return;
+    }
+    expired = request_begin(msg, &length);
+  }
+
+  const int concurrent = is_concurrent(c, msg);
+  if (concurrent) {
+    /* the next message can be read while this one is served */
+    watch_connection(c, EPOLL_CTL_MOD);
+  }
+
+  if (expired) {
+    /* request_end() answers it */
+  } else if (c->auth && msg[3] == FS_SHM_ENABLE) {
+    reply = shm_enable(c->fd, segment, length, msg + FS_HEADER, &c->shm);
+  } else if (c->auth && msg[3] == FS_CANCEL) {
+    cancel_query(length, msg + FS_HEADER);
+  } else if (!c->auth || is_general(msg[3])) {
+    /* only bnode_alloc writes, to the metadata */
+    G_LOCK(global_base);
+    reply = handle_message(global_backend, global_base, msg, segment, length,
+                           &c->auth);
+    G_UNLOCK(global_base);
+  } else if (msg[3] == FS_CHOOSE_SEGMENT) {
+    reply = choose_segment(c, msg, segment, length);
+  } else if (c->segment == -1) {
+    reply = fsp_error_new(segment, "no segment chosen");
+  } else if (is_update(msg[3])) {
+    struct shared_segment *s = &global_segments[c->segment];
+    if (!take_segment(s, c, msg)) {
+      /* we'll be back when it's our turn */
+      fsp_request_end();
+      return;
+    }
+    reply = update_segment(c, msg, segment, length);
+    if (!c->importing) {
+      release_segment(s, c);
+    }
+  } else {
+    reply = query_segment(c, msg, segment, length);
+  }
+
+  reply = request_end(segment, reply);
+  g_static_mutex_lock(&c->lock);
+  send_reply(c->fd, msg, reply, &c->shm);
+  g_static_mutex_unlock(&c->lock);
+  free(msg);
+  if (!concurrent) {
+    watch_connection(c, EPOLL_CTL_MOD);
+  }
+  connection_done(c, 0);
+}
+
+static gboolean epoll_fn (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  struct epoll_event events[FS_SERVER_EVENTS];
+  int count = epoll_wait(global_epoll, events, FS_SERVER_EVENTS, 0);
+
+  if (count == -1 && errno != EINTR) {
+    kb_error(LOG_ERR, "epoll_wait: %s", strerror(errno));
+  }
+  for (int i = 0; i < count; i++) {
+    g_thread_pool_push(global_workers, events[i].data.ptr, NULL);
+  }
+
+  return TRUE;
+}
+
+static int threaded_setup (fsp_backend *backend, int threads)
+{
+  GError *err = NULL;
+
+  global_backend = backend;
+  global_base = backend->open(global_kb_name, 0);
+  if (!global_base) {
+    kb_error(LOG_CRIT, "failed to open backend");
+    return 1;
+  }
+  fs_backend_set_min_free(global_base, global_disk_limit);
+  fs_backend_set_threaded(global_base, 1);
+
+  global_epoll = epoll_create(FS_SERVER_EVENTS);
+  if (global_epoll == -1) {
+    kb_error(LOG_ERR, "epoll_create: %s", strerror(errno));
+    return 1;
+  }
+
+  global_workers = g_thread_pool_new(serve_message, NULL, threads, TRUE, &err);
+  if (!global_workers) {
+    kb_error(LOG_ERR, "cannot start %d threads: %s", threads, err->message);
+    g_error_free(err);
+    return 1;
+  }
+
+  /* a write to a closed connection mustn't take the server down */
+  signal(SIGPIPE, SIG_IGN);
+
+  GIOChannel *events = g_io_channel_unix_new(global_epoll);
+  g_io_add_watch(events, G_IO_IN, epoll_fn, NULL);
+
+  return 0;
+}
+
+static void threaded_accept (int conn)
+{
+  struct connection *c = calloc(1, sizeof(struct connection));
+
+  c->fd = conn;
+  c->segment = -1;
+  g_static_mutex_init(&c->lock);
+  watch_connection(c, EPOLL_CTL_ADD);
+}
+
+#else
+
+static GThreadPool *global_workers = NULL;
+
+static int threaded_setup (fsp_backend *backend, int threads)
+{
+  kb_error(LOG_WARNING, "threaded serving needs epoll, forking instead");
+  return 0;
+}
+
+static void threaded_accept (int conn)
+{
+}
+
+#endif
+
 gboolean accept_fn (GIOChannel *source, GIOCondition condition, gpointer data)
 {
   fsp_backend *backend = (fsp_backend *) data;
@@ -333,6 +1115,11 @@ gboolean accept_fn (GIOChannel *source, GIOCondition condition, gpointer data)
     return TRUE; /* try again */
   }
 
+  if (global_workers) {
+    threaded_accept(conn);
+    return TRUE;
+  }
+
   pid_t pid = fork();
   if (pid == -1) {
     kb_error(LOG_ERR, "fork: %s", strerror(errno));
@@ -473,7 +1260,7 @@ static int init_runtime_info(const char *kb_name, const char *cport)
     return 0;
 }
 
-void fsp_serve (const char *kb_name, fsp_backend *backend, int daemon, float disk_limit)
+void fsp_serve (const char *kb_name, fsp_backend *backend, int daemon, float disk_limit, int threads)
 {
   struct addrinfo hints, *info;
   uint16_t port = FS_DEFAULT_PORT;
@@ -489,11 +1276,17 @@ void fsp_serve (const char *kb_name, fsp_backend *backend, int daemon, float dis
   global_kb_name = (char *)kb_name;
   global_disk_limit = disk_limit;
 
+  if (getenv("FS_SHM_THRESHOLD")) {
+    shm_threshold = strtoul(getenv("FS_SHM_THRESHOLD"), NULL, 10);
+  }
+
   if (!backend->open) {
     /* no open function defined, we will eventually fail anyway, so give up early */
     return;
   }
 
+  if (threads > 0 && !g_thread_supported()) g_thread_init(NULL);
+
   fs_backend *original = NULL;
   original = backend->open(kb_name, FS_BACKEND_NO_OPEN);
   if (!original) return;
@@ -571,6 +1364,10 @@ void fsp_serve (const char *kb_name, fsp_backend *backend, int daemon, float dis
                       
 
   signal_actions();
+
+  if (threads > 0 && threaded_setup(backend, threads)) {
+    return;
+  }
   fs_error(LOG_INFO, "4store backend %s for kb %s on port %s", FS_BACKEND_VER, kb_name, cport);
 
   GIOChannel *listener = g_io_channel_unix_new (srv);
@@ -73,6 +73,30 @@
 
 #define FS_GET_UUID 0x33
 
+#define FS_BIND_LIST_COMPACT 0x34
+
+#define FS_BIND_JOIN 0x35
+
+#define FS_BIND_STAR 0x36
+
+#define FS_BIND_GROUP 0x37
+
+#define FS_SHM_ENABLE 0x38
+#define FS_SHM_REPLY 0x39
+
+#define FS_CANCEL 0x3a
+/* the reply to a read the backend gave up on, as its query timed out or was
+   cancelled, rather than an error */
+#define FS_CANCELLED 0x3b
+
+/* set in the message type when a query context, FS_CONTEXT_LENGTH bytes,
+   comes before the contents */
+#define FS_MESSAGE_CONTEXT 0x80
+#define FS_CONTEXT_LENGTH 16
+
+/* most patterns in one FS_BIND_STAR */
+#define FS_MAX_STAR_ARMS 64
+
 /* message header  = 16 bytes */
 #define FS_HEADER 16
 
@@ -84,6 +108,24 @@ fsp_link* fsp_open_link (const char *name, char *pw, int readonly);
 void fsp_close_link (fsp_link *link);
 int fsp_link_segments (fsp_link *link);
 const char *fsp_link_features (fsp_link *link);
+/* send reads that take longer than percentile% of recent ones to the mirror
+   of their segment as well, and use whichever reply comes first. Needs
+   mirrored segments on threaded backends, 0 turns it off */
+void fsp_set_hedging (fsp_link *link, int percentile);
+
+/* reads this thread sends on link until fsp_query_end() are part of query,
+   and backends may give up on them once deadline, as from fs_time(), has
+   passed. 0 for no deadline */
+void fsp_query_begin (fsp_link *link, unsigned int query, double deadline);
+void fsp_query_end (fsp_link *link);
+/* ask the backends to give up on reads for query, from any thread. Only
+   threaded backends can hear this while they're busy */
+int fsp_cancel_all (fsp_link *link, unsigned int query);
+/* the same for the query this thread is running, see fsp_query_begin() */
+int fsp_query_cancel (fsp_link *link);
+/* true if a backend gave up on a read of this thread's query, so its
+   results are incomplete and the read failed for that reason alone */
+int fsp_query_cancelled (fsp_link *link);
 unsigned char *fsp_error_new(fs_segment segment, const char *message);
 unsigned char *message_new(int type, fs_segment segment, size_t length);
 
@@ -142,6 +184,9 @@ int fsp_get_query_times (fsp_link *link, fs_segment segment,
 
 int fsp_resolve_all (fsp_link *link, fs_rid_vector *rids[], fs_resource *resources[]);
 int fsp_start_import_all (fsp_link *link);
+/* as fsp_start_import_all, but asks backends that support it to bulk load
+ * segments that are empty */
+int fsp_start_bulk_import_all (fsp_link *link);
 int fsp_stop_import_all (fsp_link *link);
 int fsp_delete_model_all (fsp_link *link, fs_rid_vector *models);
 int fsp_new_model_all (fsp_link *link, fs_rid_vector *models);
@@ -166,6 +211,89 @@ int fsp_bind_limit_all (fsp_link *link,
                   int offset,
                   int limit);
 
+/* a filter program, a conjunction of terms the backends test bound rows
+ * against before replying, see docs/protocol. Backends can only reject the
+ * rows that certainly fail, so the filter still has to be applied to the
+ * results */
+typedef struct {
+    int terms;
+    fs_rid_vector *code;
+} fsp_filter;
+
+fsp_filter *fsp_filter_new (void);
+/* add a term, op is one of FS_FILTER_*, on the result column column */
+void fsp_filter_add (fsp_filter *filter, int op, int column, int cmp,
+                     int flags, int count, const fs_rid *operands);
+void fsp_filter_free (fsp_filter *filter);
+
+/* as fsp_bind_limit_many() and fsp_bind_limit_all(), but the rows are
+ * tested against filter, which may be NULL, by backends with the
+ * "bind-filter" feature */
+int fsp_bind_filter_many (fsp_link *link,
+                          int flags,
+                          fs_rid_vector *mrids,
+                          fs_rid_vector *srids,
+                          fs_rid_vector *prids,
+                          fs_rid_vector *orids,
+                          const fsp_filter *filter,
+                          fs_rid_vector ***result,
+                          int offset,
+                          int limit);
+int fsp_bind_filter_all (fsp_link *link,
+                         int flags,
+                         fs_rid_vector *mrids,
+                         fs_rid_vector *srids,
+                         fs_rid_vector *prids,
+                         fs_rid_vector *orids,
+                         const fsp_filter *filter,
+                         fs_rid_vector ***result,
+                         int offset,
+                         int limit);
+
+/* semi-join, keys[slot] are row aligned key columns, NULL for the slots that
+ * aren't keys, and only quads matching a whole row are bound. The model and
+ * predicate slots, if they aren't keys, take alternatives from mrids and
+ * prids. With FS_BIND_BY_SUBJECT each row only goes to its subject's
+ * segment. Needs backends with the "bind-join" feature. filter may be NULL,
+ * as for fsp_bind_filter_many() */
+int fsp_bind_join_many (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *keys[4],
+                        fs_rid_vector *mrids,
+                        fs_rid_vector *prids,
+                        const fsp_filter *filter,
+                        fs_rid_vector ***result,
+                        int limit);
+
+/* star join, the patterns ?s arms[i].predicate ?oi for each arm, which must
+ * all match for a subject. The result columns are the subject, then the
+ * objects of each arm with bind set. If srids isn't empty it holds the
+ * subjects, and each segment is only sent its own, otherwise every segment
+ * finds its subjects. The models of every arm come from mrids, and filter
+ * may be NULL. Needs backends with the "bind-star" feature */
+int fsp_bind_star_many (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *srids,
+                        fs_rid_vector *mrids,
+                        int arm_count,
+                        fs_star_arm *arms,
+                        const fsp_filter *filter,
+                        fs_rid_vector ***result,
+                        int limit);
+
+/* partial aggregation, binds as fsp_bind_limit_all() without a limit, but
+ * result holds each distinct row of the bound columns once, with an extra
+ * last column counting the matches it stands for, summed over all the
+ * segments. With no columns bound there's just the count. result is NULL if
+ * nothing matched. Needs backends with the "bind-group" feature */
+int fsp_bind_group_all (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *mrids,
+                        fs_rid_vector *srids,
+                        fs_rid_vector *prids,
+                        fs_rid_vector *orids,
+                        fs_rid_vector ***result);
+
 #define fsp_bind(link, segment, flags, mrids, srids, prids, orids, result) \
 	fsp_bind_limit(link, segment, flags, mrids, srids, prids, orids, result, -1, -1)
 
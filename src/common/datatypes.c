@@ -18,10 +18,12 @@
  *  Copyright (C) 2006 Steve Harris for Garlik
  */
 
+#define _GNU_SOURCE
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "4s-datatypes.h"
 #include "4s-hash.h"
@@ -572,4 +574,78 @@ int fs_resource_cmp(const void *va, const void *vb)
     return 0;
 }
 
+/* N.B. this code is taken from glib 2.12.13 */
+int fs_time_from_iso8601(const char *iso_date, time_t *time_)
+{
+    struct tm tm = { 0 };
+    long val;
+
+    if (!iso_date || !time_) return 0;
+
+    val = strtoul(iso_date, (char **)&iso_date, 10);
+    if (*iso_date == '-') {
+        /* YYYY-MM-DD */
+        tm.tm_year = val - 1900;
+        iso_date++;
+        tm.tm_mon = strtoul(iso_date, (char **)&iso_date, 10) - 1;
+
+        if (*iso_date++ != '-') return 0;
+
+        tm.tm_mday = strtoul(iso_date, (char **)&iso_date, 10);
+    } else {
+        /* YYYYMMDD */
+        tm.tm_mday = val % 100;
+        tm.tm_mon = (val % 10000) / 100 - 1;
+        tm.tm_year = val / 10000 - 1900;
+    }
+
+    if (*iso_date++ != 'T') return 0;
+
+    val = strtoul(iso_date, (char **)&iso_date, 10);
+    if (*iso_date == ':') {
+        /* hh:mm:ss */
+        tm.tm_hour = val;
+        iso_date++;
+        tm.tm_min = strtoul(iso_date, (char **)&iso_date, 10);
+
+        if (*iso_date++ != ':') return 0;
+
+        tm.tm_sec = strtoul(iso_date, (char **)&iso_date, 10);
+    } else {
+        /* hhmmss */
+        tm.tm_sec = val % 100;
+        tm.tm_min = (val % 10000) / 100;
+        tm.tm_hour = val / 10000;
+    }
+
+    *time_ = timegm(&tm);
+
+    if (*iso_date == '+' || *iso_date == '-') {
+        int sign = (*iso_date == '+') ? -1 : 1;
+
+        val = 60 * strtoul(iso_date + 1, (char **)&iso_date, 10);
+
+        if (*iso_date == ':') {
+            val = 60 * val + strtoul(iso_date + 1, NULL, 10);
+        } else {
+            val = 60 * (val / 100) + (val % 100);
+        }
+
+        *time_ += (time_t) (val * sign);
+    }
+
+    return 1;
+}
+
+int fs_time_from_date(const char *date, time_t *time_)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(date, "%Y-%m-%d", &tm)) return 0;
+    *time_ = timegm(&tm);
+
+    return 1;
+}
+
 /* vi:set ts=8 sts=4 sw=4: */
@@ -59,9 +59,37 @@ typedef struct {
 
   fsp_backend_fn get_uuid;
 
+  fsp_backend_fn bind_join;
+  fsp_backend_fn bind_star;
+  fsp_backend_fn bind_group;
+
   fs_backend * (* open) (const char *kb_name, int flags);
   void (* close) (fs_backend *backend);
   int (* segment_count) (fs_backend *backend);
 } fsp_backend;
 
-void fsp_serve (const char *kb_name, fsp_backend *implementation, int daemon, float free_disk);
+/* an FS_BIND_LIST reply carrying cols columns of bindings, or if compact is
+   set an FS_BIND_LIST_COMPACT one, which is smaller for sorted or repetitive
+   columns */
+unsigned char *fsp_bind_list_new(fs_segment segment, int cols,
+                                 fs_rid_vector **bindings, int compact);
+
+/* the cols columns of an FS_BIND_LIST or FS_BIND_LIST_COMPACT reply of
+   length bytes, NULL if it's malformed */
+fs_rid_vector **fsp_bind_list_decode(const unsigned char *msg,
+                                     unsigned int length, int cols);
+
+/* the query context of the request this thread is serving. The deadline
+   is ms from now, 0 for none. fsp_request_expired() is true once it has
+   passed, or the query has been cancelled, and is cheap enough to call
+   every few thousand rows. Once it has said so the request counts as
+   stopped short, and fsp_request_stopped() is true until the request ends */
+void fsp_request_begin (uint64_t query, uint32_t ms);
+void fsp_request_end (void);
+void fsp_request_cancel (uint64_t query);
+int fsp_request_expired (void);
+int fsp_request_stopped (void);
+
+/* if threads is more than zero, connections are served by that many threads
+   sharing the backend, rather than by a process each */
+void fsp_serve (const char *kb_name, fsp_backend *implementation, int daemon, float free_disk, int threads);
@@ -48,9 +48,9 @@ int main(int argc, char *argv[])
     char *password = NULL;
     char *format = "auto";
     FILE *msg = stderr;
-    char *optstring = "ac:m:M:vnf:";
+    char *optstring = "ac:m:M:vnf:B";
     int c, opt_index = 0, help = 0;
-    int files = 0, adding = 0;
+    int files = 0, adding = 0, bulk = 0;
     char *kb_name = NULL;
     char *model[argc], *uri[argc];
     char *model_default = NULL;
@@ -59,6 +59,7 @@ int main(int argc, char *argv[])
 
     static struct option long_options[] = {
         { "add", 0, 0, 'a' },
+        { "bulk", 0, 0, 'B' },
         { "config-file", 1, 0, 'c' },
         { "model", 1, 0, 'm' },
         { "model-default", 1, 0, 'M' },
@@ -87,6 +88,8 @@ int main(int argc, char *argv[])
             verbosity++;
         } else if (c == 'a') {
             adding = 1;
+        } else if (c == 'B') {
+            bulk = 1;
         } else if (c == 'c') {
             fs_set_config_file(optarg); 
         } else if (c == 'n') {
@@ -147,6 +150,8 @@ int main(int argc, char *argv[])
         fprintf(stdout, "Usage: %s <kbname> <rdf file/URI> ...\n", argv[0]);
         fprintf(stdout, " -v --verbose   increase verbosity (can repeat)\n");
         fprintf(stdout, " -a --add       add data to models instead of replacing\n");
+        fprintf(stdout, " -B --bulk      faster load into an empty KB, the data can't be\n");
+        fprintf(stdout, "                queried until the import has finished\n");
         fprintf(stdout, " -m --model     specify a model URI for the next RDF file\n");
         fprintf(stdout, " -M --model-default specify a model URI for all RDF files\n");
         fprintf(stdout, " -f --format    specify an RDF syntax for the import\n");
@@ -187,7 +192,7 @@ int main(int argc, char *argv[])
 
     gettimeofday(&then, 0);
 
-    if (fsp_start_import_all(fsplink)) {
+    if (bulk ? fsp_start_bulk_import_all(fsplink) : fsp_start_import_all(fsplink)) {
 	fs_error(LOG_ERR, "aborting import");
 
 	exit(3);
@@ -44,6 +44,7 @@ static void interactive(fsp_link *link, raptor_uri *bu, const char *result_forma
 static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lang, const char *result_format, fs_query_timing *timing, int verbosity, int opt_level, unsigned int result_flags, int soft_limit, raptor_world *rw);
 
 static int show_timing;
+static double query_timeout = 0.0; /* seconds, 0 for no limit */
 
 static double ftime()
 {
@@ -54,11 +55,28 @@ static double ftime()
     return (double)now.tv_sec + (now.tv_usec * 0.000001);
 }
 
+/* fs_query_execute(), with the backends giving up on the query once it's
+   run for query_timeout seconds */
+static fs_query *execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query, unsigned int flags, int opt_level, int soft_limit, int explain)
+{
+    static unsigned int last_query_id = 0;
+
+    if (query_timeout > 0.0) {
+        fsp_query_begin(link, ++last_query_id, fs_time() + query_timeout);
+    }
+    fs_query *q = fs_query_execute(qs, link, bu, query, flags, opt_level, soft_limit, explain);
+    if (query_timeout > 0.0) {
+        fsp_query_end(link);
+    }
+
+    return q;
+}
+
 int main(int argc, char *argv[])
 {
     char *password = fsp_argv_password(&argc, argv);
 
-    static char *optstring = "hevf:PO:Ib:rs:dc:";
+    static char *optstring = "hevf:PO:Ib:rs:t:H:dc:";
     char *format = getenv("FORMAT");
     char *kb_name = NULL, *query = NULL;
     int programatic = 0, help = 0;
@@ -70,6 +88,7 @@ int main(int argc, char *argv[])
     int soft_limit = 0;
     int explain = 0;
     int default_graph = 0;
+    int hedge_percentile = 0;
     char *base_uri = "local:";
     raptor_world *rw = NULL;
 
@@ -84,6 +103,8 @@ int main(int argc, char *argv[])
         { "insert", 0, 0, 'I' },
         { "restricted", 0, 0, 'r' },
         { "soft-limit", 1, 0, 's' },
+        { "timeout", 1, 0, 't' },
+        { "hedge", 1, 0, 'H' },
         { "default-graph", 0, 0, 'd' },
         { "base", 1, 0, 'b' },
         { "config-file", 1, 0, 'c' },
@@ -107,6 +128,10 @@ int main(int argc, char *argv[])
             restricted = 1;
         } else if (c == 's') {
             soft_limit = atoi(optarg);
+        } else if (c == 't') {
+            query_timeout = atof(optarg);
+        } else if (c == 'H') {
+            hedge_percentile = atoi(optarg);
         } else if (c == 'd') {
             default_graph = 1;
         } else if (c == 'b') {
@@ -151,6 +176,8 @@ int main(int argc, char *argv[])
       fprintf(stdout, " -I, --insert    Interpret CONSTRUCT statements as inserts\n");
       fprintf(stdout, " -r, --restricted  Enable query complexity restriction\n");
       fprintf(stdout, " -s, --soft-limit  Override default soft limit on search breadth\n");
+      fprintf(stdout, " -t, --timeout   Give up on queries after this many seconds\n");
+      fprintf(stdout, " -H, --hedge     Send reads slower than this percentile to the mirror too\n");
       fprintf(stdout, " -d, --default-graph  Enable SPARQL default graph support\n");
       fprintf(stdout, " -b, --base      Set base URI for query\n");
       fprintf(stdout, " -c, --config-file  Path and filename of configuration file to use\n");
@@ -180,6 +207,8 @@ int main(int argc, char *argv[])
       return 2;
     }
 
+    fsp_set_hedging(link, hedge_percentile);
+
     const int segments = fsp_link_segments(link);
 
     fs_query_timing timing[segments];
@@ -220,7 +249,7 @@ int main(int argc, char *argv[])
 
     fs_query_state *qs = fs_query_init(link, NULL, NULL);
     qs->verbosity = verbosity;
-    fs_query *qr = fs_query_execute(qs, link, bu, query, flags, opt_level, soft_limit, explain);
+    fs_query *qr = execute(qs, link, bu, query, flags, opt_level, soft_limit, explain);
     if (fs_query_errors(qr)) {
         ret = 1;
     }
@@ -285,7 +314,7 @@ static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lan
             if (show_timing) {
                 printf("Q: %s\n", query);
             }
-	    fs_query *tq = fs_query_execute(qs, link, bu, query,
+	    fs_query *tq = execute(qs, link, bu, query,
 		    result_flags, opt_level, soft_limit, 0);
 	    fs_query_results_output(tq, result_format, 0, stdout);
             if (show_timing) {
@@ -407,7 +436,7 @@ static void interactive(fsp_link *link, raptor_uri *bu, const char *result_forma
             if (show_timing) {
                 then = fs_time();
             }
-	    fs_query *tq = fs_query_execute(qs, link, bu, query,
+	    fs_query *tq = execute(qs, link, bu, query,
 		    result_flags, opt_level, soft_limit, 0);
             if (show_timing) {
                 double now = fs_time();
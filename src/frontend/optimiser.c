@@ -360,6 +360,137 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
     return 1;
 }
 
+/* true if t can be an arm of a star on the subject variable sv, in the graph
+ * origin */
+static int star_arm(rasqal_triple *t, rasqal_variable *sv, rasqal_literal *origin)
+{
+    if (t->subject->type != RASQAL_LITERAL_VARIABLE ||
+        t->subject->value.variable != sv) {
+        return 0;
+    }
+    if (t->predicate->type != RASQAL_LITERAL_URI) {
+        return 0;
+    }
+    if (t->object->type == RASQAL_LITERAL_VARIABLE &&
+        t->object->value.variable == sv) {
+        return 0;
+    }
+    if (!t->origin || !origin) {
+        return !t->origin && !origin;
+    }
+    if (t->origin->type != RASQAL_LITERAL_URI ||
+        origin->type != RASQAL_LITERAL_URI) {
+        return 0;
+    }
+
+    return !strcmp((char *)raptor_uri_as_string(t->origin->value.uri),
+                   (char *)raptor_uri_as_string(origin->value.uri));
+}
+
+static int mentions(rasqal_triple *t, rasqal_variable *v)
+{
+    rasqal_literal *l[4] = { t->origin, t->subject, t->predicate, t->object };
+    for (int i=0; i<4; i++) {
+        if (l[i] && l[i]->type == RASQAL_LITERAL_VARIABLE &&
+            l[i]->value.variable == v) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* marks the arms of the star on the subject of patt[first] in arm[], and
+ * returns how many there are. An object variable may only appear once */
+static int star_arms(rasqal_triple *patt[], int length, int first, char arm[])
+{
+    rasqal_variable *sv = patt[first]->subject->value.variable;
+    rasqal_literal *origin = patt[first]->origin;
+    int count = 0;
+
+    memset(arm, 0, length);
+    for (int i=first; i<length; i++) {
+        if (!star_arm(patt[i], sv, origin)) continue;
+        if (patt[i]->object->type == RASQAL_LITERAL_VARIABLE) {
+            int repeat = 0;
+            for (int j=first; j<i; j++) {
+                if (arm[j] && mentions(patt[j], patt[i]->object->value.variable)) {
+                    repeat = 1;
+                    break;
+                }
+            }
+            if (repeat) continue;
+        }
+        arm[i] = 1;
+        count++;
+    }
+
+    return count;
+}
+
+int fs_optimise_star(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start)
+{
+    if (length - start < 2 || q->opt_level < 1) {
+        return 0;
+    }
+    const char *features = fsp_link_features(q->link);
+    if (!features || !strstr(features, " bind-star ")) {
+        return 0;
+    }
+
+    char arm[length], best_arm[length];
+    int best = 0, best_bound = 0;
+    for (int i=start; i<length; i++) {
+        if (patt[i]->subject->type != RASQAL_LITERAL_VARIABLE ||
+            !star_arm(patt[i], patt[i]->subject->value.variable, patt[i]->origin)) {
+            continue;
+        }
+        rasqal_variable *sv = patt[i]->subject->value.variable;
+        int seen = 0;
+        for (int j=start; j<i && !seen; j++) {
+            seen = star_arm(patt[j], sv, patt[i]->origin);
+        }
+        if (seen) continue;
+
+        const int count = star_arms(patt, length, i, arm);
+        if (count > FS_MAX_STAR_ARMS) continue;
+        const int bound = fs_opt_is_const(q->bb[block], patt[i]->subject);
+        if (!bound) {
+            /* with an unbound subject the backends find the subjects
+             * themselves, which is only a good idea if no other pattern
+             * could bind it */
+            int other = 0;
+            for (int j=start; j<length && !other; j++) {
+                other = !arm[j] && mentions(patt[j], sv);
+            }
+            if (other) continue;
+        }
+        if (count < 2) continue;
+        if (bound > best_bound || (bound == best_bound && count > best)) {
+            best = count;
+            best_bound = bound;
+            memcpy(best_arm, arm, length);
+        }
+    }
+    if (best < 2) {
+        return 0;
+    }
+
+    /* move the arms to the front, keeping the order of the rest */
+    rasqal_triple *rest[length];
+    int pos = start, rest_length = 0;
+    for (int i=start; i<length; i++) {
+        if (best_arm[i]) {
+            patt[pos++] = patt[i];
+        } else {
+            rest[rest_length++] = patt[i];
+        }
+    }
+    memcpy(patt + pos, rest, rest_length * sizeof(rasqal_triple *));
+
+    return best;
+}
+
 static int calc_freq(fs_query *q, int block, GHashTable *freq, rasqal_literal *pri, rasqal_literal *sec)
 {
     int ret = 0;
@@ -404,9 +535,41 @@ static int calc_freq(fs_query *q, int block, GHashTable *freq, rasqal_literal *p
     return ret;
 }
 
+/* without frequency data, a pattern with one subject and predicate can be
+ * priced by the segment that holds the subject, see fs_bind_price() */
+static int price_freq(fs_query *q, int block, rasqal_triple *t)
+{
+    int ret = -1;
+
+    const char *features = fsp_link_features(q->link);
+    if (!features || !strstr(features, " price-bind ")) return ret;
+
+    int junk;
+    rasqal_variable *var;
+    fs_rid_vector *mv = fs_rid_vector_new(0);
+    fs_rid_vector *sv = fs_rid_vector_new(0);
+    fs_rid_vector *pv = fs_rid_vector_new(0);
+    fs_rid_vector *ov = fs_rid_vector_new(0);
+    fs_bind_slot(q, -1, q->bb[block], t->subject, sv, &junk, &var, 1);
+    fs_bind_slot(q, -1, q->bb[block], t->predicate, pv, &junk, &var, 1);
+    unsigned long long rows;
+    if (sv->length == 1 && pv->length == 1 &&
+        !fsp_price_bind(q->link, FS_RID_SEGMENT(sv->data[0], q->segments),
+                        FS_BIND_BY_SUBJECT, mv, sv, pv, ov, &rows)) {
+        ret = rows < INT_MAX - 100 ? rows : INT_MAX - 100;
+    }
+    fs_rid_vector_free(mv);
+    fs_rid_vector_free(sv);
+    fs_rid_vector_free(pv);
+    fs_rid_vector_free(ov);
+
+    return ret;
+}
+
 int fs_bind_freq(fs_query_state *qs, fs_query *q, int block, rasqal_triple *t)
 {
     int ret = 100;
+    int price;
 #if DEBUG_OPTIMISER
     char dir = 'X';
 #endif
@@ -447,6 +610,13 @@ int fs_bind_freq(fs_query_state *qs, fs_query *q, int block, rasqal_triple *t)
 #endif
         ret = calc_freq(q, block, qs->freq_s, t->object, NULL) +
                 q->segments * 50;
+    } else if (fs_opt_num_vals(q->bb[block], t->subject) == 1 &&
+               fs_opt_num_vals(q->bb[block], t->predicate) == 1 &&
+               (price = price_freq(q, block, t)) >= 0) {
+#if DEBUG_OPTIMISER
+        dir = 's';
+#endif
+        ret = price;
     /* cluases for if we have no freq data */
     } else if (fs_opt_num_vals(q->bb[block], t->subject) < 1000000 &&
                fs_opt_num_vals(q->bb[block], t->predicate) < 100 &&
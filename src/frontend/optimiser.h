@@ -15,6 +15,11 @@ int fs_opt_is_const(fs_binding *b, rasqal_literal *l);
  * heuristics */
 int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start);
 
+/* if the patterns from start on include a star, two or more patterns with the
+ * same variable subject and constant predicates, move it to start and return
+ * how many patterns it has, otherwise return 0 */
+int fs_optimise_star(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start);
+
 /* return an estimated number of results from a bind */
 int fs_bind_freq(fs_query_state *qs, fs_query *q, int block, rasqal_triple *t);
 
@@ -50,7 +50,7 @@ struct _fs_bind_cache {
  * present */
 
 int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
-                int flags, fs_rid_vector *rids[4],
+                int flags, fs_rid_vector *rids[4], const fsp_filter *filter,
                 fs_rid_vector ***result, int offset, int limit)
 {
     g_static_mutex_lock(&qs->cache_mutex);
@@ -126,17 +126,24 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
     }
     g_static_mutex_unlock(&qs->cache_mutex);
 
+    /* cached rows are still good for a filtered bind, as the filter is
+     * applied again later, but filtered rows can't be cached */
+    if (filter) cachable = 0;
+
     int ret;
 
     skip_cache:;
 
     int limited_before = fsp_hit_limits(qs->link);
     if (all) {
-        ret = fsp_bind_limit_all(qs->link, flags, rids[0], rids[1], rids[2], rids[3], result, offset, limit);
+        ret = fsp_bind_filter_all(qs->link, flags, rids[0], rids[1], rids[2], rids[3], filter, result, offset, limit);
     } else {
-        ret = fsp_bind_limit_many(qs->link, flags, rids[0], rids[1], rids[2], rids[3], result, offset, limit);
+        ret = fsp_bind_filter_many(qs->link, flags, rids[0], rids[1], rids[2], rids[3], filter, result, offset, limit);
     }
     int limited = fsp_hit_limits(qs->link) - limited_before;
+    if (ret && fs_query_bind_cancelled(q, result, slots)) {
+        return ret;
+    }
     if (ret) {
         fs_error(LOG_ERR, "bind failed in '%s', %d segments gave errors",
                  fsp_kb_name(qs->link), ret);
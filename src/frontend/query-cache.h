@@ -2,12 +2,14 @@
 #define QUERY_CACHE_H
 
 #include "query-datatypes.h"
+#include "../common/4store.h"
 
 typedef struct _fs_bind_cache fs_bind_cache;
 
+/* filter may be NULL, see fsp_bind_filter_many() */
 int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
-    int flags, fs_rid_vector *rids[4], fs_rid_vector ***result,
-    int offset, int limit);
+    int flags, fs_rid_vector *rids[4], const fsp_filter *filter,
+    fs_rid_vector ***result, int offset, int limit);
 
 int fs_query_cache_flush(fs_query_state *qs, int verbosity);
 
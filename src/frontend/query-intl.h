@@ -62,6 +62,7 @@ struct _fs_query {
     int lastrow;			/* last row that was resolved */
     int rows_output;			/* number of rows returned */
     int errors;				/* number of parse/execution errors */
+    int cancelled;			/* true if the backends gave up on it */
     int aggregate_order; /* 4 fields for group by + sort and/or filters */
     int aggregate_order_sorted;
     GPtrArray *agg_rows;
@@ -91,6 +92,8 @@ struct _fs_query {
     int offset_aggregate;   /* offset to be evaluated in result generation */
     long group_length;			/* number of rows in the current group */
     uint64_t *group_rows;		/* row numbers of the rows in the current group */
+    fs_rid_vector *group_weights;	/* matches each row stands for, when the
+					 * backends did the grouping */
     unsigned char *apply_constraints; /* bit array initialized to 1s, 
                                         position x shifts to 0 if no apply cons */
     int group_by;
@@ -53,6 +53,9 @@ GStaticMutex rasqal_mutex = G_STATIC_MUTEX_INIT;
 static void graph_pattern_walk(fsp_link *link, rasqal_graph_pattern *p, fs_query *q, rasqal_literal *model, int optional, int uni);
 static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t);
 static int fs_handle_query_triple_multi(fs_query *q, int block, int count, rasqal_triple *t[]);
+static int fs_handle_query_star(fs_query *q, int block, int count, rasqal_triple *t[]);
+static int fs_handle_query_group(fs_query *q, int block, rasqal_triple *t);
+static int group_pushdown(fs_query *q, int block);
 static fs_rid const_literal_to_rid(fs_query *q, rasqal_literal *l, fs_rid *attr);
 static void check_variables(fs_query *q, rasqal_expression *e, int dont_select);
 static int is_aggregate(fs_query *q, rasqal_expression *e);
@@ -117,6 +120,45 @@ static int bind(fs_query *q, int all,
 }
 #endif
 
+/* the number of columns a bind with flags returns */
+static int bind_columns(int flags)
+{
+    int cols = 0;
+    for (int k=0; k<4; k++) {
+        if (flags & 1 << k) cols++;
+    }
+
+    return cols;
+}
+
+int fs_query_bind_cancelled(fs_query *q, fs_rid_vector ***result, int cols)
+{
+    if (!q || !fsp_query_cancelled(q->link)) return 0;
+
+    if (!q->cancelled) {
+        q->cancelled = 1;
+        q->warnings = g_slist_prepend(q->warnings, "query timed out or was cancelled, results are incomplete");
+        /* the rest of its reads are wasted, so stop any the other
+         * backends are still working on */
+        fsp_query_cancel(q->link);
+    }
+    if (*result) {
+        for (int c=0; c<cols; c++) {
+            fs_rid_vector_free((*result)[c]);
+        }
+        free(*result);
+        *result = NULL;
+    }
+    if (cols) {
+        *result = calloc(cols, sizeof(fs_rid_vector *));
+        for (int c=0; c<cols; c++) {
+            (*result)[c] = fs_rid_vector_new(0);
+        }
+    }
+
+    return 1;
+}
+
 static int bind_reverse(fs_query *q, int flags, fs_rid_vector *rids[4],
                 fs_rid_vector ***result, int offset, int limit)
 {
@@ -138,6 +180,9 @@ static int bind_reverse(fs_query *q, int flags, fs_rid_vector *rids[4],
     }
         
     int ret = fsp_reverse_bind_all(q->link, flags, rids[0], rids[1], rids[2], rids[3], result, offset, limit);
+    if (ret && fs_query_bind_cancelled(q, result, bind_columns(flags))) {
+        return ret;
+    }
     if (ret) {
         fs_error(LOG_CRIT, "reverse bind failed");
 
@@ -147,6 +192,103 @@ static int bind_reverse(fs_query *q, int flags, fs_rid_vector *rids[4],
     return ret;
 }
 
+struct so_pair {
+    fs_rid s;
+    fs_rid o;
+};
+
+static int so_pair_compare(const void *va, const void *vb)
+{
+    const struct so_pair *a = va;
+    const struct so_pair *b = vb;
+
+    if (a->s > b->s) return 1;
+    if (a->s < b->s) return -1;
+    if (a->o > b->o) return 1;
+    if (a->o < b->o) return -1;
+
+    return 0;
+}
+
+/* if the subject and object of t were both bound by earlier patterns, send
+ * the (subject, object) pairs they were bound to, and the backends only
+ * return quads matching a pair, rather than every combination of the values
+ * in slot[1] and slot[3]. Returns 0 if that's not possible or not worth it */
+static int bind_join(fs_query *q, fs_binding *b, rasqal_triple *t, int flags,
+                     fs_rid_vector *slot[4], const fsp_filter *filter,
+                     fs_rid_vector ***result, int limit)
+{
+    const char *features = fsp_link_features(q->link);
+    if (!features || !strstr(features, " bind-join ")) return 0;
+
+    if (t->subject->type != RASQAL_LITERAL_VARIABLE ||
+        t->object->type != RASQAL_LITERAL_VARIABLE ||
+        t->subject->value.variable == t->object->value.variable) {
+        return 0;
+    }
+    /* both slots have to have been filled from the bindings */
+    if (slot[1]->length == 0 || slot[3]->length == 0) return 0;
+    fs_binding *sb = fs_binding_get(b, t->subject->value.variable);
+    fs_binding *ob = fs_binding_get(b, t->object->value.variable);
+    if (!sb || !ob || sb->bound != 1 || ob->bound != 1 ||
+        sb->vals->length != ob->vals->length) {
+        return 0;
+    }
+
+    const int rows = sb->vals->length;
+    struct so_pair *pairs = malloc(rows * sizeof(struct so_pair));
+    int length = 0;
+    for (int r=0; r<rows; r++) {
+        const fs_rid s = sb->vals->data[r];
+        const fs_rid o = ob->vals->data[r];
+        if (s == FS_RID_NULL || o == FS_RID_NULL || FS_IS_LITERAL(s)) continue;
+        pairs[length].s = s;
+        pairs[length].o = o;
+        length++;
+    }
+    qsort(pairs, length, sizeof(struct so_pair), so_pair_compare);
+    int distinct = 0;
+    for (int r=0; r<length; r++) {
+        if (distinct && !so_pair_compare(pairs + r, pairs + distinct - 1)) {
+            continue;
+        }
+        pairs[distinct++] = pairs[r];
+    }
+
+    /* it's only worth it when the pairs are fewer than the combinations */
+    if (distinct == 0 ||
+        (long long) distinct >= (long long) slot[1]->length * slot[3]->length) {
+        free(pairs);
+
+        return 0;
+    }
+
+    fs_rid_vector *keys[4] = { NULL, fs_rid_vector_new(distinct), NULL,
+                               fs_rid_vector_new(distinct) };
+    for (int r=0; r<distinct; r++) {
+        keys[1]->data[r] = pairs[r].s;
+        keys[3]->data[r] = pairs[r].o;
+    }
+    free(pairs);
+
+    flags = (flags & ~FS_BIND_BY_OBJECT) | FS_BIND_BY_SUBJECT;
+    int ret = fsp_bind_join_many(q->link, flags, keys, slot[0], slot[2],
+                                 filter, result, limit);
+    fs_rid_vector_free(keys[1]);
+    fs_rid_vector_free(keys[3]);
+    if (ret && fs_query_bind_cancelled(q, result, bind_columns(flags))) {
+        return 1;
+    }
+    if (ret) {
+        fs_error(LOG_ERR, "bind join failed in '%s', %d segments gave errors",
+                 fsp_kb_name(q->link), ret);
+
+        exit(1);
+    }
+
+    return 1;
+}
+
 /* note, msg must be malloc'd or equivalent, don't use for stack values */
 
 static void fs_query_explain(fs_query *q, char *msg)
@@ -779,8 +921,13 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
             q->bb[i] = fs_binding_copy(q->bb[tocopy]);
         }
 	for (int j=0; j<q->blocks[i].length; j++) {
-	    int chunk = fs_optimise_triple_pattern(q->qs, q, i,
+	    int chunk = fs_optimise_star(q->qs, q, i,
 	       (rasqal_triple **)(q->blocks[i].data), q->blocks[i].length, j);
+            const int star = chunk > 1;
+            if (!star) {
+                chunk = fs_optimise_triple_pattern(q->qs, q, i,
+                   (rasqal_triple **)(q->blocks[i].data), q->blocks[i].length, j);
+            }
 	    /* execute triple pattern query */
 	    if (explain) {
                 FILE *msg = tmpfile();
@@ -813,14 +960,20 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
                 fs_query_explain(q, cmsg);
 	    }
             int ret;
-            if (chunk == 1) {
+            if (chunk == 1 && group_pushdown(q, i)) {
+                ret = fs_handle_query_group(q, i, q->blocks[i].data[j]);
+            } else if (chunk == 1) {
                 ret = fs_handle_query_triple(q, i, q->blocks[i].data[j]);
             } else {
                 rasqal_triple *in[chunk];
                 for (int k=0; k<chunk; k++) {
                     in[k] = q->blocks[i].data[j+k];
                 }
-                ret = fs_handle_query_triple_multi(q, i, chunk, in);
+                if (star) {
+                    ret = fs_handle_query_star(q, i, chunk, in);
+                } else {
+                    ret = fs_handle_query_triple_multi(q, i, chunk, in);
+                }
                 j += chunk-1;
             }
 	    if (explain) {
@@ -848,6 +1001,10 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
             if (q->boolean == 0) {
                 break;
             }
+            /* the backends won't answer anything more for it */
+            if (q->cancelled) {
+                break;
+            }
 	}
 #if DEBUG_MERGE > 1
         printf("table after processing B%d:\n", i);
@@ -1019,6 +1176,7 @@ void fs_query_free(fs_query *q)
         fs_query_free_row_freeable(q);
 
         if (q->default_graphs) fs_rid_vector_free(q->default_graphs);
+        fs_rid_vector_free(q->group_weights);
 
     for(int i=0;i<FS_MAX_BLOCKS;i++) {
         if (q->constraints[i]) {
@@ -1243,6 +1401,257 @@ static int filter_optimise(fs_query *q, rasqal_expression *e, int block)
     return retval;
 }
 
+/* the result column holding the variable of e, or -1 if e isn't a variable
+ * that's bound */
+static int pushdown_column(rasqal_expression *e, rasqal_variable *vars[],
+                           int cols)
+{
+    if (e->op != RASQAL_EXPR_LITERAL ||
+        e->literal->type != RASQAL_LITERAL_VARIABLE) {
+        return -1;
+    }
+    rasqal_variable *v = e->literal->value.variable;
+    for (int c=0; c<cols; c++) {
+        if (vars[c] && !strcmp((char *)vars[c]->name, (char *)v->name)) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+static int is_uri_literal(rasqal_expression *e)
+{
+    return e->op == RASQAL_EXPR_LITERAL &&
+           e->literal->type == RASQAL_LITERAL_URI;
+}
+
+static fs_rid uri_literal_rid(rasqal_expression *e)
+{
+    return fs_hash_uri((char *)raptor_uri_as_string(e->literal->value.uri));
+}
+
+/* lang(?x) = "tag" and datatype(?x) = <type>, which only depend on the attr
+ * of ?x */
+static void filter_pushdown_attr(fsp_filter *f, rasqal_expression *fn,
+                                 rasqal_expression *val,
+                                 rasqal_variable *vars[], int cols)
+{
+    const int col = pushdown_column(fn->arg1, vars, cols);
+    if (col == -1 || val->op != RASQAL_EXPR_LITERAL) return;
+    rasqal_literal *l = val->literal;
+
+    if (fn->op == RASQAL_EXPR_LANG) {
+        if (l->type != RASQAL_LITERAL_STRING || l->language || l->datatype ||
+            !l->string || !*l->string) {
+            return;
+        }
+        fs_rid attr = fs_hash_literal((char *)l->string, 0);
+        fsp_filter_add(f, FS_FILTER_ATTR_IN, col, 0, 0, 1, &attr);
+    } else if (fn->op == RASQAL_EXPR_DATATYPE && l->type == RASQAL_LITERAL_URI) {
+        const char *dt = (char *)raptor_uri_as_string(l->value.uri);
+        if (!strcmp(dt, XSD_STRING)) {
+            fs_rid attrs[2] = { fs_c.xsd_string, fs_c.empty };
+            fsp_filter_add(f, FS_FILTER_ATTR_IN, col, 0, 0, 2, attrs);
+        } else {
+            fs_rid attr = fs_hash_uri(dt);
+            fsp_filter_add(f, FS_FILTER_ATTR_IN, col, 0, 0, 1, &attr);
+        }
+    }
+}
+
+/* ?x op value, where value is a numeric or xsd:dateTime constant */
+static void filter_pushdown_compare(fs_query *q, int block, fsp_filter *f,
+                                    int cmp, rasqal_expression *var,
+                                    rasqal_expression *val,
+                                    rasqal_variable *vars[], int cols)
+{
+    const int col = pushdown_column(var, vars, cols);
+    if (col == -1 || val->op != RASQAL_EXPR_LITERAL ||
+        val->literal->type == RASQAL_LITERAL_VARIABLE ||
+        val->literal->type == RASQAL_LITERAL_URI) {
+        return;
+    }
+    fs_value v = fs_expression_eval(q, -1, block, val);
+    if (fs_is_error(v)) return;
+
+    if ((v.attr == fs_c.xsd_integer || v.attr == fs_c.xsd_decimal ||
+         v.attr == fs_c.xsd_double || v.attr == fs_c.xsd_float) &&
+        fs_is_numeric(&v)) {
+        fs_value d = fn_cast_intl(q, v, fs_c.xsd_double);
+        if (fs_is_error(d) || !(d.valid & fs_valid_bit(FS_V_FP))) return;
+        fs_rid operands[FS_FILTER_NUMBER_OPERANDS] = { 0, fs_c.xsd_integer,
+            fs_c.xsd_decimal, fs_c.xsd_double, fs_c.xsd_float };
+        memcpy(operands, &d.fp, sizeof(d.fp));
+        fsp_filter_add(f, FS_FILTER_NUMBER, col, cmp, 0,
+                       FS_FILTER_NUMBER_OPERANDS, operands);
+    } else if (v.attr == fs_c.xsd_datetime &&
+               (v.valid & fs_valid_bit(FS_V_IN)) && v.in != -1) {
+        fs_rid operands[2] = { (fs_rid) v.in, fs_c.xsd_datetime };
+        fsp_filter_add(f, FS_FILTER_DATETIME, col, cmp, 0, 2, operands);
+    }
+}
+
+static void filter_pushdown_expr(fs_query *q, int block, fsp_filter *f,
+                                 rasqal_expression *e,
+                                 rasqal_variable *vars[], int cols)
+{
+    int negate = 0;
+    int col;
+
+    if (e->op == RASQAL_EXPR_AND) {
+        filter_pushdown_expr(q, block, f, e->arg1, vars, cols);
+        filter_pushdown_expr(q, block, f, e->arg2, vars, cols);
+
+        return;
+    }
+    if (e->op == RASQAL_EXPR_BANG) {
+        negate = FS_FILTER_NOT;
+        e = e->arg1;
+    }
+
+    switch (e->op) {
+    case RASQAL_EXPR_ISURI:
+    case RASQAL_EXPR_ISBLANK:
+    case RASQAL_EXPR_ISLITERAL:
+        col = pushdown_column(e->arg1, vars, cols);
+        if (col == -1) return;
+        fsp_filter_add(f, e->op == RASQAL_EXPR_ISURI ? FS_FILTER_IS_URI :
+                          e->op == RASQAL_EXPR_ISBLANK ? FS_FILTER_IS_BNODE :
+                          FS_FILTER_IS_LITERAL, col, 0, negate, 0, NULL);
+        break;
+
+    case RASQAL_EXPR_SAMETERM:
+    case RASQAL_EXPR_NEQ: {
+        /* ?x != <uri> only fails for <uri> itself */
+        if (e->op == RASQAL_EXPR_NEQ) {
+            if (negate) return;
+            negate = FS_FILTER_NOT;
+        }
+        rasqal_expression *uri = e->arg2;
+        col = pushdown_column(e->arg1, vars, cols);
+        if (col == -1) {
+            uri = e->arg1;
+            col = pushdown_column(e->arg2, vars, cols);
+        }
+        if (col == -1 || !is_uri_literal(uri)) return;
+        fs_rid rid = uri_literal_rid(uri);
+        fsp_filter_add(f, FS_FILTER_IN, col, 0, negate, 1, &rid);
+        break;
+    }
+
+    case RASQAL_EXPR_IN:
+    case RASQAL_EXPR_NOT_IN: {
+        col = pushdown_column(e->arg1, vars, cols);
+        if (col == -1 || !e->args) return;
+        const int count = raptor_sequence_size(e->args);
+        fs_rid rids[count > 0 ? count : 1];
+        for (int i=0; i<count; i++) {
+            rasqal_expression *ae = raptor_sequence_get_at(e->args, i);
+            if (!is_uri_literal(ae)) return;
+            rids[i] = uri_literal_rid(ae);
+        }
+        if (e->op == RASQAL_EXPR_NOT_IN) negate ^= FS_FILTER_NOT;
+        fsp_filter_add(f, FS_FILTER_IN, col, 0, negate, count, rids);
+        break;
+    }
+
+    case RASQAL_EXPR_EQ:
+    case RASQAL_EXPR_LT:
+    case RASQAL_EXPR_LE:
+    case RASQAL_EXPR_GE:
+    case RASQAL_EXPR_GT: {
+        if (negate) return;
+        if (e->op == RASQAL_EXPR_EQ) {
+            if (e->arg1->op == RASQAL_EXPR_LANG ||
+                e->arg1->op == RASQAL_EXPR_DATATYPE) {
+                filter_pushdown_attr(f, e->arg1, e->arg2, vars, cols);
+
+                return;
+            }
+            if (e->arg2->op == RASQAL_EXPR_LANG ||
+                e->arg2->op == RASQAL_EXPR_DATATYPE) {
+                filter_pushdown_attr(f, e->arg2, e->arg1, vars, cols);
+
+                return;
+            }
+        }
+        int cmp = 0, flipped = 0;
+        switch (e->op) {
+        case RASQAL_EXPR_EQ:
+            cmp = flipped = FS_FILTER_EQ;
+            break;
+        case RASQAL_EXPR_LT:
+            cmp = FS_FILTER_LT;
+            flipped = FS_FILTER_GT;
+            break;
+        case RASQAL_EXPR_LE:
+            cmp = FS_FILTER_LE;
+            flipped = FS_FILTER_GE;
+            break;
+        case RASQAL_EXPR_GE:
+            cmp = FS_FILTER_GE;
+            flipped = FS_FILTER_LE;
+            break;
+        default:
+            cmp = FS_FILTER_GT;
+            flipped = FS_FILTER_LT;
+            break;
+        }
+        if (pushdown_column(e->arg1, vars, cols) != -1) {
+            filter_pushdown_compare(q, block, f, cmp, e->arg1, e->arg2,
+                                    vars, cols);
+        } else {
+            filter_pushdown_compare(q, block, f, flipped, e->arg2, e->arg1,
+                                    vars, cols);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/* compiles the parts of the FILTERs of block that can be tested on the
+ * columns of a bind into a program for the backends, or returns NULL if
+ * there are none. The backends only drop rows that would certainly fail,
+ * so the FILTERs are still applied to the results as usual */
+static fsp_filter *filter_pushdown(fs_query *q, int block,
+                                   rasqal_variable *vars[], int cols)
+{
+    if (q->opt_level < 1 || !q->constraints[block]) return NULL;
+    const char *features = fsp_link_features(q->link);
+    if (!features || !strstr(features, " bind-filter ")) return NULL;
+
+    /* FILTERs of OPTIONAL and UNION blocks are applied as alternatives,
+     * and those of MINUS blocks aren't applied to its rows at all */
+    int constraints = 0;
+    for (int c=0; c<raptor_sequence_size(q->constraints[block]); c++) {
+        if (raptor_sequence_get_at(q->constraints[block], c)) constraints++;
+    }
+    if (q->join_type[block] == FS_MINUS) return NULL;
+    if (block > 0 && q->join_type[block] != FS_INNER && constraints > 1) {
+        return NULL;
+    }
+
+    fsp_filter *f = fsp_filter_new();
+    for (int c=0; c<raptor_sequence_size(q->constraints[block]); c++) {
+        rasqal_expression *e = raptor_sequence_get_at(q->constraints[block], c);
+        if (e) filter_pushdown_expr(q, block, f, e, vars, cols);
+    }
+    if (f->terms == 0) {
+        fsp_filter_free(f);
+
+        return NULL;
+    }
+    if (q->flags & FS_QUERY_EXPLAIN) {
+        fs_query_explain(q, g_strdup_printf("filter B%d, %d terms pushed to backends", block, f->terms));
+    }
+
+    return f;
+}
+
 static void graph_pattern_walk(fsp_link *link, rasqal_graph_pattern *pattern,
 	fs_query *q, rasqal_literal *model, int parent, int uni)
 {
@@ -1761,12 +2170,20 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 	    return 0;
 	}
 
-        fs_bind_cache_wrapper(q->qs, q, 0, tobind | FS_BIND_BY_SUBJECT,
-                 slot, &results, -1, q->order ? -1 : q->soft_limit);
+        const char *scope = "mmmms";
+        fsp_filter *filter = filter_pushdown(q, block, vars, numbindings);
+        if (bind_join(q, oldb, t, tobind, slot, filter, &results,
+                      q->order ? -1 : q->soft_limit)) {
+            scope = "jjjjs";
+        } else {
+            fs_bind_cache_wrapper(q->qs, q, 0, tobind | FS_BIND_BY_SUBJECT,
+                     slot, filter, &results, -1, q->order ? -1 : q->soft_limit);
+        }
+        fsp_filter_free(filter);
 	if (explain) {
 	    char desc[4][DESC_SIZE];
 	    desc_action(tobind, slot, desc);
-	    fs_query_explain(q, g_strdup_printf("mmmms (%s,%s,%s,%s) -> %d", desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2));
+	    fs_query_explain(q, g_strdup_printf("%s (%s,%s,%s,%s) -> %d", scope, desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2));
 	}
 
         ret = process_results(q, block, oldb, b, tobind, results, vars, numbindings, slot);
@@ -1796,13 +2213,20 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 	}
 
         char *scope = NULL;
-        fs_bind_cache_wrapper(q->qs, q, 1, tobind | FS_BIND_BY_OBJECT,
-                 slot, &results, -1, q->order ? -1 : q->soft_limit);
-        scope = "NNNN";
+        fsp_filter *filter = filter_pushdown(q, block, vars, numbindings);
+        if (bind_join(q, oldb, t, tobind, slot, filter, &results,
+                      q->order ? -1 : q->soft_limit)) {
+            scope = "jjjjs";
+        } else {
+            fs_bind_cache_wrapper(q->qs, q, 1, tobind | FS_BIND_BY_OBJECT,
+                     slot, filter, &results, -1, q->order ? -1 : q->soft_limit);
+            scope = "NNNNo";
+        }
+        fsp_filter_free(filter);
 	if (explain) {
 	    char desc[4][DESC_SIZE];
 	    desc_action(tobind, slot, desc);
-	    fs_query_explain(q, g_strdup_printf("%so (%s,%s,%s,%s) -> %d", scope, desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2));
+	    fs_query_explain(q, g_strdup_printf("%s (%s,%s,%s,%s) -> %d", scope, desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2));
 	}
 
 	ret = process_results(q, block, oldb, b, tobind, results, vars, numbindings, slot);
@@ -1829,8 +2253,10 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
         return 0;
     }
 
+    fsp_filter *filter = filter_pushdown(q, block, vars, numbindings);
     fs_bind_cache_wrapper(q->qs, q, 1, tobind | FS_BIND_BY_SUBJECT,
-             slot, &results, -1, q->order ? -1 : q->soft_limit);
+             slot, filter, &results, -1, q->order ? -1 : q->soft_limit);
+    fsp_filter_free(filter);
     if (explain) {
         char desc[4][DESC_SIZE];
         desc_action(tobind, slot, desc);
@@ -1927,6 +2353,345 @@ static int fs_handle_query_triple_multi(fs_query *q, int block, int count, rasqa
     return ret;
 }
 
+/* this handles a star of triples with the same variable subject, as picked
+ * out by fs_optimise_star(), in one bind_star operation */
+static int fs_handle_query_star(fs_query *q, int block, int count, rasqal_triple *t[])
+{
+    fs_binding *b = q->bb[block];
+    int tobind = q->flags;
+
+#ifdef DEBUG_MERGE
+    const int explain = 1;
+#else
+    const int explain = tobind & FS_QUERY_EXPLAIN;
+#endif
+
+    fs_binding_clear_used_all(b);
+    fs_binding *oldb = fs_binding_copy_and_clear(b);
+
+    fs_rid_vector *slot[4];
+    for (int x=0; x<4; x++) {
+        slot[x] = fs_rid_vector_new(0);
+    }
+    fs_star_arm arms[count];
+    rasqal_variable *vars[count+1];
+    rasqal_variable *v;
+    int bind, nomatch = 0;
+
+    /* the arms all have the same graph */
+    fs_bind_slot(q, block, oldb, t[0]->origin, slot[0], &bind, &v, 0);
+    if (q->default_graphs) {
+        if (!t[0]->origin && slot[0]->length == 0) {
+            fs_rid_vector_append_vector(slot[0], q->default_graphs);
+            tobind &= ~FS_QUERY_DEFAULT_GRAPH;
+        } else {
+            tobind |= FS_QUERY_DEFAULT_GRAPH;
+        }
+    }
+    /* the subject column is always returned, it's what the arms join on */
+    fs_bind_slot(q, block, oldb, t[0]->subject, slot[1], &bind, &vars[0], 0);
+    fs_rid_vector_sort(slot[1]);
+    fs_rid_vector_uniq(slot[1], 0);
+    if (slot[1]->length == 1 && slot[1]->data[0] == FS_RID_NULL) {
+        nomatch = 1;
+    }
+
+    int numbindings = 1;
+    for (int i=0; i<count; i++) {
+        if (i > 0) {
+            fs_bind_slot(q, block, oldb, t[i]->origin, slot[3], &bind, &v, 0);
+            fs_bind_slot(q, block, oldb, t[i]->subject, slot[3], &bind, &v, 0);
+        }
+        fs_rid_vector_clear(slot[2]);
+        fs_bind_slot(q, block, oldb, t[i]->predicate, slot[2], &bind, &v, 0);
+        arms[i].predicate = slot[2]->data[0];
+        arms[i].objects = fs_rid_vector_new(0);
+        fs_bind_slot(q, block, oldb, t[i]->object, arms[i].objects, &bind, &v, 1);
+        arms[i].bind = bind;
+        if (bind) {
+            vars[numbindings++] = v;
+        }
+        fs_rid_vector_sort(arms[i].objects);
+        fs_rid_vector_uniq(arms[i].objects, 0);
+        if (arms[i].objects->length == 1 &&
+            arms[i].objects->data[0] == FS_RID_NULL) {
+            nomatch = 1;
+        }
+    }
+
+    fs_rid_vector **results = NULL;
+    fsp_filter *filter = nomatch ? NULL :
+                         filter_pushdown(q, block, vars, numbindings);
+    if (nomatch) {
+        results = calloc(numbindings, sizeof(fs_rid_vector *));
+        for (int c=0; c<numbindings; c++) {
+            results[c] = fs_rid_vector_new(0);
+        }
+    } else if (fsp_bind_star_many(q->link, tobind & FS_QUERY_DEFAULT_GRAPH,
+                   slot[1], slot[0], count, arms, filter, &results,
+                   q->order ? -1 : q->soft_limit) &&
+               !fs_query_bind_cancelled(q, &results, numbindings)) {
+        fs_error(LOG_ERR, "bind star failed in '%s'", fsp_kb_name(q->link));
+
+        exit(1);
+    }
+    fsp_filter_free(filter);
+    if (explain) {
+        fs_query_explain(q, g_strdup_printf("ssss (%d subjects, %d arms) -> %d", slot[1]->length, count, results[0]->length));
+    }
+
+    int ret = process_results(q, block, oldb, b, tobind, results, vars, numbindings, slot);
+    for (int i=0; i<count; i++) {
+        fs_rid_vector_free(arms[i].objects);
+    }
+    for (int x=0; x<4; x++) {
+        fs_rid_vector_free(slot[x]);
+    }
+
+    return ret;
+}
+
+/* the variable of e, if it's a plain variable, otherwise NULL */
+static rasqal_variable *expr_variable(rasqal_expression *e)
+{
+    if (e && e->op == RASQAL_EXPR_LITERAL &&
+        e->literal->type == RASQAL_LITERAL_VARIABLE) {
+        return e->literal->value.variable;
+    }
+
+    return NULL;
+}
+
+static int is_group_variable(fs_query *q, const char *name)
+{
+    for (int i=0; rasqal_query_get_group_condition(q->rq, i); i++) {
+        rasqal_variable *gv =
+            expr_variable(rasqal_query_get_group_condition(q->rq, i));
+        if (gv && !strcmp((char *)gv->name, name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int is_pattern_variable(rasqal_triple *t, rasqal_variable *v)
+{
+    rasqal_literal *parts[4] = { t->origin, t->subject, t->predicate,
+                                 t->object };
+    for (int i=0; i<4; i++) {
+        if (parts[i] && parts[i]->type == RASQAL_LITERAL_VARIABLE &&
+            !strcmp((char *)parts[i]->value.variable->name, (char *)v->name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* the aggregates that can be computed from rows grouped by the backends,
+ * weighting each row by its count */
+static int group_aggregate_ok(rasqal_triple *t, rasqal_expression *e)
+{
+    switch (e->op) {
+    case RASQAL_EXPR_COUNT:
+        if (e->arg1->op == RASQAL_EXPR_VARSTAR) break;
+        /* fall through */
+    case RASQAL_EXPR_SUM:
+    case RASQAL_EXPR_AVG:
+    case RASQAL_EXPR_MIN:
+    case RASQAL_EXPR_MAX:
+    case RASQAL_EXPR_SAMPLE: {
+        rasqal_variable *v = expr_variable(e->arg1);
+        if (!v || !is_pattern_variable(t, v)) return 0;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    return !(e->flags & RASQAL_EXPR_FLAG_DISTINCT);
+}
+
+/* ORDER BY can only use the grouped variables and the aggregates */
+static int group_order_ok(fs_query *q, rasqal_expression *e)
+{
+    if (!e) return 1;
+    rasqal_variable *v = expr_variable(e);
+    if (v) {
+        if (is_group_variable(q, (char *)v->name)) return 1;
+        fs_binding *b = fs_binding_get(q->bb[0], v);
+
+        return b && b->proj && b->expression;
+    }
+    if (e->op == RASQAL_EXPR_LITERAL) return 1;
+    if (!group_order_ok(q, e->arg1) || !group_order_ok(q, e->arg2) ||
+        !group_order_ok(q, e->arg3)) {
+        return 0;
+    }
+    if (e->args) {
+        for (int i=0; i<raptor_sequence_size(e->args); i++) {
+            if (!group_order_ok(q, raptor_sequence_get_at(e->args, i))) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* true if block is the whole of the query, one triple pattern, and it's
+ * aggregated in ways that let the backends group the matches, see
+ * fs_handle_query_group() */
+static int group_pushdown(fs_query *q, int block)
+{
+    if (q->opt_level < 1 || !q->aggregate || block != 0) return 0;
+    const char *features = fsp_link_features(q->link);
+    if (!features || !strstr(features, " bind-group ")) return 0;
+    if (q->flags & FS_BIND_DISTINCT || q->blocks[0].length != 1) return 0;
+    if (rasqal_query_get_having_condition(q->rq, 0)) return 0;
+    for (int b=0; b<=q->block; b++) {
+        if (b > 0 && q->blocks[b].length > 0) return 0;
+        if (!q->constraints[b]) continue;
+        for (int c=0; c<raptor_sequence_size(q->constraints[b]); c++) {
+            if (raptor_sequence_get_at(q->constraints[b], c)) return 0;
+        }
+    }
+
+    /* every variable has to be bound by the pattern, and only once */
+    rasqal_triple *t = q->blocks[0].data[0];
+    rasqal_literal *parts[4] = { t->origin, t->subject, t->predicate,
+                                 t->object };
+    for (int i=0; i<4; i++) {
+        if (!parts[i] || parts[i]->type != RASQAL_LITERAL_VARIABLE) continue;
+        fs_binding *b = fs_binding_get(q->bb[0], parts[i]->value.variable);
+        if (b && b->bound) return 0;
+        for (int j=0; j<i; j++) {
+            if (parts[j] && parts[j]->type == RASQAL_LITERAL_VARIABLE &&
+                parts[j]->value.variable == parts[i]->value.variable) {
+                return 0;
+            }
+        }
+    }
+
+    for (int i=0; rasqal_query_get_group_condition(q->rq, i); i++) {
+        rasqal_variable *v =
+            expr_variable(rasqal_query_get_group_condition(q->rq, i));
+        if (!v || !is_pattern_variable(t, v)) return 0;
+    }
+    for (int c=1; c<=q->num_vars; c++) {
+        if (q->bb[0][c].expression) {
+            if (!group_aggregate_ok(t, q->bb[0][c].expression)) return 0;
+        } else if (!is_group_variable(q, q->bb[0][c].name)) {
+            return 0;
+        }
+    }
+    for (int i=0; rasqal_query_get_order_condition(q->rq, i); i++) {
+        if (!group_order_ok(q, rasqal_query_get_order_condition(q->rq, i))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* true if v's values are needed to group or aggregate */
+static int group_needs(fs_query *q, rasqal_variable *v)
+{
+    if (!v) return 0;
+    if (is_group_variable(q, (char *)v->name)) return 1;
+    for (int c=1; c<=q->num_vars; c++) {
+        rasqal_expression *e = q->bb[0][c].expression;
+        if (!e || e->op == RASQAL_EXPR_COUNT) continue;
+        rasqal_variable *ev = expr_variable(e->arg1);
+        if (ev && !strcmp((char *)ev->name, (char *)v->name)) return 1;
+    }
+
+    return 0;
+}
+
+/* an aggregate over a single triple pattern. The backends group their own
+ * matches on the columns the grouping and the aggregates use, so each row
+ * comes back once, with the number of matches it stands for in
+ * q->group_weights, which the aggregate functions weight the rows by. As
+ * every variable is bound by the pattern COUNT(?x) is the same as COUNT(*),
+ * so the ?x column isn't fetched */
+static int fs_handle_query_group(fs_query *q, int block, rasqal_triple *t)
+{
+    fs_binding *b = q->bb[block];
+    int tobind = q->flags;
+
+#ifdef DEBUG_MERGE
+    const int explain = 1;
+#else
+    const int explain = tobind & FS_QUERY_EXPLAIN;
+#endif
+
+    fs_rid_vector *slot[4];
+    for (int x=0; x<4; x++) {
+        slot[x] = fs_rid_vector_new(0);
+    }
+    rasqal_variable *vars[4] = { NULL, NULL, NULL, NULL };
+    fs_binding_clear_used_all(b);
+    fs_binding *oldb = fs_binding_copy_and_clear(b);
+
+    int numbindings = 0;
+    if (bind_pattern(q, block, oldb, t, slot, vars, &numbindings, &tobind)) {
+        for (int x=0; x<4; x++) {
+            fs_rid_vector_free(slot[x]);
+        }
+        fs_binding_free(oldb);
+
+        return 0;
+    }
+
+    /* only bind the columns that are needed */
+    int cols = 0, col = 0;
+    for (int k=0; k<4; k++) {
+        if (!(tobind & 1 << k)) continue;
+        if (group_needs(q, vars[col])) {
+            vars[cols++] = vars[col];
+        } else {
+            tobind &= ~(1 << k);
+        }
+        col++;
+    }
+
+    if (fs_opt_is_const(oldb, t->object) && !fs_opt_is_const(oldb, t->subject)) {
+        tobind |= FS_BIND_BY_OBJECT;
+    } else {
+        tobind |= FS_BIND_BY_SUBJECT;
+    }
+
+    fs_rid_vector **results = NULL;
+    if (fsp_bind_group_all(q->link, tobind, slot[0], slot[1], slot[2],
+                           slot[3], &results) &&
+        !fs_query_bind_cancelled(q, &results, cols + 1)) {
+        fs_error(LOG_ERR, "bind group failed in '%s'", fsp_kb_name(q->link));
+
+        exit(1);
+    }
+    fs_rid_vector *counts = NULL;
+    if (results) {
+        counts = results[cols];
+        results[cols] = NULL;
+    }
+    if (explain) {
+        char desc[4][DESC_SIZE];
+        desc_action(tobind, slot, desc);
+        fs_query_explain(q, g_strdup_printf("gggg (%s,%s,%s,%s) -> %d groups", desc[0], desc[1], desc[2], desc[3], counts ? counts->length : 0));
+    }
+
+    int ret = process_results(q, block, oldb, b, tobind, results, vars, cols, slot);
+    for (int x=0; x<4; x++) {
+        fs_rid_vector_free(slot[x]);
+    }
+    fs_rid_vector_free(q->group_weights);
+    q->group_weights = counts;
+
+    return ret;
+}
+
 static fs_rid const_literal_to_rid(fs_query *q, rasqal_literal *l, fs_rid *attr)
 {
     switch (l->type) {
@@ -25,6 +25,11 @@ void fs_query_free(fs_query *q);
 double fs_query_start_time(fs_query *q);
 int fs_query_flags(fs_query *q);
 int fs_query_errors(fs_query *q);
+/* if bind failed only because the backends gave up on q, as it timed out or
+ * was cancelled, marks q as cancelled, replaces *result with cols empty
+ * columns, or NULL if cols is 0, and returns true. The query then finishes
+ * early, with a warning, rather than taking the process down */
+int fs_query_bind_cancelled(fs_query *q, fs_rid_vector ***result, int cols);
 int fs_bind_slot(fs_query *q, int block, fs_binding *b, 
         rasqal_literal *l, fs_rid_vector *v, int *bind, rasqal_variable **var,
         int lit_allowed);
@@ -300,6 +300,24 @@ static fs_value literal_to_value(fs_query *q, int row, int block, rasqal_literal
     return fs_value_error(FS_ERROR_INVALID_TYPE, "unhandled literal");
 }
 
+/* a row the backends grouped stands for as many solutions as its weight,
+ * see fs_handle_query_group() */
+static long long row_weight(fs_rid_vector *weights, uint64_t row)
+{
+    if (!weights || row >= weights->length) return 1;
+
+    return weights->data[row];
+}
+
+static fs_value weighted(fs_query *q, fs_rid_vector *weights, uint64_t row,
+                         fs_value v)
+{
+    const long long weight = row_weight(weights, row);
+    if (weight == 1) return v;
+
+    return fn_numeric_multiply(q, v, fs_value_integer(weight));
+}
+
 fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *e)
 {
     if (!e) {
@@ -475,12 +493,20 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
     }
 
     case RASQAL_EXPR_COUNT: {
-        if (e->arg1->op == RASQAL_EXPR_VARSTAR && !q->apply_constraints) {
+        fs_rid_vector *weights = q->group_weights;
+        if (e->arg1->op == RASQAL_EXPR_VARSTAR && !q->apply_constraints &&
+            !weights) {
             return fs_value_integer(q->group_length);
         }
-        int count = 0;
+        long long count = 0;
         for (int r=0; r<q->group_length; r++) {
             if (q->apply_constraints && !fs_bit_array_get(q->apply_constraints,q->group_rows[r])) continue;
+            if (weights) {
+                /* the pattern binds every variable, so COUNT(?x) counts
+                 * every match, and ?x wasn't fetched */
+                count += row_weight(weights, q->group_rows[r]);
+                continue;
+            }
                 
             fs_value v = fs_expression_eval(q, q->group_rows[r], block, e->arg1);
             if (v.valid & fs_valid_bit(FS_V_TYPE_ERROR) ||
@@ -488,7 +514,7 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
                   v.rid == FS_RID_NULL)) {
                /* do nothing */
             } else {
-                count++;
+                count += row_weight(weights, q->group_rows[r]);
             }
         }
 
@@ -688,22 +714,25 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
     /* aggregates */
 
     case RASQAL_EXPR_SUM: {
+        fs_rid_vector *weights = q->group_weights;
         fs_value v = fs_value_integer(0);
         for (int r=0; r<q->group_length; r++) {
             if (q->apply_constraints && !fs_bit_array_get(q->apply_constraints,q->group_rows[r])) continue;
-            v = fn_numeric_add(q, v, fs_expression_eval(q, q->group_rows[r], block, e->arg1));
+            v = fn_numeric_add(q, v, weighted(q, weights, q->group_rows[r],
+                    fs_expression_eval(q, q->group_rows[r], block, e->arg1)));
         }
 
         return v;
     }
 
     case RASQAL_EXPR_AVG: {
+        fs_rid_vector *weights = q->group_weights;
         fs_value sum = fs_value_integer(0);
-        int count = 0;
+        long long count = 0;
         for (int r=0; r<q->group_length; r++) {
             if (q->apply_constraints && !fs_bit_array_get(q->apply_constraints,q->group_rows[r])) continue;
             fs_value expr = fs_expression_eval(q, q->group_rows[r], block, e->arg1);
-            sum = fn_numeric_add(q, sum, expr);
+            sum = fn_numeric_add(q, sum, weighted(q, weights, q->group_rows[r], expr));
             if (sum.valid & fs_valid_bit(FS_V_TYPE_ERROR)) {
                 return sum;
             }
@@ -712,7 +741,7 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
                   expr.rid == FS_RID_NULL)) {
                /* do nothing */
             } else {
-                count++;
+                count += row_weight(weights, q->group_rows[r]);
             }
         }
 
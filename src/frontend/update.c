@@ -709,7 +709,7 @@ int fs_add(struct update_context *uc, char *from, char *to)
     fs_rid_vector **results;
     fs_rid_vector *slot[4] = { mvec, empty, empty, empty };
     fs_bind_cache_wrapper(uc->qs, NULL, 1, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT,
-             slot, &results, -1, -1);
+             slot, NULL, &results, -1, -1);
     fs_rid_vector_free(mvec);
     fs_rid_vector_free(empty);
 
@@ -789,7 +789,7 @@ int fs_move(struct update_context *uc, char *from, char *to)
 
     /* see if there's any data in <from> */
     fs_bind_cache_wrapper(uc->qs, NULL, 1, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT,
-             slot, &results, -1, 1);
+             slot, NULL, &results, -1, 1);
     if (!results || results[0]->length == 0) {
         if (results) {
             fs_rid_vector_free(results[0]);
@@ -807,7 +807,7 @@ int fs_move(struct update_context *uc, char *from, char *to)
 
     /* get the contents of <from> */
     fs_bind_cache_wrapper(uc->qs, NULL, 1, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT,
-             slot, &results, -1, -1);
+             slot, NULL, &results, -1, -1);
 
     /* delete <to> */
     mvec->data[0] = torid;
@@ -887,7 +887,7 @@ int fs_copy(struct update_context *uc, char *from, char *to)
 
     /* see if there's any data in <from> */
     fs_bind_cache_wrapper(uc->qs, NULL, 1, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT,
-             slot, &results, -1, 1);
+             slot, NULL, &results, -1, 1);
     if (!results || results[0]->length == 0) {
         if (results) {
             fs_rid_vector_free(results[0]);
@@ -905,7 +905,7 @@ int fs_copy(struct update_context *uc, char *from, char *to)
 
     /* get the contents of <from> */
     fs_bind_cache_wrapper(uc->qs, NULL, 1, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT,
-             slot, &results, -1, -1);
+             slot, NULL, &results, -1, -1);
 
     /* map old bnodes to new ones */
     map_bnodes(uc, results[0]);
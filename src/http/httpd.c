@@ -71,6 +71,8 @@ static int default_graph = 0;
 static int soft_limit = 0; /* default value for soft limit */
 static int opt_level = -1;  /* default value for optimisation level */
 static int cors_support = -1; /* cross-origin resource sharing (CORS) support */
+static int hedge_percentile = 0; /* hedge reads slower than this, 0 for off */
+static int query_timeout = 0; /* seconds a query may run for, 0 for no limit */
 
 static fs_query_state *query_state;
 
@@ -336,17 +338,34 @@ static void http_query_worker(gpointer data, gpointer user_data)
   client_ctxt *ctxt = (client_ctxt *) data;
 
   ctxt->start_time = fs_time();
+  const double deadline = query_timeout ? ctxt->start_time + query_timeout : 0.0;
+  fsp_query_begin(fsplink, ctxt->query_id, deadline);
   ctxt->qr = fs_query_execute(query_state, fsplink, bu, ctxt->query_string, ctxt->query_flags, opt_level, ctxt->soft_limit, 0);
-  if (ctxt->qr->errors) {
-    http_error(ctxt, "400 Parser error");
-    GSList *w = ctxt->qr->warnings;
-    if (w) {
-       http_send(ctxt, "\n");
-    }
-    while (w) {
-       http_send(ctxt, w->data);
-       http_send(ctxt, "\n");
-       w = w->next;
+  fsp_query_end(fsplink);
+  if (ctxt->hangup_watch) {
+    g_source_destroy(ctxt->hangup_watch);
+    g_source_unref(ctxt->hangup_watch);
+    ctxt->hangup_watch = NULL;
+  }
+
+  /* the backends gave up on some of it, so the results are incomplete */
+  const int timed_out = ctxt->qr->cancelled;
+
+  if (ctxt->qr->errors || timed_out) {
+    if (timed_out) {
+      fs_error(LOG_INFO, "Q%u timed out or was cancelled after %fs", ctxt->query_id, fs_time() - ctxt->start_time);
+      http_error(ctxt, "503 Query timed out");
+    } else {
+      http_error(ctxt, "400 Parser error");
+      GSList *w = ctxt->qr->warnings;
+      if (w) {
+         http_send(ctxt, "\n");
+      }
+      while (w) {
+         http_send(ctxt, w->data);
+         http_send(ctxt, "\n");
+         w = w->next;
+      }
     }
     fs_query_free(ctxt->qr);
     ctxt->qr = NULL;
@@ -429,6 +448,24 @@ static void http_query_worker(gpointer data, gpointer user_data)
   http_close(ctxt);
 }
 
+/* the client has gone away, so the backends can stop work on its query.
+   data is the query id, not the ctxt, which the worker may free at any time */
+static gboolean hangup_fn (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  char c;
+  const ssize_t count = recv(g_io_channel_unix_get_fd(source), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  if (count == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return TRUE;
+  }
+  if (count == 0 || (condition & G_IO_HUP)) {
+    fs_error(LOG_INFO, "client hung up, cancelling Q%u", GPOINTER_TO_UINT(data));
+    fsp_cancel_all(fsplink, GPOINTER_TO_UINT(data));
+  }
+
+  return FALSE;
+}
+
 static void http_answer_query(client_ctxt *ctxt, const char *query)
 {
   ctxt->query_id = ++last_query_id;
@@ -436,6 +473,12 @@ static void http_answer_query(client_ctxt *ctxt, const char *query)
   ctxt->query_string = g_strdup(query);
   ctxt->update_string = NULL;
   g_source_remove_by_user_data(ctxt);
+
+  ctxt->hangup_watch = g_io_create_watch(ctxt->ioch, G_IO_IN | G_IO_HUP);
+  g_source_set_callback(ctxt->hangup_watch, (GSourceFunc) hangup_fn,
+                        GUINT_TO_POINTER(ctxt->query_id), NULL);
+  g_source_attach(ctxt->hangup_watch, NULL);
+
   g_thread_pool_push(pool, ctxt, NULL);
 }
 
@@ -1651,6 +1694,7 @@ static void child (int srv, char *kb_name, char *password)
   }
 
   fs_hash_init(fsp_hash_type(fsplink));
+  fsp_set_hedging(fsplink, hedge_percentile);
 
   const char *features = fsp_link_features(fsplink);
   has_o_index = !(strstr(features, "no-o-index")); /* tweak */
@@ -1824,6 +1868,18 @@ int main(int argc, char *argv[])
         opt_level = atoi(opt_level_str);
       }
     }
+
+    const char *hedge_str = NULL;
+    set_string(keyfile, kb_name, "hedge-percentile", &hedge_str);
+    if (hedge_str) {
+      hedge_percentile = atoi(hedge_str);
+    }
+
+    const char *timeout_str = NULL;
+    set_string(keyfile, kb_name, "query-timeout", &timeout_str);
+    if (timeout_str) {
+      query_timeout = atoi(timeout_str);
+    }
   }
 
   /* handle defaults */
@@ -1853,6 +1909,12 @@ int main(int argc, char *argv[])
   if (opt_level != 3) {
     fs_error(LOG_INFO, "Setting query optimiser level to %d", opt_level);
   }
+  if (hedge_percentile > 0) {
+    fs_error(LOG_INFO, "Hedging reads slower than the %dth percentile", hedge_percentile);
+  }
+  if (query_timeout > 0) {
+    fs_error(LOG_INFO, "Giving up on queries after %ds", query_timeout);
+  }
 
   pid_t wpid;
   do {
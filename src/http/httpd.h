@@ -47,4 +47,5 @@ typedef struct {
   char *output;
   unsigned int query_id;
   double start_time;
+  GSource *hangup_watch; /* while the query runs, or NULL */
 } client_ctxt;
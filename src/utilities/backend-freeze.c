@@ -0,0 +1,147 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <locale.h>
+#include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "../common/error.h"
+#include "../common/params.h"
+#include "../common/timing.h"
+
+#include "../backend/backend.h"
+#include "../backend/backend-intl.h"
+#include "../backend/frozen.h"
+
+static int verbosity = 0;
+
+static int freeze_segment(fs_backend *be, const char *kb, fs_segment seg)
+{
+    double then = fs_time();
+    if (fs_backend_open_files(be, seg, O_RDWR, 0)) {
+        fs_error(LOG_ERR, "failed to open files for segment %d", seg);
+
+        return 1;
+    }
+    char *filename = g_strdup_printf(FS_FROZEN, kb, seg);
+    int ret = fs_frozen_write(be, filename);
+    fs_backend_close_files(be, seg);
+    if (!ret && verbosity) {
+        printf("froze segment %d to %s in %.1fs\n", seg, filename,
+               fs_time() - then);
+    }
+    g_free(filename);
+
+    return ret;
+}
+
+static int thaw_segment(const char *kb, fs_segment seg)
+{
+    char *filename = g_strdup_printf(FS_FROZEN, kb, seg);
+    int ret = 0;
+    if (fs_frozen_unlink(filename) == -1) {
+        fs_error(LOG_ERR, "cannot remove %s: %s", filename, strerror(errno));
+        ret = 1;
+    } else if (verbosity) {
+        printf("thawed segment %d\n", seg);
+    }
+    g_free(filename);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char *optstring = "vt";
+    int help = 0;
+    int thaw = 0;
+    int c, opt_index = 0;
+
+    static struct option long_options[] = {
+        { "version", 0, 0, 'V' },
+        { "help", 0, 0, 'h' },
+        { "verbose", 0, 0, 'v' },
+        { "thaw", 0, 0, 't' },
+        { 0, 0, 0, 0 }
+    };
+
+    setlocale(LC_ALL, NULL);
+    int help_return = 1;
+
+    while ((c = getopt_long (argc, argv, optstring, long_options, &opt_index)) != -1) {
+        if (c == 'v') {
+            verbosity++;
+        } else if (c == 'V') {
+            printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+            exit(0);
+        } else if (c == 'h') {
+            help = 1;
+            help_return = 0;
+        } else if (c == 't') {
+            thaw = 1;
+        } else {
+            help++;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help = 1;
+    }
+
+    if (help) {
+        printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+        fprintf(stdout, "Usage: %s [-v] [--thaw] <kbname>\n", basename(argv[0]));
+        fprintf(stdout, "   -v, --verbose    increase verbosity\n");
+        fprintf(stdout, "   -t, --thaw       remove the frozen copies\n");
+        fprintf(stdout, "This command writes a read optimised copy of each segment of a KB on\n");
+        fprintf(stdout, "this node, which the backend uses for data that hasn't changed since.\n");
+        fprintf(stdout, "The backend must be stopped while it runs.\n");
+        return help_return;
+    }
+
+    const char *kb = argv[optind];
+
+    fsp_syslog_enable();
+
+    fs_backend *be = fs_backend_init(kb, 0);
+    if (!be) {
+        return 2;
+    }
+
+    int segments[FS_MAX_SEGMENTS];
+    const int count = fs_segments(be, segments);
+    int errs = 0;
+    for (int i=0; i<count; i++) {
+        if (thaw) {
+            errs += thaw_segment(kb, segments[i]);
+        } else {
+            errs += freeze_segment(be, kb, segments[i]);
+        }
+    }
+    fs_backend_fini(be);
+
+    return errs ? 3 : 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,183 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <locale.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <glib.h>
+
+#include "../common/error.h"
+#include "../common/params.h"
+#include "../common/timing.h"
+
+#include "../backend/backend.h"
+#include "../backend/backend-intl.h"
+#include "../backend/ptpack.h"
+#include "../backend/ptree.h"
+
+static int verbosity = 0;
+
+/* open predicate n's S or O tree the way the backend would, returns non zero
+ * if it's in the pack or missing, as there's no file to rewrite */
+static int in_file(fs_backend *be, int n, int object)
+{
+    const fs_rid pred = be->ptrees_priv[n].pred;
+    fs_ptree *pt;
+    if (be->ptpack) {
+        pt = fs_ptpack_open_tree(be->ptpack, n, object, be->pairs, O_RDWR);
+    } else {
+        pt = fs_ptree_open(be, pred, object ? 'o' : 's', O_RDWR, be->pairs);
+    }
+    if (!pt) {
+        return 0;
+    }
+    const int packed = fs_ptree_is_packed(pt);
+    if (be->ptpack) {
+        fs_ptpack_close_tree(be->ptpack, n, object, pt);
+    } else {
+        fs_ptree_close(pt);
+    }
+
+    return !packed;
+}
+
+static int migrate_segment(fs_backend *be, const char *kb, fs_segment seg,
+                           int revision, int compact)
+{
+    double then = fs_time();
+    if (fs_backend_open_files(be, seg, O_RDWR, 0)) {
+        fs_error(LOG_ERR, "failed to open files for segment %d", seg);
+
+        return 1;
+    }
+    int errs = 0, trees = 0, packed = 0;
+    for (int n=0; n<be->ptree_length; n++) {
+        for (int object=0; object<2; object++) {
+            if (!in_file(be, n, object)) {
+                packed++;
+
+                continue;
+            }
+            char *filename = g_strdup_printf(FS_PTREE, kb, seg,
+                                             object ? 'o' : 's',
+                                             be->ptrees_priv[n].pred);
+            if (fs_ptree_migrate(filename, be->pairs, revision, compact)) {
+                fs_error(LOG_ERR, "failed to migrate %s", filename);
+                errs++;
+            } else {
+                trees++;
+            }
+            g_free(filename);
+            /* let the directory record the new tree's count */
+            if (be->ptpack) in_file(be, n, object);
+        }
+    }
+    fs_backend_close_files(be, seg);
+    if (verbosity) {
+        printf("segment %d: %d trees rewritten, %d packed or missing, "
+               "%d errors in %.1fs\n", seg, trees, packed, errs,
+               fs_time() - then);
+    }
+
+    return errs;
+}
+
+int main(int argc, char *argv[])
+{
+    char *optstring = "vr:c";
+    int help = 0;
+    int revision = FS_PTREE_REVISION_WIDE;
+    int compact = 0;
+    int c, opt_index = 0;
+
+    static struct option long_options[] = {
+        { "version", 0, 0, 'V' },
+        { "help", 0, 0, 'h' },
+        { "verbose", 0, 0, 'v' },
+        { "revision", 1, 0, 'r' },
+        { "compact", 0, 0, 'c' },
+        { 0, 0, 0, 0 }
+    };
+
+    setlocale(LC_ALL, NULL);
+    int help_return = 1;
+
+    while ((c = getopt_long (argc, argv, optstring, long_options, &opt_index)) != -1) {
+        if (c == 'v') {
+            verbosity++;
+        } else if (c == 'V') {
+            printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+            exit(0);
+        } else if (c == 'h') {
+            help = 1;
+            help_return = 0;
+        } else if (c == 'r') {
+            revision = atoi(optarg);
+        } else if (c == 'c') {
+            compact = 1;
+        } else {
+            help++;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help = 1;
+    }
+
+    if (help) {
+        printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+        fprintf(stdout, "Usage: %s [-v] [--revision n] [--compact] <kbname>\n", basename(argv[0]));
+        fprintf(stdout, "   -v, --verbose    increase verbosity\n");
+        fprintf(stdout, "   -r, --revision   ptree revision to write, default %d\n", FS_PTREE_REVISION_WIDE);
+        fprintf(stdout, "   -c, --compact    rewrite trees already in that revision too\n");
+        fprintf(stdout, "This command rewrites the predicate trees of each segment of a KB on\n");
+        fprintf(stdout, "this node in the given revision. Trees held in the pack are left as\n");
+        fprintf(stdout, "they are. The backend must be stopped while it runs.\n");
+        return help_return;
+    }
+
+    if (revision < FS_PTREE_REVISION_CHAINS || revision > FS_PTREE_REVISION_WIDE) {
+        fprintf(stderr, "%s: unknown ptree revision %d\n", basename(argv[0]), revision);
+
+        return 1;
+    }
+
+    const char *kb = argv[optind];
+
+    fsp_syslog_enable();
+
+    fs_backend *be = fs_backend_init(kb, 0);
+    if (!be) {
+        return 2;
+    }
+
+    int segments[FS_MAX_SEGMENTS];
+    const int count = fs_segments(be, segments);
+    int errs = 0;
+    for (int i=0; i<count; i++) {
+        errs += migrate_segment(be, kb, segments[i], revision, compact);
+    }
+    fs_backend_fini(be);
+
+    return errs ? 3 : 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,116 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <locale.h>
+#include <libgen.h>
+#include <glib.h>
+
+#include "../common/error.h"
+#include "../common/params.h"
+
+#include "../backend/backend.h"
+#include "../backend/rhash.h"
+
+static int verbosity = 0;
+
+int main(int argc, char *argv[])
+{
+    char *optstring = "vr:";
+    int help = 0;
+    int revision = FS_RHASH_REVISION;
+    int c, opt_index = 0;
+
+    static struct option long_options[] = {
+        { "version", 0, 0, 'V' },
+        { "help", 0, 0, 'h' },
+        { "verbose", 0, 0, 'v' },
+        { "revision", 1, 0, 'r' },
+        { 0, 0, 0, 0 }
+    };
+
+    setlocale(LC_ALL, NULL);
+    int help_return = 1;
+
+    while ((c = getopt_long (argc, argv, optstring, long_options, &opt_index)) != -1) {
+        if (c == 'v') {
+            verbosity++;
+        } else if (c == 'V') {
+            printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+            exit(0);
+        } else if (c == 'h') {
+            help = 1;
+            help_return = 0;
+        } else if (c == 'r') {
+            revision = atoi(optarg);
+        } else {
+            help++;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help = 1;
+    }
+
+    if (help) {
+        printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+        fprintf(stdout, "Usage: %s [-v] [--revision n] <kbname>\n", basename(argv[0]));
+        fprintf(stdout, "   -v, --verbose    increase verbosity\n");
+        fprintf(stdout, "   -r, --revision   resource hash revision to upgrade to, default %d\n", FS_RHASH_REVISION);
+        fprintf(stdout, "This command upgrades the resource hash of each segment of a KB on\n");
+        fprintf(stdout, "this node. Older versions of 4store can't read the upgraded files.\n");
+        fprintf(stdout, "The backend must be stopped while it runs.\n");
+        return help_return;
+    }
+
+    if (revision < FS_RHASH_REVISION_ENTRIES || revision > FS_RHASH_REVISION) {
+        fprintf(stderr, "%s: unknown rhash revision %d\n", basename(argv[0]), revision);
+
+        return 1;
+    }
+
+    const char *kb = argv[optind];
+
+    fsp_syslog_enable();
+
+    fs_backend *be = fs_backend_init(kb, 0);
+    if (!be) {
+        return 2;
+    }
+
+    int segments[FS_MAX_SEGMENTS];
+    const int count = fs_segments(be, segments);
+    int errs = 0;
+    for (int i=0; i<count; i++) {
+        char *filename = g_strdup_printf(FS_RHASH, kb, segments[i], "res");
+        if (fs_rhash_upgrade(filename, revision)) {
+            fs_error(LOG_ERR, "failed to upgrade %s", filename);
+            errs++;
+        } else if (verbosity) {
+            printf("upgraded segment %d\n", segments[i]);
+        }
+        g_free(filename);
+    }
+    fs_backend_fini(be);
+
+    return errs ? 3 : 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+# stop the backend without letting it shut down cleanly
+
+if [ "$CLUSTER" == "yes" ] ; then
+  4s-ssh-all "pkill -KILL -f ^4s-backend\ $1\$" >/dev/null
+else
+  if [ -x /usr/bin/pkill ] ; then
+    pkill -KILL -f "^(valgrind )?../../src/backend/4s-backend\ $1\$"
+  else
+    killall -KILL 4s-backend
+  fi;
+fi;
+sleep 1
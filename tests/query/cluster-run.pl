@@ -1,7 +1,8 @@
 #!/usr/bin/perl -w
 
 $kb_name = "cluster_test";
-system("4s-cluster-start $kb_name");
+# threaded, so that mirrored segments are read from both copies
+system("4s-cluster-start $kb_name -T 4");
 
 $outdir = "results";
 $test = 1;
@@ -2,8 +2,15 @@
 
 kb="query_test_$USER"
 conf="../tests_4store.conf"
+backend_opts=""
+# --threads n serves the tests from a threaded backend, over multiplexed
+# sockets
+if [ "$1" == "--threads" ] ; then
+	backend_opts="-T $2"
+	shift 2
+fi
 ../../src/utilities/4s-backend-setup --node 0 --cluster 1 --segments 8 $kb
-../../src/backend/4s-backend $kb || exit
+../../src/backend/4s-backend $backend_opts $kb || exit
 ../../src/frontend/4s-import --config-file $conf -v $kb -m http://example.com/swh.xrdf ../../data/swh.xrdf -m http://example.com/TGR06001.nt ../../data/tiger/TGR06001.nt -m http://example.com/nasty.ttl ../../data/nasty.ttl
 echo "Preparing for tests..."
 ../../src/frontend/4s-delete-model --config-file $conf $kb http://example.com/nasty.ttl
@@ -14,9 +21,9 @@ if [ "$1" == "--autorun" ] ; then
 	ret=$?
 fi
 if [ -x /usr/bin/pkill ] ; then
-	pkill -f "^../../src/backend/4s-backend\ $kb\$"
+	pkill -f "^../../src/backend/4s-backend\ ($backend_opts\ )?$kb\$"
 else
-	for pid in `ps uwwx | grep "4s-backend $kb" | awk '{print $2}'`; do
+	for pid in `ps uwwx | grep -E "4s-backend ($backend_opts )?$kb" | awk '{print $2}'`; do
 		kill $pid 2> /dev/null
 	done
 fi